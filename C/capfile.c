@@ -0,0 +1,646 @@
+/* CODEMARK: nice-ibr */
+/*
+ * Copyright (C) 2020-2024 - Raytheon BBN Technologies Corp.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0.
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+ *
+ * Distribution Statement "A" (Approved for Public Release,
+ * Distribution Unlimited).
+ *
+ * This material is based upon work supported by the Defense
+ * Advanced Research Projects Agency (DARPA) under Contract No.
+ * HR001119C0102.  The opinions, findings, and conclusions stated
+ * herein are those of the authors and do not necessarily reflect
+ * those of DARPA.
+ *
+ * In the event permission is required, DARPA is authorized to
+ * reproduce the copyrighted material for use as an exhibit or
+ * handout at DARPA-sponsored events and/or to post the material
+ * on the DARPA website.
+ */
+/* CODEMARK: end */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "capfile.h"
+#include "pktdecode.h"
+
+/* The magic numbers of the classic pcap formats */
+#define CAPF_MAGIC_USEC		(0xa1b2c3d4)
+#define CAPF_MAGIC_NSEC		(0xa1b23c4d)
+#define CAPF_MAGIC_MODIFIED	(0xa1b2cd34)	/* Kuznetzov's libpcap */
+
+#define CAPF_PCAP_HDR_LEN		(24)
+#define CAPF_PCAP_REC_HDR_LEN		(16)
+#define CAPF_PCAP_MODIFIED_REC_HDR_LEN	(24)
+
+/*
+ * The high bits of the link type in a classic pcap header may be
+ * used for other things (like the FCS length)
+ */
+#define CAPF_PCAP_LINKTYPE_MASK	(0x03ffffff)
+
+/* The pcapng block types that we care about */
+#define CAPF_BLOCK_SHB		(0x0a0d0d0a)
+#define CAPF_BLOCK_IDB		(1)
+#define CAPF_BLOCK_PB		(2)	/* obsolete, but still seen */
+#define CAPF_BLOCK_SPB		(3)
+#define CAPF_BLOCK_EPB		(6)
+
+#define CAPF_BYTE_ORDER_MAGIC	(0x1a2b3c4d)
+
+/* The pcapng interface options that we care about */
+#define CAPF_OPT_ENDOFOPT	(0)
+#define CAPF_OPT_IF_TSRESOL	(9)
+#define CAPF_OPT_IF_TSOFFSET	(14)
+
+/* The default pcapng timestamp resolution is microseconds */
+#define CAPF_DEFAULT_UNITS	(1000000)
+
+#define CAPF_NSEC_PER_SEC	(1000000000)
+
+/* The results of peek and read_one, other than errors */
+#define CAPF_OK		(0)
+#define CAPF_EOF	(1)
+#define CAPF_MOVE	(2)
+
+static inline uint16_t
+get16(
+	capf_t *cf,
+	const uint8_t *p)
+{
+    uint16_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return cf->swapped ? __builtin_bswap16(v) : v;
+}
+
+static inline uint32_t
+get32(
+	capf_t *cf,
+	const uint8_t *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return cf->swapped ? __builtin_bswap32(v) : v;
+}
+
+static inline uint64_t
+get64(
+	capf_t *cf,
+	const uint8_t *p)
+{
+    uint64_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return cf->swapped ? __builtin_bswap64(v) : v;
+}
+
+/*
+ * Find the next n bytes of the input (without consuming them) and
+ * set *ptr to point to them.
+ *
+ * If the input isn't mapped, then this might need to read more of
+ * the input, and to make room for it, it might need to move the
+ * bytes in the buffer, which invalidates any pointers into the
+ * buffer.  If can_move is zero, then instead of moving anything,
+ * return CAPF_MOVE.
+ *
+ * Returns CAPF_OK on success, CAPF_EOF if there aren't n more bytes
+ * in the input, CAPF_MOVE (see above), or -1 on error.
+ */
+static int
+peek(
+	capf_t *cf,
+	size_t n,
+	int can_move,
+	const uint8_t **ptr)
+{
+
+    if (cf->buf_end - cf->buf_start >= n) {
+	*ptr = cf->buf + cf->buf_start;
+	return CAPF_OK;
+    }
+    else if (cf->eof) {
+	return CAPF_EOF;
+    }
+
+    if (cf->buf_start + n > cf->buf_size) {
+	size_t avail = cf->buf_end - cf->buf_start;
+
+	if (!can_move) {
+	    return CAPF_MOVE;
+	}
+
+	memmove(cf->buf, cf->buf + cf->buf_start, avail);
+	cf->buf_start = 0;
+	cf->buf_end = avail;
+
+	if (n > cf->buf_size) {
+	    uint8_t *new_buf = realloc(cf->buf, n);
+	    if (new_buf == NULL) {
+		fprintf(stderr, "ERROR: capfile: realloc failed\n");
+		return -1;
+	    }
+	    cf->buf = new_buf;
+	    cf->buf_size = n;
+	}
+    }
+
+    while ((cf->buf_end - cf->buf_start < n) && !cf->eof) {
+	size_t n_read = fread(cf->buf + cf->buf_end, 1,
+		cf->buf_size - cf->buf_end, cf->file);
+
+	if (n_read == 0) {
+	    cf->eof = 1;
+	}
+	cf->buf_end += n_read;
+    }
+
+    if (cf->buf_end - cf->buf_start < n) {
+	return CAPF_EOF;
+    }
+
+    *ptr = cf->buf + cf->buf_start;
+    return CAPF_OK;
+}
+
+/*
+ * Called when the input ends in the middle of a record or block
+ */
+static void
+warn_truncated(
+	capf_t *cf)
+{
+
+    if (cf->buf_end > cf->buf_start) {
+	fprintf(stderr, "WARNING: capfile: truncated capture file\n");
+    }
+}
+
+/*
+ * Set the timestamp of pkt from a pcapng timestamp of the given
+ * interface
+ */
+static void
+set_ts(
+	capf_pkt_t *pkt,
+	capf_iface_t *iface,
+	uint64_t ts)
+{
+    uint64_t units = iface->units_per_sec;
+    uint64_t frac = ts % units;
+
+    pkt->ts_sec = (int64_t) (ts / units) + iface->ts_offset;
+
+    if (units <= CAPF_NSEC_PER_SEC) {
+	pkt->ts_nsec = (frac * CAPF_NSEC_PER_SEC) / units;
+    }
+    else {
+	pkt->ts_nsec = (uint32_t) (((double) frac * CAPF_NSEC_PER_SEC) / units);
+    }
+}
+
+/*
+ * Add an interface, as described by the body of a pcapng IDB, to
+ * the current section.
+ */
+static int
+add_iface(
+	capf_t *cf,
+	const uint8_t *body,
+	uint32_t body_len)
+{
+
+    if (body_len < 8) {
+	fprintf(stderr, "ERROR: capfile: bad interface block\n");
+	return -1;
+    }
+
+    if (cf->n_ifaces == cf->max_ifaces) {
+	uint32_t new_max = cf->max_ifaces ? 2 * cf->max_ifaces : 4;
+	capf_iface_t *new_ifaces =
+		realloc(cf->ifaces, new_max * sizeof(capf_iface_t));
+
+	if (new_ifaces == NULL) {
+	    fprintf(stderr, "ERROR: capfile: realloc failed\n");
+	    return -1;
+	}
+	cf->ifaces = new_ifaces;
+	cf->max_ifaces = new_max;
+    }
+
+    capf_iface_t *iface = &cf->ifaces[cf->n_ifaces++];
+
+    iface->linktype = get16(cf, body);
+    iface->dlt = pktd_linktype2dlt(iface->linktype);
+    iface->units_per_sec = CAPF_DEFAULT_UNITS;
+    iface->ts_offset = 0;
+
+    uint32_t off = 8;
+    while (off + 4 <= body_len) {
+	uint16_t code = get16(cf, body + off);
+	uint16_t len = get16(cf, body + off + 2);
+	const uint8_t *val = body + off + 4;
+
+	if ((code == CAPF_OPT_ENDOFOPT) || (off + 4 + len > body_len)) {
+	    break;
+	}
+
+	if ((code == CAPF_OPT_IF_TSRESOL) && (len >= 1)) {
+	    uint8_t exp = val[0] & 0x7f;
+
+	    if (val[0] & 0x80) {
+		if (exp < 64) {
+		    iface->units_per_sec = (uint64_t) 1 << exp;
+		}
+	    }
+	    else if (exp <= 19) {
+		iface->units_per_sec = 1;
+		for (uint8_t i = 0; i < exp; i++) {
+		    iface->units_per_sec *= 10;
+		}
+	    }
+	}
+	else if ((code == CAPF_OPT_IF_TSOFFSET) && (len >= 8)) {
+	    iface->ts_offset = (int64_t) get64(cf, val);
+	}
+
+	/* option values are padded to a multiple of 4 bytes */
+	off += 4 + ((len + 3) & ~3);
+    }
+
+    return 0;
+}
+
+/*
+ * Read the next packet record from a classic pcap file.  Returns
+ * CAPF_OK if a packet was read, CAPF_EOF at the end of the input,
+ * CAPF_MOVE (see peek), or -1 on error.
+ */
+static int
+read_pcap(
+	capf_t *cf,
+	capf_pkt_t *pkt,
+	int can_move)
+{
+    const uint8_t *p;
+    int rc;
+
+    rc = peek(cf, cf->rec_hdr_len, can_move, &p);
+    if (rc != CAPF_OK) {
+	if (rc == CAPF_EOF) {
+	    warn_truncated(cf);
+	}
+	return rc;
+    }
+
+    uint32_t caplen = get32(cf, p + 8);
+    if (caplen > CAPF_MAX_BLOCK_LEN) {
+	fprintf(stderr, "ERROR: capfile: bad caplen %u\n", caplen);
+	return -1;
+    }
+
+    rc = peek(cf, cf->rec_hdr_len + caplen, can_move, &p);
+    if (rc != CAPF_OK) {
+	if (rc == CAPF_EOF) {
+	    warn_truncated(cf);
+	}
+	return rc;
+    }
+
+    uint32_t frac = get32(cf, p + 4);
+
+    pkt->data = p + cf->rec_hdr_len;
+    pkt->caplen = caplen;
+    pkt->len = get32(cf, p + 12);
+    pkt->ts_sec = get32(cf, p);
+    pkt->ts_nsec = cf->nsec ? frac : frac * 1000;
+    pkt->linktype = cf->linktype;
+    pkt->dlt = cf->dlt;
+
+    cf->buf_start += cf->rec_hdr_len + caplen;
+
+    return CAPF_OK;
+}
+
+/*
+ * Read pcapng blocks until the next packet.  Returns the same values
+ * as read_pcap.
+ */
+static int
+read_pcapng(
+	capf_t *cf,
+	capf_pkt_t *pkt,
+	int can_move)
+{
+    const uint8_t *p;
+    int rc;
+
+    for (;;) {
+	rc = peek(cf, 12, can_move, &p);
+	if (rc != CAPF_OK) {
+	    if (rc == CAPF_EOF) {
+		warn_truncated(cf);
+	    }
+	    return rc;
+	}
+
+	/*
+	 * The block type of an SHB reads the same in either byte
+	 * order, and the SHB tells us the byte order of the rest
+	 * of its section.
+	 */
+	uint32_t type = get32(cf, p);
+	if (type == CAPF_BLOCK_SHB) {
+	    uint32_t bom;
+
+	    memcpy(&bom, p + 8, sizeof(bom));
+	    if (bom == CAPF_BYTE_ORDER_MAGIC) {
+		cf->swapped = 0;
+	    }
+	    else if (bom == __builtin_bswap32(CAPF_BYTE_ORDER_MAGIC)) {
+		cf->swapped = 1;
+	    }
+	    else {
+		fprintf(stderr, "ERROR: capfile: bad pcapng section\n");
+		return -1;
+	    }
+	}
+
+	uint32_t block_len = get32(cf, p + 4);
+	if ((block_len < 12) || (block_len % 4) ||
+		(block_len > CAPF_MAX_BLOCK_LEN)) {
+	    fprintf(stderr, "ERROR: capfile: bad block length %u\n",
+		    block_len);
+	    return -1;
+	}
+
+	rc = peek(cf, block_len, can_move, &p);
+	if (rc != CAPF_OK) {
+	    if (rc == CAPF_EOF) {
+		warn_truncated(cf);
+	    }
+	    return rc;
+	}
+
+	const uint8_t *body = p + 8;
+	uint32_t body_len = block_len - 12;
+	capf_iface_t *iface = NULL;
+	int found = 0;
+
+	switch (type) {
+	    case CAPF_BLOCK_SHB:
+		/* The interfaces are numbered anew in each section */
+		cf->n_ifaces = 0;
+		break;
+	    case CAPF_BLOCK_IDB:
+		if (add_iface(cf, body, body_len) != 0) {
+		    return -1;
+		}
+		break;
+	    case CAPF_BLOCK_EPB:
+	    case CAPF_BLOCK_PB: {
+		if (body_len < 20) {
+		    fprintf(stderr, "ERROR: capfile: bad packet block\n");
+		    return -1;
+		}
+
+		uint32_t ifid = (type == CAPF_BLOCK_EPB) ?
+			get32(cf, body) : get16(cf, body);
+		uint64_t ts = ((uint64_t) get32(cf, body + 4) << 32) |
+			get32(cf, body + 8);
+
+		pkt->caplen = get32(cf, body + 12);
+		pkt->len = get32(cf, body + 16);
+		pkt->data = body + 20;
+
+		if ((ifid >= cf->n_ifaces) || (pkt->caplen > body_len - 20)) {
+		    fprintf(stderr, "ERROR: capfile: bad packet block\n");
+		    return -1;
+		}
+		iface = &cf->ifaces[ifid];
+		set_ts(pkt, iface, ts);
+		found = 1;
+		break;
+	    }
+	    case CAPF_BLOCK_SPB:
+		/* Simple packet blocks have no timestamp */
+		if ((body_len < 4) || (cf->n_ifaces == 0)) {
+		    fprintf(stderr, "ERROR: capfile: bad packet block\n");
+		    return -1;
+		}
+
+		iface = &cf->ifaces[0];
+		pkt->len = get32(cf, body);
+		pkt->caplen = (pkt->len < body_len - 4) ?
+			pkt->len : body_len - 4;
+		pkt->data = body + 4;
+		pkt->ts_sec = 0;
+		pkt->ts_nsec = 0;
+		found = 1;
+		break;
+	    default:
+		break;
+	}
+
+	cf->buf_start += block_len;
+
+	if (found) {
+	    pkt->linktype = iface->linktype;
+	    pkt->dlt = iface->dlt;
+	    return CAPF_OK;
+	}
+    }
+}
+
+/*
+ * Prepare to read packets from fin, which must be positioned at the
+ * start of a capture file.  fin is not closed by capf_close.
+ *
+ * Returns 0 on success, CAPF_ERR_FORMAT if the input isn't a pcap
+ * or pcapng file, or -1 on any other error.
+ */
+int
+capf_open(
+	capf_t *cf,
+	FILE *fin)
+{
+    const uint8_t *p;
+    struct stat sb;
+    int fd = fileno(fin);
+
+    memset(cf, 0, sizeof(capf_t));
+    cf->file = fin;
+
+    /*
+     * If it's a regular file, try to map it.  The result looks like a
+     * buffer that contains all of the input.
+     */
+    if ((fd >= 0) && (fstat(fd, &sb) == 0) && S_ISREG(sb.st_mode) &&
+	    (sb.st_size > 0) && (ftello(fin) == 0)) {
+	void *map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+	if (map != MAP_FAILED) {
+	    madvise(map, sb.st_size, MADV_SEQUENTIAL);
+	    cf->map = map;
+	    cf->map_len = sb.st_size;
+	    cf->buf = map;
+	    cf->buf_size = sb.st_size;
+	    cf->buf_end = sb.st_size;
+	    cf->eof = 1;
+	}
+    }
+
+    if (cf->map == NULL) {
+	cf->buf = malloc(CAPF_BUF_LEN);
+	if (cf->buf == NULL) {
+	    fprintf(stderr, "ERROR: capfile: malloc failed\n");
+	    return -1;
+	}
+	cf->buf_size = CAPF_BUF_LEN;
+    }
+
+    if (peek(cf, 4, 1, &p) != CAPF_OK) {
+	fprintf(stderr, "ERROR: capfile: empty or unreadable input\n");
+	capf_close(cf);
+	return -1;
+    }
+
+    uint32_t magic;
+    memcpy(&magic, p, sizeof(magic));
+
+    if (magic == CAPF_BLOCK_SHB) {
+	/* read_pcapng will read the SHB, and find the byte order */
+	cf->format = CAPF_FORMAT_PCAPNG;
+	return 0;
+    }
+
+    if ((magic == __builtin_bswap32(CAPF_MAGIC_USEC)) ||
+	    (magic == __builtin_bswap32(CAPF_MAGIC_NSEC)) ||
+	    (magic == __builtin_bswap32(CAPF_MAGIC_MODIFIED))) {
+	cf->swapped = 1;
+	magic = __builtin_bswap32(magic);
+    }
+
+    switch (magic) {
+	case CAPF_MAGIC_USEC:
+	    cf->rec_hdr_len = CAPF_PCAP_REC_HDR_LEN;
+	    break;
+	case CAPF_MAGIC_NSEC:
+	    cf->rec_hdr_len = CAPF_PCAP_REC_HDR_LEN;
+	    cf->nsec = 1;
+	    break;
+	case CAPF_MAGIC_MODIFIED:
+	    cf->rec_hdr_len = CAPF_PCAP_MODIFIED_REC_HDR_LEN;
+	    break;
+	default:
+	    capf_close(cf);
+	    return CAPF_ERR_FORMAT;
+    }
+
+    if (peek(cf, CAPF_PCAP_HDR_LEN, 1, &p) != CAPF_OK) {
+	fprintf(stderr, "ERROR: capfile: truncated pcap header\n");
+	capf_close(cf);
+	return -1;
+    }
+
+    cf->format = CAPF_FORMAT_PCAP;
+    cf->linktype = get32(cf, p + 20) & CAPF_PCAP_LINKTYPE_MASK;
+    cf->dlt = pktd_linktype2dlt(cf->linktype);
+    cf->buf_start += CAPF_PCAP_HDR_LEN;
+
+    return 0;
+}
+
+/*
+ * Read up to max_pkts packets into pkts.  The data of all of the
+ * packets remains valid until the next call to capf_next_batch (or
+ * capf_next, or capf_close).  Returns the number of packets read,
+ * which is zero only at the end of the input, or -1 on error (if
+ * there were no packets before the error).
+ */
+int
+capf_next_batch(
+	capf_t *cf,
+	capf_pkt_t *pkts,
+	uint32_t max_pkts)
+{
+    uint32_t n_pkts = 0;
+
+    while (n_pkts < max_pkts) {
+	/*
+	 * Once we've found a packet, the buffer must not move, so
+	 * if there isn't room for the next packet, then this batch
+	 * is done.
+	 */
+	int can_move = (n_pkts == 0);
+	int rc;
+
+	if (cf->format == CAPF_FORMAT_PCAP) {
+	    rc = read_pcap(cf, &pkts[n_pkts], can_move);
+	}
+	else {
+	    rc = read_pcapng(cf, &pkts[n_pkts], can_move);
+	}
+
+	if (rc == CAPF_OK) {
+	    n_pkts++;
+	}
+	else if (rc < 0) {
+	    /* Nothing was consumed, so the next call will fail again */
+	    return (n_pkts > 0) ? (int) n_pkts : -1;
+	}
+	else {
+	    break;
+	}
+    }
+
+    return n_pkts;
+}
+
+/*
+ * Read the next packet into pkt.  Returns 1 if a packet was read,
+ * 0 at the end of the input, or -1 on error.
+ */
+int
+capf_next(
+	capf_t *cf,
+	capf_pkt_t *pkt)
+{
+
+    return capf_next_batch(cf, pkt, 1);
+}
+
+void
+capf_close(
+	capf_t *cf)
+{
+
+    if (cf->map != NULL) {
+	munmap(cf->map, cf->map_len);
+    }
+    else {
+	free(cf->buf);
+    }
+    free(cf->ifaces);
+
+    cf->map = NULL;
+    cf->buf = NULL;
+    cf->ifaces = NULL;
+}
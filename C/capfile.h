@@ -0,0 +1,123 @@
+#ifndef _CAPFILE_H_
+#define _CAPFILE_H_ 1
+
+/* CODEMARK: nice-ibr */
+/*
+ * Copyright (C) 2020-2024 - Raytheon BBN Technologies Corp.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0.
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+ *
+ * Distribution Statement "A" (Approved for Public Release,
+ * Distribution Unlimited).
+ *
+ * This material is based upon work supported by the Defense
+ * Advanced Research Projects Agency (DARPA) under Contract No.
+ * HR001119C0102.  The opinions, findings, and conclusions stated
+ * herein are those of the authors and do not necessarily reflect
+ * those of DARPA.
+ *
+ * In the event permission is required, DARPA is authorized to
+ * reproduce the copyrighted material for use as an exhibit or
+ * handout at DARPA-sponsored events and/or to post the material
+ * on the DARPA website.
+ */
+/* CODEMARK: end */
+
+/*
+ * A reader for capture files, shared by the tools that read packets
+ * from pcap files, which understands both the classic pcap format
+ * (in either byte order, with microsecond or nanosecond timestamps)
+ * and pcapng (with any number of sections and interfaces, each with
+ * its own link type and timestamp resolution).
+ *
+ * If the input is a regular file, then the file is mapped into
+ * memory, and the packets point directly into the mapping.
+ * Otherwise (for example, if the input is a pipe from a decompressor)
+ * the input is read in large blocks into a buffer.  Either way, the
+ * packets are not copied.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+
+typedef enum {
+    CAPF_FORMAT_PCAP,
+    CAPF_FORMAT_PCAPNG
+} capf_format_t;
+
+/*
+ * The result of capf_open, if it fails.  CAPF_ERR_FORMAT means that
+ * the input isn't in a format that capfile understands.
+ */
+#define CAPF_ERR_FORMAT	(-2)
+
+/* The largest pcapng block, or pcap record, that capfile will read */
+#define CAPF_MAX_BLOCK_LEN	(16 * 1024 * 1024)
+
+/* The size of the buffer used when the input can't be mapped */
+#define CAPF_BUF_LEN	(4 * 1024 * 1024)
+
+typedef struct {
+    const uint8_t *data;	/* the captured bytes */
+    uint32_t caplen;		/* the number of bytes captured */
+    uint32_t len;		/* the original length of the packet */
+    int64_t ts_sec;
+    uint32_t ts_nsec;
+    uint32_t linktype;		/* the LINKTYPE_* value from the file */
+    int dlt;			/* the DLT_* value, or -1 if unsupported */
+} capf_pkt_t;
+
+/* The per-interface state of a pcapng section */
+typedef struct {
+    uint32_t linktype;
+    int dlt;
+    uint64_t units_per_sec;	/* from if_tsresol */
+    int64_t ts_offset;		/* from if_tsoffset, in seconds */
+} capf_iface_t;
+
+typedef struct {
+    FILE *file;
+    capf_format_t format;
+    int swapped;		/* the input is in the other byte order */
+
+    /* For classic pcap files */
+    int nsec;
+    uint32_t rec_hdr_len;
+    uint32_t linktype;
+    int dlt;
+
+    /* For pcapng files, the interfaces of the current section */
+    capf_iface_t *ifaces;
+    uint32_t n_ifaces;
+    uint32_t max_ifaces;
+
+    /*
+     * The input: either all of the file (if it's mapped), or a
+     * buffer of buf_size bytes, of which the bytes between buf_start
+     * and buf_end haven't been read yet.
+     */
+    uint8_t *map;
+    size_t map_len;
+    uint8_t *buf;
+    size_t buf_size;
+    size_t buf_start;
+    size_t buf_end;
+    int eof;
+} capf_t;
+
+extern int capf_open(capf_t *cf, FILE *fin);
+extern int capf_next(capf_t *cf, capf_pkt_t *pkt);
+extern int capf_next_batch(capf_t *cf, capf_pkt_t *pkts, uint32_t max_pkts);
+extern void capf_close(capf_t *cf);
+
+#endif /* _CAPFILE_H_ */
@@ -30,14 +30,21 @@
  */
 /* CODEMARK: end */
 
+#include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <unistd.h>
-#include <pcap.h>
+#include <sys/time.h>
 
-#include <netinet/ip.h>
-#include <net/ethernet.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "capfile.h"
+#include "pktdecode.h"
+#include "zout.h"
 
 /*
 Print CSV rows for each IPv4 packet in a pcap file.
@@ -90,193 +97,598 @@ typedef struct {
 } pkt_info_t;
 
 
+typedef enum {
+    OUTPUT_CSV,
+    OUTPUT_FC5
+} output_format_t;
+
 /*
- * Print the contents of a pkt_info_t to stdout
+ * The layout of a record in an fc5 file (see fc_pkt_t in
+ * ../firecracker/firecracker.h), with all of the fields in network
+ * byte order.  The flags are the low 8 bits of the TCP flags.
+ */
+typedef struct {
+    uint32_t saddr;
+    uint32_t daddr;
+    uint16_t sport;
+    uint16_t dport;
+    uint8_t proto;
+    uint8_t flags;
+    uint16_t len;
+    int32_t ts_sec;
+    uint32_t ts_usec;
+} fc5_rec_t;
+
+/*
+ * Output is accumulated in an out_buf_t and written to stdout with
+ * write(2) in large pieces, rather than through stdio.  OUTBUF_MAX_REC
+ * is an upper bound on the length of one output record; whenever there
+ * is less than this much room left, the buffer is flushed.
+ *
+ * Each out_buf_t also caches the date string for the most recent
+ * second it has seen.  Consecutive packets almost always have a
+ * timestamp in the same second, so this saves a localtime and
+ * strftime for nearly every packet.
  */
+#define OUTBUF_SIZE	(1024 * 1024)
+#define OUTBUF_MAX_REC	(512)
+
+typedef struct {
+    char *buf;
+    size_t size;
+    size_t len;
+
+    time_t date_sec;
+    char date_str[32];
+    size_t date_len;
+} out_buf_t;
+
+static int
+out_init(
+	out_buf_t *out,
+	size_t size)
+{
+
+    out->buf = malloc(size);
+    if (out->buf == NULL) {
+	fprintf(stderr, "ERROR: could not allocate output buffer\n");
+	return -1;
+    }
+
+    out->size = size;
+    out->len = 0;
+    out->date_sec = 0;
+    out->date_len = 0;
+
+    return 0;
+}
+
 static void
-print_pkt_info(
-	pkt_info_t *info,
-	int compat)
+out_free(
+	out_buf_t *out)
 {
 
-    printf("%u,%u,%u,%u,%u,",
-	    info->saddr, info->daddr, info->proto, info->sport, info->dport);
-    printf("%u,%u,%u,%u,",
-	    info->p_chksum, info->len, info->ipid, info->ttl);
+    free(out->buf);
+    out->buf = NULL;
+}
 
-    char secbuf[32];
-    sprintf(secbuf, "%lu.%.06lu", info->ts.tv_sec, info->ts.tv_usec);
-
-    char datebuf[32];
-    strftime(datebuf, sizeof(datebuf), "%Y-%m-%d %H:%M:%S",
-	    localtime(&info->ts.tv_sec));
-
-    if (compat) {
-	// Print timestamps in a way that is exactly compatible with
-	// the way the python3-based dpkt library treats them.
-	//
-	// This is annoying and technically inaccurate, but necessary in
-	// order to perfectly mimic the behavior of the Python3 pcap
-	// module, which treats timestamps as a 64-bit float instead of
-	// two ints (one for the seconds, and the other for the
-	// microseconds).  This results in rounding errors that make it
-	// appear as if the timestamps have nanosecond precision, but
-	// this is nonsense.  However, in order to match bit-for-bit the
-	// output of a Python3 program that uses dpkt pcap timestamps,
-	// we need to use a bug-compatible way of expressing the
-	// timestamps in text: first, express the timestamp (correctly)
-	// in text, and second, convert the correct timestamp to a double,
-	// and third, convert the double back to text, which introduces
-	// rounding errors in the final digits.
-
-	double realsec;
-	sscanf(secbuf, "%lf", &realsec);
-
-	// special case: if the fractional part of the timestamp is
-	// zero, then don't print the decimal point or anything after
-	//
-	if (info->ts.tv_usec == 0) {
-	    printf("%s,%.9lf,", datebuf, realsec);
+/*
+ * If the output is compressed, then the output buffers are written
+ * to this stream (and compressed by the threads of zout_pool) instead
+ * of directly to stdout
+ */
+static zout_t *zout = NULL;
+static zout_pool_t *zout_pool = NULL;
+
+/*
+ * Finish writing the compressed output, if any.
+ *
+ * Returns 0 on success, 1 on failure.
+ */
+static int
+out_close_stream(void)
+{
+    int rc = 0;
+
+    if (zout != NULL) {
+	rc = zout_close(zout) ? 1 : 0;
+	zout = NULL;
+	zout_pool_destroy(zout_pool);
+	zout_pool = NULL;
+    }
+
+    return rc;
+}
+
+static void
+out_flush(
+	out_buf_t *out)
+{
+    size_t off = 0;
+
+    if (zout != NULL) {
+	if (zout_write(zout, out->buf, out->len) != 0) {
+	    exit(1);
 	}
-	else {
-	    printf("%s.%.06lu,%.9lf,", datebuf, info->ts.tv_usec, realsec);
+	out->len = 0;
+	return;
+    }
+
+    while (off < out->len) {
+	ssize_t n = write(STDOUT_FILENO, out->buf + off, out->len - off);
+
+	if (n < 0) {
+	    if (errno == EINTR) {
+		continue;
+	    }
+	    fprintf(stderr, "ERROR: could not write output\n");
+	    exit(1);
 	}
+	off += n;
+    }
+
+    out->len = 0;
+}
+
+/*
+ * Return a pointer to room for at least OUTBUF_MAX_REC bytes at the
+ * end of the buffer, flushing the buffer if necessary.  The caller adds
+ * the number of bytes it used to out->len.
+ */
+static inline char *
+out_reserve(
+	out_buf_t *out)
+{
+
+    if (out->size - out->len < OUTBUF_MAX_REC) {
+	out_flush(out);
+    }
+
+    return out->buf + out->len;
+}
+
+/*
+ * All of the two-digit decimal numbers, from "00" to "99", so that
+ * fmt_u64 can convert two digits per division
+ */
+static const char digit_pairs[201] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+/*
+ * Write the decimal representation of val at p (without a terminating
+ * NUL) and return a pointer to the byte after the last digit
+ */
+static inline char *
+fmt_u64(
+	char *p,
+	uint64_t val)
+{
+    char tmp[20];
+    char *t = tmp + sizeof(tmp);
+
+    while (val >= 100) {
+	unsigned int pair = (val % 100) * 2;
+
+	val /= 100;
+	*--t = digit_pairs[pair + 1];
+	*--t = digit_pairs[pair];
+    }
+
+    if (val >= 10) {
+	*--t = digit_pairs[val * 2 + 1];
+	*--t = digit_pairs[val * 2];
     }
     else {
-	printf("%s.%.06lu,%s,", datebuf, info->ts.tv_usec, secbuf);
+	*--t = '0' + val;
     }
 
-    printf("%ld,%lu,", info->findx, info->pindx);
-    printf("%u,%u,%u,%u,%u,%u\n",
-	    info->tcp_flags, info->tcp_seq, info->tcp_ack, info->tcp_win,
-	    info->tcp_off, info->ip_ihl);
+    size_t len = tmp + sizeof(tmp) - t;
+    memcpy(p, t, len);
+
+    return p + len;
+}
 
-    return;
+static inline char *
+fmt_i64(
+	char *p,
+	int64_t val)
+{
+
+    if (val < 0) {
+	*p++ = '-';
+	return fmt_u64(p, -(uint64_t) val);
+    }
+    else {
+	return fmt_u64(p, val);
+    }
 }
 
 /*
- * Returns the offset, into the packet, of the end of the
- * datalink header (Ethernet header, or other header).
- *
- * For example, for an ordinary Ethernet frame, this will return
- * 14, and for RAW packets, it will return 0.
+ * Write val as at least six decimal digits, with leading zeros
+ */
+static inline char *
+fmt_usec(
+	char *p,
+	uint64_t val)
+{
+
+    if (val >= 1000000) {
+	return fmt_u64(p, val);
+    }
+
+    p[4] = digit_pairs[(val % 100) * 2];
+    p[5] = digit_pairs[(val % 100) * 2 + 1];
+    val /= 100;
+    p[2] = digit_pairs[(val % 100) * 2];
+    p[3] = digit_pairs[(val % 100) * 2 + 1];
+    val /= 100;
+    p[0] = digit_pairs[(val % 100) * 2];
+    p[1] = digit_pairs[(val % 100) * 2 + 1];
+
+    return p + 6;
+}
+
+static inline char *
+fmt_date(
+	out_buf_t *out,
+	char *p,
+	time_t sec)
+{
+
+    if (out->date_len == 0 || sec != out->date_sec) {
+	struct tm tm;
+
+	out->date_len = strftime(out->date_str, sizeof(out->date_str),
+		"%Y-%m-%d %H:%M:%S", localtime_r(&sec, &tm));
+	out->date_sec = sec;
+    }
+
+    memcpy(p, out->date_str, out->date_len);
+
+    return p + out->date_len;
+}
+
+/*
+ * Write the contents of a pkt_info_t to stdout, as an fc5 record
+ */
+static void
+print_pkt_fc5(
+	out_buf_t *out,
+	pkt_info_t *info)
+{
+    fc5_rec_t rec;
+
+    rec.saddr = htonl(info->saddr);
+    rec.daddr = htonl(info->daddr);
+    rec.sport = htons(info->sport);
+    rec.dport = htons(info->dport);
+    rec.proto = info->proto;
+    rec.flags = info->tcp_flags;
+    rec.len = htons(info->len);
+    rec.ts_sec = htonl(info->ts.tv_sec);
+    rec.ts_usec = htonl(info->ts.tv_usec);
+
+    memcpy(out_reserve(out), &rec, sizeof(rec));
+    out->len += sizeof(rec);
+}
+
+/*
+ * The columns of the CSV output, in their default order.  The names
+ * are the ones used in the usage message, and by the -c option.
+ */
+typedef enum {
+    COL_SADDR,
+    COL_DADDR,
+    COL_PROTO,
+    COL_SPORT,
+    COL_DPORT,
+    COL_P_CHKSUM,
+    COL_IPTOTLEN,
+    COL_IPID,
+    COL_TTL,
+    COL_TS_DATE,
+    COL_TS_EPOCH,
+    COL_FINDX,
+    COL_PINDX,
+    COL_TCP_FLAGS,
+    COL_TCP_SEQ,
+    COL_TCP_ACK,
+    COL_TCP_WIN,
+    COL_TCP_OFF,
+    COL_IP_IHL,
+    COL_COUNT
+} csv_col_t;
+
+static const char *col_names[COL_COUNT] = {
+    "saddr", "daddr", "proto", "sport", "dport", "p_chksum",
+    "iptotlen", "ipid", "ttl", "ts_date", "ts_epoch", "findx",
+    "pindx", "tcp_flags", "tcp_seq", "tcp_ack", "tcp_win",
+    "tcp_off", "ip_ihl"
+};
+
+/*
+ * The "compact" preset: only the columns that the downstream tools
+ * (firecracker, filter-ip, split-by-dstnet.py) read, all in decimal,
+ * without the date string
+ */
+#define COMPACT_COLS \
+	"saddr,daddr,proto,sport,dport,iptotlen,ts_epoch,tcp_flags"
+
+/*
+ * The columns to print, in order.  By default, this is all of the
+ * columns, in their default order.
+ */
+static csv_col_t csv_cols[COL_COUNT];
+static int csv_n_cols = 0;
+
+/*
+ * Parse a comma-separated list of column names (or the name of a
+ * preset) into csv_cols.
  *
- * If an unsupported frame is detected, or the frame cannot be
- * parsed to find its length, return -1.
+ * Returns 0 on success, -1 on failure.
  */
 static int
-dlt_offset(
-	pcap_t *pcap,
-	const struct pcap_pkthdr *pkthdr,
-	const unsigned char *packet)
+parse_cols(
+	const char *spec)
 {
-    uint32_t linktype = pcap_datalink(pcap);
+    char buf[256];
 
-    if (linktype == DLT_RAW) {
+    if (!strcmp(spec, "compact")) {
+	spec = COMPACT_COLS;
+    }
+    else if (!strcmp(spec, "all")) {
+	for (int i = 0; i < COL_COUNT; i++) {
+	    csv_cols[i] = i;
+	}
+	csv_n_cols = COL_COUNT;
 	return 0;
     }
-    else if (linktype == DLT_EN10MB) {
-	/*
-	 * If we see a VLAN tag instead of the IP tag, then
-	 * skip over it and continue, up to 4 tags deep.
-	 * (we could go deeper, but that will only be needed
-	 * in unusual circumstances, and I don't have a way
-	 * to test deeper than 2 tags).  Anything ethertype
-	 * other than VLAN or IP ethertype returns an error
-	 */
-	for (uint16_t i = 0; i < 4; i++) {
-	    struct ether_header *eth_header =
-		(struct ether_header *) (packet + (i * 4));
-	    if (ntohs(eth_header->ether_type) == ETHERTYPE_IP) {
-		return 14 + (i * 4);
+
+    if (strlen(spec) >= sizeof(buf)) {
+	fprintf(stderr, "ERROR: column list too long\n");
+	return -1;
+    }
+    strcpy(buf, spec);
+
+    csv_n_cols = 0;
+    for (char *name = strtok(buf, ","); name != NULL;
+	    name = strtok(NULL, ",")) {
+	int col;
+
+	for (col = 0; col < COL_COUNT; col++) {
+	    if (!strcmp(name, col_names[col])) {
+		break;
 	    }
-	    else if (ntohs(eth_header->ether_type) != ETHERTYPE_VLAN) {
+	}
+	if (col == COL_COUNT) {
+	    fprintf(stderr, "ERROR: unknown column [%s]\n", name);
+	    return -1;
+	}
+	for (int i = 0; i < csv_n_cols; i++) {
+	    if (csv_cols[i] == col) {
+		fprintf(stderr, "ERROR: column [%s] given more than once\n",
+			name);
 		return -1;
 	    }
 	}
+	csv_cols[csv_n_cols++] = col;
+    }
 
+    if (csv_n_cols == 0) {
+	fprintf(stderr, "ERROR: no columns selected\n");
 	return -1;
     }
-    else if (linktype == DLT_LINUX_SLL) {
-	/* FIXME */
-	return 16;
+
+    return 0;
+}
+
+/*
+ * Write the header line that names the columns: a '#' followed by
+ * the column names, separated by commas
+ */
+static void
+print_header(
+	out_buf_t *out)
+{
+    char *start = out_reserve(out);
+    char *p = start;
+
+    *p++ = '#';
+    for (int i = 0; i < csv_n_cols; i++) {
+	size_t len = strlen(col_names[csv_cols[i]]);
+
+	if (i > 0) {
+	    *p++ = ',';
+	}
+	memcpy(p, col_names[csv_cols[i]], len);
+	p += len;
     }
+    *p++ = '\n';
 
-    return -1;
+    out->len += p - start;
 }
 
+/*
+ * Print the contents of a pkt_info_t to stdout
+ */
+static void
+print_pkt_info(
+	out_buf_t *out,
+	pkt_info_t *info,
+	int compat)
+{
+    char *start = out_reserve(out);
+    char *p = start;
 
-// Macro to simplify checking whether an address
-// we need to dereference is past the end of the packet.
-//
-// Only to be used inside the handler.
-//
-#define CHECK_ADDR(addr) \
-{ if (((uint8_t *) (addr)) > (last_addr)) return; }
+    /* The epoch timestamp, as seconds.microseconds */
+    char secbuf[32];
+    char *s = fmt_u64(secbuf, (unsigned long) info->ts.tv_sec);
+    *s++ = '.';
+    s = fmt_usec(s, info->ts.tv_usec);
+    *s = '\0';
+
+    for (int i = 0; i < csv_n_cols; i++) {
+	if (i > 0) {
+	    *p++ = ',';
+	}
+
+	switch (csv_cols[i]) {
+	    case COL_SADDR:
+		p = fmt_u64(p, info->saddr);
+		break;
+	    case COL_DADDR:
+		p = fmt_u64(p, info->daddr);
+		break;
+	    case COL_PROTO:
+		p = fmt_u64(p, info->proto);
+		break;
+	    case COL_SPORT:
+		p = fmt_u64(p, info->sport);
+		break;
+	    case COL_DPORT:
+		p = fmt_u64(p, info->dport);
+		break;
+	    case COL_P_CHKSUM:
+		p = fmt_u64(p, info->p_chksum);
+		break;
+	    case COL_IPTOTLEN:
+		p = fmt_u64(p, info->len);
+		break;
+	    case COL_IPID:
+		p = fmt_u64(p, info->ipid);
+		break;
+	    case COL_TTL:
+		p = fmt_u64(p, info->ttl);
+		break;
+	    case COL_TS_DATE:
+		p = fmt_date(out, p, info->ts.tv_sec);
+
+		// In compat mode, if the fractional part of the
+		// timestamp is zero, then don't print the decimal point
+		// or anything after (see COL_TS_EPOCH, below)
+		//
+		if (!compat || info->ts.tv_usec != 0) {
+		    *p++ = '.';
+		    p = fmt_usec(p, info->ts.tv_usec);
+		}
+		break;
+	    case COL_TS_EPOCH:
+		if (compat) {
+		    // Print timestamps in a way that is exactly compatible
+		    // with the way the python3-based dpkt library treats
+		    // them.
+		    //
+		    // This is annoying and technically inaccurate, but
+		    // necessary in order to perfectly mimic the behavior of
+		    // the Python3 pcap module, which treats timestamps as a
+		    // 64-bit float instead of two ints (one for the
+		    // seconds, and the other for the microseconds).  This
+		    // results in rounding errors that make it appear as if
+		    // the timestamps have nanosecond precision, but this is
+		    // nonsense.  However, in order to match bit-for-bit the
+		    // output of a Python3 program that uses dpkt pcap
+		    // timestamps, we need to use a bug-compatible way of
+		    // expressing the timestamps in text: first, express the
+		    // timestamp (correctly) in text, and second, convert
+		    // the correct timestamp to a double, and third, convert
+		    // the double back to text, which introduces rounding
+		    // errors in the final digits.
+
+		    double realsec = strtod(secbuf, NULL);
+
+		    p += snprintf(p, OUTBUF_MAX_REC - (p - start), "%.9lf",
+			    realsec);
+		}
+		else {
+		    memcpy(p, secbuf, s - secbuf);
+		    p += s - secbuf;
+		}
+		break;
+	    case COL_FINDX:
+		p = fmt_i64(p, info->findx);
+		break;
+	    case COL_PINDX:
+		p = fmt_u64(p, info->pindx);
+		break;
+	    case COL_TCP_FLAGS:
+		p = fmt_u64(p, info->tcp_flags);
+		break;
+	    case COL_TCP_SEQ:
+		p = fmt_u64(p, info->tcp_seq);
+		break;
+	    case COL_TCP_ACK:
+		p = fmt_u64(p, info->tcp_ack);
+		break;
+	    case COL_TCP_WIN:
+		p = fmt_u64(p, info->tcp_win);
+		break;
+	    case COL_TCP_OFF:
+		p = fmt_u64(p, info->tcp_off);
+		break;
+	    case COL_IP_IHL:
+		p = fmt_u64(p, info->ip_ihl);
+		break;
+	    default:
+		break;
+	}
+    }
+    *p++ = '\n';
+
+    out->len += p - start;
+}
 
 static void
 handler(
-	unsigned char *user,
-	const struct pcap_pkthdr *pkthdr,
-	const unsigned char *packet)
+	out_buf_t *out,
+	const capf_pkt_t *pkt,
+	uint64_t pindx,
+	output_format_t format)
 {
-    static uint64_t pindx = 0;
-    pcap_t *pcap = (pcap_t *) user;
     pkt_info_t info;
+    pktd_ip_t ip;
 
-    /* Always increment this, even if it's a packet that we ignore,
-     * because it's the index of the packet in the input file (NOT
-     * the index in the output file)
+    /* The pindx is the index of the packet in the input file (NOT
+     * the index in the output file), so the caller counts every
+     * packet, including the ones that we ignore
      */
-    info.pindx = pindx++;
-
-    uint8_t *last_addr = (uint8_t *) packet + pkthdr->caplen;
+    info.pindx = pindx;
 
-    int header_len = dlt_offset(pcap, pkthdr, packet);
-    if (header_len < 0) {
-	/* If the header length is < 0, then it's a
-	 * packet we don't know how to parse; drop it
-	 */
+    /* If it's not an IPv4 packet, or there's not even a valid,
+     * minimal IP header (length 20), then it's a packet we don't
+     * know how to parse; drop it
+     */
+    if (pktd_decode(pkt->dlt, pkt->data, pkt->caplen, &ip) != 0) {
 	return;
     }
 
-    struct ip *ip_header = (struct ip *) (packet + header_len);
-
     /* We don't parse fragments, except for the first
      */
-    if ((ntohs(ip_header->ip_off) & 0x1fff) != 0) {
+    if ((ip.ip_off & 0x1fff) != 0) {
 	return;
     }
 
-    uint16_t ip_len = ntohs(ip_header->ip_len);
-
-    /* If there's not even a valid, minimal IP header
-     * (length 20), then something is totally messed up;
-     * bail out
-     */
-    CHECK_ADDR((uint8_t *) &packet[header_len + 20]);
-
-    uint32_t saddr = ntohl(ip_header->ip_src.s_addr);
-    uint32_t daddr = ntohl(ip_header->ip_dst.s_addr);
-    uint8_t proto = ip_header->ip_p;
+    const uint8_t *l4 = ip.l4;
 
-    uint16_t ip_hdr_len = ip_header->ip_hl * 4;
-    uint8_t *proto_u8 = (uint8_t *)
-		(((unsigned char *) ip_header) + ip_hdr_len);
-    uint16_t *proto_u16 = (uint16_t *) proto_u8;
-    uint32_t *proto_u32 = (uint32_t *) proto_u8;
+    info.ts.tv_sec = pkt->ts_sec;
+    info.ts.tv_usec = pkt->ts_nsec / 1000;
 
-    info.ts.tv_sec = pkthdr->ts.tv_sec;
-    info.ts.tv_usec = pkthdr->ts.tv_usec;
+    info.ip_ihl = ip.ip_hl;
+    info.len = ip.ip_len;
+    info.ipid = ip.ipid;
+    info.ttl = ip.ttl;
+    info.proto = ip.proto;
 
-    info.ip_ihl = ip_header->ip_hl;
-    info.len = ip_len;
-    info.ipid = ntohs(ip_header->ip_id);
-    info.ttl = ip_header->ip_ttl;
-    info.proto = proto;
-
-    info.saddr = saddr;
-    info.daddr = daddr;
+    info.saddr = ip.saddr;
+    info.daddr = ip.daddr;
     info.findx = -1;
 
     info.sport = 0;
@@ -289,43 +701,56 @@ handler(
     info.tcp_off = 0;
     info.tcp_win = 0;
 
-    switch (proto) {
+    /* If the part of the protocol header that we need wasn't
+     * captured, then drop the packet
+     */
+    switch (ip.proto) {
 	case IPPROTO_TCP:
-	    CHECK_ADDR((uint8_t *) &proto_u16[10]);
-	    info.sport = ntohs(proto_u16[0]);
-	    info.dport = ntohs(proto_u16[1]);
-	    info.p_chksum = ntohs(proto_u16[8]);
+	    if (ip.l4_caplen < 20) {
+		return;
+	    }
+	    info.sport = pktd_get16(l4);
+	    info.dport = pktd_get16(l4 + 2);
+	    info.p_chksum = pktd_get16(l4 + 16);
 
 	    /* this mask for the flags includes some reserved bits,
 	     * but we DO see these bits set sometimes (they show
 	     * up in RFCs for variants)
 	     */
-	    info.tcp_flags = ntohs(proto_u16[6]) & 0xff;
-	    info.tcp_seq = ntohl(proto_u32[1]);
-	    info.tcp_ack = ntohl(proto_u32[2]);
-	    info.tcp_off = (ntohs(proto_u16[6]) >> 12) & 0xf;
-	    info.tcp_win = ntohs(proto_u16[7]);
+	    info.tcp_flags = pktd_get16(l4 + 12) & 0xff;
+	    info.tcp_seq = pktd_get32(l4 + 4);
+	    info.tcp_ack = pktd_get32(l4 + 8);
+	    info.tcp_off = (pktd_get16(l4 + 12) >> 12) & 0xf;
+	    info.tcp_win = pktd_get16(l4 + 14);
 	    break;
 	case IPPROTO_UDP:
-	    CHECK_ADDR((uint8_t *) &proto_u16[4]);
-	    info.sport = ntohs(proto_u16[0]);
-	    info.dport = ntohs(proto_u16[1]);
-	    info.p_chksum = ntohs(proto_u16[3]);
+	    if (ip.l4_caplen < 8) {
+		return;
+	    }
+	    info.sport = pktd_get16(l4);
+	    info.dport = pktd_get16(l4 + 2);
+	    info.p_chksum = pktd_get16(l4 + 6);
 	    break;
 	case IPPROTO_ICMP:
-	    CHECK_ADDR((uint8_t *) &proto_u16[2]);
-	    info.sport = proto_u8[0];
-	    info.dport = proto_u8[1];
-	    info.p_chksum = ntohs(proto_u16[1]);
+	    if (ip.l4_caplen < 4) {
+		return;
+	    }
+	    info.sport = l4[0];
+	    info.dport = l4[1];
+	    info.p_chksum = pktd_get16(l4 + 2);
 	    break;
 	case IPPROTO_SCTP:
-	    CHECK_ADDR((uint8_t *) &proto_u16[2]);
-	    info.sport = ntohs(proto_u16[0]);
-	    info.dport = ntohs(proto_u16[1]);
-	    info.p_chksum = ntohl(proto_u32[2]);
+	    if (ip.l4_caplen < 12) {
+		return;
+	    }
+	    info.sport = pktd_get16(l4);
+	    info.dport = pktd_get16(l4 + 2);
+	    info.p_chksum = pktd_get32(l4 + 8);
 	    break;
 	case IPPROTO_GRE:
-	    CHECK_ADDR((uint8_t *) &proto_u16[2]);
+	    if (ip.l4_caplen < 4) {
+		return;
+	    }
 
 	    /* the checksum is optional; we ignore it
 	     * (to be backward compatible with the
@@ -335,71 +760,455 @@ handler(
 	    break;
 	case IPPROTO_IPV6:
 	    /* FIXME wrong, but we don't look deeper */
-	    CHECK_ADDR((uint8_t *) &proto_u16[1]);
+	    if (ip.l4_caplen < 2) {
+		return;
+	    }
 
-	    info.p_chksum = ntohs(ip_header->ip_sum);
+	    info.p_chksum = ip.ip_sum;
 	    break;
 	default:
 	    break;
     }
 
+    if (format == OUTPUT_FC5) {
+	print_pkt_fc5(out, &info);
+	return;
+    }
+
     int compat = 0;
 
 #ifdef PCAP2CSV_COMPAT
     compat = 1;
 #endif /* PCAP2CSV_COMPAT */
 
-    print_pkt_info(&info, compat);
+    print_pkt_info(out, &info, compat);
 }
 
+/* The number of packets read from the input at a time */
+#define CPCAP2CSV_BATCH_SIZE	(256)
+
+/*
+ * Decode and print each packet in the input, one batch at a time
+ */
 static int
-pcap_reader(FILE *fin)
+serial_reader(
+	capf_t *cf,
+	output_format_t format)
 {
-    char err[PCAP_ERRBUF_SIZE];
-    pcap_t *pcap;
+    capf_pkt_t pkts[CPCAP2CSV_BATCH_SIZE];
+    out_buf_t out;
+    uint64_t pindx = 0;
+    int n_pkts;
 
-    pcap = pcap_fopen_offline(fin, err);
-    if (pcap == NULL) {
-	fprintf(stderr, "pcap_open failed [%s]\n", err);
+    if (out_init(&out, OUTBUF_SIZE) != 0) {
 	return 1;
     }
 
-    switch (pcap_datalink(pcap)) {
-	case DLT_RAW:
-	case DLT_EN10MB:
-	case DLT_LINUX_SLL:
-	    break;
-	default:
-	    fprintf(stderr, "ERROR: unsupported link type (%d)\n",
-		    pcap_datalink(pcap));
-	    exit(1);
+    while ((n_pkts = capf_next_batch(cf, pkts, CPCAP2CSV_BATCH_SIZE)) > 0) {
+	for (int i = 0; i < n_pkts; i++) {
+	    if (!pktd_link_supported(pkts[i].dlt)) {
+		fprintf(stderr, "ERROR: unsupported link type (%u)\n",
+			pkts[i].linktype);
+		out_flush(&out);
+		out_close_stream();
+		exit(1);
+	    }
+	    handler(&out, &pkts[i], pindx++, format);
+	}
     }
 
-    if (pcap_loop(pcap, 0, handler, (u_char *) pcap) < 0) {
+    if (n_pkts < 0) {
 	/*
 	 * don't consider this a fatal error, but let the
 	 * user know something is amiss
 	 */
-	fprintf(stderr, "pcap_loop failed [%s]\n", pcap_geterr(pcap));
+	fprintf(stderr, "ERROR: could not read all of the input\n");
+    }
+
+    out_flush(&out);
+    out_free(&out);
+
+    return 0;
+}
+
+/*
+ * The parallel reader (used when there is more than one worker) is a
+ * pipeline with three stages: the main thread reads batches of packets
+ * from the input, the worker threads decode and format the batches
+ * into per-batch output buffers, and a writer thread writes the output
+ * buffers to stdout in the same order that the batches were read.
+ *
+ * The batches are kept in a ring of n_batches slots.  Batch number seq
+ * always uses slot (seq % n_batches), and the slot isn't refilled until
+ * the writer has written and freed it, so the reader can't get more
+ * than n_batches ahead of the writer.
+ */
+
+/* The number of packets in each batch of the parallel reader */
+#define CPCAP2CSV_PAR_BATCH_SIZE	(4096)
+
+typedef enum {
+    BATCH_FREE,
+    BATCH_FILLED,
+    BATCH_DONE
+} batch_state_t;
+
+typedef struct {
+    batch_state_t state;
+    uint64_t pindx;		/* the pindx of the first packet */
+    int n_pkts;
+    capf_pkt_t pkts[CPCAP2CSV_PAR_BATCH_SIZE];
+
+    /*
+     * If the input isn't mapped, then the packet data is only valid
+     * until the next read, so the reader copies the packets here
+     */
+    uint8_t *data;
+    size_t data_size;
+
+    out_buf_t out;
+} batch_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    batch_t *batches;
+    uint64_t n_batches;
+
+    uint64_t n_filled;		/* the number of batches read */
+    uint64_t next_decode;	/* the next batch to give to a worker */
+    int eof;			/* the reader has read its last batch */
+
+    output_format_t format;
+} pipeline_t;
+
+static void *
+worker_main(
+	void *arg)
+{
+    pipeline_t *pl = arg;
+
+    for (;;) {
+	pthread_mutex_lock(&pl->lock);
+	while (pl->next_decode >= pl->n_filled && !pl->eof) {
+	    pthread_cond_wait(&pl->cond, &pl->lock);
+	}
+	if (pl->next_decode >= pl->n_filled) {
+	    pthread_mutex_unlock(&pl->lock);
+	    break;
+	}
+	batch_t *batch = &pl->batches[pl->next_decode++ % pl->n_batches];
+	pthread_mutex_unlock(&pl->lock);
+
+	for (int i = 0; i < batch->n_pkts; i++) {
+	    handler(&batch->out, &batch->pkts[i], batch->pindx + i,
+		    pl->format);
+	}
+
+	pthread_mutex_lock(&pl->lock);
+	batch->state = BATCH_DONE;
+	pthread_cond_broadcast(&pl->cond);
+	pthread_mutex_unlock(&pl->lock);
+    }
+
+    return NULL;
+}
+
+static void *
+writer_main(
+	void *arg)
+{
+    pipeline_t *pl = arg;
+
+    for (uint64_t seq = 0; ; seq++) {
+	batch_t *batch = &pl->batches[seq % pl->n_batches];
+
+	pthread_mutex_lock(&pl->lock);
+	while (batch->state != BATCH_DONE &&
+		!(pl->eof && seq >= pl->n_filled)) {
+	    pthread_cond_wait(&pl->cond, &pl->lock);
+	}
+	if (batch->state != BATCH_DONE) {
+	    pthread_mutex_unlock(&pl->lock);
+	    break;
+	}
+	pthread_mutex_unlock(&pl->lock);
+
+	out_flush(&batch->out);
+
+	pthread_mutex_lock(&pl->lock);
+	batch->state = BATCH_FREE;
+	pthread_cond_broadcast(&pl->cond);
+	pthread_mutex_unlock(&pl->lock);
+    }
+
+    return NULL;
+}
+
+/*
+ * Copy the packets in a batch into the batch's own buffer.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+static int
+batch_copy_data(
+	batch_t *batch)
+{
+    size_t total = 0;
+
+    for (int i = 0; i < batch->n_pkts; i++) {
+	total += batch->pkts[i].caplen;
+    }
+
+    if (total > batch->data_size) {
+	uint8_t *data = realloc(batch->data, total);
+
+	if (data == NULL) {
+	    fprintf(stderr, "ERROR: could not allocate packet buffer\n");
+	    return -1;
+	}
+	batch->data = data;
+	batch->data_size = total;
+    }
+
+    size_t off = 0;
+    for (int i = 0; i < batch->n_pkts; i++) {
+	memcpy(batch->data + off, batch->pkts[i].data, batch->pkts[i].caplen);
+	batch->pkts[i].data = batch->data + off;
+	off += batch->pkts[i].caplen;
     }
 
     return 0;
 }
 
+static int
+parallel_reader(
+	capf_t *cf,
+	output_format_t format,
+	int n_workers)
+{
+    pthread_t workers[n_workers];
+    pthread_t writer;
+    int n_started = 0;
+    int have_writer = 0;
+    pipeline_t pl;
+    uint64_t pindx = 0;
+    int bad_link = 0;
+    uint32_t bad_linktype = 0;
+    int read_err = 0;
+    int rc = 0;
+
+    pthread_mutex_init(&pl.lock, NULL);
+    pthread_cond_init(&pl.cond, NULL);
+    pl.n_batches = 2 * n_workers + 2;
+    pl.n_filled = 0;
+    pl.next_decode = 0;
+    pl.eof = 0;
+    pl.format = format;
+
+    pl.batches = calloc(pl.n_batches, sizeof(batch_t));
+    if (pl.batches == NULL) {
+	fprintf(stderr, "ERROR: could not allocate batches\n");
+	return 1;
+    }
+
+    for (uint64_t i = 0; i < pl.n_batches; i++) {
+	pl.batches[i].state = BATCH_FREE;
+	if (out_init(&pl.batches[i].out,
+		    (CPCAP2CSV_PAR_BATCH_SIZE + 1) * OUTBUF_MAX_REC) != 0) {
+	    return 1;
+	}
+    }
+
+    /*
+     * If any of the threads can't be started, then don't read
+     * anything: the threads that did start see the end of the
+     * input right away, and are joined below
+     */
+    for (int i = 0; i < n_workers; i++) {
+	if (pthread_create(&workers[i], NULL, worker_main, &pl) != 0) {
+	    fprintf(stderr, "ERROR: could not start worker thread\n");
+	    rc = 1;
+	    break;
+	}
+	n_started++;
+    }
+    if (rc == 0) {
+	if (pthread_create(&writer, NULL, writer_main, &pl) != 0) {
+	    fprintf(stderr, "ERROR: could not start writer thread\n");
+	    rc = 1;
+	}
+	else {
+	    have_writer = 1;
+	}
+    }
+
+    for (uint64_t seq = 0; (rc == 0) && !bad_link; seq++) {
+	batch_t *batch = &pl.batches[seq % pl.n_batches];
+
+	pthread_mutex_lock(&pl.lock);
+	while (batch->state != BATCH_FREE) {
+	    pthread_cond_wait(&pl.cond, &pl.lock);
+	}
+	pthread_mutex_unlock(&pl.lock);
+
+	int n_pkts = capf_next_batch(cf, batch->pkts, CPCAP2CSV_PAR_BATCH_SIZE);
+	if (n_pkts < 0) {
+	    read_err = 1;
+	    break;
+	}
+
+	/*
+	 * If there's a packet with a link type that we can't decode,
+	 * then finish the packets before it, and then stop
+	 */
+	for (int i = 0; i < n_pkts; i++) {
+	    if (!pktd_link_supported(batch->pkts[i].dlt)) {
+		bad_link = 1;
+		bad_linktype = batch->pkts[i].linktype;
+		n_pkts = i;
+		break;
+	    }
+	}
+
+	if (n_pkts == 0) {
+	    break;
+	}
+
+	batch->n_pkts = n_pkts;
+	batch->pindx = pindx;
+	pindx += n_pkts;
+
+	if (cf->map == NULL && batch_copy_data(batch) != 0) {
+	    rc = 1;
+	    break;
+	}
+
+	pthread_mutex_lock(&pl.lock);
+	batch->state = BATCH_FILLED;
+	pl.n_filled++;
+	pthread_cond_broadcast(&pl.cond);
+	pthread_mutex_unlock(&pl.lock);
+    }
+
+    pthread_mutex_lock(&pl.lock);
+    pl.eof = 1;
+    pthread_cond_broadcast(&pl.cond);
+    pthread_mutex_unlock(&pl.lock);
+
+    for (int i = 0; i < n_started; i++) {
+	pthread_join(workers[i], NULL);
+    }
+    if (have_writer) {
+	pthread_join(writer, NULL);
+    }
+
+    for (uint64_t i = 0; i < pl.n_batches; i++) {
+	out_free(&pl.batches[i].out);
+	free(pl.batches[i].data);
+    }
+    free(pl.batches);
+    pthread_cond_destroy(&pl.cond);
+    pthread_mutex_destroy(&pl.lock);
+
+    if (bad_link) {
+	fprintf(stderr, "ERROR: unsupported link type (%u)\n", bad_linktype);
+	out_close_stream();
+	exit(1);
+    }
+
+    if (read_err) {
+	/*
+	 * don't consider this a fatal error, but let the
+	 * user know something is amiss
+	 */
+	fprintf(stderr, "ERROR: could not read all of the input\n");
+    }
+
+    return rc;
+}
+
+static int
+pcap_reader(
+	FILE *fin,
+	output_format_t format,
+	int n_workers,
+	int header)
+{
+    capf_t cf;
+    int rc;
+
+    /*
+     * capfile reads both pcap and pcapng, and in a pcapng file each
+     * interface may have its own link type, so the link type is
+     * checked for each packet
+     */
+    if (capf_open(&cf, fin) != 0) {
+	fprintf(stderr, "ERROR: input is not a pcap or pcapng file\n");
+	return 1;
+    }
+
+    if (header) {
+	out_buf_t out;
+
+	if (out_init(&out, OUTBUF_MAX_REC) != 0) {
+	    capf_close(&cf);
+	    return 1;
+	}
+	print_header(&out);
+	out_flush(&out);
+	out_free(&out);
+    }
+
+    if (n_workers > 1) {
+	rc = parallel_reader(&cf, format, n_workers);
+    }
+    else {
+	rc = serial_reader(&cf, format);
+    }
+
+    capf_close(&cf);
+
+    return rc;
+}
+
 static void
 usage(
 	char *progname)
 {
 
-    printf("usage: %s [-h]\n", progname);
+    printf("usage: %s [-h] [-c COLS] [-j N] [-O FORMAT] [-z CODEC] [-Z N]\n",
+	    progname);
     printf("\n"
 "Commandline flags:\n"
-"-h      Print usage message and exit.\n"
+"-c COLS    Print only the given columns, in the given order, where\n"
+"           COLS is a comma-separated list of the column names shown\n"
+"           below, or one of the presets \"all\" or \"compact\".  The\n"
+"           compact preset is\n"
+"           " COMPACT_COLS "\n"
+"           When -c is used, the first line of the output is a header\n"
+"           that names the columns, prefixed with a '#'.\n"
+"-h         Print usage message and exit.\n"
+"-j N       Use N threads to decode and format the packets.  The\n"
+"           output is the same as with one thread.  The default is 1.\n"
+"-O FORMAT  Write the output in the given FORMAT, which must be\n"
+"           csv or fc5.  The default is csv.  The fc5 format is\n"
+"           the binary format read by firecracker (and written by\n"
+"           fc5conv), with the TCP flags in the flags field.\n"
+"-z CODEC   Compress the output with the given CODEC, which must be\n"
+"           gzip, lz4, or zstd, optionally followed by :LEVEL (for\n"
+"           example, gzip:6).  The output is a series of independently\n"
+"           compressed blocks, which the usual decompressors read as\n"
+"           one stream.  lz4 and zstd are only available if cpcap2csv\n"
+"           was built with support for them.\n"
+"-Z N       Use N threads to compress the output.  The default is the\n"
+"           number of online processors.\n"
 "\n"
 "For backward compatibility, the option [-f N] is\n"
 "permitted, but ignored.\n"
 "\n"
-"Reads a pcap from stdin and writes a CSV description\n"
+"Reads a pcap or pcapng file from stdin and writes a CSV description\n"
 "of each IPv4 packet to stdout.\n"
 "\n"
 "The fields in the CSV output represent:\n"
@@ -440,14 +1249,62 @@ main(
 	int argc,
 	char **argv)
 {
+    output_format_t format = OUTPUT_CSV;
+    int n_workers = 1;
+    int header = 0;
+    zout_codec_t codec = ZOUT_CODEC_NONE;
+    int level = 0;
+    int n_zthreads = sysconf(_SC_NPROCESSORS_ONLN);
     int opt;
 
-    while ((opt = getopt(argc, argv, "f:h")) != -1) {
+    parse_cols("all");
+
+    while ((opt = getopt(argc, argv, "c:f:hj:O:z:Z:")) != -1) {
 	switch (opt) {
+	    case 'c':
+		if (parse_cols(optarg) != 0) {
+		    exit(1);
+		}
+		header = 1;
+		break;
 	    case 'h':
 		usage(argv[0]);
 		exit(0);
 		break;
+	    case 'j':
+		n_workers = atoi(optarg);
+		if (n_workers < 1) {
+		    fprintf(stderr, "ERROR: bad number of threads [%s]\n",
+			    optarg);
+		    exit(1);
+		}
+		break;
+	    case 'O':
+		if (!strcmp(optarg, "csv")) {
+		    format = OUTPUT_CSV;
+		}
+		else if (!strcmp(optarg, "fc5")) {
+		    format = OUTPUT_FC5;
+		}
+		else {
+		    fprintf(stderr, "ERROR: unknown output format [%s]\n",
+			    optarg);
+		    exit(1);
+		}
+		break;
+	    case 'z':
+		if (zout_codec_parse(optarg, &codec, &level) != 0) {
+		    exit(1);
+		}
+		break;
+	    case 'Z':
+		n_zthreads = atoi(optarg);
+		if (n_zthreads < 0) {
+		    fprintf(stderr, "ERROR: bad number of threads [%s]\n",
+			    optarg);
+		    exit(1);
+		}
+		break;
 	    case 'f':
 		/*
 		 * NOTE: the findx option is permitted, to make
@@ -467,7 +1324,33 @@ main(
      * backward compatible with the old pcap2csv
      */
 
-    int rc = pcap_reader(stdin);
+    /*
+     * The worker threads use localtime_r, which (unlike localtime)
+     * isn't required to initialize the timezone
+     */
+    tzset();
+
+    if (header && format != OUTPUT_CSV) {
+	fprintf(stderr, "ERROR: -c can only be used with CSV output\n");
+	exit(1);
+    }
+
+    if (codec != ZOUT_CODEC_NONE) {
+	zout_pool = zout_pool_create(n_zthreads);
+	if (zout_pool == NULL) {
+	    exit(1);
+	}
+	zout = zout_fdopen(STDOUT_FILENO, codec, level, zout_pool);
+	if (zout == NULL) {
+	    exit(1);
+	}
+    }
+
+    int rc = pcap_reader(stdin, format, n_workers, header);
+
+    if (out_close_stream() != 0) {
+	rc = 1;
+    }
 
     exit(rc);
 }
@@ -34,215 +34,568 @@
  * Filter CSV data (from stdin) and print to stdout the rows with a
  * value in the nth column (assumed to signify an IPv4 address) do
  * not match any of the subnets in a file of subnet specs.
+ *
+ * Alternatively, route each row to one of several files according to
+ * which of several lists of subnets (if any) its address matches, in
+ * one pass over the input.
  */
 
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
-/* The algorithm used by this program assumes that the
- * total number of addresses is relatively small, i.e.
- * less than a hundred thousand.  If there are millions
- * of addresses, then it's going to behave badly.  If
- * even larger than that, we give up.
- */
-#define MIN_ALLOWED_PREFIX_LEN	(14)
-
-/* If it takes more than 127 characters to define a
- * subnet, something is broken.
- */
-#define SUBNET_BUFSIZE	(128)
+#include "ipmatch.h"
 
 /* Define a maximum length for each filtered CSV record.
  */
 #define FILTER_BUFSIZE	(8192)
 
 
-int
-add_subnet(
-	char *subnet_name,
-	uint32_t **seen,
-	uint32_t *seen_n,
-	uint32_t *max_len)
+/*
+ * Find the column with the given name in a header line (a line that
+ * starts with a '#', followed by the names of the columns, as written
+ * by cpcap2csv -c).
+ *
+ * Returns the one-based index of the column, or -1 if there is no
+ * column with that name.
+ */
+static int
+find_column(
+	char *header,
+	int sep,
+	char *name)
 {
-    uint32_t subnet_size = 1;
-    uint32_t subnet_mask = 0xffffffff;
-    uint32_t base_addr;
-    int rc;
-
-    /* We use uint64_t for these values, even though a byte
-     * should be large enough, in case the user provides bad
-     * input.  The %hhu scanf format DOES NOT check whether
-     * the input string actually fits in a byte; it simply
-     * truncates the value.  So if we tried to use %hhu to
-     * parse the input, it would "succeed" for something like
-     * 1.2.3.4000, but the value of the low-order byte would
-     * be 4000 % 256.
-     *
-     * Allowing a preposterously large value and then checking
-     * it later will catch some potential errors, although
-     * it's still not foolproof.
-     */
-    uint64_t q[4];
-    uint64_t prefix_len;
+    size_t name_len = strlen(name);
+    char *pos = header + 1;
 
-    if (NULL != strchr(subnet_name, '/')) {
+    for (int nth = 1; ; nth++) {
+	size_t len = strcspn(pos, (char []) { sep, '\r', '\n', '\0' });
 
-	rc = sscanf(subnet_name, "%lu.%lu.%lu.%lu/%lu",
-		&q[3], &q[2], &q[1], &q[0], &prefix_len);
-	if (rc != 5) {
-	    fprintf(stderr, "ERROR: bad subnet spec [%s]\n", subnet_name);
-	    return -1;
-	}
-
-	if (prefix_len > 32) {
-	    fprintf(stderr, "ERROR: bad subnet spec [%s]\n", subnet_name);
-	    return -1;
+	if ((len == name_len) && !strncmp(pos, name, len)) {
+	    return nth;
 	}
-	if (prefix_len < MIN_ALLOWED_PREFIX_LEN) {
-	    fprintf(stderr, "ERROR: prefix for [%s] is too short [%lu < %u]\n",
-		    subnet_name, prefix_len, MIN_ALLOWED_PREFIX_LEN);
-	    return -1;
-	}
-
-	subnet_size = 1 << (32 - prefix_len);
-	if (prefix_len == 32) {
-	    subnet_mask = 0xffffffff;
-	}
-	else {
-	    subnet_mask = ~(0xffffffff & (0xffffffff >> prefix_len));
-	}
-    }
-    else {
-	rc = sscanf(subnet_name, "%lu.%lu.%lu.%lu",
-		&q[3], &q[2], &q[1], &q[0]);
-	if (rc != 4) {
-	    fprintf(stderr, "ERROR: bad subnet spec [%s]\n", subnet_name);
+	if (pos[len] != sep) {
 	    return -1;
 	}
+	pos += len + 1;
     }
+}
 
-    if (q[3] > 255 || q[2] > 255 || q[1] > 255 || q[0] > 255) {
-	fprintf(stderr, "ERROR: bad subnet spec [%s]\n", subnet_name);
-	return -1;
-    }
+/* The size of each read from the input */
+#define FILTER_READ_LEN	(4 * 1024 * 1024)
+
+/* The size of the output buffer */
+#define FILTER_OUT_LEN	(1024 * 1024)
 
-    base_addr = (q[3] << 24) | (q[2] << 16) | (q[1] << 8) | q[0];
-    base_addr &= subnet_mask;
+typedef struct {
+    int fd;
+    char *buf;
+    size_t len;
+    size_t size;
+} out_buf_t;
+
+/*
+ * Returns 0 on success, -1 on failure.
+ */
+static int
+write_all(
+	int fd,
+	const char *buf,
+	size_t len)
+{
+    size_t off = 0;
 
-    for (uint32_t i = 0; i < subnet_size; i++) {
+    while (off < len) {
+	ssize_t n = write(fd, buf + off, len - off);
 
-	if (*seen_n == *max_len) {
-	    *max_len = 2 * *max_len;
-	    *seen = realloc(
-		    (void *) *seen,
-		    (size_t) (*max_len * sizeof(uint32_t)));
-	    if (*seen == NULL) {
-		fprintf(stderr, "ERROR: realloc failed\n");
-		return -2;
+	if (n < 0) {
+	    if (errno == EINTR) {
+		continue;
 	    }
+	    fprintf(stderr, "ERROR: could not write output: %s\n",
+		    strerror(errno));
+	    return -1;
 	}
-
-	(*seen)[*seen_n] = base_addr + i;
-	*seen_n += 1;
+	off += n;
     }
 
     return 0;
 }
 
 static int
-read_subnets(
-	char *fname,
-	uint32_t **seen_addrs,
-	uint32_t *seen_addrs_n,
-	uint32_t *max_len)
+out_flush(
+	out_buf_t *out)
 {
-    char buf[SUBNET_BUFSIZE];
-    int rc;
+    int rc = write_all(out->fd, out->buf, out->len);
 
-    FILE *fin = fopen(fname, "r");
-    if (fin == NULL) {
-	fprintf(stderr, "ERROR: count not open [%s]\n", fname);
-	return -1;
-    }
+    out->len = 0;
 
-    while (NULL != fgets(buf, SUBNET_BUFSIZE, fin)) {
-	char *newline_pos = strrchr(buf, '\n');
-	if (newline_pos == NULL) {
-	    fprintf(stderr, "ERROR: line too long [%s...]\n", buf);
-	    return -2;
-	}
-	else {
-	    *newline_pos = 0;
-	}
+    return rc;
+}
 
-	char *comment = strchr(buf, '#');
-	if (comment != NULL) {
-	    *comment = '\0';
-	}
-	if (strlen(buf) == 0) {
-	    continue;
-	}
+/*
+ * Append a range of lines to the output.  If the range is at least as
+ * large as the output buffer, then it is written directly.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+static int
+out_append(
+	out_buf_t *out,
+	const char *p,
+	size_t len)
+{
 
-	rc = add_subnet(buf, seen_addrs, seen_addrs_n, max_len);
-	if (rc != 0) {
+    if (len > out->size - out->len) {
+	if (out_flush(out) != 0) {
 	    return -1;
 	}
+	if (len >= out->size) {
+	    return write_all(out->fd, p, len);
+	}
     }
 
-    fclose(fin);
+    memcpy(out->buf + out->len, p, len);
+    out->len += len;
 
     return 0;
 }
 
-static char *
-strnthchr(
-	char *str,
+/*
+ * Return a pointer to the nth (one-based) field of the line that
+ * begins at line and ends at end, or NULL if the line has fewer than
+ * nth fields
+ */
+static inline const char *
+find_field(
+	const char *line,
+	const char *end,
 	int sep,
 	int nth)
 {
-    char *pos = str;
+    const char *pos = line;
 
-    for (int i = 0; i < nth; i++) {
-	pos = strchr(pos, sep);
+    for (int i = 1; i < nth; i++) {
+	pos = memchr(pos, sep, end - pos);
 	if (pos == NULL) {
 	    return NULL;
 	}
 	pos += 1;
     }
 
-    if (*pos) {
-	return pos;
+    return pos;
+}
+
+static int
+bad_address(
+	const char *field)
+{
+
+    fprintf(stderr, "ERROR: bad address [%.*s]\n",
+	    (int) strcspn(field, "\n"), field);
+
+    return -1;
+}
+
+/*
+ * The longest field that the slow parsers look at.  A longer field
+ * can't be a valid address anyway.
+ */
+#define FILTER_FIELD_MAX	(64)
+
+/*
+ * Copy the rest of the line, starting at field, into buf (which must
+ * have FILTER_FIELD_MAX bytes), and terminate it, so that strtoul and
+ * sscanf stop at the end of the line (as they did when each line was
+ * read into its own buffer) instead of skipping over the newline and
+ * reading the next line.
+ */
+static const char *
+copy_field(
+	const char *field,
+	const char *line_end,
+	char *buf)
+{
+    size_t len = line_end - field;
+
+    if (len > FILTER_FIELD_MAX - 1) {
+	len = FILTER_FIELD_MAX - 1;
+    }
+    memcpy(buf, field, len);
+    buf[len] = '\0';
+
+    return buf;
+}
+
+/*
+ * Parse an address in dotted-quad notation, with sscanf, for the
+ * fields that parse_addr doesn't handle itself (such as octets with
+ * leading zeros, or leading whitespace)
+ */
+static int
+parse_quad_slow(
+	const char *field,
+	uint32_t *addr)
+{
+    uint64_t q[4];
+
+    int rc = sscanf(field, "%lu.%lu.%lu.%lu", &q[3], &q[2], &q[1], &q[0]);
+    if (rc != 4) {
+	return bad_address(field);
+    }
+    if (q[3] > 255 || q[2] > 255 || q[1] > 255 || q[0] > 255) {
+	return bad_address(field);
+    }
+
+    *addr = (q[3] << 24) | (q[2] << 16) | (q[1] << 8) | q[0];
+
+    return 0;
+}
+
+static inline int
+hex_value(
+	int c)
+{
+
+    if (c >= '0' && c <= '9') {
+	return c - '0';
+    }
+    else if (c >= 'a' && c <= 'f') {
+	return c - 'a' + 10;
+    }
+    else if (c >= 'A' && c <= 'F') {
+	return c - 'A' + 10;
     }
     else {
-	return NULL;
+	return -1;
+    }
+}
+
+/*
+ * Parse the address at the start of field (in the line that ends at
+ * line_end), in the given format.  The common cases are parsed
+ * directly; anything unusual (including an empty field) is passed to
+ * strtoul or sscanf, on a copy of the field, so that the result is the
+ * same as theirs.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+static inline int
+parse_addr(
+	const char *field,
+	const char *line_end,
+	int format,
+	uint32_t *addr)
+{
+    const unsigned char *p = (const unsigned char *) field;
+    char buf[FILTER_FIELD_MAX];
+    uint64_t val = 0;
+    int n;
+
+    switch (format) {
+	case 'd':
+	    for (n = 0; n < 19 && (unsigned int) (p[n] - '0') < 10; n++) {
+		val = (val * 10) + (p[n] - '0');
+	    }
+	    if (n == 0 || n == 19) {
+		*addr = strtoul(copy_field(field, line_end, buf), NULL, 10);
+	    }
+	    else {
+		*addr = val;
+	    }
+	    return 0;
+
+	case 'x':
+	    if (p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) {
+		*addr = strtoul(copy_field(field, line_end, buf), NULL, 16);
+		return 0;
+	    }
+	    for (n = 0; n < 15 && hex_value(p[n]) >= 0; n++) {
+		val = (val << 4) | hex_value(p[n]);
+	    }
+	    if (n == 0 || n == 15) {
+		*addr = strtoul(copy_field(field, line_end, buf), NULL, 16);
+	    }
+	    else {
+		*addr = val;
+	    }
+	    return 0;
+
+	case 'q':
+	    for (int i = 0; i < 4; i++) {
+		uint32_t octet = 0;
+
+		for (n = 0; n < 3 && (unsigned int) (p[n] - '0') < 10; n++) {
+		    octet = (octet * 10) + (p[n] - '0');
+		}
+		if (n == 0 || octet > 255 ||
+			(unsigned int) (p[n] - '0') < 10) {
+		    return parse_quad_slow(
+			    copy_field(field, line_end, buf), addr);
+		}
+		if (i < 3 && p[n] != '.') {
+		    return parse_quad_slow(
+			    copy_field(field, line_end, buf), addr);
+		}
+		val = (val << 8) | octet;
+		p += n + 1;
+	    }
+	    *addr = val;
+	    return 0;
+
+	default:
+	    fprintf(stderr, "ERROR: unsupported format [%c]\n", format);
+	    return -1;
     }
 }
 
+/*
+ * Open an output for the given file name, or stdout if the name is "-".
+ *
+ * Returns 0 on success, -1 on failure.
+ */
 static int
-uint32_compare(
-	const void *p0,
-	const void *p1)
+out_open(
+	out_buf_t *out,
+	const char *fname)
 {
-    uint32_t val0 = *(uint32_t *) p0;
-    uint32_t val1 = *(uint32_t *) p1;
 
-    /* Because we're dealing with unsigned numbers, we can't just
-     * do the usual trick of returning val0 - val1 without some
-     * ugly casting.  So we'll do things the explicit way and let the
-     * compiler figure out how to optimize it.
-     */
-    if (val0 < val1) {
+    if (!strcmp(fname, "-")) {
+	out->fd = STDOUT_FILENO;
+    }
+    else {
+	out->fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (out->fd < 0) {
+	    fprintf(stderr, "ERROR: could not open [%s]: %s\n",
+		    fname, strerror(errno));
+	    return -1;
+	}
+    }
+
+    out->buf = malloc(FILTER_OUT_LEN);
+    if (out->buf == NULL) {
+	fprintf(stderr, "ERROR: malloc failed\n");
 	return -1;
     }
-    else if (val0 > val1) {
-	return 1;
+    out->len = 0;
+    out->size = FILTER_OUT_LEN;
+
+    return 0;
+}
+
+/*
+ * Flush and close an output (unless it is stdout).
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+static int
+out_close(
+	out_buf_t *out)
+{
+    int rc = out_flush(out);
+
+    if (out->fd != STDOUT_FILENO && close(out->fd) != 0) {
+	fprintf(stderr, "ERROR: could not close output: %s\n",
+		strerror(errno));
+	rc = -1;
     }
-    else {
-	return 0;
+    free(out->buf);
+    out->buf = NULL;
+
+    return rc;
+}
+
+/*
+ * Read CSV from stdin, and route each row to the output for the tag of
+ * the address list that its address matches (or tag 0, if it doesn't
+ * match any list).  routes[tag] is the output for the given tag, or
+ * NULL if rows with that tag are dropped.  Header lines are written to
+ * each of the n_outs outputs in outs.
+ *
+ * The input is read in large blocks, and each block is scanned for
+ * complete lines with memchr.  Consecutive lines that go to the same
+ * output are copied to it as one range.  A line that doesn't end in a
+ * newline (at the end of the input) is treated like any other line.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+static int
+filter_input(
+	ipmatch_t *addresses,
+	int sep,
+	int nth,
+	char *nth_name,
+	int format,
+	out_buf_t **routes,
+	out_buf_t *outs,
+	int n_outs)
+{
+    char *buf = malloc(FILTER_READ_LEN + 1);
+    uint64_t lineno = 0;
+    size_t have = 0;
+    int skip_line = 0;
+    int eof = 0;
+    int rc = 0;
+
+    if (buf == NULL) {
+	fprintf(stderr, "ERROR: malloc failed\n");
+	return -1;
+    }
+
+    while (rc == 0 && !(eof && have == 0)) {
+	ssize_t n = read(STDIN_FILENO, buf + have, FILTER_READ_LEN - have);
+	if (n < 0) {
+	    if (errno == EINTR) {
+		continue;
+	    }
+	    fprintf(stderr, "ERROR: could not read input: %s\n",
+		    strerror(errno));
+	    rc = -1;
+	    break;
+	}
+	else if (n == 0) {
+	    eof = 1;
+	}
+	have += n;
+
+	/* Make sure that strtoul and friends stop at the end of
+	 * the data, even if the last line has no newline
+	 */
+	buf[have] = '\0';
+
+	char *p = buf;
+	char *end = buf + have;
+
+	/* If the previous block ended in the middle of a line that
+	 * was too long, then skip the rest of that line
+	 */
+	if (skip_line) {
+	    char *nl = memchr(p, '\n', end - p);
+
+	    if (nl == NULL) {
+		have = 0;
+		if (eof) {
+		    break;
+		}
+		continue;
+	    }
+	    p = nl + 1;
+	    skip_line = 0;
+	}
+
+	/* The start of the current run of lines, and their output
+	 * (or NULL, if they are dropped)
+	 */
+	char *run = p;
+	out_buf_t *run_out = NULL;
+
+	while (p < end) {
+	    char *nl = memchr(p, '\n', end - p);
+	    char *line_end;
+
+	    if (nl != NULL) {
+		line_end = nl + 1;
+	    }
+	    else if (eof) {
+		line_end = end;
+	    }
+	    else {
+		break;
+	    }
+
+	    lineno++;
+	    out_buf_t *dest = NULL;
+	    int header = 0;
+
+	    if (line_end - p >= FILTER_BUFSIZE) {
+		fprintf(stderr, "WARNING: line %lu too long [%.*s]\n",
+			lineno, FILTER_BUFSIZE - 1, p);
+	    }
+	    else if (*p == '#') {
+		if (nth_name != NULL) {
+		    nth = find_column(p, sep, nth_name);
+		    if (nth < 1) {
+			fprintf(stderr, "ERROR: no column [%s] in header\n",
+				nth_name);
+			rc = -1;
+			break;
+		    }
+		}
+		header = 1;
+	    }
+	    else if (nth_name != NULL && nth == 0) {
+		fprintf(stderr, "ERROR: no header line to find column [%s]\n",
+			nth_name);
+		rc = -1;
+		break;
+	    }
+	    else {
+		const char *field = find_field(p, line_end, sep, nth);
+		uint32_t addr;
+
+		if (field != NULL) {
+		    if (parse_addr(field, line_end, format, &addr) != 0) {
+			rc = -1;
+			break;
+		    }
+		    dest = routes[ipmatch_lookup(addresses, addr)];
+		}
+	    }
+
+	    if (header || dest != run_out) {
+		if (run_out != NULL && out_append(run_out, run, p - run) != 0) {
+		    rc = -1;
+		    break;
+		}
+		run = p;
+		run_out = dest;
+	    }
+
+	    if (header) {
+		for (int i = 0; i < n_outs; i++) {
+		    if (out_append(&outs[i], p, line_end - p) != 0) {
+			rc = -1;
+			break;
+		    }
+		}
+		if (rc != 0) {
+		    break;
+		}
+		run = line_end;
+	    }
+
+	    p = line_end;
+	}
+
+	if (run_out != NULL && out_append(run_out, run, p - run) != 0) {
+	    rc = -1;
+	}
+
+	/* Keep the partial line (if any) for the next block.  If
+	 * the partial line is already too long, then warn about it
+	 * and skip the rest of it.
+	 */
+	have = end - p;
+	if (have >= FILTER_BUFSIZE) {
+	    lineno++;
+	    fprintf(stderr, "WARNING: line %lu too long [%.*s]\n",
+		    lineno, FILTER_BUFSIZE - 1, p);
+	    have = 0;
+	    skip_line = 1;
+	}
+	else {
+	    memmove(buf, p, have);
+	}
     }
+
+    free(buf);
+
+    return rc;
 }
 
 static void
@@ -250,8 +603,10 @@ usage(
 	char *progname)
 {
 
-    fprintf(stderr, "usage: %s [-r] [-b FMT] [-F SEP] [-n NUM] [-s NET] [NETFILE]\n",
+    fprintf(stderr, "usage: %s [-r] [-b FMT] [-F SEP] [-n COL] [-s NET] [NETFILE]\n",
 	    progname);
+    fprintf(stderr, "       %s [-b FMT] [-F SEP] [-n COL] [-u OUTFILE] "
+	    "-m LISTFILE=OUTFILE ...\n", progname);
     fprintf(stderr, "%s",
     "\n"
     "Filter CSV from stdin by IP address in one column;\n"
@@ -262,12 +617,26 @@ usage(
     "        (d is decimal; x is hex; q is dotted decimal quads)\n"
     "-F SEP  Use the SEP character as the field separator\n"
     "        (default=,)\n"
-    "-n NUM  Use the nth (one-based) column as the filter address\n"
-    "        (default=1)\n"
+    "-n COL  Use the nth (one-based) column as the filter address\n"
+    "        (default=1).  If COL is not a number, then it is the name\n"
+    "        of the column, which is found in the header line.\n"
     "-s NET  Filter by the given subnet (in addition to the NETFILE,\n"
     "        if any)\n"
     "NETFILE A file containing IPv4 addresses or subnets (in CIDR\n"
-    "        notation), one per line, to filter.\n");
+    "        notation), one per line, to filter.\n"
+    "\n"
+    "-m LISTFILE=OUTFILE  Route the rows that match the addresses or\n"
+    "        subnets in LISTFILE to OUTFILE.  May be given more than\n"
+    "        once, to route the input to several outputs in one pass;\n"
+    "        if a row matches more than one LISTFILE, then it goes to\n"
+    "        the OUTFILE of the first.  Several LISTFILEs may share\n"
+    "        the same OUTFILE.  An OUTFILE of - is stdout.\n"
+    "-u OUTFILE  Route the rows that do not match any LISTFILE to\n"
+    "        OUTFILE.  By default, these rows are discarded.\n"
+    "\n"
+    "Header lines (lines that start with a '#', as written by\n"
+    "cpcap2csv -c) are always written to stdout, or to every\n"
+    "OUTFILE when routing with -m.\n");
 }
 
 static int
@@ -276,15 +645,19 @@ parse_args(
 	char **argv,
 	int *sep,
 	int *nth,
+	char **nth_name,
 	int *format,
 	int *inverse,
 	char **fname,
-	char **subnet)
+	char **subnet,
+	char **routes,
+	int *n_routes,
+	char **unmatched)
 {
     extern char *optarg;
     int opt;
 
-    while ((opt = getopt(argc, argv, "b:F:n:rs:")) != -1) {
+    while ((opt = getopt(argc, argv, "b:F:m:n:rs:u:")) != -1) {
 	switch (opt) {
 	    case 'b':
 		if (strlen(optarg) != 1) {
@@ -293,7 +666,19 @@ parse_args(
 		}
 		*format = optarg[0];
 		break;
+	    case 'm':
+		if (strchr(optarg, '=') == NULL) {
+		    fprintf(stderr, "ERROR: bad route [%s] (not LISTFILE=OUTFILE)\n",
+			    optarg);
+		    return -1;
+		}
+		routes[(*n_routes)++] = optarg;
+		break;
 	    case 'n':
+		if (!isdigit((unsigned char) optarg[0])) {
+		    *nth_name = optarg;
+		    break;
+		}
 		*nth = strtoul(optarg, NULL, 0);
 		if (*nth < 1) {
 		    fprintf(stderr, "ERROR: nth must be >= 1\n");
@@ -306,6 +691,9 @@ parse_args(
 	    case 's':
 		*subnet = optarg;
 		break;
+	    case 'u':
+		*unmatched = optarg;
+		break;
 	    case 'F':
 		if (strlen(optarg) != 1) {
 		    fprintf(stderr, "ERROR: bad seperator specifier\n");
@@ -342,119 +730,162 @@ parse_args(
 	return -1;
     }
 
+    if (*n_routes == 0 && *unmatched != NULL) {
+	fprintf(stderr, "ERROR: -u requires at least one -m\n");
+	return -1;
+    }
+    if (*n_routes > 0 && (*inverse || *subnet != NULL || *fname != NULL)) {
+	fprintf(stderr, "ERROR: -m cannot be used with -r, -s, or NETFILE\n");
+	return -1;
+    }
+
     return 0;
 }
 
+/*
+ * Find the output with the given file name in outs, or open a new one
+ * if there isn't one already.
+ *
+ * Returns a pointer to the output, or NULL on failure.
+ */
+static out_buf_t *
+find_output(
+	out_buf_t *outs,
+	char **out_names,
+	int *n_outs,
+	char *fname)
+{
+
+    for (int i = 0; i < *n_outs; i++) {
+	if (!strcmp(out_names[i], fname)) {
+	    return &outs[i];
+	}
+    }
+
+    if (out_open(&outs[*n_outs], fname) != 0) {
+	return NULL;
+    }
+    out_names[*n_outs] = fname;
+
+    return &outs[(*n_outs)++];
+}
+
 int
 main(
 	int argc,
 	char **argv)
 {
-    /* we don't want to realloc too often, so we'll start
-     * with a generous size -- and maybe we won't need to
-     * realloc at all
-     */
-    char line[FILTER_BUFSIZE];
-    uint32_t max_size = 64 * 1024;
-    uint32_t curr_size = 0;
     int rc;
 
     int nth = 0;
+    char *nth_name = NULL;
     int sep = ',';
     int format = 'd';
     int inverse = 0;
     char *fname = NULL;
     char *subnet = NULL;
+    char **route_specs = calloc(argc, sizeof(char *));
+    int n_route_specs = 0;
+    char *unmatched = NULL;
 
-    void *loc = NULL;
+    if (route_specs == NULL) {
+	fprintf(stderr, "ERROR: malloc failed\n");
+	return -1;
+    }
 
-    rc = parse_args(argc, argv, &sep, &nth, &format, &inverse,
-	    &fname, &subnet);
+    rc = parse_args(argc, argv, &sep, &nth, &nth_name, &format, &inverse,
+	    &fname, &subnet, route_specs, &n_route_specs, &unmatched);
     if (rc != 0) {
 	return -1;
     }
 
-    uint32_t *addresses = malloc(max_size * sizeof(uint32_t));
+    ipmatch_t *addresses = ipmatch_create();
     if (addresses == NULL) {
-	fprintf(stderr, "ERROR: malloc failed\n");
 	return -1;
     }
 
-    /* If there's neither an fname or a subnet on the commandline,
-     * then we'll either filter everything or nothing (depending on
-     * whether reverse was set)
+    /* routes[tag] is the output for the rows whose address has the
+     * given tag (where tag 0 means no match), or NULL if those rows
+     * are dropped.  There is at most one output per route, plus one
+     * for the unmatched rows.
      */
-    if (fname != NULL) {
-	rc = read_subnets(fname, &addresses, &curr_size, &max_size);
-	if (rc != 0) {
-	    return -1;
-	}
-    }
-    else if (subnet != NULL) {
-	rc = add_subnet(subnet, &addresses, &curr_size, &max_size);
-	if (rc != 0) {
-	    return -1;
-	}
-    }
+    int n_tags = (n_route_specs > 0) ? n_route_specs + 1 : 2;
+    out_buf_t **routes = calloc(n_tags, sizeof(out_buf_t *));
+    out_buf_t *outs = calloc(n_tags, sizeof(out_buf_t));
+    char **out_names = calloc(n_tags, sizeof(char *));
+    int n_outs = 0;
 
-    if (curr_size > 0) {
-	qsort(addresses, curr_size, sizeof(uint32_t), uint32_compare);
+    if (routes == NULL || outs == NULL || out_names == NULL) {
+	fprintf(stderr, "ERROR: malloc failed\n");
+	return -1;
     }
 
-    uint64_t lineno = 0;
-    while (NULL != fgets(line, FILTER_BUFSIZE, stdin)) {
-	lineno++;
-
-	if (NULL == strrchr(line, '\n')) {
-	    fprintf(stderr, "WARNING: line %lu too long [%s]\n",
-		    lineno, line);
-	    continue;
+    if (n_route_specs == 0) {
+	/* If there's neither an fname or a subnet on the commandline,
+	 * then we'll either filter everything or nothing (depending on
+	 * whether reverse was set)
+	 */
+	if (fname != NULL) {
+	    rc = ipmatch_add_file(addresses, fname, 1);
+	    if (rc != 0) {
+		return -1;
+	    }
+	}
+	if (subnet != NULL) {
+	    rc = ipmatch_add_str(addresses, subnet, 1);
+	    if (rc != 0) {
+		return -1;
+	    }
 	}
 
-	char *field = strnthchr(line, sep, nth - 1);
-	if (field) {
-	    uint32_t addr = 0;
-
-	    switch (format) {
-		case 'd':
-		    addr = strtoul(field, NULL, 10);
-		    break;
-		case 'x':
-		    addr = strtoul(field, NULL, 16);
-		    break;
-		case 'q': {
-		    uint64_t q[4];
-
-		    rc = sscanf(field, "%lu.%lu.%lu.%lu",
-			    &q[3], &q[2], &q[1], &q[0]);
-		    if (rc != 4) {
-			fprintf(stderr, "ERROR: bad address [%s]\n", field);
-			return -1;
-		    }
-		    if (q[3] > 255 || q[2] > 255
-			    || q[1] > 255 || q[0] > 255) {
-			fprintf(stderr, "ERROR: bad address [%s]\n", field);
-			return -1;
-		    }
-
-		    addr = (q[3] << 24) | (q[2] << 16) | (q[1] << 8) | q[0];
-		}
-		default:
-		    fprintf(stderr,
-			    "ERROR: unsupported format [%c]\n", format);
-		    return -1;
+	out_buf_t *out = find_output(outs, out_names, &n_outs, "-");
+	if (out == NULL) {
+	    return -1;
+	}
+	routes[inverse ? 1 : 0] = out;
+    }
+    else {
+	/* Each list is added with its own tag, so the first list that
+	 * contains an address wins
+	 */
+	for (int i = 0; i < n_route_specs; i++) {
+	    char *list_name = route_specs[i];
+	    char *out_name = strchr(list_name, '=');
+
+	    *out_name++ = '\0';
+	    rc = ipmatch_add_file(addresses, list_name, i + 1);
+	    if (rc != 0) {
+		return -1;
 	    }
 
-	    loc = NULL;
-	    if (addresses != NULL) {
-		loc = bsearch(
-			(void *) &addr, (void *) addresses, curr_size,
-			sizeof(uint32_t), uint32_compare);
+	    routes[i + 1] = find_output(outs, out_names, &n_outs, out_name);
+	    if (routes[i + 1] == NULL) {
+		return -1;
 	    }
-	    uint32_t unmatched = (loc == NULL) ? 1 : 0;
-	    if (inverse ^ unmatched) {
-		printf("%s", line);
+	}
+
+	if (unmatched != NULL) {
+	    routes[0] = find_output(outs, out_names, &n_outs, unmatched);
+	    if (routes[0] == NULL) {
+		return -1;
 	    }
 	}
     }
+
+    rc = filter_input(addresses, sep, nth, nth_name, format,
+	    routes, outs, n_outs);
+
+    for (int i = 0; i < n_outs; i++) {
+	if (out_close(&outs[i]) != 0) {
+	    rc = -1;
+	}
+    }
+
+    ipmatch_free(addresses);
+    free(routes);
+    free(outs);
+    free(out_names);
+    free(route_specs);
+
+    return rc;
 }
@@ -0,0 +1,1194 @@
+/* CODEMARK: nice-ibr */
+/*
+ * Copyright (C) 2020-2024 - Raytheon BBN Technologies Corp.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0.
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+ *
+ * Distribution Statement "A" (Approved for Public Release,
+ * Distribution Unlimited).
+ *
+ * This material is based upon work supported by the Defense
+ * Advanced Research Projects Agency (DARPA) under Contract No.
+ * HR001119C0102.  The opinions, findings, and conclusions stated
+ * herein are those of the authors and do not necessarily reflect
+ * those of DARPA.
+ *
+ * In the event permission is required, DARPA is authorized to
+ * reproduce the copyrighted material for use as an exhibit or
+ * handout at DARPA-sponsored events and/or to post the material
+ * on the DARPA website.
+ */
+/* CODEMARK: end */
+
+/*
+ * Reassemble IPv4 fragments, in one streaming pass over any number of
+ * pcap or pcapng files, and report how each datagram was (or was not)
+ * reassembled.
+ *
+ * show-frags only describes each fragment, and test-assembly.py puts
+ * all of the fragments with the same (saddr, daddr, proto, ipid) into
+ * one pool, no matter how far apart in time they are, and keeps all of
+ * them in memory until the end of the input.  frag-reasm instead keeps
+ * a table of the datagrams that are being reassembled (keyed by saddr,
+ * daddr, proto, and ipid, as in RFC 791) and, like a real IP stack,
+ * discards a datagram that has not been completed within a timeout.
+ * The table also has a memory limit: when the fragments held exceed
+ * the limit, the oldest datagrams are discarded until they fit.  So
+ * the memory needed does not grow with the length of the input.
+ *
+ * Each fragment is compared with the fragments of the same datagram
+ * that arrived earlier.  An exact copy of an earlier fragment is a
+ * duplicate, and is otherwise ignored.  A fragment that overlaps an
+ * earlier fragment is an overlap, and if the bytes that they have in
+ * common (and that were both captured) differ, then the reassembly is
+ * ambiguous.  When fragments overlap, the bytes that arrived first are
+ * used.
+ *
+ * A CSV row is written for each datagram when it is completed or
+ * discarded.  The first eleven columns are the same as the output of
+ * test-assembly.py:
+ *
+ * saddr,daddr,proto,ipid,ts,nfrags,nfirst,nlast,noverlap,nmissing,ndiff,
+ * ndup,dlen,status
+ *
+ * saddr and daddr are dotted quads, and ts is the time of the first
+ * fragment.  nfrags is the number of fragments (including duplicates),
+ * nfirst and nlast are the number of fragments with offset zero and
+ * without the more-fragments flag, noverlap is the number of fragments
+ * that overlap earlier fragments (not counting duplicates), nmissing is
+ * the number of gaps between the fragments, ndiff is the number of
+ * fragments that conflict with earlier fragments (because the bytes
+ * that they overlap differ, or they disagree about where the datagram
+ * ends), and ndup is the number of duplicates.  dlen is the length of
+ * the reassembled payload (after the IP header), or -1 if the last
+ * fragment was never seen.  status is one of:
+ *
+ * complete - all of the fragments arrived
+ * oversize - a fragment would make the datagram longer than 65535
+ *	bytes (like an IP stack, frag-reasm discards such fragments)
+ * timeout - the datagram was not completed within the timeout
+ * memory - the datagram was discarded to stay within the memory limit
+ * eof - the datagram was not completed by the end of the input
+ *
+ * The reassembled datagrams (with status "complete") may also be
+ * written to a pcap file, with the link type LINKTYPE_RAW, the IP
+ * header of the first fragment (with the length, flags, offset, and
+ * checksum fixed), and the timestamp of the fragment that completed
+ * the datagram.  If some of the payload was not captured, then the
+ * record is truncated at the first byte that is missing.
+ *
+ * The timeouts use the timestamps of the packets, not the clock, so
+ * the results don't depend on how quickly the input is read, but the
+ * input should be (approximately) in time order.  The files are read
+ * in the order they are given, and datagrams may span files.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <netinet/ip.h>
+
+#include "capfile.h"
+#include "pktdecode.h"
+#include "zout.h"
+
+/* The number of packets read from the input at a time */
+#define FR_BATCH_SIZE		(1024)
+
+#define FR_PCAP_MAGIC_USEC	(0xa1b2c3d4)
+#define FR_PCAP_MAGIC_NSEC	(0xa1b23c4d)
+#define FR_PCAP_SNAPLEN		(65535)
+#define FR_LINKTYPE_RAW		(101)
+
+/* The largest IPv4 datagram, including the header */
+#define FR_MAX_DATAGRAM		(65535)
+
+#define FR_DEFAULT_TIMEOUT	(30)
+#define FR_DEFAULT_MAX_MBYTES	(256)
+
+#define FR_NSEC_PER_SEC		(1000000000LL)
+
+typedef enum {
+    FR_COMPLETE,
+    FR_OVERSIZE,
+    FR_TIMEOUT,
+    FR_MEMORY,
+    FR_EOF
+} fr_status_t;
+
+static const char *fr_status_names[] = {
+    "complete", "oversize", "timeout", "memory", "eof"
+};
+
+typedef struct {
+    uint32_t off;		/* the offset of the payload, in bytes */
+    uint32_t len;		/* the length of the payload */
+    uint32_t caplen;		/* the bytes of the payload captured */
+    uint32_t seq;		/* the order of arrival */
+    uint8_t *data;
+} fr_frag_t;
+
+/*
+ * A datagram that is being reassembled.  The fragments are kept in
+ * order of their offsets (and fragments with the same offset in order
+ * of arrival).
+ */
+typedef struct fr_dgram {
+    struct fr_dgram *hnext;	/* the next in the same hash bucket */
+    struct fr_dgram *older;	/* the list of datagrams by age */
+    struct fr_dgram *newer;
+
+    uint32_t saddr;
+    uint32_t daddr;
+    uint16_t ipid;
+    uint8_t proto;
+
+    int64_t first_ts;		/* in nsec */
+
+    fr_frag_t *frags;
+    uint32_t n_held;
+    uint32_t max_held;
+
+    uint32_t n_frags;
+    uint32_t n_first;
+    uint32_t n_last;
+    uint32_t n_overlap;
+    uint32_t n_diff;
+    uint32_t n_dup;
+    int32_t end;		/* -1 until the last fragment arrives */
+    uint8_t oversize;		/* a fragment ended past FR_MAX_DATAGRAM */
+
+    uint8_t hdr[60];		/* the IP header of the first fragment */
+    uint32_t hdr_len;		/* 0 until the first fragment arrives */
+
+    size_t mem;
+} fr_dgram_t;
+
+/* The output pcap file of reassembled datagrams */
+typedef struct {
+    zout_t *z;			/* NULL if there isn't one */
+    int nsec;			/* write nanosecond timestamps */
+    int hdr_written;
+    uint64_t n_pkts;
+} fr_pcap_out_t;
+
+typedef struct {
+    fr_dgram_t **buckets;
+    uint64_t n_buckets;		/* a power of two */
+    uint64_t n_dgrams;
+
+    fr_dgram_t *oldest;
+    fr_dgram_t *newest;
+
+    size_t mem;
+    size_t max_mem;
+    int64_t timeout;		/* in nsec */
+
+    FILE *csv_out;		/* NULL if there isn't one */
+    fr_pcap_out_t pcap_out;
+    int nsec_known;
+
+    uint64_t n_status[FR_EOF + 1];
+    uint64_t n_frags;
+} fr_table_t;
+
+static inline uint64_t
+mix64(
+	uint64_t x)
+{
+
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+
+    return x;
+}
+
+static inline uint64_t
+dgram_hash(
+	uint32_t saddr,
+	uint32_t daddr,
+	uint8_t proto,
+	uint16_t ipid)
+{
+
+    return mix64((((uint64_t) saddr << 32) | daddr) ^
+	    mix64(((uint64_t) proto << 16) | ipid));
+}
+
+static int
+pcap_out_header(
+	fr_pcap_out_t *out)
+{
+    uint32_t hdr[6];
+
+    /* The version (2.4) is two 16-bit fields, major first */
+    uint16_t version[2] = { 2, 4 };
+
+    hdr[0] = out->nsec ? FR_PCAP_MAGIC_NSEC : FR_PCAP_MAGIC_USEC;
+    memcpy(&hdr[1], version, sizeof(version));
+    hdr[2] = 0;			/* thiszone */
+    hdr[3] = 0;			/* sigfigs */
+    hdr[4] = FR_PCAP_SNAPLEN;
+    hdr[5] = FR_LINKTYPE_RAW;
+
+    out->hdr_written = 1;
+
+    return zout_write(out->z, hdr, sizeof(hdr));
+}
+
+/*
+ * Returns 0 on success, -1 on failure.
+ */
+static int
+pcap_out_write(
+	fr_pcap_out_t *out,
+	int64_t ts,
+	const uint8_t *data,
+	uint32_t caplen,
+	uint32_t len)
+{
+    uint32_t rec[4];
+
+    if (!out->hdr_written && pcap_out_header(out) != 0) {
+	return -1;
+    }
+
+    rec[0] = (uint32_t) (ts / FR_NSEC_PER_SEC);
+    rec[1] = ts % FR_NSEC_PER_SEC;
+    if (!out->nsec) {
+	rec[1] /= 1000;
+    }
+    rec[2] = caplen;
+    rec[3] = len;
+
+    out->n_pkts++;
+
+    if (zout_write(out->z, rec, sizeof(rec)) != 0) {
+	return -1;
+    }
+    return zout_write(out->z, data, caplen);
+}
+
+static uint16_t
+ip_cksum(
+	const uint8_t *hdr,
+	uint32_t hdr_len)
+{
+    uint32_t sum = 0;
+
+    for (uint32_t i = 0; i < hdr_len; i += 2) {
+	sum += pktd_get16(hdr + i);
+    }
+    while (sum >> 16) {
+	sum = (sum & 0xffff) + (sum >> 16);
+    }
+
+    return ~sum & 0xffff;
+}
+
+/*
+ * Write the reassembled datagram to the pcap output.  When fragments
+ * overlap, the bytes that arrived first are used.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+static int
+write_dgram(
+	fr_table_t *table,
+	const fr_dgram_t *dgram,
+	int64_t ts)
+{
+    static uint8_t buf[FR_MAX_DATAGRAM];
+    static uint8_t known[FR_MAX_DATAGRAM];
+    uint32_t len = dgram->hdr_len + dgram->end;
+    uint8_t *payload = buf + dgram->hdr_len;
+
+    memcpy(buf, dgram->hdr, dgram->hdr_len);
+    buf[2] = len >> 8;
+    buf[3] = len & 0xff;
+    buf[6] &= (IP_DF >> 8);	/* clear everything but DF */
+    buf[7] = 0;
+    buf[10] = 0;
+    buf[11] = 0;
+
+    uint16_t sum = ip_cksum(buf, dgram->hdr_len);
+    buf[10] = sum >> 8;
+    buf[11] = sum & 0xff;
+
+    uint32_t *by_seq = malloc(dgram->n_held * sizeof(uint32_t));
+    if (by_seq == NULL) {
+	fprintf(stderr, "ERROR: malloc failed\n");
+	return -1;
+    }
+    for (uint32_t i = 0; i < dgram->n_held; i++) {
+	by_seq[dgram->frags[i].seq] = i;
+    }
+
+    memset(known, 0, dgram->end);
+
+    /*
+     * Copy the fragments, latest first, so that the bytes that arrived
+     * first are the ones that are left.  Fragments (or the parts of
+     * them) past the end of the datagram are ignored.
+     */
+    for (uint32_t seq = dgram->n_held; seq-- > 0; ) {
+	const fr_frag_t *frag = &dgram->frags[by_seq[seq]];
+	uint32_t n_bytes = frag->caplen;
+
+	if (frag->off >= (uint32_t) dgram->end) {
+	    continue;
+	}
+	if (n_bytes > dgram->end - frag->off) {
+	    n_bytes = dgram->end - frag->off;
+	}
+
+	memcpy(payload + frag->off, frag->data, n_bytes);
+	memset(known + frag->off, 1, n_bytes);
+    }
+    free(by_seq);
+
+    /* Truncate the record at the first byte that wasn't captured */
+    uint32_t caplen = 0;
+    while (caplen < (uint32_t) dgram->end && known[caplen]) {
+	caplen++;
+    }
+
+    return pcap_out_write(&table->pcap_out, ts, buf,
+	    dgram->hdr_len + caplen, len);
+}
+
+/*
+ * The number of gaps between the fragments (not counting a missing
+ * beginning or end)
+ */
+static uint32_t
+count_gaps(
+	const fr_dgram_t *dgram)
+{
+    uint32_t n_gaps = 0;
+
+    if (dgram->n_held == 0) {
+	return 0;
+    }
+
+    uint32_t covered = dgram->frags[0].off + dgram->frags[0].len;
+    for (uint32_t i = 1; i < dgram->n_held; i++) {
+	const fr_frag_t *frag = &dgram->frags[i];
+
+	if (frag->off > covered) {
+	    n_gaps++;
+	}
+	if (frag->off + frag->len > covered) {
+	    covered = frag->off + frag->len;
+	}
+    }
+
+    return n_gaps;
+}
+
+/*
+ * Returns 1 if every byte of the datagram has arrived, 0 otherwise.
+ */
+static int
+is_complete(
+	const fr_dgram_t *dgram)
+{
+
+    if (dgram->end < 0 || dgram->hdr_len == 0) {
+	return 0;
+    }
+
+    /* Fragments past the end of the datagram don't matter */
+    uint32_t covered = 0;
+    for (uint32_t i = 0;
+	    i < dgram->n_held && covered < (uint32_t) dgram->end; i++) {
+	const fr_frag_t *frag = &dgram->frags[i];
+
+	if (frag->off > covered) {
+	    return 0;
+	}
+	if (frag->off + frag->len > covered) {
+	    covered = frag->off + frag->len;
+	}
+    }
+
+    return covered >= (uint32_t) dgram->end;
+}
+
+static void
+unlink_dgram(
+	fr_table_t *table,
+	fr_dgram_t *dgram)
+{
+    uint64_t bucket = dgram_hash(dgram->saddr, dgram->daddr,
+	    dgram->proto, dgram->ipid) & (table->n_buckets - 1);
+    fr_dgram_t **prev = &table->buckets[bucket];
+
+    while (*prev != dgram) {
+	prev = &(*prev)->hnext;
+    }
+    *prev = dgram->hnext;
+
+    if (dgram->older != NULL) {
+	dgram->older->newer = dgram->newer;
+    }
+    else {
+	table->oldest = dgram->newer;
+    }
+    if (dgram->newer != NULL) {
+	dgram->newer->older = dgram->older;
+    }
+    else {
+	table->newest = dgram->older;
+    }
+
+    table->n_dgrams--;
+    table->mem -= dgram->mem;
+}
+
+/*
+ * Report the datagram, remove it from the table, and free it.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+static int
+finish_dgram(
+	fr_table_t *table,
+	fr_dgram_t *dgram,
+	fr_status_t status,
+	int64_t ts)
+{
+    int rc = 0;
+
+    if (dgram->oversize ||
+	    (status == FR_COMPLETE &&
+	     dgram->hdr_len + dgram->end > FR_MAX_DATAGRAM)) {
+	status = FR_OVERSIZE;
+    }
+    table->n_status[status]++;
+
+    if (table->csv_out != NULL) {
+	fprintf(table->csv_out,
+		"%u.%u.%u.%u,%u.%u.%u.%u,%u,%u,%ld.%.6ld,"
+		"%u,%u,%u,%u,%u,%u,%u,%d,%s\n",
+		dgram->saddr >> 24, (dgram->saddr >> 16) & 0xff,
+		(dgram->saddr >> 8) & 0xff, dgram->saddr & 0xff,
+		dgram->daddr >> 24, (dgram->daddr >> 16) & 0xff,
+		(dgram->daddr >> 8) & 0xff, dgram->daddr & 0xff,
+		dgram->proto, dgram->ipid,
+		(long) (dgram->first_ts / FR_NSEC_PER_SEC),
+		(long) ((dgram->first_ts % FR_NSEC_PER_SEC) / 1000),
+		dgram->n_frags, dgram->n_first, dgram->n_last,
+		dgram->n_overlap, count_gaps(dgram), dgram->n_diff,
+		dgram->n_dup, dgram->end, fr_status_names[status]);
+    }
+
+    if (status == FR_COMPLETE && table->pcap_out.z != NULL) {
+	rc = write_dgram(table, dgram, ts);
+    }
+
+    unlink_dgram(table, dgram);
+
+    for (uint32_t i = 0; i < dgram->n_held; i++) {
+	free(dgram->frags[i].data);
+    }
+    free(dgram->frags);
+    free(dgram);
+
+    return rc;
+}
+
+/*
+ * Returns 0 on success, -1 on failure.
+ */
+static int
+table_grow(
+	fr_table_t *table)
+{
+    uint64_t n_buckets = 2 * table->n_buckets;
+    fr_dgram_t **buckets = calloc(n_buckets, sizeof(fr_dgram_t *));
+
+    if (buckets == NULL) {
+	fprintf(stderr, "ERROR: malloc failed\n");
+	return -1;
+    }
+
+    for (uint64_t i = 0; i < table->n_buckets; i++) {
+	fr_dgram_t *dgram = table->buckets[i];
+
+	while (dgram != NULL) {
+	    fr_dgram_t *next = dgram->hnext;
+	    uint64_t bucket = dgram_hash(dgram->saddr, dgram->daddr,
+		    dgram->proto, dgram->ipid) & (n_buckets - 1);
+
+	    dgram->hnext = buckets[bucket];
+	    buckets[bucket] = dgram;
+	    dgram = next;
+	}
+    }
+
+    table->mem += (n_buckets - table->n_buckets) * sizeof(fr_dgram_t *);
+    free(table->buckets);
+    table->buckets = buckets;
+    table->n_buckets = n_buckets;
+
+    return 0;
+}
+
+/*
+ * Find the datagram with the given key, creating it if it doesn't
+ * exist.
+ *
+ * Returns a pointer to the datagram, or NULL on failure.
+ */
+static fr_dgram_t *
+find_dgram(
+	fr_table_t *table,
+	uint32_t saddr,
+	uint32_t daddr,
+	uint8_t proto,
+	uint16_t ipid,
+	int64_t ts)
+{
+    uint64_t hash = dgram_hash(saddr, daddr, proto, ipid);
+    fr_dgram_t *dgram = table->buckets[hash & (table->n_buckets - 1)];
+
+    while (dgram != NULL) {
+	if (dgram->saddr == saddr && dgram->daddr == daddr &&
+		dgram->proto == proto && dgram->ipid == ipid) {
+	    return dgram;
+	}
+	dgram = dgram->hnext;
+    }
+
+    if (table->n_dgrams >= table->n_buckets && table_grow(table) != 0) {
+	return NULL;
+    }
+
+    dgram = calloc(1, sizeof(fr_dgram_t));
+    if (dgram == NULL) {
+	fprintf(stderr, "ERROR: malloc failed\n");
+	return NULL;
+    }
+
+    dgram->saddr = saddr;
+    dgram->daddr = daddr;
+    dgram->proto = proto;
+    dgram->ipid = ipid;
+    dgram->first_ts = ts;
+    dgram->end = -1;
+    dgram->mem = sizeof(fr_dgram_t);
+
+    uint64_t bucket = hash & (table->n_buckets - 1);
+    dgram->hnext = table->buckets[bucket];
+    table->buckets[bucket] = dgram;
+
+    dgram->older = table->newest;
+    if (table->newest != NULL) {
+	table->newest->newer = dgram;
+    }
+    else {
+	table->oldest = dgram;
+    }
+    table->newest = dgram;
+
+    table->n_dgrams++;
+    table->mem += dgram->mem;
+
+    return dgram;
+}
+
+/*
+ * Add a fragment to a datagram.  ip is the decoded fragment, and
+ * [off, off + len) is the range of the payload that it holds.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+static int
+add_frag(
+	fr_table_t *table,
+	fr_dgram_t *dgram,
+	const pktd_ip_t *ip,
+	uint32_t off,
+	uint32_t len)
+{
+    uint32_t end = off + len;
+    uint32_t caplen = (ip->l4_caplen < len) ? ip->l4_caplen : len;
+    int more = (ip->ip_off & IP_MF) != 0;
+    int overlap = 0;
+    int diff = 0;
+
+    dgram->n_frags++;
+    dgram->n_first += (off == 0);
+    dgram->n_last += !more;
+
+    /*
+     * Discard a fragment that would make the datagram too long to be
+     * valid (as in the "ping of death"), as an IP stack would, but
+     * remember that there was one
+     */
+    if (end > FR_MAX_DATAGRAM - (uint32_t) (ip->ip_hl * 4)) {
+	dgram->oversize = 1;
+	return 0;
+    }
+
+    if (!more) {
+	if (dgram->end < 0) {
+	    dgram->end = end;
+	}
+	else if ((uint32_t) dgram->end != end) {
+	    diff = 1;
+	}
+    }
+    else if (dgram->end >= 0 && end > (uint32_t) dgram->end) {
+	diff = 1;
+    }
+
+    uint32_t pos = dgram->n_held;
+    for (uint32_t i = 0; i < dgram->n_held; i++) {
+	const fr_frag_t *frag = &dgram->frags[i];
+
+	if (frag->off > off && pos == dgram->n_held) {
+	    pos = i;
+	}
+
+	if (frag->off == off && frag->len == len && frag->caplen == caplen &&
+		!memcmp(frag->data, ip->l4, caplen)) {
+	    dgram->n_dup++;
+	    dgram->n_diff += diff;
+	    return 0;
+	}
+
+	uint32_t lo = (frag->off > off) ? frag->off : off;
+	uint32_t hi = (frag->off + frag->len < end) ?
+		frag->off + frag->len : end;
+	if (lo >= hi) {
+	    continue;
+	}
+	overlap = 1;
+
+	/* Compare only the bytes that both fragments captured */
+	uint32_t cap_hi = hi;
+	if (frag->off + frag->caplen < cap_hi) {
+	    cap_hi = frag->off + frag->caplen;
+	}
+	if (off + caplen < cap_hi) {
+	    cap_hi = off + caplen;
+	}
+	if (lo < cap_hi && memcmp(frag->data + (lo - frag->off),
+		    ip->l4 + (lo - off), cap_hi - lo)) {
+	    diff = 1;
+	}
+    }
+
+    dgram->n_overlap += overlap;
+    dgram->n_diff += diff;
+
+    if (dgram->n_held == dgram->max_held) {
+	uint32_t max_held = (dgram->max_held == 0) ? 4 : 2 * dgram->max_held;
+	fr_frag_t *frags = realloc(dgram->frags, max_held * sizeof(fr_frag_t));
+
+	if (frags == NULL) {
+	    fprintf(stderr, "ERROR: malloc failed\n");
+	    return -1;
+	}
+	dgram->mem += (max_held - dgram->max_held) * sizeof(fr_frag_t);
+	table->mem += (max_held - dgram->max_held) * sizeof(fr_frag_t);
+	dgram->frags = frags;
+	dgram->max_held = max_held;
+    }
+
+    uint8_t *data = malloc(caplen ? caplen : 1);
+    if (data == NULL) {
+	fprintf(stderr, "ERROR: malloc failed\n");
+	return -1;
+    }
+    memcpy(data, ip->l4, caplen);
+
+    memmove(&dgram->frags[pos + 1], &dgram->frags[pos],
+	    (dgram->n_held - pos) * sizeof(fr_frag_t));
+    dgram->frags[pos].off = off;
+    dgram->frags[pos].len = len;
+    dgram->frags[pos].caplen = caplen;
+    dgram->frags[pos].seq = dgram->n_held;
+    dgram->frags[pos].data = data;
+    dgram->n_held++;
+
+    dgram->mem += caplen;
+    table->mem += caplen;
+
+    if (off == 0 && dgram->hdr_len == 0) {
+	dgram->hdr_len = ip->ip_hl * 4;
+	memcpy(dgram->hdr, ip->ip, dgram->hdr_len);
+    }
+
+    return 0;
+}
+
+/*
+ * Discard the datagrams that have timed out, as of ts.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+static int
+expire_dgrams(
+	fr_table_t *table,
+	int64_t ts)
+{
+
+    while (table->oldest != NULL &&
+	    table->oldest->first_ts + table->timeout <= ts) {
+	if (finish_dgram(table, table->oldest, FR_TIMEOUT, ts) != 0) {
+	    return -1;
+	}
+    }
+
+    return 0;
+}
+
+/*
+ * Returns 0 on success, -1 on failure.
+ */
+static int
+handle_frag(
+	fr_table_t *table,
+	const capf_pkt_t *pkt,
+	const pktd_ip_t *ip)
+{
+    int64_t ts = (pkt->ts_sec * FR_NSEC_PER_SEC) + pkt->ts_nsec;
+    uint32_t off = 8 * (ip->ip_off & IP_OFFMASK);
+    uint32_t hdr_len = ip->ip_hl * 4;
+
+    table->n_frags++;
+
+    if (expire_dgrams(table, ts) != 0) {
+	return -1;
+    }
+
+    /*
+     * Skip fragments with a broken header, or that are shorter than
+     * their own header, or whose header wasn't captured
+     */
+    if (ip->ip_hl < 5 || ip->ip_len < hdr_len || ip->ip_caplen < hdr_len) {
+	return 0;
+    }
+
+    fr_dgram_t *dgram = find_dgram(table, ip->saddr, ip->daddr,
+	    ip->proto, ip->ipid, ts);
+    if (dgram == NULL) {
+	return -1;
+    }
+
+    if (add_frag(table, dgram, ip, off, ip->ip_len - hdr_len) != 0) {
+	return -1;
+    }
+
+    if (is_complete(dgram)) {
+	return finish_dgram(table, dgram, FR_COMPLETE, ts);
+    }
+
+    while (table->mem > table->max_mem && table->oldest != NULL) {
+	if (finish_dgram(table, table->oldest, FR_MEMORY, ts) != 0) {
+	    return -1;
+	}
+    }
+
+    return 0;
+}
+
+/*
+ * Read the packets from a pcap or pcapng file, and reassemble the
+ * fragments among them.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+static int
+read_pcap(
+	FILE *fin,
+	fr_table_t *table)
+{
+    capf_pkt_t pkts[FR_BATCH_SIZE];
+    capf_t cf;
+    int n_pkts;
+    int rc = 0;
+
+    if (capf_open(&cf, fin) != 0) {
+	fprintf(stderr, "ERROR: input is not a pcap or pcapng file\n");
+	return -1;
+    }
+
+    /* Keep the timestamp resolution of the first classic pcap input */
+    if (!table->nsec_known) {
+	table->pcap_out.nsec = (cf.format == CAPF_FORMAT_PCAP) ? cf.nsec : 0;
+	table->nsec_known = 1;
+    }
+
+    while (rc == 0 &&
+	    (n_pkts = capf_next_batch(&cf, pkts, FR_BATCH_SIZE)) > 0) {
+	for (int i = 0; i < n_pkts; i++) {
+	    pktd_ip_t ip;
+
+	    if (!pktd_link_supported(pkts[i].dlt)) {
+		fprintf(stderr, "ERROR: unsupported link type (%u)\n",
+			pkts[i].linktype);
+		rc = -1;
+		break;
+	    }
+
+	    /* Skip the packets that aren't IPv4 fragments */
+	    if ((pktd_decode(pkts[i].dlt, pkts[i].data, pkts[i].caplen,
+			    &ip) != 0) ||
+		    ((ip.ip_off & (IP_MF | IP_OFFMASK)) == 0)) {
+		continue;
+	    }
+
+	    if (handle_frag(table, &pkts[i], &ip) != 0) {
+		rc = -1;
+		break;
+	    }
+	}
+    }
+
+    if (rc == 0 && n_pkts < 0) {
+	fprintf(stderr, "ERROR: could not read all of the input\n");
+	rc = -1;
+    }
+
+    capf_close(&cf);
+
+    return rc;
+}
+
+static int
+strendswith(
+	const char *str,
+	const char *suffix)
+{
+    size_t str_len = strlen(str);
+    size_t suf_len = strlen(suffix);
+
+    /* suffix is longer than the string; the string can't possibly
+     * end with the suffix
+     */
+    if (suf_len > str_len) {
+	return 0;
+    }
+
+    size_t off = str_len - suf_len;
+
+    return strcmp(str + off, suffix) == 0;
+}
+
+static FILE *
+do_popen(
+	const char *fname,
+	const char *app)
+{
+
+    if (access(fname, R_OK)) {
+	fprintf(stderr, "ERROR: cannot read input [%s]\n", fname);
+	return NULL;
+    }
+
+    char *buf = calloc(1, strlen(fname) + strlen(app) + 2);
+    if (buf == NULL) {
+	fprintf(stderr, "ERROR: calloc failed in do_open(%s, %s)\n",
+		fname, app);
+	return NULL;
+    }
+
+    sprintf(buf, "%s %s", app, fname);
+
+    FILE *fin = popen(buf, "r");
+
+    free(buf);
+
+    return fin;
+}
+
+static int
+read_file_by_name(
+	char *fname,
+	fr_table_t *table)
+{
+    FILE *fin = NULL;
+    int is_pipe = 1;
+    int rc;
+
+    if (!strcmp(fname, "-")) {
+	fin = stdin;
+	is_pipe = 0;
+    }
+    else if (strendswith(fname, ".gz")) {
+	fin = do_popen(fname, "/bin/gunzip -c");
+    }
+    else if (strendswith(fname, ".lz4")) {
+	fin = do_popen(fname, "/usr/bin/lz4cat");
+    }
+    else if (strendswith(fname, ".bz2")) {
+	fin = do_popen(fname, "/bin/bunzip2 -c");
+    }
+    else if (strendswith(fname, ".xz")) {
+	fin = do_popen(fname, "/usr/bin/lzcat");
+    }
+    else {
+	fin = fopen(fname, "r");
+	is_pipe = 0;
+    }
+
+    if (fin == NULL) {
+	fprintf(stderr, "ERROR: cannot open [%s]: %s\n",
+		fname, strerror(errno));
+	return -1;
+    }
+
+    rc = read_pcap(fin, table);
+
+    if (is_pipe) {
+	if (pclose(fin) != 0) {
+	    fprintf(stderr, "ERROR: could not decompress [%s]\n", fname);
+	    rc = -1;
+	}
+    }
+    else if (fin != stdin) {
+	fclose(fin);
+    }
+
+    return rc;
+}
+
+static void
+usage(
+	char *progname)
+{
+
+    fprintf(stderr, "usage: %s [-hv] [-c CSV] [-m MBYTES] [-o PCAP] [-t SECS]\n"
+	    "       [-z CODEC] [-Z N] [FNAME ...]\n", progname);
+    fprintf(stderr, "%s",
+    "\n"
+    "Reassemble the IPv4 fragments in the given pcap or pcapng files\n"
+    "(or stdin, if there are none), and write a CSV row for each\n"
+    "datagram.  Packets that are not fragments are ignored.\n"
+    "\n"
+    "-c CSV    Write the CSV rows to the file CSV.  The default is\n"
+    "          stdout, unless -o is given.\n"
+    "-h        Print this message and exit.\n"
+    "-m MBYTES Hold at most MBYTES megabytes of fragments.  When the\n"
+    "          limit is reached, the oldest datagrams are discarded.\n"
+    "          The default is 256.\n"
+    "-o PCAP   Write the reassembled datagrams to the pcap file PCAP,\n"
+    "          with the link type LINKTYPE_RAW.\n"
+    "-t SECS   Discard the datagrams that are not complete SECS seconds\n"
+    "          after their first fragment arrives.  The default is 30.\n"
+    "-v        Print the number of datagrams with each status.\n"
+    "-z CODEC  Compress the outputs with the given CODEC (gzip, lz4, or\n"
+    "          zstd, optionally followed by :LEVEL).  By default, an\n"
+    "          output is compressed if its name ends in .gz, .lz4, or\n"
+    "          .zst, and stdout is not compressed.\n"
+    "-Z N      Use N threads to compress the outputs.  The default is\n"
+    "          the number of processors.\n"
+    "FNAME     An input file, or - for stdin.  Files with names that\n"
+    "          end in .gz, .lz4, .bz2, or .xz are decompressed.\n"
+    "\n"
+    "The CSV columns are:\n"
+    "\n"
+    "saddr,daddr,proto,ipid,ts,nfrags,nfirst,nlast,noverlap,nmissing,ndiff,\n"
+    "ndup,dlen,status\n"
+    "\n"
+    "where status is complete, oversize, timeout, memory, or eof.\n"
+    "See frag-reasm.c for more information.\n");
+}
+
+int
+main(
+	int argc,
+	char **argv)
+{
+    char *csv_name = NULL;
+    char *pcap_name = NULL;
+    int verbose = 0;
+    long timeout = FR_DEFAULT_TIMEOUT;
+    long max_mbytes = FR_DEFAULT_MAX_MBYTES;
+    zout_codec_t codec = ZOUT_CODEC_NONE;
+    int codec_set = 0;
+    int level = 0;
+    int n_zthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:hm:o:t:vz:Z:")) != -1) {
+	switch (opt) {
+	    case 'c':
+		csv_name = optarg;
+		break;
+	    case 'h':
+		usage(argv[0]);
+		exit(0);
+	    case 'm':
+		max_mbytes = atol(optarg);
+		if (max_mbytes <= 0) {
+		    fprintf(stderr, "ERROR: bad memory limit [%s]\n", optarg);
+		    exit(1);
+		}
+		break;
+	    case 'o':
+		pcap_name = optarg;
+		break;
+	    case 't':
+		timeout = atol(optarg);
+		if (timeout <= 0) {
+		    fprintf(stderr, "ERROR: bad timeout [%s]\n", optarg);
+		    exit(1);
+		}
+		break;
+	    case 'v':
+		verbose = 1;
+		break;
+	    case 'z':
+		if (zout_codec_parse(optarg, &codec, &level) != 0) {
+		    exit(1);
+		}
+		codec_set = 1;
+		break;
+	    case 'Z':
+		n_zthreads = atoi(optarg);
+		if (n_zthreads < 0) {
+		    fprintf(stderr, "ERROR: bad number of threads [%s]\n",
+			    optarg);
+		    exit(1);
+		}
+		break;
+	    default:
+		fprintf(stderr, "ERROR: bad usage\n");
+		usage(argv[0]);
+		exit(1);
+	}
+    }
+
+    if (csv_name == NULL && pcap_name == NULL) {
+	csv_name = "-";
+    }
+    if (csv_name != NULL && pcap_name != NULL &&
+	    !strcmp(csv_name, "-") && !strcmp(pcap_name, "-")) {
+	fprintf(stderr, "ERROR: the CSV and pcap outputs are both stdout\n");
+	exit(1);
+    }
+
+    zout_pool_t *pool = zout_pool_create(n_zthreads);
+    if (pool == NULL) {
+	exit(1);
+    }
+
+    fr_table_t table;
+    memset(&table, 0, sizeof(table));
+    table.timeout = timeout * FR_NSEC_PER_SEC;
+    table.max_mem = max_mbytes * 1024 * 1024;
+    table.n_buckets = 1024;
+    table.buckets = calloc(table.n_buckets, sizeof(fr_dgram_t *));
+    if (table.buckets == NULL) {
+	fprintf(stderr, "ERROR: malloc failed\n");
+	exit(1);
+    }
+    table.mem = table.n_buckets * sizeof(fr_dgram_t *);
+
+    if (csv_name != NULL) {
+	if (!strcmp(csv_name, "-")) {
+	    table.csv_out = stdout;
+	}
+	else {
+	    table.csv_out = zout_fopen(csv_name,
+		    codec_set ? codec : zout_codec_from_fname(csv_name),
+		    level, pool);
+	    if (table.csv_out == NULL) {
+		exit(1);
+	    }
+	}
+    }
+
+    if (pcap_name != NULL) {
+	zout_codec_t pcap_codec =
+		codec_set ? codec : zout_codec_from_fname(pcap_name);
+
+	if (!strcmp(pcap_name, "-")) {
+	    table.pcap_out.z = zout_fdopen(STDOUT_FILENO, pcap_codec,
+		    level, pool);
+	}
+	else {
+	    table.pcap_out.z = zout_open(pcap_name, pcap_codec, level, pool);
+	}
+	if (table.pcap_out.z == NULL) {
+	    exit(1);
+	}
+    }
+
+    int rc = 0;
+    if (optind == argc) {
+	rc = read_file_by_name("-", &table);
+    }
+    for (int i = optind; rc == 0 && i < argc; i++) {
+	rc = read_file_by_name(argv[i], &table);
+	if (rc != 0) {
+	    fprintf(stderr, "%s: ERROR: could not read input [%s]\n",
+		    argv[0], argv[i]);
+	}
+    }
+
+    /* Report the datagrams that were never completed */
+    while (table.oldest != NULL) {
+	if (finish_dgram(&table, table.oldest, FR_EOF, 0) != 0) {
+	    rc = -1;
+	    break;
+	}
+    }
+
+    if (table.pcap_out.z != NULL) {
+	if (!table.pcap_out.hdr_written &&
+		pcap_out_header(&table.pcap_out) != 0) {
+	    rc = -1;
+	}
+	if (zout_close(table.pcap_out.z) != 0) {
+	    rc = -1;
+	}
+    }
+
+    if (table.csv_out != NULL && table.csv_out != stdout) {
+	if (fclose(table.csv_out) != 0) {
+	    fprintf(stderr, "ERROR: could not write [%s]\n", csv_name);
+	    rc = -1;
+	}
+    }
+    else if (table.csv_out == stdout && fflush(stdout) != 0) {
+	fprintf(stderr, "ERROR: could not write stdout\n");
+	rc = -1;
+    }
+
+    if (verbose) {
+	fprintf(stderr, "fragments %lu", table.n_frags);
+	for (int i = 0; i <= FR_EOF; i++) {
+	    fprintf(stderr, " %s %lu", fr_status_names[i], table.n_status[i]);
+	}
+	fprintf(stderr, "\n");
+    }
+
+    zout_pool_destroy(pool);
+    free(table.buckets);
+
+    return (rc == 0) ? 0 : 1;
+}
@@ -0,0 +1,345 @@
+/* CODEMARK: nice-ibr */
+/*
+ * Copyright (C) 2020-2024 - Raytheon BBN Technologies Corp.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0.
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+ *
+ * Distribution Statement "A" (Approved for Public Release,
+ * Distribution Unlimited).
+ *
+ * This material is based upon work supported by the Defense
+ * Advanced Research Projects Agency (DARPA) under Contract No.
+ * HR001119C0102.  The opinions, findings, and conclusions stated
+ * herein are those of the authors and do not necessarily reflect
+ * those of DARPA.
+ *
+ * In the event permission is required, DARPA is authorized to
+ * reproduce the copyrighted material for use as an exhibit or
+ * handout at DARPA-sponsored events and/or to post the material
+ * on the DARPA website.
+ */
+/* CODEMARK: end */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ipmatch.h"
+
+/* If it takes more than 127 characters to define a
+ * subnet, something is broken.
+ */
+#define IPMATCH_LINE_LEN	(128)
+
+ipmatch_t *
+ipmatch_create(void)
+{
+    ipmatch_t *m = calloc(1, sizeof(ipmatch_t));
+
+    if (m == NULL) {
+	fprintf(stderr, "ERROR: could not allocate address table\n");
+    }
+
+    return m;
+}
+
+void
+ipmatch_free(
+	ipmatch_t *m)
+{
+
+    if (m != NULL) {
+	free(m->children);
+	free(m);
+    }
+}
+
+/*
+ * Return a pointer to the given entry of a table, where table -1 is
+ * the root table.  The pointer is only valid until the next child is
+ * allocated.
+ */
+static inline uint32_t *
+entry_ptr(
+	ipmatch_t *m,
+	int64_t table,
+	uint32_t i)
+{
+
+    if (table < 0) {
+	return &m->root[i];
+    }
+    else {
+	return &m->children[(table * IPMATCH_CHILD_LEN) + i];
+    }
+}
+
+/*
+ * Allocate a new child table, with all of its entries set to tag.
+ *
+ * Returns the index of the table, or -1 on failure.
+ */
+static int64_t
+new_child(
+	ipmatch_t *m,
+	uint32_t tag)
+{
+
+    if (m->n_children == m->max_children) {
+	uint32_t max_children = m->max_children ? 2 * m->max_children : 64;
+
+	if (max_children > IPMATCH_MAX_TAG) {
+	    return -1;
+	}
+
+	uint32_t *children = realloc(m->children,
+		(size_t) max_children * IPMATCH_CHILD_LEN * sizeof(uint32_t));
+	if (children == NULL) {
+	    return -1;
+	}
+	m->children = children;
+	m->max_children = max_children;
+    }
+
+    uint32_t *child = &m->children[m->n_children * IPMATCH_CHILD_LEN];
+    for (int i = 0; i < IPMATCH_CHILD_LEN; i++) {
+	child[i] = tag;
+    }
+
+    return m->n_children++;
+}
+
+/*
+ * Tag every untagged address under an entry
+ */
+static void
+fill_entry(
+	ipmatch_t *m,
+	int64_t table,
+	uint32_t i,
+	uint32_t tag)
+{
+    uint32_t e = *entry_ptr(m, table, i);
+
+    if (e & IPMATCH_CHILD) {
+	for (uint32_t j = 0; j < IPMATCH_CHILD_LEN; j++) {
+	    fill_entry(m, e & ~IPMATCH_CHILD, j, tag);
+	}
+    }
+    else if (e == 0) {
+	*entry_ptr(m, table, i) = tag;
+    }
+}
+
+/*
+ * Add a prefix to the given table, which is at the given depth (0 for
+ * the root, which covers the first 16 bits of the address, 1 for a
+ * table that covers bits 16-23, and 2 for a table that covers bits
+ * 24-31).
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+static int
+add_prefix(
+	ipmatch_t *m,
+	int64_t table,
+	int depth,
+	uint32_t addr,
+	int prefix_len,
+	uint32_t tag)
+{
+    static const int first_bit[] = { 0, 16, 24 };
+    static const int end_bit[] = { 16, 24, 32 };
+
+    uint32_t index = (addr << first_bit[depth]) >> (32 -
+	    (end_bit[depth] - first_bit[depth]));
+
+    if (prefix_len <= end_bit[depth]) {
+	uint32_t count = 1 << (end_bit[depth] - prefix_len);
+
+	index &= ~(count - 1);
+	for (uint32_t i = 0; i < count; i++) {
+	    fill_entry(m, table, index + i, tag);
+	}
+	return 0;
+    }
+
+    uint32_t e = *entry_ptr(m, table, index);
+    if (!(e & IPMATCH_CHILD)) {
+	/* If all of the addresses covered by this entry are
+	 * already tagged, then the new prefix adds nothing
+	 */
+	if (e != 0) {
+	    return 0;
+	}
+
+	int64_t child = new_child(m, 0);
+	if (child < 0) {
+	    fprintf(stderr, "ERROR: could not allocate address table\n");
+	    return -1;
+	}
+	e = IPMATCH_CHILD | child;
+	*entry_ptr(m, table, index) = e;
+    }
+
+    return add_prefix(m, e & ~IPMATCH_CHILD, depth + 1, addr, prefix_len,
+	    tag);
+}
+
+/*
+ * Tag all of the untagged addresses in addr/prefix_len.  Any bits of
+ * addr past the prefix are ignored.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+int
+ipmatch_add(
+	ipmatch_t *m,
+	uint32_t addr,
+	int prefix_len,
+	uint32_t tag)
+{
+
+    if (tag == 0 || tag > IPMATCH_MAX_TAG) {
+	fprintf(stderr, "ERROR: bad address table tag [%u]\n", tag);
+	return -1;
+    }
+    if (prefix_len < 0 || prefix_len > 32) {
+	fprintf(stderr, "ERROR: bad prefix length [%d]\n", prefix_len);
+	return -1;
+    }
+
+    return add_prefix(m, -1, 0, addr, prefix_len, tag);
+}
+
+/*
+ * Parse an IPv4 address in dotted-quad notation, optionally followed
+ * by a prefix length (in CIDR notation).  If there is no prefix
+ * length, then the prefix length is 32.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+int
+ipmatch_parse_prefix(
+	const char *str,
+	uint32_t *addr,
+	int *prefix_len)
+{
+    /* We use uint64_t for these values, even though a byte
+     * should be large enough, in case the user provides bad
+     * input.  The %hhu scanf format DOES NOT check whether
+     * the input string actually fits in a byte; it simply
+     * truncates the value.  So if we tried to use %hhu to
+     * parse the input, it would "succeed" for something like
+     * 1.2.3.4000, but the value of the low-order byte would
+     * be 4000 % 256.
+     */
+    uint64_t q[4];
+    uint64_t len = 32;
+    int rc;
+
+    if (NULL != strchr(str, '/')) {
+	rc = sscanf(str, "%lu.%lu.%lu.%lu/%lu",
+		&q[3], &q[2], &q[1], &q[0], &len);
+	if (rc != 5 || len > 32) {
+	    fprintf(stderr, "ERROR: bad subnet spec [%s]\n", str);
+	    return -1;
+	}
+    }
+    else {
+	rc = sscanf(str, "%lu.%lu.%lu.%lu", &q[3], &q[2], &q[1], &q[0]);
+	if (rc != 4) {
+	    fprintf(stderr, "ERROR: bad subnet spec [%s]\n", str);
+	    return -1;
+	}
+    }
+
+    if (q[3] > 255 || q[2] > 255 || q[1] > 255 || q[0] > 255) {
+	fprintf(stderr, "ERROR: bad subnet spec [%s]\n", str);
+	return -1;
+    }
+
+    *addr = (q[3] << 24) | (q[2] << 16) | (q[1] << 8) | q[0];
+    *prefix_len = len;
+
+    return 0;
+}
+
+/*
+ * Add a prefix given as a string (see ipmatch_parse_prefix).
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+int
+ipmatch_add_str(
+	ipmatch_t *m,
+	const char *str,
+	uint32_t tag)
+{
+    uint32_t addr;
+    int prefix_len;
+
+    if (ipmatch_parse_prefix(str, &addr, &prefix_len) != 0) {
+	return -1;
+    }
+
+    return ipmatch_add(m, addr, prefix_len, tag);
+}
+
+/*
+ * Add each of the prefixes in a file, one per line.  Anything after a
+ * '#' on a line is a comment, and empty lines are ignored.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+int
+ipmatch_add_file(
+	ipmatch_t *m,
+	const char *fname,
+	uint32_t tag)
+{
+    char buf[IPMATCH_LINE_LEN];
+
+    FILE *fin = fopen(fname, "r");
+    if (fin == NULL) {
+	fprintf(stderr, "ERROR: could not open [%s]\n", fname);
+	return -1;
+    }
+
+    while (NULL != fgets(buf, IPMATCH_LINE_LEN, fin)) {
+	char *newline_pos = strrchr(buf, '\n');
+	if (newline_pos == NULL) {
+	    fprintf(stderr, "ERROR: line too long [%s...]\n", buf);
+	    fclose(fin);
+	    return -1;
+	}
+	*newline_pos = 0;
+
+	char *comment = strchr(buf, '#');
+	if (comment != NULL) {
+	    *comment = '\0';
+	}
+	if (strlen(buf) == 0) {
+	    continue;
+	}
+
+	if (ipmatch_add_str(m, buf, tag) != 0) {
+	    fclose(fin);
+	    return -1;
+	}
+    }
+
+    fclose(fin);
+
+    return 0;
+}
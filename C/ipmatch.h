@@ -0,0 +1,105 @@
+#ifndef _IPMATCH_H_
+#define _IPMATCH_H_ 1
+
+/* CODEMARK: nice-ibr */
+/*
+ * Copyright (C) 2020-2024 - Raytheon BBN Technologies Corp.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0.
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+ *
+ * Distribution Statement "A" (Approved for Public Release,
+ * Distribution Unlimited).
+ *
+ * This material is based upon work supported by the Defense
+ * Advanced Research Projects Agency (DARPA) under Contract No.
+ * HR001119C0102.  The opinions, findings, and conclusions stated
+ * herein are those of the authors and do not necessarily reflect
+ * those of DARPA.
+ *
+ * In the event permission is required, DARPA is authorized to
+ * reproduce the copyrighted material for use as an exhibit or
+ * handout at DARPA-sponsored events and/or to post the material
+ * on the DARPA website.
+ */
+/* CODEMARK: end */
+
+/*
+ * A table that maps IPv4 addresses to the tag of the prefix (if any)
+ * that contains them, with a lookup cost of at most three array
+ * references, regardless of the number or length of the prefixes.
+ *
+ * The table is a 16-8-8 multibit trie: the first 16 bits of the address
+ * index a table of 65536 entries, and each entry is either a tag (for
+ * all of the addresses with those 16 bits) or a reference to a table of
+ * 256 entries indexed by the next 8 bits, and likewise for the last 8
+ * bits.  Prefixes are expanded to the stride boundaries when they are
+ * added, so a /12 fills 16 entries of the first table, and a /20 fills
+ * 16 entries of a second-level table.
+ *
+ * Tags are non-zero; a lookup returns 0 if the address doesn't match
+ * any prefix.  If prefixes with different tags overlap, then the prefix
+ * that was added first keeps the addresses that they share, so if each
+ * list of prefixes is added with its own tag, then an address is
+ * tagged with the first list that contains it.
+ */
+
+#include <stdint.h>
+
+/* The high bit of an entry marks a reference to a child table */
+#define IPMATCH_CHILD		(0x80000000)
+#define IPMATCH_MAX_TAG		(0x7fffffff)
+
+#define IPMATCH_CHILD_LEN	(256)
+
+typedef struct {
+    uint32_t root[1 << 16];
+
+    /* The child tables, each IPMATCH_CHILD_LEN entries long */
+    uint32_t *children;
+    uint32_t n_children;
+    uint32_t max_children;
+} ipmatch_t;
+
+extern ipmatch_t *ipmatch_create(void);
+extern void ipmatch_free(ipmatch_t *m);
+extern int ipmatch_add(ipmatch_t *m, uint32_t addr, int prefix_len,
+	uint32_t tag);
+extern int ipmatch_parse_prefix(const char *str, uint32_t *addr,
+	int *prefix_len);
+extern int ipmatch_add_str(ipmatch_t *m, const char *str, uint32_t tag);
+extern int ipmatch_add_file(ipmatch_t *m, const char *fname, uint32_t tag);
+
+/*
+ * Return the tag of the prefix that contains addr, or 0 if there is
+ * no such prefix
+ */
+static inline uint32_t
+ipmatch_lookup(
+	const ipmatch_t *m,
+	uint32_t addr)
+{
+    uint32_t e = m->root[addr >> 16];
+
+    if (e & IPMATCH_CHILD) {
+	e = m->children[((e & ~IPMATCH_CHILD) * IPMATCH_CHILD_LEN)
+		+ ((addr >> 8) & 0xff)];
+	if (e & IPMATCH_CHILD) {
+	    e = m->children[((e & ~IPMATCH_CHILD) * IPMATCH_CHILD_LEN)
+		    + (addr & 0xff)];
+	}
+    }
+
+    return e;
+}
+
+#endif /* _IPMATCH_H_ */
@@ -0,0 +1,1011 @@
+/* CODEMARK: nice-ibr */
+/*
+ * Copyright (C) 2020-2024 - Raytheon BBN Technologies Corp.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0.
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+ *
+ * Distribution Statement "A" (Approved for Public Release,
+ * Distribution Unlimited).
+ *
+ * This material is based upon work supported by the Defense
+ * Advanced Research Projects Agency (DARPA) under Contract No.
+ * HR001119C0102.  The opinions, findings, and conclusions stated
+ * herein are those of the authors and do not necessarily reflect
+ * those of DARPA.
+ *
+ * In the event permission is required, DARPA is authorized to
+ * reproduce the copyrighted material for use as an exhibit or
+ * handout at DARPA-sponsored events and/or to post the material
+ * on the DARPA website.
+ */
+/* CODEMARK: end */
+
+/*
+ * Find the destination ports with the largest number of distinct
+ * sources, in one pass over pcap or CSV input.  This is a native
+ * replacement for tools/meanies/highest-src-cnt (which is used to find
+ * the port of the day of the Greenwich Meanie), and writes its results
+ * in the same format.
+ *
+ * As in highest-src-cnt, the source addresses are masked to a prefix
+ * (by default, a /24) before they are counted, so that a scan from a
+ * few densely-populated subnets doesn't look like many sources.  The
+ * ports may also be counted separately for each destination prefix.
+ *
+ * The packet counts are exact.  The number of distinct sources for
+ * each port is counted exactly (with a small hash set of the source
+ * prefixes) until it reaches MP_SET_MAX, and then estimated with a
+ * HyperLogLog sketch, which has a standard error of about 1.6% and
+ * a fixed size.  Nearly all ports have a handful of sources, so the
+ * memory needed is proportional to the number of ports seen, not the
+ * number of sources.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <getopt.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "capfile.h"
+#include "pktdecode.h"
+
+/*
+ * The number of distinct sources at which a port switches from an
+ * exact set to a sketch
+ */
+#define MP_SET_MAX	(1024)
+
+/* The sketch has 2^MP_HLL_BITS one-byte registers */
+#define MP_HLL_BITS	(12)
+#define MP_HLL_LEN	(1 << MP_HLL_BITS)
+
+/* The number of packets read from a pcap at a time */
+#define MP_BATCH_SIZE	(1024)
+
+/* The size of each read of CSV input, and the longest CSV line */
+#define MP_CSV_READ_LEN	(4 * 1024 * 1024)
+#define MP_CSV_MAX_LINE	(8192)
+
+#define MP_PROTO_ICMP	(1)
+#define MP_PROTO_TCP	(6)
+#define MP_PROTO_UDP	(17)
+
+/*
+ * The counts for one destination port (and destination prefix).
+ * While hll is NULL, the source prefixes are kept in srcs, an open
+ * addressing hash set of set_size slots, in which 0 marks an empty
+ * slot (so the source prefix 0 is kept in has_zero instead).
+ */
+typedef struct {
+    uint64_t key;		/* (dnet << 16) | dport */
+    uint64_t npkts;
+    uint32_t n_srcs;		/* while the count is exact */
+    uint32_t set_size;
+    uint32_t *srcs;
+    uint8_t *hll;
+    uint8_t has_zero;
+    uint8_t used;
+} mp_port_t;
+
+typedef struct {
+    mp_port_t *ports;
+    uint64_t n_ports;
+    uint64_t size;		/* a power of two */
+} mp_table_t;
+
+typedef struct {
+    int proto;
+    int src_len;
+    uint32_t src_mask;
+    int dst_len;
+    uint32_t dst_mask;
+    int show_n;
+    char *tag;
+    int use_csv;
+    int exact;
+
+    /* The (one-based) CSV columns, from the header if there is one */
+    int col_saddr;
+    int col_daddr;
+    int col_proto;
+    int col_dport;
+} mp_args_t;
+
+/*
+ * A 64-bit mixing function (the finalizer of splitmix64), so that
+ * consecutive addresses and ports are spread over the hash table and
+ * the sketch registers
+ */
+static inline uint64_t
+mix64(
+	uint64_t x)
+{
+
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+
+    return x;
+}
+
+static inline void
+hll_add(
+	uint8_t *hll,
+	uint32_t src)
+{
+    uint64_t h = mix64(src + 1);
+    uint32_t reg = h >> (64 - MP_HLL_BITS);
+
+    /* The guard bit limits the rank to 64 - MP_HLL_BITS + 1 */
+    uint64_t rest = (h << MP_HLL_BITS) | (1ULL << (MP_HLL_BITS - 1));
+    uint8_t rank = __builtin_clzll(rest) + 1;
+
+    if (rank > hll[reg]) {
+	hll[reg] = rank;
+    }
+}
+
+static double
+hll_estimate(
+	const uint8_t *hll)
+{
+    double m = MP_HLL_LEN;
+    double sum = 0;
+    uint32_t zeros = 0;
+
+    for (uint32_t i = 0; i < MP_HLL_LEN; i++) {
+	sum += ldexp(1.0, -hll[i]);
+	zeros += (hll[i] == 0);
+    }
+
+    double alpha = 0.7213 / (1 + (1.079 / m));
+    double est = alpha * m * m / sum;
+
+    /* Use linear counting for small cardinalities */
+    if (est <= 2.5 * m && zeros > 0) {
+	est = m * log(m / zeros);
+    }
+
+    return est;
+}
+
+/*
+ * Returns 0 on success, -1 on failure.
+ */
+static int
+port_to_hll(
+	mp_port_t *port)
+{
+
+    port->hll = calloc(MP_HLL_LEN, 1);
+    if (port->hll == NULL) {
+	fprintf(stderr, "ERROR: malloc failed\n");
+	return -1;
+    }
+
+    if (port->has_zero) {
+	hll_add(port->hll, 0);
+    }
+    for (uint32_t i = 0; i < port->set_size; i++) {
+	if (port->srcs[i] != 0) {
+	    hll_add(port->hll, port->srcs[i]);
+	}
+    }
+
+    free(port->srcs);
+    port->srcs = NULL;
+    port->set_size = 0;
+
+    return 0;
+}
+
+/*
+ * Insert src into the set, which must have at least one empty slot.
+ * Returns 1 if src was added, or 0 if it was already there.
+ */
+static inline int
+set_insert(
+	uint32_t *srcs,
+	uint32_t set_size,
+	uint32_t src)
+{
+    uint32_t i = mix64(src) & (set_size - 1);
+
+    while (srcs[i] != 0) {
+	if (srcs[i] == src) {
+	    return 0;
+	}
+	i = (i + 1) & (set_size - 1);
+    }
+    srcs[i] = src;
+
+    return 1;
+}
+
+/*
+ * Returns 0 on success, -1 on failure.
+ */
+static int
+port_add_src(
+	mp_port_t *port,
+	uint32_t src,
+	int exact)
+{
+
+    if (port->hll != NULL) {
+	hll_add(port->hll, src);
+	return 0;
+    }
+
+    if (src == 0) {
+	port->n_srcs += !port->has_zero;
+	port->has_zero = 1;
+	return 0;
+    }
+
+    /* Keep the set at most half full */
+    if (2 * (port->n_srcs + 1) > port->set_size) {
+	if (!exact && port->n_srcs >= MP_SET_MAX) {
+	    if (port_to_hll(port) != 0) {
+		return -1;
+	    }
+	    hll_add(port->hll, src);
+	    return 0;
+	}
+
+	uint32_t set_size = (port->set_size == 0) ? 8 : 2 * port->set_size;
+	uint32_t *srcs = calloc(set_size, sizeof(uint32_t));
+	if (srcs == NULL) {
+	    fprintf(stderr, "ERROR: malloc failed\n");
+	    return -1;
+	}
+	for (uint32_t i = 0; i < port->set_size; i++) {
+	    if (port->srcs[i] != 0) {
+		set_insert(srcs, set_size, port->srcs[i]);
+	    }
+	}
+	free(port->srcs);
+	port->srcs = srcs;
+	port->set_size = set_size;
+    }
+
+    port->n_srcs += set_insert(port->srcs, port->set_size, src);
+
+    return 0;
+}
+
+static double
+port_n_srcs(
+	const mp_port_t *port)
+{
+
+    if (port->hll != NULL) {
+	return floor(hll_estimate(port->hll) + 0.5);
+    }
+    else {
+	return port->n_srcs;
+    }
+}
+
+/*
+ * Returns 0 on success, -1 on failure.
+ */
+static int
+table_init(
+	mp_table_t *table)
+{
+
+    table->size = 1024;
+    table->n_ports = 0;
+    table->ports = calloc(table->size, sizeof(mp_port_t));
+    if (table->ports == NULL) {
+	fprintf(stderr, "ERROR: malloc failed\n");
+	return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Find the entry for key in the table, adding it if it isn't there.
+ *
+ * Returns a pointer to the entry, or NULL on failure.
+ */
+static mp_port_t *
+table_find(
+	mp_table_t *table,
+	uint64_t key)
+{
+
+    /* Keep the table at most half full */
+    if (2 * (table->n_ports + 1) > table->size) {
+	uint64_t size = 2 * table->size;
+	mp_port_t *ports = calloc(size, sizeof(mp_port_t));
+
+	if (ports == NULL) {
+	    fprintf(stderr, "ERROR: malloc failed\n");
+	    return NULL;
+	}
+	for (uint64_t i = 0; i < table->size; i++) {
+	    if (table->ports[i].used) {
+		uint64_t j = mix64(table->ports[i].key) & (size - 1);
+
+		while (ports[j].used) {
+		    j = (j + 1) & (size - 1);
+		}
+		ports[j] = table->ports[i];
+	    }
+	}
+	free(table->ports);
+	table->ports = ports;
+	table->size = size;
+    }
+
+    uint64_t i = mix64(key) & (table->size - 1);
+    while (table->ports[i].used) {
+	if (table->ports[i].key == key) {
+	    return &table->ports[i];
+	}
+	i = (i + 1) & (table->size - 1);
+    }
+
+    table->ports[i].used = 1;
+    table->ports[i].key = key;
+    table->n_ports++;
+
+    return &table->ports[i];
+}
+
+static void
+table_free(
+	mp_table_t *table)
+{
+
+    for (uint64_t i = 0; i < table->size; i++) {
+	free(table->ports[i].srcs);
+	free(table->ports[i].hll);
+    }
+    free(table->ports);
+    table->ports = NULL;
+}
+
+/*
+ * Count one packet.  Returns 0 on success, -1 on failure.
+ */
+static inline int
+count_pkt(
+	mp_table_t *table,
+	const mp_args_t *args,
+	uint32_t saddr,
+	uint32_t daddr,
+	uint16_t dport)
+{
+    uint64_t key = ((uint64_t) (daddr & args->dst_mask) << 16) | dport;
+    mp_port_t *port = table_find(table, key);
+
+    if (port == NULL) {
+	return -1;
+    }
+    port->npkts++;
+
+    return port_add_src(port, saddr & args->src_mask, args->exact);
+}
+
+/*
+ * Count the packets of a pcap or pcapng file.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+static int
+read_pcap(
+	FILE *fin,
+	mp_table_t *table,
+	const mp_args_t *args)
+{
+    capf_pkt_t pkts[MP_BATCH_SIZE];
+    capf_t cf;
+    int n_pkts;
+    int rc = 0;
+
+    if (capf_open(&cf, fin) != 0) {
+	fprintf(stderr, "ERROR: input is not a pcap or pcapng file\n");
+	return -1;
+    }
+
+    while (rc == 0 &&
+	    (n_pkts = capf_next_batch(&cf, pkts, MP_BATCH_SIZE)) > 0) {
+	for (int i = 0; i < n_pkts; i++) {
+	    pktd_ip_t ip;
+
+	    if (!pktd_link_supported(pkts[i].dlt)) {
+		fprintf(stderr, "ERROR: unsupported link type (%u)\n",
+			pkts[i].linktype);
+		rc = -1;
+		break;
+	    }
+
+	    /*
+	     * Skip packets that aren't IPv4 or aren't the right
+	     * protocol, and the fragments after the first (which
+	     * don't have the next header)
+	     */
+	    if ((pktd_decode(pkts[i].dlt, pkts[i].data, pkts[i].caplen,
+			    &ip) != 0) ||
+		    (ip.proto != args->proto) ||
+		    ((ip.ip_off & 0x1fff) != 0)) {
+		continue;
+	    }
+
+	    /* The ICMP type is analogous to a destination port, sort of */
+	    uint16_t dport;
+	    if (ip.proto == MP_PROTO_ICMP) {
+		if (ip.l4_caplen < 1) {
+		    continue;
+		}
+		dport = ip.l4[0];
+	    }
+	    else {
+		if (ip.l4_caplen < 4) {
+		    continue;
+		}
+		dport = pktd_get16(ip.l4 + 2);
+	    }
+
+	    if (count_pkt(table, args, ip.saddr, ip.daddr, dport) != 0) {
+		rc = -1;
+		break;
+	    }
+	}
+    }
+
+    if (rc == 0 && n_pkts < 0) {
+	fprintf(stderr, "ERROR: could not read all of the input\n");
+	rc = -1;
+    }
+
+    capf_close(&cf);
+
+    return rc;
+}
+
+/*
+ * Find the columns that the CSV parser needs in a header line (as
+ * written by cpcap2csv -c).
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+static int
+parse_header(
+	const char *line,
+	const char *end,
+	mp_args_t *args)
+{
+    const char *names[] = { "saddr", "daddr", "proto", "dport" };
+    int *cols[] = {
+	&args->col_saddr, &args->col_daddr, &args->col_proto, &args->col_dport
+    };
+    const char *pos = line + 1;
+
+    for (int i = 0; i < 4; i++) {
+	*cols[i] = 0;
+    }
+
+    for (int nth = 1; pos < end; nth++) {
+	const char *field_end = pos;
+
+	while (field_end < end && *field_end != ',' && *field_end != '\n' &&
+		*field_end != '\r') {
+	    field_end++;
+	}
+	for (int i = 0; i < 4; i++) {
+	    if ((size_t) (field_end - pos) == strlen(names[i]) &&
+		    !strncmp(pos, names[i], field_end - pos)) {
+		*cols[i] = nth;
+	    }
+	}
+	if (field_end >= end || *field_end != ',') {
+	    break;
+	}
+	pos = field_end + 1;
+    }
+
+    for (int i = 0; i < 4; i++) {
+	if (*cols[i] == 0) {
+	    fprintf(stderr, "ERROR: no column [%s] in header\n", names[i]);
+	    return -1;
+	}
+    }
+
+    return 0;
+}
+
+/*
+ * Parse one CSV row, and count it.
+ *
+ * Returns 0 on success (including rows that are skipped), -1 on
+ * failure.
+ */
+static int
+parse_row(
+	const char *line,
+	const char *end,
+	mp_table_t *table,
+	mp_args_t *args)
+{
+    uint64_t vals[4] = { 0, 0, 0, 0 };
+    int found[4] = { 0, 0, 0, 0 };
+    const int cols[4] = {
+	args->col_saddr, args->col_daddr, args->col_proto, args->col_dport
+    };
+    const char *p = line;
+
+    for (int nth = 1; p < end; nth++) {
+	for (int i = 0; i < 4; i++) {
+	    if (cols[i] == nth) {
+		uint64_t val = 0;
+		const char *q = p;
+
+		while (q < end && (unsigned int) (*q - '0') < 10) {
+		    val = (val * 10) + (*q - '0');
+		    q++;
+		}
+		if (q == p) {
+		    fprintf(stderr, "ERROR: bad row [%.*s]\n",
+			    (int) (end - line), line);
+		    return -1;
+		}
+		vals[i] = val;
+		found[i] = 1;
+	    }
+	}
+
+	p = memchr(p, ',', end - p);
+	if (p == NULL) {
+	    break;
+	}
+	p++;
+    }
+
+    if (!(found[0] && found[1] && found[2] && found[3])) {
+	fprintf(stderr, "ERROR: short row [%.*s]\n", (int) (end - line), line);
+	return -1;
+    }
+
+    if (vals[2] != (uint64_t) args->proto) {
+	return 0;
+    }
+
+    return count_pkt(table, args, vals[0], vals[1], vals[3]);
+}
+
+/*
+ * Count the rows of CSV (as written by cpcap2csv).
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+static int
+read_csv(
+	FILE *fin,
+	mp_table_t *table,
+	mp_args_t *args)
+{
+    char *buf = malloc(MP_CSV_READ_LEN);
+    size_t have = 0;
+    int rc = 0;
+
+    if (buf == NULL) {
+	fprintf(stderr, "ERROR: malloc failed\n");
+	return -1;
+    }
+
+    for (;;) {
+	size_t n = fread(buf + have, 1, MP_CSV_READ_LEN - have, fin);
+	int eof = (n == 0);
+
+	have += n;
+
+	char *p = buf;
+	char *end = buf + have;
+
+	while (rc == 0 && p < end) {
+	    char *nl = memchr(p, '\n', end - p);
+	    char *line_end = (nl != NULL) ? nl : (eof ? end : NULL);
+
+	    if (line_end == NULL) {
+		break;
+	    }
+
+	    if (*p == '#') {
+		rc = parse_header(p, line_end, args);
+	    }
+	    else if (line_end > p) {
+		rc = parse_row(p, line_end, table, args);
+	    }
+	    p = (nl != NULL) ? nl + 1 : end;
+	}
+
+	have = end - p;
+	if (rc != 0 || eof) {
+	    break;
+	}
+	if (have >= MP_CSV_MAX_LINE) {
+	    fprintf(stderr, "ERROR: line too long [%.*s]\n", 80, p);
+	    rc = -1;
+	    break;
+	}
+	memmove(buf, p, have);
+    }
+
+    if (rc == 0 && ferror(fin)) {
+	fprintf(stderr, "ERROR: could not read input\n");
+	rc = -1;
+    }
+
+    free(buf);
+
+    return rc;
+}
+
+static int
+strendswith(
+	const char *str,
+	const char *suffix)
+{
+    size_t str_len = strlen(str);
+    size_t suf_len = strlen(suffix);
+
+    /* suffix is longer than the string; the string can't possibly
+     * end with the suffix
+     */
+    if (suf_len > str_len) {
+	return 0;
+    }
+
+    size_t off = str_len - suf_len;
+
+    return strcmp(str + off, suffix) == 0;
+}
+
+static FILE *
+do_popen(
+	const char *fname,
+	const char *app)
+{
+
+    if (access(fname, R_OK)) {
+	fprintf(stderr, "ERROR: cannot read input [%s]\n", fname);
+	return NULL;
+    }
+
+    char *buf = calloc(1, strlen(fname) + strlen(app) + 2);
+    if (buf == NULL) {
+	fprintf(stderr, "ERROR: calloc failed in do_open(%s, %s)\n",
+		fname, app);
+	return NULL;
+    }
+
+    sprintf(buf, "%s %s", app, fname);
+
+    FILE *fin = popen(buf, "r");
+
+    free(buf);
+
+    return fin;
+}
+
+static int
+read_file_by_name(
+	char *fname,
+	mp_table_t *table,
+	mp_args_t *args)
+{
+    FILE *fin = NULL;
+    int is_pipe = 1;
+    int rc;
+
+    if (!strcmp(fname, "-")) {
+	fin = stdin;
+	is_pipe = 0;
+    }
+    else if (strendswith(fname, ".gz")) {
+	fin = do_popen(fname, "/bin/gunzip -c");
+    }
+    else if (strendswith(fname, ".lz4")) {
+	fin = do_popen(fname, "/usr/bin/lz4cat");
+    }
+    else if (strendswith(fname, ".bz2")) {
+	fin = do_popen(fname, "/bin/bunzip2 -c");
+    }
+    else if (strendswith(fname, ".xz")) {
+	fin = do_popen(fname, "/usr/bin/lzcat");
+    }
+    else {
+	fin = fopen(fname, "r");
+	is_pipe = 0;
+    }
+
+    if (fin == NULL) {
+	fprintf(stderr, "ERROR: cannot open [%s]: %s\n",
+		fname, strerror(errno));
+	return -1;
+    }
+
+    if (args->use_csv) {
+	rc = read_csv(fin, table, args);
+    }
+    else {
+	rc = read_pcap(fin, table, args);
+    }
+
+    if (is_pipe) {
+	if (pclose(fin) != 0) {
+	    fprintf(stderr, "ERROR: could not decompress [%s]\n", fname);
+	    rc = -1;
+	}
+    }
+    else if (fin != stdin) {
+	fclose(fin);
+    }
+
+    return rc;
+}
+
+typedef struct {
+    const mp_port_t *port;
+    double n_srcs;
+} mp_score_t;
+
+/*
+ * Sort by the number of sources, then the number of packets (both in
+ * descending order), and then by the key, so that the order is
+ * deterministic
+ */
+static int
+cmp_scores(
+	const void *a,
+	const void *b)
+{
+    const mp_score_t *x = a;
+    const mp_score_t *y = b;
+
+    if (x->n_srcs != y->n_srcs) {
+	return (x->n_srcs < y->n_srcs) ? 1 : -1;
+    }
+    if (x->port->npkts != y->port->npkts) {
+	return (x->port->npkts < y->port->npkts) ? 1 : -1;
+    }
+    return (x->port->key > y->port->key) - (x->port->key < y->port->key);
+}
+
+/*
+ * Print the top args->show_n ports, in the same format as
+ * highest-src-cnt (with the destination prefix after the other fields,
+ * if the ports are counted per destination prefix)
+ */
+static int
+print_scores(
+	const mp_table_t *table,
+	const mp_args_t *args)
+{
+    mp_score_t *scores = malloc((table->n_ports + 1) * sizeof(mp_score_t));
+    uint64_t n_scores = 0;
+
+    if (scores == NULL) {
+	fprintf(stderr, "ERROR: malloc failed\n");
+	return -1;
+    }
+
+    for (uint64_t i = 0; i < table->size; i++) {
+	if (table->ports[i].used) {
+	    scores[n_scores].port = &table->ports[i];
+	    scores[n_scores].n_srcs = port_n_srcs(&table->ports[i]);
+	    n_scores++;
+	}
+    }
+
+    qsort(scores, n_scores, sizeof(mp_score_t), cmp_scores);
+
+    uint64_t show_n = n_scores;
+    if (args->show_n >= 0 && (uint64_t) args->show_n < n_scores) {
+	show_n = args->show_n;
+    }
+
+    for (uint64_t i = 0; i < show_n; i++) {
+	const mp_port_t *port = scores[i].port;
+
+	printf("n %lu dport %u proto %d nsrcs %.0f npkts %lu p/s %.5f plen %d",
+		i + 1, (unsigned int) (port->key & 0xffff), args->proto,
+		scores[i].n_srcs, port->npkts,
+		port->npkts / scores[i].n_srcs, args->src_len);
+	if (args->dst_len > 0) {
+	    uint32_t dnet = port->key >> 16;
+
+	    printf(" dnet %u.%u.%u.%u/%d",
+		    dnet >> 24, (dnet >> 16) & 0xff, (dnet >> 8) & 0xff,
+		    dnet & 0xff, args->dst_len);
+	}
+	if (args->tag != NULL && args->tag[0] != 0) {
+	    printf(" tag %s", args->tag);
+	}
+	printf("\n");
+    }
+
+    free(scores);
+
+    return 0;
+}
+
+static uint32_t
+prefix_mask(
+	int len)
+{
+
+    return (len == 0) ? 0 : (uint32_t) (0xffffffffULL << (32 - len));
+}
+
+static void
+usage(
+	char *progname)
+{
+
+    printf("usage: %s [-cE] [-d DLEN] [-l PREFIXLEN] [-n NUM] [-p PROTO]\n"
+	    "       [-t STR] FNAME ...\n", progname);
+    printf("\n"
+"Count the distinct sources and the packets of each destination port, and\n"
+"print the ports with the most sources.\n"
+"\n"
+"-c          Read CSV (as written by cpcap2csv) instead of pcap.  If the\n"
+"            CSV has a header line, then the saddr, daddr, proto, and\n"
+"            dport columns are found from the header.\n"
+"-E          Count the sources of every port exactly, instead of estimating\n"
+"            the count for ports with more than %d sources.  This may\n"
+"            need much more memory.\n"
+"-d DLEN     Count each destination prefix of length DLEN separately.\n"
+"            The default is 0 (count all of the destinations together).\n"
+"-l PREFIXLEN  Mask the source addresses to PREFIXLEN bits before\n"
+"            counting them.  The default is 24.\n"
+"-n NUM      Show the top NUM results.  The default is 1; -1 shows all.\n"
+"-p PROTO    Count the ports of the given protocol (udp, tcp, or icmp,\n"
+"            for which the port is the ICMP type).  The default is udp.\n"
+"-t STR      Tag to append to every output line.\n"
+"FNAME       An input file, or - for stdin.  Files with names that end\n"
+"            in .gz, .lz4, .bz2, or .xz are decompressed.\n", MP_SET_MAX);
+}
+
+static int
+parse_args(
+	int argc,
+	char **argv,
+	mp_args_t *args)
+{
+    int opt;
+
+    args->proto = MP_PROTO_UDP;
+    args->src_len = 24;
+    args->dst_len = 0;
+    args->show_n = 1;
+    args->tag = NULL;
+    args->use_csv = 0;
+    args->exact = 0;
+
+    /* The columns of the default cpcap2csv output */
+    args->col_saddr = 1;
+    args->col_daddr = 2;
+    args->col_proto = 3;
+    args->col_dport = 5;
+
+    while ((opt = getopt(argc, argv, "cd:Ehl:n:p:t:")) != -1) {
+	switch (opt) {
+	    case 'c':
+		args->use_csv = 1;
+		break;
+	    case 'd':
+		args->dst_len = atoi(optarg);
+		if (args->dst_len < 0 || args->dst_len > 32) {
+		    fprintf(stderr, "ERROR: prefix length must be 0..32\n");
+		    return -1;
+		}
+		break;
+	    case 'E':
+		args->exact = 1;
+		break;
+	    case 'h':
+		usage(argv[0]);
+		exit(0);
+	    case 'l':
+		args->src_len = atoi(optarg);
+		if (args->src_len < 0 || args->src_len > 32) {
+		    fprintf(stderr, "ERROR: prefix length must be 0..32\n");
+		    return -1;
+		}
+		break;
+	    case 'n':
+		args->show_n = atoi(optarg);
+		if (args->show_n < 0) {
+		    args->show_n = -1;
+		}
+		break;
+	    case 'p':
+		if (!strcmp(optarg, "udp") || !strcmp(optarg, "17")) {
+		    args->proto = MP_PROTO_UDP;
+		}
+		else if (!strcmp(optarg, "tcp") || !strcmp(optarg, "6")) {
+		    args->proto = MP_PROTO_TCP;
+		}
+		else if (!strcmp(optarg, "icmp") || !strcmp(optarg, "1")) {
+		    args->proto = MP_PROTO_ICMP;
+		}
+		else {
+		    fprintf(stderr,
+			    "ERROR: protocol must be one of udp, tcp, or icmp\n");
+		    return -1;
+		}
+		break;
+	    case 't':
+		args->tag = optarg;
+		break;
+	    default:
+		usage(argv[0]);
+		return -1;
+	}
+    }
+
+    if (optind == argc) {
+	fprintf(stderr, "ERROR: no input files\n");
+	usage(argv[0]);
+	return -1;
+    }
+
+    args->src_mask = prefix_mask(args->src_len);
+    args->dst_mask = prefix_mask(args->dst_len);
+
+    return 0;
+}
+
+int
+main(
+	int argc,
+	char **argv)
+{
+    mp_args_t args;
+    mp_table_t table;
+
+    if (parse_args(argc, argv, &args) != 0) {
+	exit(1);
+    }
+
+    if (table_init(&table) != 0) {
+	exit(1);
+    }
+
+    for (int i = optind; i < argc; i++) {
+	if (read_file_by_name(argv[i], &table, &args) != 0) {
+	    fprintf(stderr, "%s: ERROR: could not read input [%s]\n",
+		    argv[0], argv[i]);
+	    exit(1);
+	}
+    }
+
+    int rc = print_scores(&table, &args);
+
+    table_free(&table);
+
+    return (rc == 0) ? 0 : 1;
+}
@@ -49,7 +49,8 @@
 #include <net/ethernet.h>
 
 #include <pcap/pcap.h>
-#include <pcap/sll.h>
+
+#include "pktdecode.h"
 
 /*
 Example commandline:
@@ -68,25 +69,295 @@ ALL of the fields are expressed in hex EXCEPT for the timestamp, the
 protocol, and the payload length.  The timestamp, protocol, and payload
 length are in decimal.
 
+With -O bin, each packet is written as a binary record instead: a
+meanie_rec_t (below, with every field in network byte order) followed
+by the plen bytes of the payload.  The records are about half the size
+of the CSV rows, and much faster to write.  They can be converted to
+CSV later with -R, which reads records instead of pcap files:
+
+   meanie2csv -O bin input.pcap > meanies.bin
+   meanie2csv -R meanies.bin > meanies.csv
+
 */
 
+typedef enum {
+    OUTPUT_CSV,
+    OUTPUT_BIN
+} output_format_t;
+
+typedef struct {
+    uint32_t saddr;
+    uint32_t daddr;
+    uint16_t sport;
+    uint16_t dport;
+    uint32_t ts_sec;
+    uint32_t ts_usec;
+    uint16_t cksum;
+    uint16_t plen;		/* the number of payload bytes that follow */
+    uint16_t ipid;
+    uint8_t proto;
+    uint8_t ttl;
+} meanie_rec_t;
+
 typedef struct {
     char **infile_names;
+    output_format_t format;
+    int read_records;
 } dagshow_args_t;
 
 typedef struct {
     int link_type;
-    int header_len;
     pcap_t *pcap;
+    output_format_t format;
 } handler_args_t;
 
+/*
+ * Output is accumulated in a large buffer and written to stdout with
+ * write(2), rather than through stdio.  OUTBUF_MAX_REC is an upper
+ * bound on the length of one output record (a CSV row with a 64K
+ * payload, in hex); whenever there is less than this much room left,
+ * the buffer is flushed.
+ */
+#define OUTBUF_SIZE	(1024 * 1024)
+#define OUTBUF_MAX_REC	(2 * 65536 + 256)
+
+typedef struct {
+    char *buf;
+    size_t size;
+    size_t len;
+} out_buf_t;
+
+static out_buf_t out;
+
+static int
+out_init(void)
+{
+
+    out.buf = malloc(OUTBUF_SIZE);
+    if (out.buf == NULL) {
+	fprintf(stderr, "ERROR: could not allocate output buffer\n");
+	return -1;
+    }
+    out.size = OUTBUF_SIZE;
+    out.len = 0;
+
+    return 0;
+}
+
+static void
+out_flush(void)
+{
+    size_t off = 0;
+
+    while (off < out.len) {
+	ssize_t n = write(STDOUT_FILENO, out.buf + off, out.len - off);
+
+	if (n < 0) {
+	    if (errno == EINTR) {
+		continue;
+	    }
+	    fprintf(stderr, "ERROR: could not write output\n");
+	    exit(1);
+	}
+	off += n;
+    }
+
+    out.len = 0;
+}
+
+/*
+ * Return a pointer to room for at least OUTBUF_MAX_REC bytes at the
+ * end of the buffer, flushing the buffer if necessary.  The caller adds
+ * the number of bytes it used to out.len.
+ */
+static inline char *
+out_reserve(void)
+{
+
+    if (out.size - out.len < OUTBUF_MAX_REC) {
+	out_flush();
+    }
+
+    return out.buf + out.len;
+}
+
+/*
+ * The two hex digits of every byte value, so that each byte of the
+ * payload is formatted with one table lookup and one two-byte copy
+ */
+static char hex_pairs[256][2];
+
+static void
+init_hex_pairs(void)
+{
+    static const char digits[] = "0123456789abcdef";
+
+    for (int i = 0; i < 256; i++) {
+	hex_pairs[i][0] = digits[i >> 4];
+	hex_pairs[i][1] = digits[i & 0xf];
+    }
+}
+
+/*
+ * Write the len bytes at bytes in hex, and return a pointer to the
+ * byte after the last digit
+ */
+static inline char *
+fmt_hex_bytes(
+	char *p,
+	const uint8_t *bytes,
+	size_t len)
+{
+
+    for (size_t i = 0; i < len; i++) {
+	memcpy(p + (2 * i), hex_pairs[bytes[i]], 2);
+    }
+
+    return p + (2 * len);
+}
+
+/*
+ * Write val as exactly n_bytes * 2 hex digits (like "%.8x" for a
+ * 32-bit value, if n_bytes is 4)
+ */
+static inline char *
+fmt_hex(
+	char *p,
+	uint32_t val,
+	int n_bytes)
+{
+
+    for (int i = n_bytes - 1; i >= 0; i--) {
+	memcpy(p, hex_pairs[(val >> (8 * i)) & 0xff], 2);
+	p += 2;
+    }
+
+    return p;
+}
+
+/*
+ * Write the decimal representation of val at p (without a terminating
+ * NUL) and return a pointer to the byte after the last digit
+ */
+static inline char *
+fmt_u64(
+	char *p,
+	uint64_t val)
+{
+    char tmp[20];
+    char *t = tmp + sizeof(tmp);
+
+    do {
+	*--t = '0' + (val % 10);
+	val /= 10;
+    } while (val > 0);
+
+    size_t len = tmp + sizeof(tmp) - t;
+    memcpy(p, t, len);
+
+    return p + len;
+}
+
+/*
+ * Write val as at least six decimal digits, with leading zeros
+ */
+static inline char *
+fmt_usec(
+	char *p,
+	uint64_t val)
+{
+
+    if (val >= 1000000) {
+	return fmt_u64(p, val);
+    }
+
+    for (int i = 5; i >= 0; i--) {
+	p[i] = '0' + (val % 10);
+	val /= 10;
+    }
+
+    return p + 6;
+}
+
+/*
+ * Write the CSV row for the given record and payload
+ */
+static void
+print_csv(
+	const meanie_rec_t *rec,
+	const uint8_t *payload)
+{
+    char *start = out_reserve();
+    char *p = start;
+
+    p = fmt_hex(p, rec->saddr, 4);
+    *p++ = ',';
+    p = fmt_hex(p, rec->daddr, 4);
+    *p++ = ',';
+    p = fmt_hex(p, rec->sport, 2);
+    *p++ = ',';
+    p = fmt_hex(p, rec->dport, 2);
+    *p++ = ',';
+    p = fmt_u64(p, rec->proto);
+    *p++ = ',';
+    p = fmt_u64(p, rec->ts_sec);
+    *p++ = '.';
+    p = fmt_usec(p, rec->ts_usec);
+    *p++ = ',';
+    p = fmt_hex(p, rec->cksum, 2);
+    *p++ = ',';
+    p = fmt_u64(p, rec->plen);
+    *p++ = ',';
+    p = fmt_hex_bytes(p, payload, rec->plen);
+    *p++ = ',';
+    p = fmt_hex(p, rec->ttl, 1);
+    *p++ = ',';
+    p = fmt_hex(p, rec->ipid, 2);
+    *p++ = '\n';
+
+    out.len += p - start;
+}
+
+/*
+ * Write the given record (in network byte order) and payload
+ */
+static void
+print_bin(
+	const meanie_rec_t *rec,
+	const uint8_t *payload)
+{
+    char *p = out_reserve();
+    meanie_rec_t nrec;
+
+    nrec.saddr = htonl(rec->saddr);
+    nrec.daddr = htonl(rec->daddr);
+    nrec.sport = htons(rec->sport);
+    nrec.dport = htons(rec->dport);
+    nrec.ts_sec = htonl(rec->ts_sec);
+    nrec.ts_usec = htonl(rec->ts_usec);
+    nrec.cksum = htons(rec->cksum);
+    nrec.plen = htons(rec->plen);
+    nrec.ipid = htons(rec->ipid);
+    nrec.proto = rec->proto;
+    nrec.ttl = rec->ttl;
+
+    memcpy(p, &nrec, sizeof(nrec));
+    memcpy(p + sizeof(nrec), payload, rec->plen);
+
+    out.len += sizeof(nrec) + rec->plen;
+}
+
 static void
 usage(char *const prog)
 {
     /* FIXME make this non-lame */
-    printf("usage: %s [-h] INPUT1 .. INPUTN\n",
+    printf("usage: %s [-h] [-O FORMAT] [-R] INPUT1 .. INPUTN\n",
 	    prog);
     printf("    -h          Print help message and exit.\n");
+    printf("    -O FORMAT   Write the output in the given FORMAT, which\n");
+    printf("                must be csv or bin.  The default is csv.\n");
+    printf("    -R          The inputs are binary records (written by\n");
+    printf("                -O bin), instead of pcap files.\n");
 
     return;
 }
@@ -100,13 +371,31 @@ parse_args(
     int opt;
 
     args->infile_names = NULL;
+    args->format = OUTPUT_CSV;
+    args->read_records = 0;
 
-    while ((opt = getopt(argc, argv, "h")) != -1) {
+    while ((opt = getopt(argc, argv, "hO:R")) != -1) {
 	switch (opt) {
 	    case 'h':
 		usage(argv[0]);
 		exit(0);
 		break;
+	    case 'O':
+		if (!strcmp(optarg, "csv")) {
+		    args->format = OUTPUT_CSV;
+		}
+		else if (!strcmp(optarg, "bin")) {
+		    args->format = OUTPUT_BIN;
+		}
+		else {
+		    fprintf(stderr, "ERROR: unknown output format [%s]\n",
+			    optarg);
+		    return -1;
+		}
+		break;
+	    case 'R':
+		args->read_records = 1;
+		break;
 	    default:
 		/* OOPS -- should not happen */
 		return -1;
@@ -127,6 +416,7 @@ handler(
 	const unsigned char *packet)
 {
     handler_args_t *args = (handler_args_t *) user;
+    pktd_ip_t ip;
 
     /*
      * Some packets are broken, and even if the caplen is long
@@ -135,80 +425,135 @@ handler(
      *
      * We're parsing an IPv4 packet, so it must have AT LEAST 20 bytes
      * after the link header has been removed to hold a header (without
-     * any options).
+     * any options), and then the 8 bytes of the UDP header.
      *
      * If the packet is too short, we just drop it.
      */
-
-    if (pkthdr->caplen < (args->header_len + 20)) {
-	return;
-    }
-
-    struct ip *ip_header = (struct ip *) (packet + args->header_len);
-
-    /*
-     * Now we know that we have at least the start of the ip_header.
-     * Let's see whether we have enough for the whole header, and then
-     * the 4 bytes that follow the IP header (because we need them
-     * for sport and dport)
-     *
-     * If not, just drop it.
-     */
-    if (pkthdr->caplen < (args->header_len + (ip_header->ip_hl * 4) + 4)) {
+    if ((pktd_decode(args->link_type, packet, pkthdr->caplen, &ip) != 0) ||
+	    (ip.l4_caplen < 8)) {
 	return;
     }
 
-    uint8_t proto = ip_header->ip_p;
-    if (proto != IPPROTO_UDP) {
+    if (ip.proto != IPPROTO_UDP) {
 	/* it's not a packet this tool can cope with;
 	 * meanie packets are always UDP
 	 */
 	return;
     }
 
-    uint32_t saddr = ntohl(ip_header->ip_src.s_addr);
-    uint32_t daddr = ntohl(ip_header->ip_dst.s_addr);
-    uint16_t len = ntohs(ip_header->ip_len);
-    uint8_t ttl = ip_header->ip_ttl;
-    uint16_t ipid = ntohs(ip_header->ip_id);
-
-    uint16_t *proto_hdr = (uint16_t *)
-            (((unsigned char *) ip_header) + (ip_header->ip_hl * 4));
-
     /*
      * It might be a meanie packet, but the packet is too short
      * (perhaps just a fragment): drop it.
      */
-    if (pkthdr->caplen < (args->header_len + len)) {
+    if (ip.ip_caplen < ip.ip_len) {
 	return;
     }
 
-    uint16_t sport = ntohs(proto_hdr[0]);
-    uint16_t dport = ntohs(proto_hdr[1]);
-    uint16_t plen = ntohs(proto_hdr[2]) - 8;
-    uint16_t cksum = ntohs(proto_hdr[3]);
-
-    printf("%.8x,%.8x,%.4x,%.4x,%u,%ld.%.6ld,%.4x,%u,",
-	    saddr, daddr, sport, dport, proto,
-	    pkthdr->ts.tv_sec, pkthdr->ts.tv_usec, cksum, plen);
+    uint16_t sport = pktd_get16(ip.l4);
+    uint16_t dport = pktd_get16(ip.l4 + 2);
+    uint16_t udp_len = pktd_get16(ip.l4 + 4);
+    uint16_t cksum = pktd_get16(ip.l4 + 6);
 
-    uint8_t *base = (uint8_t *) (proto_hdr + 4);
-    for (uint16_t i = 0; i < plen; i++) {
-	printf("%.2x", base[i]);
+    /*
+     * If the UDP length doesn't make sense, or claims that there's
+     * more payload than was captured, then drop it.
+     */
+    if ((udp_len < 8) || (udp_len > ip.l4_caplen)) {
+	return;
+    }
+    meanie_rec_t rec;
+
+    rec.saddr = ip.saddr;
+    rec.daddr = ip.daddr;
+    rec.sport = sport;
+    rec.dport = dport;
+    rec.ts_sec = pkthdr->ts.tv_sec;
+    rec.ts_usec = pkthdr->ts.tv_usec;
+    rec.cksum = cksum;
+    rec.plen = udp_len - 8;
+    rec.ipid = ip.ipid;
+    rec.proto = ip.proto;
+    rec.ttl = ip.ttl;
+
+    if (args->format == OUTPUT_BIN) {
+	print_bin(&rec, ip.l4 + 8);
+    }
+    else {
+	print_csv(&rec, ip.l4 + 8);
     }
-    printf(",%.2x,%.4x\n", ttl, ipid);
 
     return ;
 }
 
+/*
+ * Read binary records (written by -O bin) from fin, and write them in
+ * the given format
+ */
+static int
+read_records(
+	FILE *fin,
+	output_format_t format)
+{
+    meanie_rec_t rec;
+    uint8_t payload[65536];
+
+    for (;;) {
+	size_t n = fread(&rec, 1, sizeof(rec), fin);
+
+	if (n == 0) {
+	    break;
+	}
+	else if (n != sizeof(rec)) {
+	    fprintf(stderr, "ERROR: truncated record\n");
+	    return -1;
+	}
+
+	rec.saddr = ntohl(rec.saddr);
+	rec.daddr = ntohl(rec.daddr);
+	rec.sport = ntohs(rec.sport);
+	rec.dport = ntohs(rec.dport);
+	rec.ts_sec = ntohl(rec.ts_sec);
+	rec.ts_usec = ntohl(rec.ts_usec);
+	rec.cksum = ntohs(rec.cksum);
+	rec.plen = ntohs(rec.plen);
+	rec.ipid = ntohs(rec.ipid);
+
+	if (fread(payload, 1, rec.plen, fin) != rec.plen) {
+	    fprintf(stderr, "ERROR: truncated record\n");
+	    return -1;
+	}
+
+	if (format == OUTPUT_BIN) {
+	    print_bin(&rec, payload);
+	}
+	else {
+	    print_csv(&rec, payload);
+	}
+    }
+
+    if (ferror(fin)) {
+	fprintf(stderr, "ERROR: could not read records\n");
+	return -1;
+    }
+
+    return 0;
+}
+
 static int
-read_file(FILE *fin)
+read_file(
+	FILE *fin,
+	const dagshow_args_t *args)
 {
     char errbuf[PCAP_ERRBUF_SIZE];
-    int header_len = 0;
     int result = 0;
     int rc;
 
+    if (args->read_records) {
+	result = read_records(fin, args->format);
+	fclose(fin);
+	return result;
+    }
+
     pcap_t *pcap = pcap_fopen_offline(fin, errbuf);
     if (pcap == NULL) {
 	fprintf(stderr, "ERROR: [%s]\n", errbuf);
@@ -217,30 +562,15 @@ read_file(FILE *fin)
 
     /*
      * Check that the DLT is one that we know how
-     * to parse, and if so, find the link type header
-     * length.  If we don't understand the data link
+     * to parse.  If we don't understand the data link
      * type, then we have to abandon this pcap.
      */
     int link_type = pcap_datalink(pcap);
-    switch (link_type) {
-	case DLT_EN10MB:
-	    /* There's no mention in the code about how to handle
-	     * a VLAN tag.  TODO: check that EN10MB can't have a
-	     * VLAN tag (or stacked tags, for that matter)
-	     */
-	    header_len = sizeof(struct ether_header);
-	    break;
-	case DLT_RAW:
-	    header_len = 0; /* TODO: double check */
-	    break;
-	case DLT_LINUX_SLL:
-	    header_len = sizeof(struct sll_header);
-	    break;
-	default:
-	    fprintf(stderr, "ERROR: unsupported capture type: %d\n",
-		    link_type);
-	    pcap_close(pcap);
-	    return -1;
+    if (!pktd_link_supported(link_type)) {
+	fprintf(stderr, "ERROR: unsupported capture type: %d\n",
+		link_type);
+	pcap_close(pcap);
+	return -1;
     }
 
     struct bpf_program filter;
@@ -256,7 +586,7 @@ read_file(FILE *fin)
     }
 
     handler_args_t handler_args = {
-	link_type, header_len, pcap
+	link_type, pcap, args->format
     };
 
     if (pcap_loop(pcap, -1, handler, (u_char *) &handler_args) < 0) {
@@ -319,7 +649,9 @@ do_popen(
 }
 
 static int
-read_file_by_name(char *fname)
+read_file_by_name(
+	char *fname,
+	const dagshow_args_t *args)
 {
     FILE *fin = NULL;
     int rc;
@@ -351,10 +683,10 @@ read_file_by_name(char *fname)
 	return -1;
     }
 
-    rc = read_file(fin);
+    rc = read_file(fin, args);
 
     /*
-     * pcap_close closes the underlying FILE, so we don't
+     * read_file closes the underlying FILE, so we don't
      * need to (and doing so will cause a double-free).
      */
 
@@ -373,22 +705,30 @@ main(
 	return -1;
     }
 
+    init_hex_pairs();
+    if (out_init() != 0) {
+	return -1;
+    }
+
     if (args.infile_names == NULL) {
-	rc = read_file(stdin);
+	rc = read_file(stdin, &args);
+	out_flush();
 	return rc;
     }
     else {
 	for (unsigned int i = 0; args.infile_names[i] != NULL; i++) {
 
 	    char *fname = args.infile_names[i];
-	    rc = read_file_by_name(args.infile_names[i]);
+	    rc = read_file_by_name(args.infile_names[i], &args);
 	    if (rc != 0) {
 		fprintf(stderr, "%s: ERROR: could not read input [%s]\n",
 			argv[0], fname);
+		out_flush();
 		return -1;
 	    }
 	}
 
+	out_flush();
 	return 0;
     }
 }
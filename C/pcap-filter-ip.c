@@ -0,0 +1,440 @@
+/* CODEMARK: nice-ibr */
+/*
+ * Copyright (C) 2020-2024 - Raytheon BBN Technologies Corp.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0.
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+ *
+ * Distribution Statement "A" (Approved for Public Release,
+ * Distribution Unlimited).
+ *
+ * This material is based upon work supported by the Defense
+ * Advanced Research Projects Agency (DARPA) under Contract No.
+ * HR001119C0102.  The opinions, findings, and conclusions stated
+ * herein are those of the authors and do not necessarily reflect
+ * those of DARPA.
+ *
+ * In the event permission is required, DARPA is authorized to
+ * reproduce the copyrighted material for use as an exhibit or
+ * handout at DARPA-sponsored events and/or to post the material
+ * on the DARPA website.
+ */
+/* CODEMARK: end */
+
+/*
+ * Split a capture file (from stdin) into the packets to keep and the
+ * packets to set aside, according to whether their IPv4 source and/or
+ * destination addresses match any of a list of subnets, in one pass.
+ *
+ * This does the same job as a tcpdump filter such as "ip and not dst
+ * net 192.168.0.0/16", but the subnets are kept in an ipmatch table,
+ * so the cost per packet doesn't depend on how many subnets there are
+ * (a BPF program for a list of subnets tests each subnet in turn).
+ *
+ * The input may be pcap or pcapng (via capfile), and the link types
+ * are the ones understood by pktdecode.  The outputs are classic pcap
+ * files, which may be compressed (via zout).
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "capfile.h"
+#include "ipmatch.h"
+#include "pktdecode.h"
+#include "zout.h"
+
+/* The number of packets read from the input at a time */
+#define PFI_BATCH_SIZE		(1024)
+
+#define PFI_PCAP_MAGIC_USEC	(0xa1b2c3d4)
+#define PFI_PCAP_MAGIC_NSEC	(0xa1b23c4d)
+#define PFI_PCAP_SNAPLEN	(262144)
+
+/* The link type of an output that doesn't have any packets */
+#define PFI_DEFAULT_LINKTYPE	(1)
+
+typedef enum {
+    MATCH_SRC,
+    MATCH_DST,
+    MATCH_ANY
+} match_addr_t;
+
+/*
+ * An output pcap file.  The file header is written when the first
+ * packet is written, because the link type of a pcapng input isn't
+ * known until then.
+ */
+typedef struct {
+    zout_t *z;			/* NULL if the output is discarded */
+    int nsec;			/* write nanosecond timestamps */
+    int hdr_written;
+    uint32_t linktype;
+    uint64_t n_pkts;
+} pcap_out_t;
+
+/*
+ * Open the output with the given file name, or stdout if the name is
+ * "-", compressed with the given codec.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+static int
+pcap_out_open(
+	pcap_out_t *out,
+	const char *fname,
+	zout_codec_t codec,
+	int level,
+	zout_pool_t *pool)
+{
+
+    if (!strcmp(fname, "-")) {
+	out->z = zout_fdopen(STDOUT_FILENO, codec, level, pool);
+    }
+    else {
+	out->z = zout_open(fname, codec, level, pool);
+    }
+
+    return (out->z != NULL) ? 0 : -1;
+}
+
+static int
+pcap_out_header(
+	pcap_out_t *out,
+	uint32_t linktype)
+{
+    uint32_t hdr[6];
+
+    /* The version (2.4) is two 16-bit fields, major first */
+    uint16_t version[2] = { 2, 4 };
+
+    hdr[0] = out->nsec ? PFI_PCAP_MAGIC_NSEC : PFI_PCAP_MAGIC_USEC;
+    memcpy(&hdr[1], version, sizeof(version));
+    hdr[2] = 0;			/* thiszone */
+    hdr[3] = 0;			/* sigfigs */
+    hdr[4] = PFI_PCAP_SNAPLEN;
+    hdr[5] = linktype;
+
+    out->linktype = linktype;
+    out->hdr_written = 1;
+
+    return zout_write(out->z, hdr, sizeof(hdr));
+}
+
+/*
+ * Returns 0 on success, -1 on failure.
+ */
+static int
+pcap_out_write(
+	pcap_out_t *out,
+	const capf_pkt_t *pkt)
+{
+    uint32_t rec[4];
+
+    if (!out->hdr_written) {
+	if (pcap_out_header(out, pkt->linktype) != 0) {
+	    return -1;
+	}
+    }
+    else if (pkt->linktype != out->linktype) {
+	fprintf(stderr,
+		"ERROR: cannot write link types %u and %u to one pcap file\n",
+		out->linktype, pkt->linktype);
+	return -1;
+    }
+
+    rec[0] = (uint32_t) pkt->ts_sec;
+    rec[1] = out->nsec ? pkt->ts_nsec : pkt->ts_nsec / 1000;
+    rec[2] = pkt->caplen;
+    rec[3] = pkt->len;
+
+    out->n_pkts++;
+
+    if (zout_write(out->z, rec, sizeof(rec)) != 0) {
+	return -1;
+    }
+    return zout_write(out->z, pkt->data, pkt->caplen);
+}
+
+/*
+ * Returns 0 on success, -1 on failure.
+ */
+static int
+pcap_out_close(
+	pcap_out_t *out,
+	uint32_t linktype)
+{
+    int rc = 0;
+
+    if (out->z == NULL) {
+	return 0;
+    }
+
+    if (!out->hdr_written) {
+	rc = pcap_out_header(out, linktype);
+    }
+    if (zout_close(out->z) != 0) {
+	rc = -1;
+    }
+    out->z = NULL;
+
+    return rc;
+}
+
+/*
+ * Read packets from cf, and write each IPv4 packet to kept or aside,
+ * depending on whether its address (or addresses) match the prefixes
+ * in addresses.  Packets that are not IPv4 are written to neither.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+static int
+filter_packets(
+	capf_t *cf,
+	ipmatch_t *addresses,
+	match_addr_t match,
+	int inverse,
+	pcap_out_t *kept,
+	pcap_out_t *aside,
+	uint64_t *n_other)
+{
+    capf_pkt_t pkts[PFI_BATCH_SIZE];
+    int n_pkts;
+
+    while ((n_pkts = capf_next_batch(cf, pkts, PFI_BATCH_SIZE)) > 0) {
+	for (int i = 0; i < n_pkts; i++) {
+	    capf_pkt_t *pkt = &pkts[i];
+	    pktd_ip_t ip;
+	    uint32_t tag;
+
+	    if (!pktd_link_supported(pkt->dlt)) {
+		fprintf(stderr, "ERROR: unsupported link type (%u)\n",
+			pkt->linktype);
+		return -1;
+	    }
+
+	    if (pktd_decode(pkt->dlt, pkt->data, pkt->caplen, &ip) != 0) {
+		(*n_other)++;
+		continue;
+	    }
+
+	    switch (match) {
+		case MATCH_SRC:
+		    tag = ipmatch_lookup(addresses, ip.saddr);
+		    break;
+		case MATCH_DST:
+		    tag = ipmatch_lookup(addresses, ip.daddr);
+		    break;
+		default:
+		    tag = ipmatch_lookup(addresses, ip.saddr) |
+			    ipmatch_lookup(addresses, ip.daddr);
+		    break;
+	    }
+
+	    pcap_out_t *dest = ((tag != 0) ^ inverse) ? aside : kept;
+	    if (dest->z != NULL && pcap_out_write(dest, pkt) != 0) {
+		return -1;
+	    }
+	}
+    }
+
+    if (n_pkts < 0) {
+	fprintf(stderr, "ERROR: could not read all of the input\n");
+	return -1;
+    }
+
+    return 0;
+}
+
+static void
+usage(
+	char *progname)
+{
+
+    fprintf(stderr, "usage: %s [-hrv] [-a ADDR] [-o KEPT] [-x ASIDE] [-s NET]\n"
+	    "       [-z CODEC] [-Z N] [NETFILE ...]\n", progname);
+    fprintf(stderr, "%s",
+    "\n"
+    "Read a pcap or pcapng file from stdin, and write the IPv4 packets\n"
+    "whose addresses do not match any of the given subnets to KEPT, and\n"
+    "the packets whose addresses match to ASIDE.  Packets that are not\n"
+    "IPv4 are discarded.\n"
+    "\n"
+    "-a ADDR  Match the given address of each packet: src, dst, or any\n"
+    "         (either the source or the destination).  The default is\n"
+    "         dst.\n"
+    "-h       Print this message and exit.\n"
+    "-o KEPT  Write the kept packets to the file KEPT.  The default is\n"
+    "         stdout.\n"
+    "-r       Reverse the filter: keep the packets that match, and set\n"
+    "         aside the packets that do not.\n"
+    "-s NET   Match the given subnet (in addition to the NETFILEs, if\n"
+    "         any).\n"
+    "-v       Print the number of packets written to each output.\n"
+    "-x ASIDE Write the packets that are set aside to the file ASIDE.\n"
+    "         By default, they are discarded.\n"
+    "-z CODEC Compress the outputs with the given CODEC (gzip, lz4, or\n"
+    "         zstd, optionally followed by :LEVEL).  By default, an\n"
+    "         output is compressed if its name ends in .gz, .lz4, or\n"
+    "         .zst, and stdout is not compressed.\n"
+    "-Z N     Use N threads to compress the outputs.  The default is\n"
+    "         the number of processors.\n"
+    "NETFILE  A file containing IPv4 addresses or subnets (in CIDR\n"
+    "         notation), one per line, to match.\n"
+    "\n"
+    "The outputs are classic pcap files, with the same link type as\n"
+    "the input.  If the input is a pcapng file, then all of its\n"
+    "interfaces must have the same link type.\n");
+}
+
+int
+main(
+	int argc,
+	char **argv)
+{
+    match_addr_t match = MATCH_DST;
+    int inverse = 0;
+    int verbose = 0;
+    char *kept_name = "-";
+    char *aside_name = NULL;
+    char *subnet = NULL;
+    zout_codec_t codec = ZOUT_CODEC_NONE;
+    int codec_set = 0;
+    int level = 0;
+    int n_zthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    int opt;
+
+    while ((opt = getopt(argc, argv, "a:ho:rs:vx:z:Z:")) != -1) {
+	switch (opt) {
+	    case 'a':
+		if (!strcmp(optarg, "src")) {
+		    match = MATCH_SRC;
+		}
+		else if (!strcmp(optarg, "dst")) {
+		    match = MATCH_DST;
+		}
+		else if (!strcmp(optarg, "any")) {
+		    match = MATCH_ANY;
+		}
+		else {
+		    fprintf(stderr, "ERROR: bad address [%s] (not src, dst, or any)\n",
+			    optarg);
+		    exit(1);
+		}
+		break;
+	    case 'h':
+		usage(argv[0]);
+		exit(0);
+	    case 'o':
+		kept_name = optarg;
+		break;
+	    case 'r':
+		inverse = 1;
+		break;
+	    case 's':
+		subnet = optarg;
+		break;
+	    case 'v':
+		verbose = 1;
+		break;
+	    case 'x':
+		aside_name = optarg;
+		break;
+	    case 'z':
+		if (zout_codec_parse(optarg, &codec, &level) != 0) {
+		    exit(1);
+		}
+		codec_set = 1;
+		break;
+	    case 'Z':
+		n_zthreads = atoi(optarg);
+		if (n_zthreads < 0) {
+		    fprintf(stderr, "ERROR: bad number of threads [%s]\n",
+			    optarg);
+		    exit(1);
+		}
+		break;
+	    default:
+		fprintf(stderr, "ERROR: bad usage\n");
+		usage(argv[0]);
+		exit(1);
+	}
+    }
+
+    ipmatch_t *addresses = ipmatch_create();
+    if (addresses == NULL) {
+	exit(1);
+    }
+
+    for (int i = optind; i < argc; i++) {
+	if (ipmatch_add_file(addresses, argv[i], 1) != 0) {
+	    exit(1);
+	}
+    }
+    if (subnet != NULL && ipmatch_add_str(addresses, subnet, 1) != 0) {
+	exit(1);
+    }
+
+    capf_t cf;
+    if (capf_open(&cf, stdin) != 0) {
+	fprintf(stderr, "ERROR: input is not a pcap or pcapng file\n");
+	exit(1);
+    }
+
+    zout_pool_t *pool = zout_pool_create(n_zthreads);
+    if (pool == NULL) {
+	exit(1);
+    }
+
+    /* Keep the timestamp resolution of a classic pcap input */
+    int nsec = (cf.format == CAPF_FORMAT_PCAP) ? cf.nsec : 0;
+    pcap_out_t kept = { NULL, nsec, 0, 0, 0 };
+    pcap_out_t aside = { NULL, nsec, 0, 0, 0 };
+
+    if (pcap_out_open(&kept, kept_name,
+		codec_set ? codec : zout_codec_from_fname(kept_name),
+		level, pool) != 0) {
+	exit(1);
+    }
+    if (aside_name != NULL && pcap_out_open(&aside, aside_name,
+		codec_set ? codec : zout_codec_from_fname(aside_name),
+		level, pool) != 0) {
+	exit(1);
+    }
+
+    uint64_t n_other = 0;
+    int rc = filter_packets(&cf, addresses, match, inverse,
+	    &kept, &aside, &n_other);
+
+    uint32_t linktype = (cf.format == CAPF_FORMAT_PCAP) ?
+	    cf.linktype : PFI_DEFAULT_LINKTYPE;
+    if (pcap_out_close(&kept, linktype) != 0) {
+	rc = -1;
+    }
+    if (pcap_out_close(&aside, linktype) != 0) {
+	rc = -1;
+    }
+
+    if (verbose) {
+	fprintf(stderr, "kept %lu set aside %lu other %lu\n",
+		kept.n_pkts, aside.n_pkts, n_other);
+    }
+
+    zout_pool_destroy(pool);
+    capf_close(&cf);
+    ipmatch_free(addresses);
+
+    return (rc == 0) ? 0 : 1;
+}
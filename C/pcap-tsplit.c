@@ -32,19 +32,27 @@
 
 #include <errno.h>
 #include <getopt.h>
+#include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <pcap/pcap.h>
 
+#include "zout.h"
+
 /*
 Example commandline:
 
     pcap-tsplit -s X,Y,foo.pcap [-s Y,Z,bar.pcap] [-f BPF] \
 	    input1.pcap input2.pcap ... inputN.pcap
 
+    pcap-tsplit -H 3600 -o 'out-%F-%H.pcap.gz' [-f BPF] \
+	    input1.pcap input2.pcap ... inputN.pcap
+
 The (optional) -f parameter is a BPF predicate; any packets
 that don't satisfy this predicate are discarded.
 
@@ -54,17 +62,53 @@ FNAME is a pcap file.  If the timestamp of a packet is strictly greater
 or equal to STARTTS and less than ENDTS, it is written to FNAME.  Note
 that FNAME is created as an empty pcap file (of the same type as the
 input pcap) when the program is run.  The FNAME of each span should be
-unique, but this is not checked.  A maximum of 128 spans can be
-specified.  If no spans are specified, then the program exits
-immediately after creating the output files.
+unique, but this is not checked.  There is no limit on the number of
+spans.  If no spans are specified (and -H is not used), then the program
+exits immediately after creating the output files.
 
 Note that spans may overlap; the timestamp of a packet might fall into
 multiple spans.  In this case, it will be written to all of the
 corresponding output FNAMEs.
 
-*/
+The -H SECS parameter splits the input into periods of SECS seconds,
+aligned to multiples of SECS since the epoch (so -H 3600 gives hourly
+files that start on the hour), and writes each packet to the file for
+its period, which is created when the first packet in the period is
+seen.  The name of each file is given by the -o TEMPLATE parameter,
+which is expanded by strftime for the start of the period, in the local
+timezone (so set TZ=UTC to name the files by UTC time).  The -H outputs
+are kept open until all of the inputs have been read, so that the
+inputs may be in any order, and may overlap (except with -m; see
+below).  -H and -s may be used together.  If -o is used without -H,
+then TEMPLATE is the name of a single output, which gets all of the packets.
+
+The -m parameter merges the inputs by timestamp: all of the inputs are
+read at once, and the packets are handled in time order (as long as
+each input is in time order), even if the time ranges of the inputs
+overlap.  Packets with the same timestamp are handled in the order of
+their inputs on the commandline.  With -d, packets that are exact
+duplicates of a packet that has already been handled (the same
+timestamp, lengths, and bytes) are dropped, which removes the copies of
+packets that were captured in two overlapping inputs.  For example,
+
+    pcap-tsplit -m -d -H 3600 -o 'out-%F-%H.pcap.gz' input*.pcap.gz
+
+writes the packets of the inputs to time-sorted hourly files, without
+duplicates.  Note that -m reads from all of the inputs at the same time,
+so it needs one file descriptor (and decompressor) per input.  With -m,
+each -H output is closed as soon as all of the remaining packets of
+the inputs are later than its period, so only the outputs of the
+current periods are open at once; a packet that belongs to a period
+that has already been closed (because its input is not in time order)
+is an error.
+
+If an FNAME (or TEMPLATE) ends in .gz, .lz4, or .zst, then it is
+compressed (with gzip, lz4, or zstd, respectively) as it is written.
+The compression is done by a pool of threads shared by all of the
+outputs; the (optional) -Z parameter sets the number of threads, which
+by default is the number of online processors.
 
-#define MAX_SPANS	(128)
+*/
 
 typedef struct {
     struct timeval start_ts;
@@ -73,15 +117,66 @@ typedef struct {
     pcap_dumper_t *output;
 } tsplit_span_t;
 
+/*
+ * An index of the spans, for finding all of the spans that contain a
+ * timestamp with a binary search.  The start and end timestamps of all
+ * of the spans, sorted and without duplicates, divide the time line
+ * into elementary intervals, and each interval is contained by the
+ * same set of spans.  The spans that contain the interval
+ * [bounds[k], bounds[k + 1]) are refs[first[k]] to refs[first[k + 1] - 1],
+ * in the order in which the spans were given.
+ */
+typedef struct {
+    int64_t *bounds;		/* in microseconds since the epoch */
+    uint32_t n_bounds;
+    uint32_t *first;
+    uint32_t *refs;
+    uint32_t last;		/* the interval of the previous lookup */
+} tsplit_index_t;
+
+/* An output of the -H mode (or the only output, for -o without -H) */
+typedef struct {
+    int64_t start;		/* the start of the period, in seconds */
+    char *fname;
+    pcap_dumper_t *output;
+} tsplit_period_t;
+
 typedef struct {
     char *bpf;
-    tsplit_span_t spans[MAX_SPANS];
+    tsplit_span_t *spans;
+    uint32_t n_spans;
+    tsplit_index_t index;
     char **infile_names;
+    int n_zthreads;
+    zout_pool_t *zpool;
+
+    /* The link type of the first input, used for all of the outputs */
+    int link_type;
+
+    /* Merge the inputs by timestamp (-m), dropping duplicates (-d) */
+    int merge;
+    int dedup;
+
+    /* The -H periods, sorted by start (or the -o output, without -H) */
+    int64_t period;
+    char *template;
+    tsplit_period_t *periods;
+    uint32_t n_periods;
+    uint32_t max_periods;
+    uint32_t last_period;	/* the period of the previous lookup */
+
+    /* With -m, the periods that end at or before closed_before (in
+     * microseconds since the epoch) are closed; they are the first
+     * first_open periods.
+     */
+    int64_t closed_before;
+    uint32_t first_open;
 } tsplit_args_t;
 
 typedef struct {
     pcap_t *in_pcap;
-    tsplit_span_t *spans;
+    tsplit_args_t *args;
+    int failed;
 } handler_args_t;
 
 
@@ -89,13 +184,149 @@ static void
 usage(char *const prog)
 {
     /* FIXME make this non-lame */
-    printf("usage: %s [-h] -s STS1,ETS1,FOUT1 [-s STS2,ETS2,FOUT2 ...] \\\n",
-	    prog);
+    printf("usage: %s [-h] [-f BPF] [-Z N] [-m [-d]] \\\n", prog);
+    printf("        [-s STS1,ETS1,FOUT1 [-s STS2,ETS2,FOUT2 ...]] \\\n");
+    printf("        [[-H SECS] -o TEMPLATE] \\\n");
     printf("        FIN1 .. FINN\n");
 
     return;
 }
 
+static int64_t
+tv2usec(
+	const struct timeval *tv)
+{
+
+    return ((int64_t) tv->tv_sec * 1000000) + tv->tv_usec;
+}
+
+static int
+cmp_int64(
+	const void *a,
+	const void *b)
+{
+    int64_t x = *(const int64_t *) a;
+    int64_t y = *(const int64_t *) b;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ * Return the index of the last element of the sorted array bounds
+ * that is less than or equal to key, or -1 if there is no such element
+ */
+static int64_t
+find_bound(
+	const int64_t *bounds,
+	uint32_t n_bounds,
+	int64_t key)
+{
+    int64_t lo = 0;
+    int64_t hi = (int64_t) n_bounds - 1;
+
+    while (lo <= hi) {
+	int64_t mid = lo + ((hi - lo) / 2);
+
+	if (bounds[mid] <= key) {
+	    lo = mid + 1;
+	}
+	else {
+	    hi = mid - 1;
+	}
+    }
+
+    return hi;
+}
+
+/*
+ * Build the index of the spans.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+static int
+build_index(
+	tsplit_args_t *args)
+{
+    tsplit_index_t *index = &args->index;
+    uint32_t n_spans = args->n_spans;
+
+    index->bounds = malloc((2 * n_spans + 1) * sizeof(int64_t));
+    index->first = calloc(2 * n_spans + 1, sizeof(uint32_t));
+    if (index->bounds == NULL || index->first == NULL) {
+	fprintf(stderr, "ERROR: malloc failed\n");
+	return -1;
+    }
+
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < n_spans; i++) {
+	index->bounds[n++] = tv2usec(&args->spans[i].start_ts);
+	index->bounds[n++] = tv2usec(&args->spans[i].end_ts);
+    }
+    qsort(index->bounds, n, sizeof(int64_t), cmp_int64);
+
+    index->n_bounds = 0;
+    for (uint32_t i = 0; i < n; i++) {
+	if (index->n_bounds == 0 ||
+		index->bounds[i] != index->bounds[index->n_bounds - 1]) {
+	    index->bounds[index->n_bounds++] = index->bounds[i];
+	}
+    }
+
+    /*
+     * Count the spans that contain each interval, and then fill in
+     * the refs.  Each span [start, end) contains the intervals from
+     * the one that starts at start, up to but not including the one
+     * that starts at end.  (A span with end <= start contains none.)
+     */
+    uint32_t *counts = calloc(index->n_bounds + 1, sizeof(uint32_t));
+    if (counts == NULL) {
+	fprintf(stderr, "ERROR: malloc failed\n");
+	return -1;
+    }
+
+    uint64_t n_refs = 0;
+    for (uint32_t i = 0; i < n_spans; i++) {
+	int64_t k0 = find_bound(index->bounds, index->n_bounds,
+		tv2usec(&args->spans[i].start_ts));
+	int64_t k1 = find_bound(index->bounds, index->n_bounds,
+		tv2usec(&args->spans[i].end_ts));
+
+	for (int64_t k = k0; k < k1; k++) {
+	    counts[k]++;
+	    n_refs++;
+	}
+    }
+
+    index->refs = malloc((n_refs + 1) * sizeof(uint32_t));
+    if (index->refs == NULL) {
+	fprintf(stderr, "ERROR: malloc failed\n");
+	free(counts);
+	return -1;
+    }
+
+    index->first[0] = 0;
+    for (uint32_t k = 0; k < index->n_bounds; k++) {
+	index->first[k + 1] = index->first[k] + counts[k];
+	counts[k] = index->first[k];
+    }
+
+    for (uint32_t i = 0; i < n_spans; i++) {
+	int64_t k0 = find_bound(index->bounds, index->n_bounds,
+		tv2usec(&args->spans[i].start_ts));
+	int64_t k1 = find_bound(index->bounds, index->n_bounds,
+		tv2usec(&args->spans[i].end_ts));
+
+	for (int64_t k = k0; k < k1; k++) {
+	    index->refs[counts[k]++] = i;
+	}
+    }
+
+    index->last = 0;
+    free(counts);
+
+    return 0;
+}
+
 static int
 parse_args(
 	int argc,
@@ -103,20 +334,27 @@ parse_args(
 	tsplit_args_t *args)
 {
     int opt;
-    int span_cnt = 0;
+    uint32_t span_cnt = 0;
 
-    char *span_descriptions[MAX_SPANS];
-    for (unsigned int i = 0; i < MAX_SPANS; i++) {
-	span_descriptions[i] = NULL;
+    char **span_descriptions = calloc(argc, sizeof(char *));
+    if (span_descriptions == NULL) {
+	fprintf(stderr, "ERROR: malloc failed\n");
+	return -1;
     }
 
-    for (unsigned int i = 0; i < MAX_SPANS; i++) {
-	args->spans[i].fname = NULL;
-	args->spans[i].output = NULL;
-    }
+    memset(args, 0, sizeof(*args));
+    args->closed_before = INT64_MIN;
+    args->bpf = NULL;
+    args->infile_names = NULL;
+    args->n_zthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    args->zpool = NULL;
+    args->link_type = -1;
 
-    while ((opt = getopt(argc, argv, "f:hs:")) != -1) {
+    while ((opt = getopt(argc, argv, "df:hH:mo:s:Z:")) != -1) {
 	switch (opt) {
+	    case 'd':
+		args->dedup = 1;
+		break;
 	    case 'f':
 		args->bpf = optarg;
 		break;
@@ -124,24 +362,57 @@ parse_args(
 		usage(argv[0]);
 		exit(0);
 		break;
-	    case 's':
-		if (span_cnt >= MAX_SPANS) {
-		    fprintf(stderr, "ERROR: %s: too many spans (> %d)\n",
-			    argv[0], MAX_SPANS);
+	    case 'H':
+		args->period = atol(optarg);
+		if (args->period < 1) {
+		    fprintf(stderr, "ERROR: %s: bad period [%s]\n",
+			    argv[0], optarg);
 		    exit(1);
 		}
+		break;
+	    case 'm':
+		args->merge = 1;
+		break;
+	    case 'o':
+		args->template = optarg;
+		break;
+	    case 's':
 		span_descriptions[span_cnt++] = optarg;
 		break;
+	    case 'Z':
+		args->n_zthreads = atoi(optarg);
+		if (args->n_zthreads < 0) {
+		    fprintf(stderr, "ERROR: %s: bad number of threads [%s]\n",
+			    argv[0], optarg);
+		    exit(1);
+		}
+		break;
 	    default:
 		/* OOPS -- should not happen */
 		return -1;
 	}
     }
 
+    if (args->dedup && !args->merge) {
+	fprintf(stderr, "ERROR: %s: -d requires -m\n", argv[0]);
+	return -1;
+    }
+    if (args->period != 0 && args->template == NULL) {
+	fprintf(stderr, "ERROR: %s: -H requires -o\n", argv[0]);
+	return -1;
+    }
+
     if (argc > optind) {
 	args->infile_names = (char **) argv + optind;
     }
 
+    args->spans = calloc(span_cnt + 1, sizeof(tsplit_span_t));
+    if (args->spans == NULL) {
+	fprintf(stderr, "ERROR: malloc failed\n");
+	return -1;
+    }
+    args->n_spans = span_cnt;
+
     for (unsigned int i = 0; i < span_cnt; i++) {
 	/* make these much longer than necessary, so we don't
 	 * need to worry about overrunning them in any plausible
@@ -199,7 +470,189 @@ parse_args(
 	args->spans[i].output = NULL;
     }
 
-    return 0;
+    free(span_descriptions);
+
+    return build_index(args);
+}
+
+/*
+ * Create the output pcap fname, with the given link type, compressed
+ * if the name has a suffix that zout understands.
+ *
+ * Returns the dumper, or NULL on failure.
+ */
+static pcap_dumper_t *
+open_output(
+	tsplit_args_t *args,
+	const char *fname,
+	int link_type)
+{
+    pcap_t *pcap_out = pcap_open_dead(link_type, 65536);
+    pcap_dumper_t *dumper;
+
+    zout_codec_t codec = zout_codec_from_fname(fname);
+    if (codec != ZOUT_CODEC_NONE) {
+	if (args->zpool == NULL) {
+	    args->zpool = zout_pool_create(args->n_zthreads);
+	    if (args->zpool == NULL) {
+		return NULL;
+	    }
+	}
+
+	FILE *fout = zout_fopen(fname, codec, 0, args->zpool);
+	if (fout == NULL) {
+	    return NULL;
+	}
+	dumper = pcap_dump_fopen(pcap_out, fout);
+    }
+    else {
+	dumper = pcap_dump_open(pcap_out, fname);
+    }
+    if (dumper == NULL) {
+	fprintf(stderr, "ERROR: cannot create [%s]\n", fname);
+    }
+
+    return dumper;
+}
+
+/*
+ * Find the output for the -H period that starts at start, creating it
+ * if it doesn't exist yet.
+ *
+ * Returns the dumper, or NULL on failure.
+ */
+static pcap_dumper_t *
+find_period(
+	tsplit_args_t *args,
+	int64_t start)
+{
+    uint32_t n = args->n_periods;
+
+    /* Packets usually arrive in time order, so check the period of
+     * the previous packet first
+     */
+    if (n > 0 && args->periods[args->last_period].start == start) {
+	return args->periods[args->last_period].output;
+    }
+
+    uint32_t lo = 0;
+    uint32_t hi = n;
+    while (lo < hi) {
+	uint32_t mid = lo + ((hi - lo) / 2);
+
+	if (args->periods[mid].start < start) {
+	    lo = mid + 1;
+	}
+	else {
+	    hi = mid;
+	}
+    }
+
+    if (lo < n && args->periods[lo].start == start) {
+	if (args->periods[lo].output == NULL) {
+	    fprintf(stderr,
+		    "ERROR: input out of time order: period [%s] "
+		    "is already closed\n", args->periods[lo].fname);
+	    return NULL;
+	}
+	args->last_period = lo;
+	return args->periods[lo].output;
+    }
+
+    if (args->period != 0 &&
+	    (start + args->period) * 1000000 <= args->closed_before) {
+	fprintf(stderr,
+		"ERROR: input out of time order: the period that starts "
+		"at %lld has already ended\n", (long long) start);
+	return NULL;
+    }
+
+    /* This is a new period: make its name, and create its output */
+    char fname[PATH_MAX];
+    time_t t = start;
+    struct tm tm;
+
+    localtime_r(&t, &tm);
+    if (args->period == 0) {
+	/* Without -H, all of the packets go to one output */
+	if (strlen(args->template) >= sizeof(fname)) {
+	    fprintf(stderr, "ERROR: output name too long [%s]\n",
+		    args->template);
+	    return NULL;
+	}
+	strcpy(fname, args->template);
+    }
+    else if (strftime(fname, sizeof(fname), args->template, &tm) == 0) {
+	fprintf(stderr, "ERROR: bad output template [%s]\n", args->template);
+	return NULL;
+    }
+
+    for (uint32_t i = 0; i < n; i++) {
+	if (!strcmp(args->periods[i].fname, fname)) {
+	    fprintf(stderr,
+		    "ERROR: output template [%s] gives the same name [%s] "
+		    "to more than one period\n", args->template, fname);
+	    return NULL;
+	}
+    }
+
+    if (n == args->max_periods) {
+	uint32_t max_periods = (n == 0) ? 64 : 2 * n;
+	tsplit_period_t *periods = realloc(args->periods,
+		max_periods * sizeof(tsplit_period_t));
+
+	if (periods == NULL) {
+	    fprintf(stderr, "ERROR: malloc failed\n");
+	    return NULL;
+	}
+	args->periods = periods;
+	args->max_periods = max_periods;
+    }
+
+    tsplit_period_t period;
+
+    period.start = start;
+    period.fname = strdup(fname);
+    period.output = open_output(args, fname, args->link_type);
+    if (period.fname == NULL || period.output == NULL) {
+	return NULL;
+    }
+
+    memmove(&args->periods[lo + 1], &args->periods[lo],
+	    (n - lo) * sizeof(tsplit_period_t));
+    args->periods[lo] = period;
+    args->n_periods++;
+    args->last_period = lo;
+
+    return period.output;
+}
+
+/*
+ * Close the outputs of the -H periods that end at or before ts (in
+ * microseconds since the epoch).  This is only safe when there are no
+ * more packets earlier than ts, as in the merge (-m).
+ */
+static void
+close_periods(
+	tsplit_args_t *args,
+	int64_t ts)
+{
+
+    if (args->period == 0 || ts <= args->closed_before) {
+	return;
+    }
+    args->closed_before = ts;
+
+    while (args->first_open < args->n_periods) {
+	tsplit_period_t *period = &args->periods[args->first_open];
+
+	if ((period->start + args->period) * 1000000 > ts) {
+	    break;
+	}
+	pcap_dump_close(period->output);
+	period->output = NULL;
+	args->first_open++;
+    }
 }
 
 static void
@@ -208,60 +661,101 @@ handler(
 	const struct pcap_pkthdr *pkthdr,
 	const unsigned char *packet)
 {
-    handler_args_t *args = (handler_args_t *) user;
+    handler_args_t *hargs = (handler_args_t *) user;
+    tsplit_args_t *args = hargs->args;
+    tsplit_index_t *index = &args->index;
+    int64_t ts = tv2usec(&pkthdr->ts);
 
-    for (unsigned int i = 0; i < MAX_SPANS; i++) {
-	tsplit_span_t *span = &(args->spans[i]);
-	if (span->output == NULL) {
-	    break;
+    if (index->n_bounds > 1) {
+	uint32_t k = index->last;
+
+	/* Packets usually arrive in time order, so check the
+	 * interval of the previous packet first
+	 */
+	if (!(ts >= index->bounds[k] && ts < index->bounds[k + 1])) {
+	    int64_t found = find_bound(index->bounds, index->n_bounds, ts);
+
+	    if (found < 0 || found >= index->n_bounds - 1) {
+		k = UINT32_MAX;
+	    }
+	    else {
+		k = index->last = found;
+	    }
+	}
+
+	if (k != UINT32_MAX) {
+	    for (uint32_t i = index->first[k]; i < index->first[k + 1]; i++) {
+		tsplit_span_t *span = &(args->spans[index->refs[i]]);
+
+		pcap_dump((u_char *) span->output, pkthdr, packet);
+	    }
 	}
+    }
+
+    if (args->template != NULL) {
+	int64_t start = 0;
+
+	if (args->period != 0) {
+	    int64_t sec = pkthdr->ts.tv_sec;
 
-	if (timercmp(&pkthdr->ts, &span->start_ts, >=) &&
-		timercmp(&pkthdr->ts, &span->end_ts, <)) {
-	    pcap_dump((u_char *) span->output, pkthdr, packet);
+	    start = sec - (((sec % args->period) + args->period) %
+		    args->period);
 	}
+
+	pcap_dumper_t *output = find_period(args, start);
+
+	if (output == NULL) {
+	    hargs->failed = 1;
+	    if (hargs->in_pcap != NULL) {
+		pcap_breakloop(hargs->in_pcap);
+	    }
+	    return;
+	}
+	pcap_dump((u_char *) output, pkthdr, packet);
     }
 
     return;
 }
 
+/*
+ * Prepare to read from pcap: open the outputs (if they haven't been
+ * opened already), and install the BPF filter (if any) in filter.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
 static int
-read_file(
-	FILE *fin,
-	tsplit_args_t *args)
+prepare_input(
+	pcap_t *pcap,
+	tsplit_args_t *args,
+	struct bpf_program *filter)
 {
-    char errbuf[PCAP_ERRBUF_SIZE];
-    int result = 0;
     int rc;
 
-    pcap_t *pcap = pcap_fopen_offline(fin, errbuf);
-    if (pcap == NULL) {
-	fprintf(stderr, "ERROR: [%s]\n", errbuf);
-	return -1;
+    /*
+     * We use the same output DLT for all of the outputs as the
+     * FIRST input stream -- even though different input streams
+     * might use different DLTs
+     */
+    if (args->link_type < 0) {
+	args->link_type = pcap_datalink(pcap);
     }
 
-    int link_type = pcap_datalink(pcap);
-
     /*
      * If we haven't already opened the output pcaps, then do
      * so now.  We delay opening the output until after we've
      * opened the input, so we can use the same DLT for the ouput
-     * and the input (we always use the same output DLT as the
-     * FIRST input stream -- even though different input streams
-     * might use different DLTs)
+     * and the input.
      */
-    for (unsigned int i = 0; i < MAX_SPANS; i++) {
-	if (args->spans[i].fname == NULL) {
-	    break;
+    for (unsigned int i = 0; i < args->n_spans; i++) {
+	if (args->spans[i].output != NULL) {
+	    continue;
 	}
-	pcap_t *pcap_out = pcap_open_dead(link_type, 65536);
-	pcap_dumper_t *dumper = pcap_dump_open(
-		pcap_out, args->spans[i].fname);
-	if (dumper == NULL) {
+
+	args->spans[i].output = open_output(args, args->spans[i].fname,
+		args->link_type);
+	if (args->spans[i].output == NULL) {
 	    return -1;
 	}
-
-	args->spans[i].output = dumper;
     }
 
     /* TODO: see if we can compile this once and then use it for
@@ -271,25 +765,47 @@ read_file(
      * overhead to recompile it for each, but it would be nice to know)
      */
 
-    struct bpf_program filter;
     if (args->bpf != NULL) {
-	rc = pcap_compile(pcap, &filter, args->bpf, 1, PCAP_NETMASK_UNKNOWN);
+	rc = pcap_compile(pcap, filter, args->bpf, 1, PCAP_NETMASK_UNKNOWN);
 	if (rc != 0) {
 	    fprintf(stderr, "ERROR: filter failed\n");
 	    return -1;
 	}
-	rc = pcap_setfilter(pcap, &filter);
+	rc = pcap_setfilter(pcap, filter);
 	if (rc != 0) {
 	    fprintf(stderr, "ERROR: setfilter failed\n");
 	    return -1;
 	}
     }
 
+    return 0;
+}
+
+static int
+read_file(
+	FILE *fin,
+	tsplit_args_t *args)
+{
+    char errbuf[PCAP_ERRBUF_SIZE];
+    int result = 0;
+
+    pcap_t *pcap = pcap_fopen_offline(fin, errbuf);
+    if (pcap == NULL) {
+	fprintf(stderr, "ERROR: [%s]\n", errbuf);
+	return -1;
+    }
+
+    struct bpf_program filter;
+    if (prepare_input(pcap, args, &filter) != 0) {
+	return -1;
+    }
+
     handler_args_t handler_args = {
-	pcap, args->spans
+	pcap, args, 0
     };
 
-    if (pcap_loop(pcap, -1, handler, (u_char *) &handler_args) < 0) {
+    if (pcap_loop(pcap, -1, handler, (u_char *) &handler_args) < 0 ||
+	    handler_args.failed) {
 	/* TODO: if there's an error, can we get the errstr and print it? */
 	fprintf(stderr, "ERROR: pcap_loop failed\n");
 	result = -1;
@@ -351,13 +867,17 @@ do_popen(
     return fin;
 }
 
-static int
-read_file_by_name(
-	char *fname,
-	tsplit_args_t *args)
+/*
+ * Open the input file fname, decompressing it (via a pipe from the
+ * appropriate decompressor) if its name has a compression suffix.
+ *
+ * Returns the FILE, or NULL on failure.
+ */
+static FILE *
+open_input(
+	char *fname)
 {
     FILE *fin = NULL;
-    int rc;
 
     if (strendswith(fname, ".gz")) {
 	fin = do_popen(fname, "/bin/gunzip -c");
@@ -378,6 +898,20 @@ read_file_by_name(
     if (fin == NULL) {
 	fprintf(stderr, "ERROR: cannot open [%s]: %s\n",
 		fname, strerror(errno));
+    }
+
+    return fin;
+}
+
+static int
+read_file_by_name(
+	char *fname,
+	tsplit_args_t *args)
+{
+    FILE *fin = open_input(fname);
+    int rc;
+
+    if (fin == NULL) {
 	return -1;
     }
 
@@ -391,6 +925,260 @@ read_file_by_name(
     return rc;
 }
 
+/*
+ * The merge (-m) reads all of the inputs at once, and always handles
+ * the packet with the earliest timestamp next, so the packets are
+ * handled in time order even if the inputs overlap (as long as each
+ * input is in time order itself).  The inputs are kept in a binary
+ * heap ordered by the timestamp of the next packet of each input, so
+ * each packet costs O(log N) for N inputs, and only the next packet of
+ * each input is kept in memory.
+ */
+
+typedef struct {
+    pcap_t *pcap;
+    struct bpf_program filter;
+    struct pcap_pkthdr *pkthdr;	/* the next packet */
+    const u_char *packet;
+    int64_t ts;			/* the timestamp of the next packet */
+    uint32_t order;		/* the position of the input on the cmdline */
+} merge_input_t;
+
+/*
+ * The packets that have been handled with the current timestamp, for
+ * finding exact duplicates (-d).  Each record is the caplen and len of
+ * a packet, followed by its bytes.
+ */
+typedef struct {
+    int64_t ts;
+    uint8_t *buf;
+    size_t len;
+    size_t size;
+} merge_dups_t;
+
+static inline int
+merge_before(
+	const merge_input_t *a,
+	const merge_input_t *b)
+{
+
+    return (a->ts < b->ts) || (a->ts == b->ts && a->order < b->order);
+}
+
+static void
+heap_down(
+	merge_input_t **heap,
+	uint32_t n,
+	uint32_t i)
+{
+
+    for (;;) {
+	uint32_t min = i;
+	uint32_t left = (2 * i) + 1;
+	uint32_t right = left + 1;
+
+	if (left < n && merge_before(heap[left], heap[min])) {
+	    min = left;
+	}
+	if (right < n && merge_before(heap[right], heap[min])) {
+	    min = right;
+	}
+	if (min == i) {
+	    return;
+	}
+
+	merge_input_t *tmp = heap[i];
+	heap[i] = heap[min];
+	heap[min] = tmp;
+	i = min;
+    }
+}
+
+/*
+ * Read the next packet of in.
+ *
+ * Returns 1 if there is a packet, 0 at the end of the input, or -1 on
+ * failure.
+ */
+static int
+merge_next(
+	merge_input_t *in)
+{
+    int rc = pcap_next_ex(in->pcap, &in->pkthdr, &in->packet);
+
+    if (rc == 1) {
+	in->ts = tv2usec(&in->pkthdr->ts);
+	return 1;
+    }
+    else if (rc == PCAP_ERROR_BREAK) {
+	return 0;
+    }
+    else {
+	fprintf(stderr, "ERROR: could not read input: %s\n",
+		pcap_geterr(in->pcap));
+	return -1;
+    }
+}
+
+/*
+ * Returns 1 if the packet is an exact duplicate (the same timestamp,
+ * lengths, and bytes) of a packet that has already been handled, or 0
+ * otherwise (in which case it's remembered).  Returns -1 on failure.
+ */
+static int
+merge_is_dup(
+	merge_dups_t *dups,
+	int64_t ts,
+	const struct pcap_pkthdr *pkthdr,
+	const u_char *packet)
+{
+    uint32_t lens[2] = { pkthdr->caplen, pkthdr->len };
+
+    if (ts != dups->ts) {
+	dups->ts = ts;
+	dups->len = 0;
+    }
+
+    size_t off = 0;
+    while (off < dups->len) {
+	uint32_t rec_lens[2];
+
+	memcpy(rec_lens, dups->buf + off, sizeof(rec_lens));
+	off += sizeof(rec_lens);
+	if (rec_lens[0] == lens[0] && rec_lens[1] == lens[1] &&
+		!memcmp(dups->buf + off, packet, lens[0])) {
+	    return 1;
+	}
+	off += rec_lens[0];
+    }
+
+    size_t need = dups->len + sizeof(lens) + lens[0];
+    if (need > dups->size) {
+	size_t size = (need > 2 * dups->size) ? need : 2 * dups->size;
+	uint8_t *buf = realloc(dups->buf, size);
+
+	if (buf == NULL) {
+	    fprintf(stderr, "ERROR: malloc failed\n");
+	    return -1;
+	}
+	dups->buf = buf;
+	dups->size = size;
+    }
+
+    memcpy(dups->buf + dups->len, lens, sizeof(lens));
+    memcpy(dups->buf + dups->len + sizeof(lens), packet, lens[0]);
+    dups->len = need;
+
+    return 0;
+}
+
+static int
+merge_files(
+	tsplit_args_t *args)
+{
+    uint32_t n_inputs = 0;
+    int result = 0;
+
+    while (args->infile_names[n_inputs] != NULL) {
+	n_inputs++;
+    }
+
+    merge_input_t *inputs = calloc(n_inputs, sizeof(merge_input_t));
+    merge_input_t **heap = calloc(n_inputs, sizeof(merge_input_t *));
+    if (inputs == NULL || heap == NULL) {
+	fprintf(stderr, "ERROR: malloc failed\n");
+	return -1;
+    }
+
+    uint32_t n_heap = 0;
+    for (uint32_t i = 0; i < n_inputs; i++) {
+	char errbuf[PCAP_ERRBUF_SIZE];
+	FILE *fin = open_input(args->infile_names[i]);
+
+	if (fin == NULL) {
+	    return -1;
+	}
+
+	inputs[i].order = i;
+	inputs[i].pcap = pcap_fopen_offline(fin, errbuf);
+	if (inputs[i].pcap == NULL) {
+	    fprintf(stderr, "ERROR: [%s]: [%s]\n",
+		    args->infile_names[i], errbuf);
+	    return -1;
+	}
+	if (prepare_input(inputs[i].pcap, args, &inputs[i].filter) != 0) {
+	    return -1;
+	}
+
+	int rc = merge_next(&inputs[i]);
+	if (rc < 0) {
+	    return -1;
+	}
+	else if (rc > 0) {
+	    heap[n_heap++] = &inputs[i];
+	}
+    }
+
+    for (int64_t i = ((int64_t) n_heap / 2) - 1; i >= 0; i--) {
+	heap_down(heap, n_heap, i);
+    }
+
+    merge_dups_t dups = { INT64_MIN, NULL, 0, 0 };
+    handler_args_t handler_args = {
+	NULL, args, 0
+    };
+
+    while (n_heap > 0) {
+	merge_input_t *in = heap[0];
+	int dup = 0;
+
+	if (args->dedup) {
+	    dup = merge_is_dup(&dups, in->ts, in->pkthdr, in->packet);
+	    if (dup < 0) {
+		result = -1;
+		break;
+	    }
+	}
+	if (!dup) {
+	    handler((u_char *) &handler_args, in->pkthdr, in->packet);
+	    if (handler_args.failed) {
+		result = -1;
+		break;
+	    }
+	}
+
+	int rc = merge_next(in);
+	if (rc < 0) {
+	    result = -1;
+	    break;
+	}
+	else if (rc == 0) {
+	    heap[0] = heap[--n_heap];
+	}
+	heap_down(heap, n_heap, 0);
+
+	/* All of the remaining packets are at or after the next one,
+	 * so the periods that end before it are finished
+	 */
+	if (n_heap > 0) {
+	    close_periods(args, heap[0]->ts);
+	}
+    }
+
+    for (uint32_t i = 0; i < n_inputs; i++) {
+	pcap_close(inputs[i].pcap);
+	if (args->bpf != NULL) {
+	    pcap_freecode(&inputs[i].filter);
+	}
+    }
+
+    free(dups.buf);
+    free(heap);
+    free(inputs);
+
+    return result;
+}
+
 int
 main(
 	int argc,
@@ -406,6 +1194,9 @@ main(
     if (args.infile_names == NULL) {
 	rc = read_file(stdin, &args);
     }
+    else if (args.merge) {
+	rc = merge_files(&args);
+    }
     else {
 	for (unsigned int i = 0; args.infile_names[i] != NULL; i++) {
 
@@ -420,12 +1211,19 @@ main(
 	}
     }
 
-    for (unsigned int i = 0; i < MAX_SPANS; i++) {
-	if (args.spans[i].fname == NULL) {
-	    break;
+    for (unsigned int i = 0; i < args.n_spans; i++) {
+	if (args.spans[i].output != NULL) {
+	    pcap_dump_close(args.spans[i].output);
 	}
-	pcap_dump_close(args.spans[i].output);
     }
+    for (unsigned int i = 0; i < args.n_periods; i++) {
+	if (args.periods[i].output != NULL) {
+	    pcap_dump_close(args.periods[i].output);
+	}
+	free(args.periods[i].fname);
+    }
+
+    zout_pool_destroy(args.zpool);
 
     return rc;
 }
@@ -0,0 +1,228 @@
+/* CODEMARK: nice-ibr */
+/*
+ * Copyright (C) 2020-2024 - Raytheon BBN Technologies Corp.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0.
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+ *
+ * Distribution Statement "A" (Approved for Public Release,
+ * Distribution Unlimited).
+ *
+ * This material is based upon work supported by the Defense
+ * Advanced Research Projects Agency (DARPA) under Contract No.
+ * HR001119C0102.  The opinions, findings, and conclusions stated
+ * herein are those of the authors and do not necessarily reflect
+ * those of DARPA.
+ *
+ * In the event permission is required, DARPA is authorized to
+ * reproduce the copyrighted material for use as an exhibit or
+ * handout at DARPA-sponsored events and/or to post the material
+ * on the DARPA website.
+ */
+/* CODEMARK: end */
+
+#include <pcap.h>
+
+#include "pktdecode.h"
+
+#define PKTD_ETHERTYPE_IP	(0x0800)
+#define PKTD_ETHERTYPE_VLAN	(0x8100)
+#define PKTD_ETHERTYPE_QINQ	(0x88a8)
+#define PKTD_ETHERTYPE_QINQ_OLD	(0x9100)
+
+/* The offset of the ethertype in an Ethernet header */
+#define PKTD_ETHER_TYPE_OFF	(12)
+
+/* The length of a VLAN tag (and the TPID that precedes it) */
+#define PKTD_VLAN_TAG_LEN	(4)
+
+/* The length of, and offset of the protocol in, a Linux SLL header */
+#define PKTD_SLL_HDR_LEN	(16)
+#define PKTD_SLL_PROTO_OFF	(14)
+
+/* The LINKTYPE_* values used in pcap file headers */
+#define PKTD_LINKTYPE_ETHERNET	(1)
+#define PKTD_LINKTYPE_RAW	(101)
+#define PKTD_LINKTYPE_LINUX_SLL	(113)
+
+/*
+ * Return non-zero if packets with the given DLT can be decoded
+ */
+int
+pktd_link_supported(
+	int dlt)
+{
+
+    switch (dlt) {
+	case DLT_EN10MB:
+	case DLT_RAW:
+	case DLT_LINUX_SLL:
+	    return 1;
+	default:
+	    return 0;
+    }
+}
+
+/*
+ * Convert the LINKTYPE_* value in the header of a pcap file (for
+ * tools that read pcap files without libpcap) to the corresponding
+ * DLT_* value, or -1 if it's not a supported link type.
+ *
+ * Most LINKTYPE_* values are the same as their DLT_* values, but
+ * not DLT_RAW, which varies from platform to platform.
+ */
+int
+pktd_linktype2dlt(
+	uint32_t linktype)
+{
+
+    switch (linktype) {
+	case PKTD_LINKTYPE_ETHERNET:
+	    return DLT_EN10MB;
+	case PKTD_LINKTYPE_RAW:
+	    return DLT_RAW;
+	case PKTD_LINKTYPE_LINUX_SLL:
+	    return DLT_LINUX_SLL;
+	default:
+	    return -1;
+    }
+}
+
+/*
+ * Returns the offset, into the packet, of the start of the IPv4
+ * header (i.e. the length of the link header, including any VLAN
+ * tags), or -1 if the packet isn't IPv4 or the link header wasn't
+ * completely captured.
+ */
+int
+pktd_ip_offset(
+	int dlt,
+	const uint8_t *packet,
+	uint32_t caplen)
+{
+
+    switch (dlt) {
+	case DLT_EN10MB: {
+	    uint32_t off = PKTD_ETHER_TYPE_OFF;
+
+	    for (int i = 0; ; i++) {
+		if (caplen < off + 2) {
+		    return -1;
+		}
+
+		uint16_t ether_type = pktd_get16(packet + off);
+		if (ether_type == PKTD_ETHERTYPE_IP) {
+		    return off + 2;
+		}
+		else if (((ether_type != PKTD_ETHERTYPE_VLAN) &&
+			    (ether_type != PKTD_ETHERTYPE_QINQ) &&
+			    (ether_type != PKTD_ETHERTYPE_QINQ_OLD)) ||
+			(i == PKTD_MAX_VLAN_TAGS)) {
+		    return -1;
+		}
+		off += PKTD_VLAN_TAG_LEN;
+	    }
+	}
+	case DLT_RAW:
+	    /* The packet might be IPv6 */
+	    if ((caplen < 1) || ((packet[0] >> 4) != 4)) {
+		return -1;
+	    }
+	    return 0;
+	case DLT_LINUX_SLL:
+	    if ((caplen < PKTD_SLL_HDR_LEN) ||
+		    (pktd_get16(packet + PKTD_SLL_PROTO_OFF) !=
+		     PKTD_ETHERTYPE_IP)) {
+		return -1;
+	    }
+	    return PKTD_SLL_HDR_LEN;
+	default:
+	    return -1;
+    }
+}
+
+/*
+ * Decode the link and IPv4 headers of the packet (of which caplen
+ * bytes were captured) into ip.  Returns 0 if the packet is IPv4,
+ * its header length is valid (at least 5 words), and at least a
+ * minimal IP header was captured, or -1 otherwise (in which case
+ * ip->ip is set to NULL).
+ *
+ * The IP options and the next header might not have been captured,
+ * so the caller must check ip->l4_caplen before reading from l4.
+ */
+int
+pktd_decode(
+	int dlt,
+	const uint8_t *packet,
+	uint32_t caplen,
+	pktd_ip_t *ip)
+{
+    int off = pktd_ip_offset(dlt, packet, caplen);
+
+    if ((off < 0) || (caplen - off < PKTD_MIN_IP_HDR_LEN)) {
+	ip->ip = NULL;
+	return -1;
+    }
+
+    const uint8_t *hdr = packet + off;
+    uint32_t hdr_len;
+
+    /* A header length of less than 5 words is bogus, and would put
+     * l4 inside the fixed part of the IP header
+     */
+    if ((hdr[0] & 0xf) < 5) {
+	ip->ip = NULL;
+	return -1;
+    }
+
+    ip->ip = hdr;
+    ip->ip_caplen = caplen - off;
+    ip->ip_hl = hdr[0] & 0xf;
+    ip->ip_len = pktd_get16(hdr + 2);
+    ip->ipid = pktd_get16(hdr + 4);
+    ip->ip_off = pktd_get16(hdr + 6);
+    ip->ttl = hdr[8];
+    ip->proto = hdr[9];
+    ip->ip_sum = pktd_get16(hdr + 10);
+    ip->saddr = pktd_get32(hdr + 12);
+    ip->daddr = pktd_get32(hdr + 16);
+
+    hdr_len = ip->ip_hl * 4;
+    ip->l4 = hdr + hdr_len;
+    ip->l4_caplen = (ip->ip_caplen > hdr_len) ? ip->ip_caplen - hdr_len : 0;
+
+    return 0;
+}
+
+/*
+ * Decode n_pkts packets at once, all with the same DLT.  The result
+ * for packets[i] (of which caplens[i] bytes were captured) is stored
+ * in ips[i], just as pktd_decode would.  Returns the number of
+ * packets that were decoded; the others have ips[i].ip set to NULL.
+ */
+size_t
+pktd_decode_batch(
+	int dlt,
+	size_t n_pkts,
+	const uint8_t *const *packets,
+	const uint32_t *caplens,
+	pktd_ip_t *ips)
+{
+    size_t n_decoded = 0;
+
+    for (size_t i = 0; i < n_pkts; i++) {
+	n_decoded += (pktd_decode(dlt, packets[i], caplens[i], &ips[i]) == 0);
+    }
+
+    return n_decoded;
+}
@@ -0,0 +1,106 @@
+#ifndef _PKTDECODE_H_
+#define _PKTDECODE_H_ 1
+
+/* CODEMARK: nice-ibr */
+/*
+ * Copyright (C) 2020-2024 - Raytheon BBN Technologies Corp.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0.
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+ *
+ * Distribution Statement "A" (Approved for Public Release,
+ * Distribution Unlimited).
+ *
+ * This material is based upon work supported by the Defense
+ * Advanced Research Projects Agency (DARPA) under Contract No.
+ * HR001119C0102.  The opinions, findings, and conclusions stated
+ * herein are those of the authors and do not necessarily reflect
+ * those of DARPA.
+ *
+ * In the event permission is required, DARPA is authorized to
+ * reproduce the copyrighted material for use as an exhibit or
+ * handout at DARPA-sponsored events and/or to post the material
+ * on the DARPA website.
+ */
+/* CODEMARK: end */
+
+/*
+ * Shared decoding of the link and IPv4 headers of captured packets,
+ * for all of the tools that read pcap files.
+ *
+ * The supported link types are DLT_EN10MB (with up to
+ * PKTD_MAX_VLAN_TAGS stacked 802.1Q/802.1ad VLAN tags), DLT_RAW,
+ * and DLT_LINUX_SLL.  Only IPv4 packets are decoded; every
+ * other packet is rejected.
+ *
+ * Decoding doesn't copy anything: the result is a view of the packet
+ * that points into the captured bytes, with the fields of the IPv4
+ * header that every tool needs already converted to host byte order,
+ * and with the number of bytes captured after the start of the IP
+ * header and after the start of the next header, so that each tool
+ * can check that the bytes it needs are actually there before it
+ * reads them.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define PKTD_MAX_VLAN_TAGS	(8)
+
+/* The number of bytes in an IPv4 header without options */
+#define PKTD_MIN_IP_HDR_LEN	(20)
+
+typedef struct {
+    const uint8_t *ip;		/* the start of the IPv4 header */
+    const uint8_t *l4;		/* the start of the next header */
+    uint32_t ip_caplen;		/* bytes captured, starting at ip */
+    uint32_t l4_caplen;		/* bytes captured, starting at l4 */
+    uint32_t saddr;
+    uint32_t daddr;
+    uint16_t ip_len;		/* the total length, from the IP header */
+    uint16_t ipid;
+    uint16_t ip_off;		/* the flags and fragment offset */
+    uint16_t ip_sum;
+    uint8_t ip_hl;		/* header length, in 32-bit words */
+    uint8_t ttl;
+    uint8_t proto;
+} pktd_ip_t;
+
+extern int pktd_link_supported(int dlt);
+extern int pktd_linktype2dlt(uint32_t linktype);
+extern int pktd_ip_offset(int dlt, const uint8_t *packet, uint32_t caplen);
+extern int pktd_decode(
+	int dlt, const uint8_t *packet, uint32_t caplen, pktd_ip_t *ip);
+extern size_t pktd_decode_batch(
+	int dlt, size_t n_pkts,
+	const uint8_t *const *packets, const uint32_t *caplens,
+	pktd_ip_t *ips);
+
+/* Fetch an unaligned 16 or 32-bit value in network byte order */
+
+static inline uint16_t
+pktd_get16(
+	const uint8_t *p)
+{
+
+    return (p[0] << 8) | p[1];
+}
+
+static inline uint32_t
+pktd_get32(
+	const uint8_t *p)
+{
+
+    return ((uint32_t) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+#endif /* _PKTDECODE_H_ */
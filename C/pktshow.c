@@ -45,7 +45,8 @@
 #include <net/ethernet.h>
 
 #include <pcap/pcap.h>
-#include <pcap/sll.h>
+
+#include "pktdecode.h"
 
 /*
 
@@ -94,7 +95,6 @@ typedef struct {
 
 typedef struct {
     int link_type;
-    int header_len;
     pktshow_field_code_t field_code;
     pcap_t *pcap;
 } handler_args_t;
@@ -176,6 +176,7 @@ handler(
 	const unsigned char *packet)
 {
     handler_args_t *args = (handler_args_t *) user;
+    pktd_ip_t ip;
 
     /*
      * Some packets are broken, and even if the caplen is long
@@ -184,39 +185,17 @@ handler(
      *
      * We're parsing an IPv4 packet, so it must have AT LEAST 20 bytes
      * after the link header has been removed to hold a header (without
-     * any options).
+     * any options), and then the 4 bytes that follow the IP header
+     * (because we need them for sport and dport)
      *
      * If the packet is too short, we just drop it.
      */
-
-    if (pkthdr->caplen < (args->header_len + 20)) {
+    if ((pktd_decode(args->link_type, packet, pkthdr->caplen, &ip) != 0) ||
+	    (ip.l4_caplen < 4)) {
 	return;
     }
 
-    struct ip *ip_header = (struct ip *) (packet + args->header_len);
-
-    /*
-     * Now we know that we have at least the start of the ip_header.
-     * Let's see whether we have enough for the whole header, and then
-     * the 4 bytes that follow the IP header (because we need them
-     * for sport and dport)
-     *
-     * If not, just drop it.
-     */
-    if (pkthdr->caplen < (args->header_len + (ip_header->ip_hl * 4) + 4)) {
-	/* printf("cap %d too short 2 %d %d %d\n",
-		ip_header->ip_p, pkthdr->caplen,
-		ip_header->ip_hl, ip_header->ip_p); */
-	return;
-    }
-
-    uint32_t saddr = ntohl(ip_header->ip_src.s_addr);
-    uint32_t daddr = ntohl(ip_header->ip_dst.s_addr);
-    uint8_t proto = ip_header->ip_p;
-    uint16_t len = ntohs(ip_header->ip_len);
-
-    uint16_t *proto_hdr = (uint16_t *)
-            (((unsigned char *) ip_header) + (ip_header->ip_hl * 4));
+    uint8_t proto = ip.proto;
 
     /*
      * For TCP, UDP or SCTP, we read the ports.  For other protocols,
@@ -226,28 +205,15 @@ handler(
     uint16_t sport = 0;
     uint16_t dport = 0;
     if ((proto == 6) || (proto == 17) || (proto == 132)) {
-	/* this is a shortcut -- instead of checking whether the
-	 * complete header is there, we only check whether the part
-	 * of the header that we're going to read is actually there.
-	 */
-	if (pkthdr->caplen < (args->header_len + (ip_header->ip_hl * 4) + 4)) {
-	    return;
-	}
-
-	sport = ntohs(proto_hdr[0]);
-	dport = ntohs(proto_hdr[1]);
+	sport = pktd_get16(ip.l4);
+	dport = pktd_get16(ip.l4 + 2);
     }
     else if (proto == 1) {
-	/* like the shortcut described above -- this is a half-check */
-	if (pkthdr->caplen < (args->header_len + (ip_header->ip_hl * 4) + 2)) {
-	    return;
-	}
-
 	/* This is somewhat backwards, but is bug-compatible with
 	 * other tools.  TODO: should fix consistently everywhere.
 	 */
-	sport = ((uint8_t *) proto_hdr)[0];
-	dport = ((uint8_t *) proto_hdr)[1];
+	sport = ip.l4[0];
+	dport = ip.l4[1];
     }
 
     uint32_t val = 0;
@@ -255,19 +221,19 @@ handler(
 
     switch (args->field_code) {
 	case PKTSHOW_FIELD_TTL:
-	    val = ip_header->ip_ttl; 
+	    val = ip.ttl; 
 	    val_name = "TTL";
 	    break;
 	case PKTSHOW_FIELD_IPID:
-	    val = ntohs(ip_header->ip_id); 
+	    val = ip.ipid; 
 	    val_name = "IPID";
 	    break;
 	case PKTSHOW_FIELD_IPOFF:
-	    val = 0x1fff & ntohs(ip_header->ip_off);
+	    val = 0x1fff & ip.ip_off;
 	    val_name = "OFF";
 	    break;
 	case PKTSHOW_FIELD_HLEN:
-	    val = ip_header->ip_hl;
+	    val = ip.ip_hl;
 	    val_name = "HLEN";
 	    break;
 	default:
@@ -279,9 +245,9 @@ handler(
     }
 
     printf("%u,%u,%u,%u,%u,%ld.%.6ld,%u,%u,%s\n",
-	    saddr, daddr, sport, dport, proto,
+	    ip.saddr, ip.daddr, sport, dport, proto,
 	    pkthdr->ts.tv_sec, pkthdr->ts.tv_usec,
-	    len, val, val_name);
+	    ip.ip_len, val, val_name);
 
     return;
 }
@@ -293,7 +259,6 @@ read_file(
 	char *bpf)
 {
     char errbuf[PCAP_ERRBUF_SIZE];
-    int header_len = 0;
     int result = 0;
     int rc;
 
@@ -305,30 +270,15 @@ read_file(
 
     /*
      * Check that the DLT is one that we know how
-     * to parse, and if so, find the link type header
-     * length.  If we don't understand the data link
+     * to parse.  If we don't understand the data link
      * type, then we have to abandon this pcap.
      */
     int link_type = pcap_datalink(pcap);
-    switch (link_type) {
-	case DLT_EN10MB:
-	    /* There's no mention in the code about how to handle
-	     * a VLAN tag.  TODO: check that EN10MB can't have a
-	     * VLAN tag (or stacked tags, for that matter)
-	     */
-	    header_len = sizeof(struct ether_header);
-	    break;
-	case DLT_RAW:
-	    header_len = 0; /* TODO: double check */
-	    break;
-	case DLT_LINUX_SLL:
-	    header_len = sizeof(struct sll_header);
-	    break;
-	default:
-	    fprintf(stderr, "ERROR: unsupported capture type: %d\n",
-		    link_type);
-	    pcap_close(pcap);
-	    return -1;
+    if (!pktd_link_supported(link_type)) {
+	fprintf(stderr, "ERROR: unsupported capture type: %d\n",
+		link_type);
+	pcap_close(pcap);
+	return -1;
     }
 
     char *filter_str;
@@ -367,7 +317,7 @@ read_file(
     }
 
     handler_args_t handler_args = {
-	link_type, header_len, field_code, pcap
+	link_type, field_code, pcap
     };
 
     if (pcap_loop(pcap, -1, handler, (u_char *) &handler_args) < 0) {
@@ -45,7 +45,8 @@
 #include <net/ethernet.h>
 
 #include <pcap/pcap.h>
-#include <pcap/sll.h>
+
+#include "pktdecode.h"
 
 /*
 Example commandline:
@@ -93,7 +94,6 @@ typedef struct {
 
 typedef struct {
     int link_type;
-    int header_len;
     pcap_t *pcap;
     int frags_only;
     int no_payload;
@@ -170,6 +170,7 @@ handler(
 	const unsigned char *packet)
 {
     handler_args_t *args = (handler_args_t *) user;
+    pktd_ip_t ip;
 
     /*
      * Some packets are broken, and even if the caplen is long
@@ -178,38 +179,20 @@ handler(
      *
      * We're parsing an IPv4 packet, so it must have AT LEAST 20 bytes
      * after the link header has been removed to hold a header (without
-     * any options).
+     * any options), and then the 4 bytes that follow the IP header
+     * (because we need them for sport and dport, or any kind of
+     * protocol-specific info)
      *
      * If the packet is too short, we just drop it.
      */
-
-    if (pkthdr->caplen < (args->header_len + 20)) {
-	return;
-    }
-
-    struct ip *ip_header = (struct ip *) (packet + args->header_len);
-
-    /*
-     * Now we know that we have at least the start of the ip_header.
-     * Let's see whether we have enough for the whole header, and then
-     * the 4 bytes that follow the IP header (because we need them
-     * for sport and dport, or any kind of protocol-specific info)
-     *
-     * If not, just drop it.
-     */
-    if (pkthdr->caplen < (args->header_len + (ip_header->ip_hl * 4) + 4)) {
+    if ((pktd_decode(args->link_type, packet, pkthdr->caplen, &ip) != 0) ||
+	    (ip.l4_caplen < 4)) {
 	return;
     }
 
-    uint32_t saddr = ntohl(ip_header->ip_src.s_addr);
-    uint32_t daddr = ntohl(ip_header->ip_dst.s_addr);
-
-    uint8_t proto = ip_header->ip_p;
-    uint16_t len = ntohs(ip_header->ip_len);
-
-    uint16_t ipid = ntohs(ip_header->ip_id);
-    uint16_t mfrag = (ntohs(ip_header->ip_off) & IP_MF) ? 1: 0;
-    uint16_t offset = 8 * (ntohs(ip_header->ip_off) & IP_OFFMASK);
+    uint8_t proto = ip.proto;
+    uint16_t mfrag = (ip.ip_off & IP_MF) ? 1: 0;
+    uint16_t offset = 8 * (ip.ip_off & IP_OFFMASK);
 
     if (args->frags_only) {
 	if (!mfrag && !offset) {
@@ -217,9 +200,7 @@ handler(
 	}
     }
 
-    uint8_t *ip_base = (uint8_t *) ip_header;
-    uint16_t iph_len = ip_header->ip_hl * 4;
-    uint16_t *proto_hdr = (uint16_t *) (ip_base + iph_len);
+    uint16_t iph_len = ip.ip_hl * 4;
 
     uint16_t sport = 0;
     uint16_t dport = 0;
@@ -240,51 +221,42 @@ handler(
 	 * (but in most cases, we don't do anything right now).
 	 */
 	if ((proto == 6) || (proto == 17) || (proto == 132)) {
-	    /* this is a shortcut -- instead of checking whether the
-	     * complete header is there, we only check whether the part
-	     * of the header that we're going to read is actually there.
-	     */
-	    if (pkthdr->caplen <
-		    (args->header_len + (ip_header->ip_hl * 4) + 4)) {
-		return;
-	    }
-
-	    sport = ntohs(proto_hdr[0]);
-	    dport = ntohs(proto_hdr[1]);
+	    sport = pktd_get16(ip.l4);
+	    dport = pktd_get16(ip.l4 + 2);
 	}
 	else if (proto == 1) {
-	    /* like the shortcut described above -- this is a half-check */
-	    if (pkthdr->caplen < (args->header_len + iph_len + 4)) {
-		return;
-	    }
-
 	    /* This is somewhat backwards, but is bug-compatible with
 	     * other tools.  TODO: should fix consistently everywhere.
 	     */
-	    sport = ((uint8_t *) proto_hdr)[0];
-	    dport = ((uint8_t *) proto_hdr)[1];
+	    sport = ip.l4[0];
+	    dport = ip.l4[1];
 	}
     }
 
     /* It's possible that the packet says that it's longer
      * than what got captured; don't just fly off the end
      */
-    int plen = len - iph_len;
+    int plen = ip.ip_len - iph_len;
     if (plen < 0) {
 	plen = -1;
     }
 
     printf("%u,%u,%u,%u,%u,%ld.%.6ld,%d,%u,%u,%u",
-	    saddr, daddr, sport, dport, proto,
+	    ip.saddr, ip.daddr, sport, dport, proto,
 	    pkthdr->ts.tv_sec, pkthdr->ts.tv_usec,
-	    plen, ipid, mfrag, offset);
+	    plen, ip.ipid, mfrag, offset);
 
     if (!args->no_payload) {
 	printf(",");
 
-	uint8_t *payload = ip_base + iph_len;
-	for (uint16_t i = 0; i < plen; i++) {
-	    printf("%.2x", payload[i]);
+	/* Only print the part of the payload that was captured */
+	uint32_t n_bytes = (plen < 0) ? 0 : plen;
+	if (n_bytes > ip.l4_caplen) {
+	    n_bytes = ip.l4_caplen;
+	}
+
+	for (uint32_t i = 0; i < n_bytes; i++) {
+	    printf("%.2x", ip.l4[i]);
 	}
     }
 
@@ -305,7 +277,6 @@ read_file(
 	char *frag_pcap_fname)
 {
     char errbuf[PCAP_ERRBUF_SIZE];
-    int header_len = 0;
     int result = 0;
     int rc;
 
@@ -317,30 +288,15 @@ read_file(
 
     /*
      * Check that the DLT is one that we know how
-     * to parse, and if so, find the link type header
-     * length.  If we don't understand the data link
+     * to parse.  If we don't understand the data link
      * type, then we have to abandon this pcap.
      */
     int link_type = pcap_datalink(pcap);
-    switch (link_type) {
-	case DLT_EN10MB:
-	    /* There's no mention in the code about how to handle
-	     * a VLAN tag.  TODO: check that EN10MB can't have a
-	     * VLAN tag (or stacked tags, for that matter)
-	     */
-	    header_len = sizeof(struct ether_header);
-	    break;
-	case DLT_RAW:
-	    header_len = 0; /* TODO: double check */
-	    break;
-	case DLT_LINUX_SLL:
-	    header_len = sizeof(struct sll_header);
-	    break;
-	default:
-	    fprintf(stderr, "ERROR: unsupported capture type: %d\n",
-		    link_type);
-	    pcap_close(pcap);
-	    return -1;
+    if (!pktd_link_supported(link_type)) {
+	fprintf(stderr, "ERROR: unsupported capture type: %d\n",
+		link_type);
+	pcap_close(pcap);
+	return -1;
     }
 
     struct bpf_program filter;
@@ -366,7 +322,7 @@ read_file(
     }
 
     handler_args_t handler_args = {
-	link_type, header_len, pcap, frags_only, no_payload,
+	link_type, pcap, frags_only, no_payload,
 	frag_dumper
     };
 
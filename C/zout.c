@@ -0,0 +1,767 @@
+/* CODEMARK: nice-ibr */
+/*
+ * Copyright (C) 2020-2024 - Raytheon BBN Technologies Corp.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0.
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+ *
+ * Distribution Statement "A" (Approved for Public Release,
+ * Distribution Unlimited).
+ *
+ * This material is based upon work supported by the Defense
+ * Advanced Research Projects Agency (DARPA) under Contract No.
+ * HR001119C0102.  The opinions, findings, and conclusions stated
+ * herein are those of the authors and do not necessarily reflect
+ * those of DARPA.
+ *
+ * In the event permission is required, DARPA is authorized to
+ * reproduce the copyrighted material for use as an exhibit or
+ * handout at DARPA-sponsored events and/or to post the material
+ * on the DARPA website.
+ */
+/* CODEMARK: end */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+#ifdef HAVE_LZ4
+#include <lz4frame.h>
+#endif /* HAVE_LZ4 */
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif /* HAVE_ZSTD */
+
+#include "zout.h"
+
+/*
+ * The number of blocks of a stream that may be waiting to be
+ * compressed or written, per thread in the pool, before zout_write
+ * waits for some of them to finish
+ */
+#define ZOUT_BLOCKS_PER_THREAD	(2)
+
+/*
+ * The most blocks of one stream that may be waiting, regardless of
+ * the number of threads, so that a tool that writes many streams at
+ * once doesn't use too much memory
+ */
+#define ZOUT_MAX_PENDING	(16)
+
+typedef struct zout_block {
+    zout_t *z;
+    uint8_t *in;
+    size_t in_len;
+    uint8_t *out;
+    size_t out_len;
+    int done;
+    struct zout_block *next_job;	/* in the pool's queue */
+    struct zout_block *next_pending;	/* in the stream's queue */
+} zout_block_t;
+
+struct zout_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    zout_block_t *job_head;
+    zout_block_t *job_tail;
+    int shutdown;
+
+    int n_threads;
+    pthread_t *threads;
+};
+
+struct zout {
+    int fd;
+    zout_codec_t codec;
+    int level;
+    zout_pool_t *pool;
+
+    /* The block that is being filled by zout_write */
+    zout_block_t *cur;
+
+    /*
+     * The blocks that have been filled but not yet written, in the
+     * order that they must be written
+     */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    zout_block_t *pending_head;
+    zout_block_t *pending_tail;
+    int n_pending;
+    int max_pending;
+    int writing;		/* a thread is writing a block */
+    int error;
+};
+
+static const struct {
+    const char *name;
+    zout_codec_t codec;
+    const char *suffix;
+} zout_codecs[] = {
+    { "none", ZOUT_CODEC_NONE, NULL },
+    { "gzip", ZOUT_CODEC_GZIP, ".gz" },
+    { "lz4", ZOUT_CODEC_LZ4, ".lz4" },
+    { "zstd", ZOUT_CODEC_ZSTD, ".zst" },
+    { NULL, ZOUT_CODEC_NONE, NULL }
+};
+
+/*
+ * Parse a codec spec of the form NAME or NAME:LEVEL, where NAME is
+ * one of none, gzip, lz4, or zstd.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+int
+zout_codec_parse(
+	const char *spec,
+	zout_codec_t *codec,
+	int *level)
+{
+    const char *colon = strchr(spec, ':');
+    size_t name_len = colon ? (size_t) (colon - spec) : strlen(spec);
+
+    *level = 0;
+    if (colon != NULL) {
+	char *endptr;
+
+	*level = strtol(colon + 1, &endptr, 10);
+	if (*endptr != '\0' || *level < 0) {
+	    fprintf(stderr, "ERROR: bad compression level [%s]\n", spec);
+	    return -1;
+	}
+    }
+
+    for (int i = 0; zout_codecs[i].name != NULL; i++) {
+	if (strlen(zout_codecs[i].name) == name_len &&
+		!strncmp(spec, zout_codecs[i].name, name_len)) {
+	    *codec = zout_codecs[i].codec;
+
+	    if (!zout_codec_available(*codec)) {
+		fprintf(stderr, "ERROR: compression [%s] not supported "
+			"by this build\n", zout_codecs[i].name);
+		return -1;
+	    }
+	    return 0;
+	}
+    }
+
+    fprintf(stderr, "ERROR: unknown compression [%s]\n", spec);
+    return -1;
+}
+
+/*
+ * Return the codec implied by the suffix of fname (.gz, .lz4, or
+ * .zst), or ZOUT_CODEC_NONE if it has none of these suffixes
+ */
+zout_codec_t
+zout_codec_from_fname(
+	const char *fname)
+{
+    size_t fname_len = strlen(fname);
+
+    for (int i = 0; zout_codecs[i].name != NULL; i++) {
+	const char *suffix = zout_codecs[i].suffix;
+
+	if (suffix != NULL && fname_len > strlen(suffix) &&
+		!strcmp(fname + fname_len - strlen(suffix), suffix)) {
+	    return zout_codecs[i].codec;
+	}
+    }
+
+    return ZOUT_CODEC_NONE;
+}
+
+int
+zout_codec_available(
+	zout_codec_t codec)
+{
+
+    switch (codec) {
+	case ZOUT_CODEC_NONE:
+	case ZOUT_CODEC_GZIP:
+	    return 1;
+#ifdef HAVE_LZ4
+	case ZOUT_CODEC_LZ4:
+	    return 1;
+#endif /* HAVE_LZ4 */
+#ifdef HAVE_ZSTD
+	case ZOUT_CODEC_ZSTD:
+	    return 1;
+#endif /* HAVE_ZSTD */
+	default:
+	    return 0;
+    }
+}
+
+/*
+ * Compress the input of a block into its output buffer, as one
+ * complete gzip member, lz4 frame, or zstd frame.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+static int
+compress_block(
+	zout_block_t *block)
+{
+    zout_t *z = block->z;
+
+    switch (z->codec) {
+	case ZOUT_CODEC_NONE:
+	    block->out = block->in;
+	    block->out_len = block->in_len;
+	    return 0;
+
+	case ZOUT_CODEC_GZIP: {
+	    z_stream strm;
+	    int level = z->level ? z->level : Z_DEFAULT_COMPRESSION;
+
+	    memset(&strm, 0, sizeof(strm));
+
+	    /* 15 + 16 selects a 32K window, with a gzip wrapper */
+	    if (deflateInit2(&strm, level, Z_DEFLATED, 15 + 16, 8,
+			Z_DEFAULT_STRATEGY) != Z_OK) {
+		return -1;
+	    }
+
+	    size_t bound = deflateBound(&strm, block->in_len);
+	    block->out = malloc(bound);
+	    if (block->out == NULL) {
+		deflateEnd(&strm);
+		return -1;
+	    }
+
+	    strm.next_in = block->in;
+	    strm.avail_in = block->in_len;
+	    strm.next_out = block->out;
+	    strm.avail_out = bound;
+
+	    int rc = deflate(&strm, Z_FINISH);
+	    block->out_len = bound - strm.avail_out;
+	    deflateEnd(&strm);
+
+	    return (rc == Z_STREAM_END) ? 0 : -1;
+	}
+
+#ifdef HAVE_LZ4
+	case ZOUT_CODEC_LZ4: {
+	    LZ4F_preferences_t prefs;
+
+	    memset(&prefs, 0, sizeof(prefs));
+	    prefs.compressionLevel = z->level;
+	    prefs.frameInfo.contentSize = block->in_len;
+
+	    size_t bound = LZ4F_compressFrameBound(block->in_len, &prefs);
+	    block->out = malloc(bound);
+	    if (block->out == NULL) {
+		return -1;
+	    }
+
+	    size_t rc = LZ4F_compressFrame(block->out, bound,
+		    block->in, block->in_len, &prefs);
+	    if (LZ4F_isError(rc)) {
+		return -1;
+	    }
+	    block->out_len = rc;
+
+	    return 0;
+	}
+#endif /* HAVE_LZ4 */
+
+#ifdef HAVE_ZSTD
+	case ZOUT_CODEC_ZSTD: {
+	    int level = z->level ? z->level : ZSTD_CLEVEL_DEFAULT;
+
+	    size_t bound = ZSTD_compressBound(block->in_len);
+	    block->out = malloc(bound);
+	    if (block->out == NULL) {
+		return -1;
+	    }
+
+	    size_t rc = ZSTD_compress(block->out, bound,
+		    block->in, block->in_len, level);
+	    if (ZSTD_isError(rc)) {
+		return -1;
+	    }
+	    block->out_len = rc;
+
+	    return 0;
+	}
+#endif /* HAVE_ZSTD */
+
+	default:
+	    return -1;
+    }
+}
+
+static void
+free_block(
+	zout_block_t *block)
+{
+
+    if (block->out != block->in) {
+	free(block->out);
+    }
+    free(block->in);
+    free(block);
+}
+
+static int
+write_all(
+	int fd,
+	const uint8_t *buf,
+	size_t len)
+{
+    size_t off = 0;
+
+    while (off < len) {
+	ssize_t n = write(fd, buf + off, len - off);
+
+	if (n < 0) {
+	    if (errno == EINTR) {
+		continue;
+	    }
+	    return -1;
+	}
+	off += n;
+    }
+
+    return 0;
+}
+
+/*
+ * Write all of the blocks at the head of the stream's queue that are
+ * done, in order.  Only one thread writes at a time; if another thread
+ * is already writing, it will write any blocks that are done by the
+ * time it finishes its current block.
+ *
+ * Must be called with z->lock held.
+ */
+static void
+write_pending(
+	zout_t *z)
+{
+
+    if (z->writing) {
+	return;
+    }
+
+    z->writing = 1;
+    while (z->pending_head != NULL && z->pending_head->done) {
+	zout_block_t *block = z->pending_head;
+
+	z->pending_head = block->next_pending;
+	if (z->pending_head == NULL) {
+	    z->pending_tail = NULL;
+	}
+
+	pthread_mutex_unlock(&z->lock);
+	int rc = write_all(z->fd, block->out, block->out_len);
+	free_block(block);
+	pthread_mutex_lock(&z->lock);
+
+	if (rc != 0) {
+	    z->error = 1;
+	}
+	z->n_pending--;
+	pthread_cond_broadcast(&z->cond);
+    }
+    z->writing = 0;
+}
+
+/*
+ * Compress a block, mark it done, and write any blocks that are ready
+ */
+static void
+finish_block(
+	zout_block_t *block)
+{
+    zout_t *z = block->z;
+    int rc = compress_block(block);
+
+    pthread_mutex_lock(&z->lock);
+    if (rc != 0) {
+	z->error = 1;
+    }
+    block->done = 1;
+    write_pending(z);
+    pthread_mutex_unlock(&z->lock);
+}
+
+static void *
+pool_main(
+	void *arg)
+{
+    zout_pool_t *pool = arg;
+
+    for (;;) {
+	pthread_mutex_lock(&pool->lock);
+	while (pool->job_head == NULL && !pool->shutdown) {
+	    pthread_cond_wait(&pool->cond, &pool->lock);
+	}
+	if (pool->job_head == NULL) {
+	    pthread_mutex_unlock(&pool->lock);
+	    break;
+	}
+
+	zout_block_t *block = pool->job_head;
+	pool->job_head = block->next_job;
+	if (pool->job_head == NULL) {
+	    pool->job_tail = NULL;
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	finish_block(block);
+    }
+
+    return NULL;
+}
+
+zout_pool_t *
+zout_pool_create(
+	int n_threads)
+{
+    zout_pool_t *pool = calloc(1, sizeof(zout_pool_t));
+
+    if (pool == NULL) {
+	fprintf(stderr, "ERROR: could not allocate compression pool\n");
+	return NULL;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+
+    if (n_threads > 0) {
+	pool->threads = calloc(n_threads, sizeof(pthread_t));
+	if (pool->threads == NULL) {
+	    fprintf(stderr, "ERROR: could not allocate compression pool\n");
+	    free(pool);
+	    return NULL;
+	}
+    }
+
+    for (int i = 0; i < n_threads; i++) {
+	if (pthread_create(&pool->threads[i], NULL, pool_main, pool) != 0) {
+	    fprintf(stderr, "ERROR: could not start compression thread\n");
+	    break;
+	}
+	pool->n_threads++;
+    }
+
+    return pool;
+}
+
+/*
+ * Stop the threads of a pool, after they have finished all of the
+ * blocks in the queue, and free the pool.  All of the streams that
+ * use the pool should be closed first.
+ */
+void
+zout_pool_destroy(
+	zout_pool_t *pool)
+{
+
+    if (pool == NULL) {
+	return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->n_threads; i++) {
+	pthread_join(pool->threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->threads);
+    free(pool);
+}
+
+static zout_block_t *
+new_block(
+	zout_t *z)
+{
+    zout_block_t *block = calloc(1, sizeof(zout_block_t));
+
+    if (block == NULL) {
+	return NULL;
+    }
+
+    block->in = malloc(ZOUT_BLOCK_LEN);
+    if (block->in == NULL) {
+	free(block);
+	return NULL;
+    }
+    block->z = z;
+
+    return block;
+}
+
+zout_t *
+zout_fdopen(
+	int fd,
+	zout_codec_t codec,
+	int level,
+	zout_pool_t *pool)
+{
+
+    if (!zout_codec_available(codec)) {
+	fprintf(stderr, "ERROR: compression not supported by this build\n");
+	return NULL;
+    }
+
+    zout_t *z = calloc(1, sizeof(zout_t));
+    if (z == NULL) {
+	fprintf(stderr, "ERROR: could not allocate output stream\n");
+	return NULL;
+    }
+
+    z->fd = fd;
+    z->codec = codec;
+    z->level = level;
+    z->pool = (pool != NULL && pool->n_threads > 0) ? pool : NULL;
+    z->max_pending = 1;
+    if (z->pool != NULL) {
+	z->max_pending = ZOUT_BLOCKS_PER_THREAD * z->pool->n_threads;
+	if (z->max_pending > ZOUT_MAX_PENDING) {
+	    z->max_pending = ZOUT_MAX_PENDING;
+	}
+    }
+    pthread_mutex_init(&z->lock, NULL);
+    pthread_cond_init(&z->cond, NULL);
+
+    z->cur = new_block(z);
+    if (z->cur == NULL) {
+	fprintf(stderr, "ERROR: could not allocate output stream\n");
+	free(z);
+	return NULL;
+    }
+
+    return z;
+}
+
+zout_t *
+zout_open(
+	const char *fname,
+	zout_codec_t codec,
+	int level,
+	zout_pool_t *pool)
+{
+    int fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (fd < 0) {
+	fprintf(stderr, "ERROR: cannot create [%s]: %s\n",
+		fname, strerror(errno));
+	return NULL;
+    }
+
+    zout_t *z = zout_fdopen(fd, codec, level, pool);
+    if (z == NULL) {
+	close(fd);
+    }
+
+    return z;
+}
+
+/*
+ * Queue the current block to be compressed and written, and start a
+ * new current block
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+static int
+submit_block(
+	zout_t *z)
+{
+    zout_block_t *block = z->cur;
+
+    z->cur = NULL;
+
+    pthread_mutex_lock(&z->lock);
+    while (z->n_pending >= z->max_pending) {
+	pthread_cond_wait(&z->cond, &z->lock);
+    }
+    z->n_pending++;
+    if (z->pending_tail != NULL) {
+	z->pending_tail->next_pending = block;
+    }
+    else {
+	z->pending_head = block;
+    }
+    z->pending_tail = block;
+    pthread_mutex_unlock(&z->lock);
+
+    if (z->pool != NULL) {
+	zout_pool_t *pool = z->pool;
+
+	pthread_mutex_lock(&pool->lock);
+	if (pool->job_tail != NULL) {
+	    pool->job_tail->next_job = block;
+	}
+	else {
+	    pool->job_head = block;
+	}
+	pool->job_tail = block;
+	pthread_cond_signal(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+    }
+    else {
+	finish_block(block);
+    }
+
+    return z->error ? -1 : 0;
+}
+
+/*
+ * Returns 0 on success, -1 on failure.  After a failure, the output
+ * is incomplete, and the stream should be closed.
+ */
+int
+zout_write(
+	zout_t *z,
+	const void *buf,
+	size_t len)
+{
+    const uint8_t *p = buf;
+
+    while (len > 0) {
+	if (z->cur == NULL) {
+	    z->cur = new_block(z);
+	    if (z->cur == NULL) {
+		fprintf(stderr, "ERROR: could not allocate output block\n");
+		return -1;
+	    }
+	}
+
+	size_t n = ZOUT_BLOCK_LEN - z->cur->in_len;
+	if (n > len) {
+	    n = len;
+	}
+
+	memcpy(z->cur->in + z->cur->in_len, p, n);
+	z->cur->in_len += n;
+	p += n;
+	len -= n;
+
+	if (z->cur->in_len == ZOUT_BLOCK_LEN) {
+	    if (submit_block(z) != 0) {
+		fprintf(stderr, "ERROR: could not write output\n");
+		return -1;
+	    }
+	}
+    }
+
+    return 0;
+}
+
+/*
+ * Write any remaining output, wait for all of the blocks to be
+ * written, close the file descriptor, and free the stream.
+ *
+ * Returns 0 on success, -1 if any of the output could not be
+ * written.
+ */
+int
+zout_close(
+	zout_t *z)
+{
+    int rc = 0;
+
+    if (z->cur != NULL && z->cur->in_len > 0) {
+	submit_block(z);
+    }
+    else if (z->cur != NULL) {
+	free_block(z->cur);
+	z->cur = NULL;
+    }
+
+    pthread_mutex_lock(&z->lock);
+    while (z->n_pending > 0) {
+	pthread_cond_wait(&z->cond, &z->lock);
+    }
+    pthread_mutex_unlock(&z->lock);
+
+    if (z->error) {
+	fprintf(stderr, "ERROR: could not write output\n");
+	rc = -1;
+    }
+
+    if (close(z->fd) != 0) {
+	rc = -1;
+    }
+
+    pthread_cond_destroy(&z->cond);
+    pthread_mutex_destroy(&z->lock);
+    free(z);
+
+    return rc;
+}
+
+static ssize_t
+zout_cookie_write(
+	void *cookie,
+	const char *buf,
+	size_t len)
+{
+
+    /* A cookie write function must return 0, not -1, on failure */
+    return (zout_write(cookie, buf, len) == 0) ? len : 0;
+}
+
+static int
+zout_cookie_close(
+	void *cookie)
+{
+
+    return zout_close(cookie);
+}
+
+/*
+ * Open a compressed output file as a stdio FILE.  Closing the FILE
+ * closes the stream.
+ */
+FILE *
+zout_fopen(
+	const char *fname,
+	zout_codec_t codec,
+	int level,
+	zout_pool_t *pool)
+{
+    cookie_io_functions_t funcs = {
+	.read = NULL,
+	.write = zout_cookie_write,
+	.seek = NULL,
+	.close = zout_cookie_close
+    };
+
+    zout_t *z = zout_open(fname, codec, level, pool);
+    if (z == NULL) {
+	return NULL;
+    }
+
+    FILE *fout = fopencookie(z, "w", funcs);
+    if (fout == NULL) {
+	fprintf(stderr, "ERROR: cannot create [%s]\n", fname);
+	zout_close(z);
+    }
+
+    return fout;
+}
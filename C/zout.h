@@ -0,0 +1,100 @@
+#ifndef _ZOUT_H_
+#define _ZOUT_H_ 1
+
+/* CODEMARK: nice-ibr */
+/*
+ * Copyright (C) 2020-2024 - Raytheon BBN Technologies Corp.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0.
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+ *
+ * Distribution Statement "A" (Approved for Public Release,
+ * Distribution Unlimited).
+ *
+ * This material is based upon work supported by the Defense
+ * Advanced Research Projects Agency (DARPA) under Contract No.
+ * HR001119C0102.  The opinions, findings, and conclusions stated
+ * herein are those of the authors and do not necessarily reflect
+ * those of DARPA.
+ *
+ * In the event permission is required, DARPA is authorized to
+ * reproduce the copyrighted material for use as an exhibit or
+ * handout at DARPA-sponsored events and/or to post the material
+ * on the DARPA website.
+ */
+/* CODEMARK: end */
+
+/*
+ * Compressed output, shared by the tools that write large files.
+ *
+ * The output is divided into blocks of ZOUT_BLOCK_LEN bytes, and each
+ * block is compressed independently, as a complete gzip member, lz4
+ * frame, or zstd frame.  A concatenation of gzip members is itself a
+ * valid gzip file (and likewise for lz4 and zstd frames), so the
+ * output can be read by the usual tools, but the blocks can be
+ * compressed in parallel.
+ *
+ * The blocks are compressed by the threads of a zout_pool_t, which may
+ * be shared by any number of zout_t streams.  The blocks of each
+ * stream are written in order, by whichever thread finishes the next
+ * block.  If there is no pool (or the pool has no threads), then each
+ * block is compressed and written by the thread that fills it.
+ *
+ * zout_fopen wraps a stream in a stdio FILE (with fopencookie), for
+ * writers such as pcap_dump_fopen that need a FILE.
+ *
+ * gzip output needs only zlib.  lz4 and zstd output are only available
+ * if zout.c is compiled with HAVE_LZ4 and HAVE_ZSTD, respectively.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+typedef enum {
+    ZOUT_CODEC_NONE,
+    ZOUT_CODEC_GZIP,
+    ZOUT_CODEC_LZ4,
+    ZOUT_CODEC_ZSTD
+} zout_codec_t;
+
+/* The amount of uncompressed data in each block */
+#define ZOUT_BLOCK_LEN		(1024 * 1024)
+
+/*
+ * The compression levels are the ones used by each codec (1-9 for
+ * gzip, 1-12 for lz4, 1-19 for zstd), except that a level of 0 always
+ * selects the default level of the codec
+ */
+
+typedef struct zout_pool zout_pool_t;
+typedef struct zout zout_t;
+
+extern int zout_codec_parse(const char *spec, zout_codec_t *codec,
+	int *level);
+extern zout_codec_t zout_codec_from_fname(const char *fname);
+extern int zout_codec_available(zout_codec_t codec);
+
+extern zout_pool_t *zout_pool_create(int n_threads);
+extern void zout_pool_destroy(zout_pool_t *pool);
+
+extern zout_t *zout_fdopen(int fd, zout_codec_t codec, int level,
+	zout_pool_t *pool);
+extern zout_t *zout_open(const char *fname, zout_codec_t codec, int level,
+	zout_pool_t *pool);
+extern int zout_write(zout_t *z, const void *buf, size_t len);
+extern int zout_close(zout_t *z);
+
+extern FILE *zout_fopen(const char *fname, zout_codec_t codec, int level,
+	zout_pool_t *pool);
+
+#endif /* _ZOUT_H_ */
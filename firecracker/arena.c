@@ -0,0 +1,151 @@
+/* CODEMARK: nice-ibr */
+/*
+ * Copyright (C) 2020-2024 - Raytheon BBN Technologies Corp.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0.
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+ *
+ * Distribution Statement "A" (Approved for Public Release,
+ * Distribution Unlimited).
+ *
+ * This material is based upon work supported by the Defense
+ * Advanced Research Projects Agency (DARPA) under Contract No.
+ * HR001119C0102.  The opinions, findings, and conclusions stated
+ * herein are those of the authors and do not necessarily reflect
+ * those of DARPA.
+ *
+ * In the event permission is required, DARPA is authorized to
+ * reproduce the copyrighted material for use as an exhibit or
+ * handout at DARPA-sponsored events and/or to post the material
+ * on the DARPA website.
+ */
+/* CODEMARK: end */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include "firecracker.h"
+
+/*
+ * A very simple arena: a large range of virtual address space is
+ * reserved up front (without any memory behind it), and then the
+ * start of that range is made usable ("committed") as the arena
+ * grows.  Because the reservation never moves, growing the arena
+ * never requires copying its contents, and pointers into the arena
+ * stay valid.
+ *
+ * The arena is committed in FC_ARENA_PAGE_SIZE steps, and the
+ * kernel is asked to back it with transparent huge pages (where
+ * available) to cut down on TLB misses when it's scanned or sorted.
+ */
+
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE	(0)
+#endif
+
+int
+fc_arena_init(
+	fc_arena_t *arena,
+	size_t reserve)
+{
+
+    memset(arena, 0, sizeof(fc_arena_t));
+
+    reserve = (reserve + FC_ARENA_PAGE_SIZE - 1) & ~(FC_ARENA_PAGE_SIZE - 1);
+
+    /*
+     * If we can't reserve as much as we asked for (because of a
+     * ulimit, for example), then try to make do with less.
+     * Reserve an extra page so that we can align the start of the
+     * arena on a huge page boundary.
+     */
+    for (;;) {
+	size_t map_len = reserve + FC_ARENA_PAGE_SIZE;
+	void *map = mmap(NULL, map_len, PROT_NONE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+	if (map != MAP_FAILED) {
+	    uintptr_t start = ((uintptr_t) map + FC_ARENA_PAGE_SIZE - 1) &
+		    ~((uintptr_t) FC_ARENA_PAGE_SIZE - 1);
+
+	    arena->map = map;
+	    arena->map_len = map_len;
+	    arena->base = (char *) start;
+	    arena->reserved = reserve;
+	    arena->committed = 0;
+	    break;
+	}
+
+	if (reserve <= FC_ARENA_MIN_RESERVE) {
+	    fprintf(stderr, "ERROR: could not reserve arena: %s\n",
+		    strerror(errno));
+	    return -1;
+	}
+	reserve /= 2;
+    }
+
+#ifdef MADV_HUGEPAGE
+    /* This is only a hint, so it's not an error if it fails */
+    madvise(arena->base, arena->reserved, MADV_HUGEPAGE);
+#endif
+
+    return 0;
+}
+
+/*
+ * Make sure that at least the first size bytes of the arena are
+ * committed.
+ */
+int
+fc_arena_commit(
+	fc_arena_t *arena,
+	size_t size)
+{
+
+    if (size <= arena->committed) {
+	return 0;
+    }
+
+    size = (size + FC_ARENA_PAGE_SIZE - 1) & ~(FC_ARENA_PAGE_SIZE - 1);
+    if (size > arena->reserved) {
+	fprintf(stderr, "ERROR: arena is full (%lu bytes)\n",
+		(unsigned long) arena->reserved);
+	return -1;
+    }
+
+    if (mprotect(arena->base + arena->committed, size - arena->committed,
+		PROT_READ | PROT_WRITE) != 0) {
+	fprintf(stderr, "ERROR: could not grow arena: %s\n",
+		strerror(errno));
+	return -1;
+    }
+
+    arena->committed = size;
+
+    return 0;
+}
+
+void
+fc_arena_free(
+	fc_arena_t *arena)
+{
+
+    if (arena->map != NULL) {
+	munmap(arena->map, arena->map_len);
+    }
+
+    memset(arena, 0, sizeof(fc_arena_t));
+}
@@ -39,6 +39,206 @@
 
 #define MAX_LINE_LEN	(2048)
 
+/*
+ * The columns that have been decoded after each stage of parsing a
+ * line, so that lines that can't match the filter can be rejected
+ * before the rest of the line is parsed
+ */
+#define C25_STAGE1_COLS	(FC_COL_SADDR | FC_COL_DADDR | FC_COL_PROTO)
+#define C25_STAGE2_COLS	(C25_STAGE1_COLS | FC_COL_SPORT | FC_COL_DPORT)
+#define C25_STAGE3_COLS	(C25_STAGE2_COLS | FC_COL_LEN | FC_COL_FLAGS)
+
+/*
+ * Return 0 if the filter uses any of the columns in new_cols, and the
+ * packet can't match it based on the columns in known_cols; return 1
+ * otherwise.
+ */
+static inline int
+maybe_match(
+	fc_pkt_t *pkt,
+	fc_filter_t *filter,
+	uint32_t known_cols,
+	uint32_t new_cols)
+{
+
+    if ((filter == NULL) || !(filter->cols & new_cols)) {
+	return 1;
+    }
+
+    return fc_filter_partial(pkt, filter, known_cols);
+}
+
+/*
+ * If a CSV file begins with a header line (a '#' followed by the
+ * names of the columns, as written by cpcap2csv -c), then the columns
+ * are found by name, and the other columns are skipped.  Without a
+ * header, the columns must be in the default order written by
+ * cpcap2csv.
+ */
+#define C25_MAX_COLS	(64)
+
+typedef enum {
+    C25_COL_SKIP = 0,
+    C25_COL_SADDR,
+    C25_COL_DADDR,
+    C25_COL_PROTO,
+    C25_COL_SPORT,
+    C25_COL_DPORT,
+    C25_COL_LEN,
+    C25_COL_TS,
+    C25_COL_FLAGS
+} c25_col_t;
+
+static const struct {
+    const char *name;
+    c25_col_t col;
+    int required;
+} c25_col_names[] = {
+    { "saddr", C25_COL_SADDR, 1 },
+    { "daddr", C25_COL_DADDR, 1 },
+    { "proto", C25_COL_PROTO, 1 },
+    { "sport", C25_COL_SPORT, 1 },
+    { "dport", C25_COL_DPORT, 1 },
+    { "iptotlen", C25_COL_LEN, 1 },
+    { "ts_epoch", C25_COL_TS, 1 },
+    { "tcp_flags", C25_COL_FLAGS, 0 },
+    { NULL, C25_COL_SKIP, 0 }
+};
+
+typedef struct {
+    int n_cols;		/* the number of columns to parse */
+    c25_col_t cols[C25_MAX_COLS];
+} c25_layout_t;
+
+/*
+ * Parse a header line into a layout.  n_cols is set to one past the
+ * last column that we need, so that the rest of each line is ignored.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+static int
+parse_header(
+	char *line,
+	c25_layout_t *layout)
+{
+    char *saveptr = NULL;
+    uint32_t found = 0;
+    int n = 0;
+
+    layout->n_cols = 0;
+
+    for (char *name = strtok_r(line + 1, ",\r\n", &saveptr); name != NULL;
+	    name = strtok_r(NULL, ",\r\n", &saveptr)) {
+	if (n == C25_MAX_COLS) {
+	    break;
+	}
+
+	layout->cols[n] = C25_COL_SKIP;
+	for (int i = 0; c25_col_names[i].name != NULL; i++) {
+	    if (!strcmp(name, c25_col_names[i].name)) {
+		layout->cols[n] = c25_col_names[i].col;
+		found |= 1 << c25_col_names[i].col;
+		layout->n_cols = n + 1;
+		break;
+	    }
+	}
+	n++;
+    }
+
+    for (int i = 0; c25_col_names[i].name != NULL; i++) {
+	if (c25_col_names[i].required &&
+		!(found & (1 << c25_col_names[i].col))) {
+	    fprintf(stderr, "ERROR: CSV header does not have column [%s]\n",
+		    c25_col_names[i].name);
+	    return -1;
+	}
+    }
+
+    return 0;
+}
+
+/*
+ * Parse a line using the layout from a header line.
+ *
+ * Returns 0 on success, or a negative number if the line is malformed.
+ */
+static int
+parse_line_layout(
+	char *p,
+	c25_layout_t *layout,
+	fc_pkt_t *pkt)
+{
+    char *endptr = p;
+
+    pkt->flags = 0;
+
+    for (int i = 0; i < layout->n_cols; i++) {
+	switch (layout->cols[i]) {
+	    case C25_COL_SADDR:
+		pkt->saddr = (uint32_t) strtoll(p, &endptr, 10);
+		break;
+	    case C25_COL_DADDR:
+		pkt->daddr = (uint32_t) strtoll(p, &endptr, 10);
+		break;
+	    case C25_COL_PROTO:
+		pkt->proto = (uint8_t) strtoll(p, &endptr, 10);
+		break;
+	    case C25_COL_SPORT:
+		pkt->sport = (uint16_t) strtoll(p, &endptr, 10);
+		break;
+	    case C25_COL_DPORT:
+		pkt->dport = (uint16_t) strtoll(p, &endptr, 10);
+		break;
+	    case C25_COL_LEN:
+		pkt->len = (uint16_t) strtoll(p, &endptr, 10);
+		break;
+	    case C25_COL_FLAGS:
+		pkt->flags = (uint8_t) strtoll(p, &endptr, 10);
+		break;
+	    case C25_COL_TS: {
+		/*
+		 * Parse the fraction as an integer number of
+		 * microseconds, rather than as a double, so that
+		 * the timestamp is exact.  Any digits past the
+		 * microseconds are ignored.
+		 */
+		uint32_t usec = 0;
+		int digits = 0;
+
+		pkt->ts.ts_sec = (uint32_t) strtoll(p, &endptr, 10);
+		if (*endptr == '.') {
+		    for (endptr++; *endptr >= '0' && *endptr <= '9'; endptr++) {
+			if (digits < 6) {
+			    usec = (usec * 10) + (*endptr - '0');
+			    digits++;
+			}
+		    }
+		}
+		for (; digits < 6; digits++) {
+		    usec *= 10;
+		}
+		pkt->ts.ts_usec = usec;
+		break;
+	    }
+	    default:
+		endptr = strchr(p, ',');
+		if (endptr == NULL) {
+		    return -11;
+		}
+		break;
+	}
+
+	if (*endptr == ',') {
+	    p = endptr + 1;
+	}
+	else if (i + 1 < layout->n_cols) {
+	    return -12;
+	}
+    }
+
+    return 0;
+}
+
 int
 fc_csv_read(
 	fc_fin_t *fin,
@@ -46,11 +246,10 @@ fc_csv_read(
 	fc_filter_t *filter)
 {
     char buf[MAX_LINE_LEN];
+    c25_layout_t layout = { 0 };
+    int have_layout = 0;
     int rc;
 
-    chain->first = NULL;
-    chain->curr = NULL;
-
     memset(buf, 0, MAX_LINE_LEN);
 
     for (;;) {
@@ -59,8 +258,22 @@ fc_csv_read(
 	    break;
 	}
 
-	uint32_t saddr, daddr, proto, sport, dport, dummy, len;
-	uint32_t ts_sec, ts_usec;
+	uint32_t dummy;
+	fc_pkt_t pkt;
+
+	/* A header line may appear at the start of the input, or at
+	 * the start of each file if several files have been
+	 * concatenated, so each header replaces the previous layout
+	 */
+	if (*p == '#') {
+	    if (parse_header(p, &layout) != 0) {
+		return -13;
+	    }
+	    have_layout = 1;
+	    continue;
+	}
+
+	pkt.flags = 0; /* TODO */
 
 	/* This reproduces the functionality of the sscanf call above,
 	 * but is much, much faster...  and has no error checking
@@ -81,39 +294,58 @@ fc_csv_read(
 	 * run fast, since speed is the first priority for firecracker.
 	 */
 
-	{
+	if (have_layout) {
+	    rc = parse_line_layout(p, &layout, &pkt);
+	    if (rc != 0) {
+		return rc;
+	    }
+	}
+	else {
 	    char *endptr;
 
-	    saddr = (uint32_t) strtoll(p, &endptr, 10);
+	    pkt.saddr = (uint32_t) strtoll(p, &endptr, 10);
 	    if (*endptr != ',') {
 		printf("end %s\n", endptr);
 		return -1;
 	    }
-	    daddr = (uint32_t) strtoll(endptr + 1, &endptr, 10);
+	    pkt.daddr = (uint32_t) strtoll(endptr + 1, &endptr, 10);
 	    if (*endptr != ',') {
 		return -2;
 	    }
-	    proto = (uint32_t) strtoll(endptr + 1, &endptr, 10);
+	    pkt.proto = (uint8_t) strtoll(endptr + 1, &endptr, 10);
 	    if (*endptr != ',') {
 		return -3;
 	    }
-	    sport = (uint32_t) strtoll(endptr + 1, &endptr, 10);
+	    if (!maybe_match(&pkt, filter, C25_STAGE1_COLS, C25_STAGE1_COLS)) {
+		continue;
+	    }
+
+	    pkt.sport = (uint16_t) strtoll(endptr + 1, &endptr, 10);
 	    if (*endptr != ',') {
 		return -4;
 	    }
-	    dport = (uint32_t) strtoll(endptr + 1, &endptr, 10);
+	    pkt.dport = (uint16_t) strtoll(endptr + 1, &endptr, 10);
 	    if (*endptr != ',') {
 		return -5;
 	    }
+	    if (!maybe_match(&pkt, filter, C25_STAGE2_COLS,
+			FC_COL_SPORT | FC_COL_DPORT)) {
+		continue;
+	    }
+
 	    dummy = (uint32_t) strtoll(endptr + 1, &endptr, 10);
 	    (void) dummy; /* prevent gcc warnings re unused variable */
 	    if (*endptr != ',') {
 		return -6;
 	    }
-	    len = (uint32_t) strtoll(endptr + 1, &endptr, 10);
+	    pkt.len = (uint16_t) strtoll(endptr + 1, &endptr, 10);
 	    if (*endptr != ',') {
 		return -7;
 	    }
+	    if (!maybe_match(&pkt, filter, C25_STAGE3_COLS,
+			FC_COL_LEN | FC_COL_FLAGS)) {
+		continue;
+	    }
 
 	    for (int i = 0; i < 3; i++) {
 		endptr = strchr(endptr + 1, ',');
@@ -121,11 +353,11 @@ fc_csv_read(
 		    return -8;
 		}
 	    }
-	    ts_sec = (uint32_t) strtoll(endptr + 1, &endptr, 10);
+	    pkt.ts.ts_sec = (uint32_t) strtoll(endptr + 1, &endptr, 10);
 	    if (*endptr != '.') {
 		return -9;
 	    }
-	    ts_usec = 1000000 * strtod(endptr, &endptr);
+	    pkt.ts.ts_usec = 1000000 * strtod(endptr, &endptr);
 
 	    /* It is OK if there are more fields after ts_use, or it's
 	     * the last fields on the line (followed by a newline).  The
@@ -138,32 +370,14 @@ fc_csv_read(
 
 	}
 
-	rc = fc_extend_chain(chain);
+	/* The rest of the filter (if any) is checked by the chain,
+	 * a block of packets at a time.  See fc_chain_set_filter.
+	 */
+	rc = fc_chain_append(chain, &pkt);
 	if (rc != 0) {
 	    pcap_free_chain(chain);
 	    return 1;
 	}
-
-	uint32_t curr_cnt = chain->curr->cnt;
-	fc_pkt_t *pkt = &chain->curr->pkts[curr_cnt];
-
-	pkt->saddr = saddr;
-	pkt->daddr = daddr;
-	pkt->proto = (uint8_t) proto;
-	pkt->sport = (uint16_t) sport;
-	pkt->dport = (uint16_t) dport;
-	pkt->len = (uint16_t) len;
-	pkt->ts.ts_sec = ts_sec;
-	pkt->ts.ts_usec = ts_usec;
-	pkt->flags = 0; /* TODO */
-
-	/* If there's a filter, and it doesn't match this packet,
-	 * then don't increment the current count.  Just ignore
-	 * this packet
-	 */
-	if ((filter == NULL) || fc_filter_pkt(pkt, filter)) {
-	    chain->curr->cnt++;
-	}
     }
 
     return 0;
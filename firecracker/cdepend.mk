@@ -1,4 +1,4 @@
-p25.o: p25.c firecracker.h
+p25.o: p25.c firecracker.h ../C/capfile.h ../C/pktdecode.h
 c25.o: c25.c firecracker.h
 fc5.o: fc5.c firecracker.h
 input.o: input.c firecracker.h
@@ -6,6 +6,13 @@ process.o: process.c firecracker.h
 print.o: print.c firecracker.h
 filter.o: filter.c firecracker.h
 chain.o: chain.c firecracker.h
+change.o: change.c firecracker.h
+pivot.o: pivot.c firecracker.h
+spill.o: spill.c firecracker.h
+arena.o: arena.c firecracker.h
+prefix.o: prefix.c firecracker.h
+capfile.o: ../C/capfile.c ../C/capfile.h ../C/pktdecode.h
+pktdecode.o: ../C/pktdecode.c ../C/pktdecode.h
 firecracker.o: firecracker.c firecracker.h
 test_p25.o: test_p25.c firecracker.h
 test_c25.o: test_c25.c firecracker.h
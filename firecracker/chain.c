@@ -30,6 +30,7 @@
  */
 /* CODEMARK: end */
 
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -37,50 +38,491 @@
 
 #include "firecracker.h"
 
+/*
+ * The location and element size of each column in an fc_chunk_t,
+ * so that the operations that don't care what's in the columns
+ * (allocating, copying, slicing) can just loop over them.
+ */
+static const struct {
+    uint32_t col;
+    size_t offset;
+    size_t size;
+} col_info[] = {
+    { FC_COL_SADDR, offsetof(fc_chunk_t, saddr), sizeof(uint32_t) },
+    { FC_COL_DADDR, offsetof(fc_chunk_t, daddr), sizeof(uint32_t) },
+    { FC_COL_SPORT, offsetof(fc_chunk_t, sport), sizeof(uint16_t) },
+    { FC_COL_DPORT, offsetof(fc_chunk_t, dport), sizeof(uint16_t) },
+    { FC_COL_PROTO, offsetof(fc_chunk_t, proto), sizeof(uint8_t) },
+    { FC_COL_FLAGS, offsetof(fc_chunk_t, flags), sizeof(uint8_t) },
+    { FC_COL_LEN, offsetof(fc_chunk_t, len), sizeof(uint16_t) },
+    { FC_COL_SEC, offsetof(fc_chunk_t, ts_sec), sizeof(int32_t) },
+    { FC_COL_USEC, offsetof(fc_chunk_t, ts_usec), sizeof(uint32_t) },
+    { 0, 0, 0 }
+};
+
+static inline char **
+col_ptr(
+	fc_chunk_t *chunk,
+	int i)
+{
+    return (char **) (((char *) chunk) + col_info[i].offset);
+}
+
+/*
+ * Allocate space for size packets in the given chunk, for each of
+ * the given columns.  The other columns are left NULL.
+ */
+int
+fc_chunk_alloc(
+	fc_chunk_t *chunk,
+	uint32_t cols,
+	uint64_t size)
+{
+
+    memset(chunk, 0, sizeof(fc_chunk_t));
+    chunk->cols = cols;
+
+    if (size == 0) {
+	return 0;
+    }
+
+    for (int i = 0; col_info[i].col != 0; i++) {
+	if (cols & col_info[i].col) {
+	    char *col = malloc(size * col_info[i].size);
+	    if (col == NULL) {
+		fc_chunk_free(chunk);
+		return -1;
+	    }
+	    *col_ptr(chunk, i) = col;
+	}
+    }
+
+    return 0;
+}
+
+void
+fc_chunk_free(
+	fc_chunk_t *chunk)
+{
+
+    for (int i = 0; col_info[i].col != 0; i++) {
+	free(*col_ptr(chunk, i));
+	*col_ptr(chunk, i) = NULL;
+    }
+    chunk->count = 0;
+}
+
+/*
+ * Copy count packets from src (starting at src_off) to dst (starting
+ * at dst_off).  Only the columns present in dst are copied, and they
+ * must also be present in src.
+ */
+void
+fc_chunk_copy(
+	fc_chunk_t *dst,
+	uint64_t dst_off,
+	fc_chunk_t *src,
+	uint64_t src_off,
+	uint64_t count)
+{
+
+    for (int i = 0; col_info[i].col != 0; i++) {
+	if (dst->cols & col_info[i].col) {
+	    size_t size = col_info[i].size;
+
+	    memcpy(*col_ptr(dst, i) + (dst_off * size),
+		    *col_ptr(src, i) + (src_off * size),
+		    count * size);
+	}
+    }
+}
+
+/*
+ * Copy the elements of the src column at the given indices into the
+ * dst column: dst[j] = src[order[j]], for each j less than count.
+ */
+static void
+gather_col(
+	char *dst,
+	const char *src,
+	size_t size,
+	const uint64_t *order,
+	uint64_t count)
+{
+
+    switch (size) {
+	case sizeof(uint8_t): {
+	    const uint8_t *s = (const uint8_t *) src;
+	    uint8_t *d = (uint8_t *) dst;
+
+	    for (uint64_t j = 0; j < count; j++) {
+		d[j] = s[order[j]];
+	    }
+	    break;
+	}
+	case sizeof(uint16_t): {
+	    const uint16_t *s = (const uint16_t *) src;
+	    uint16_t *d = (uint16_t *) dst;
+
+	    for (uint64_t j = 0; j < count; j++) {
+		d[j] = s[order[j]];
+	    }
+	    break;
+	}
+	case sizeof(uint32_t): {
+	    const uint32_t *s = (const uint32_t *) src;
+	    uint32_t *d = (uint32_t *) dst;
+
+	    for (uint64_t j = 0; j < count; j++) {
+		d[j] = s[order[j]];
+	    }
+	    break;
+	}
+    }
+}
+
+/*
+ * Reorder the packets in the chunk so that the ith packet is the
+ * packet that was previously at order[i].  This is done one column
+ * at a time (through a temporary copy of the column), so the only
+ * extra memory needed is a copy of the largest column, and the
+ * columns stay where they are.
+ */
+int
+fc_chunk_permute(
+	fc_chunk_t *chunk,
+	const uint64_t *order)
+{
+    uint64_t count = chunk->count;
+
+    for (int i = 0; col_info[i].col != 0; i++) {
+	if (!(chunk->cols & col_info[i].col)) {
+	    continue;
+	}
+
+	char *col = *col_ptr(chunk, i);
+	char *tmp = malloc(count * col_info[i].size);
+	if (tmp == NULL) {
+	    return -1;
+	}
+
+	gather_col(tmp, col, col_info[i].size, order, count);
+
+	memcpy(col, tmp, count * col_info[i].size);
+	free(tmp);
+    }
+
+    return 0;
+}
+
+/*
+ * Copy count packets of src, selected by the indices in sel, into
+ * dst (starting at dst_off).  As with fc_chunk_copy,
+ * only the columns present in dst are copied.
+ */
+void
+fc_chunk_gather(
+	fc_chunk_t *dst,
+	uint64_t dst_off,
+	fc_chunk_t *src,
+	const uint64_t *sel,
+	uint64_t count)
+{
+
+    for (int i = 0; col_info[i].col != 0; i++) {
+	if (dst->cols & col_info[i].col) {
+	    size_t size = col_info[i].size;
+
+	    gather_col(*col_ptr(dst, i) + (dst_off * size),
+		    *col_ptr(src, i), size, sel, count);
+	}
+    }
+}
+
+/*
+ * Make dst into a view of count packets of src, starting at base.
+ * dst shares the columns of src, so it must not be freed.
+ */
+void
+fc_chunk_slice(
+	fc_chunk_t *src,
+	uint64_t base,
+	uint64_t count,
+	fc_chunk_t *dst)
+{
+
+    *dst = *src;
+    dst->count = count;
+
+    for (int i = 0; col_info[i].col != 0; i++) {
+	if (src->cols & col_info[i].col) {
+	    *col_ptr(dst, i) = *col_ptr(src, i) + (base * col_info[i].size);
+	}
+    }
+}
+
+/*
+ * Store the fields of pkt as the ind'th packet of the chunk.  Fields
+ * that don't have a column in the chunk are dropped.
+ */
+void
+fc_chunk_set(
+	fc_chunk_t *chunk,
+	uint64_t ind,
+	fc_pkt_t *pkt)
+{
+    uint32_t cols = chunk->cols;
+
+    if (cols & FC_COL_SADDR) {
+	chunk->saddr[ind] = pkt->saddr;
+    }
+    if (cols & FC_COL_DADDR) {
+	chunk->daddr[ind] = pkt->daddr;
+    }
+    if (cols & FC_COL_SPORT) {
+	chunk->sport[ind] = pkt->sport;
+    }
+    if (cols & FC_COL_DPORT) {
+	chunk->dport[ind] = pkt->dport;
+    }
+    if (cols & FC_COL_PROTO) {
+	chunk->proto[ind] = pkt->proto;
+    }
+    if (cols & FC_COL_FLAGS) {
+	chunk->flags[ind] = pkt->flags;
+    }
+    if (cols & FC_COL_LEN) {
+	chunk->len[ind] = pkt->len;
+    }
+    if (cols & FC_COL_SEC) {
+	chunk->ts_sec[ind] = pkt->ts.ts_sec;
+    }
+    if (cols & FC_COL_USEC) {
+	chunk->ts_usec[ind] = pkt->ts.ts_usec;
+    }
+}
+
+/*
+ * The inverse of fc_chunk_set: fetch the ind'th packet of the chunk.
+ * Fields that don't have a column in the chunk are set to zero.
+ */
+void
+fc_chunk_get(
+	fc_chunk_t *chunk,
+	uint64_t ind,
+	fc_pkt_t *pkt)
+{
+    uint32_t cols = chunk->cols;
+
+    memset(pkt, 0, sizeof(fc_pkt_t));
+
+    if (cols & FC_COL_SADDR) {
+	pkt->saddr = chunk->saddr[ind];
+    }
+    if (cols & FC_COL_DADDR) {
+	pkt->daddr = chunk->daddr[ind];
+    }
+    if (cols & FC_COL_SPORT) {
+	pkt->sport = chunk->sport[ind];
+    }
+    if (cols & FC_COL_DPORT) {
+	pkt->dport = chunk->dport[ind];
+    }
+    if (cols & FC_COL_PROTO) {
+	pkt->proto = chunk->proto[ind];
+    }
+    if (cols & FC_COL_FLAGS) {
+	pkt->flags = chunk->flags[ind];
+    }
+    if (cols & FC_COL_LEN) {
+	pkt->len = chunk->len[ind];
+    }
+    if (cols & FC_COL_SEC) {
+	pkt->ts.ts_sec = chunk->ts_sec[ind];
+    }
+    if (cols & FC_COL_USEC) {
+	pkt->ts.ts_usec = chunk->ts_usec[ind];
+    }
+}
+
+/*
+ * Initialize an empty chain, which will store the given columns
+ * of each packet appended to it.  This reserves (but does not
+ * commit) the space for up to FC_CHAIN_MAX_PKTS packets.
+ */
+int
+fc_chain_init(
+	pkt_chain_t *chain,
+	uint32_t cols)
+{
+
+    memset(chain, 0, sizeof(pkt_chain_t));
+    chain->pkts.cols = cols;
+
+    for (int i = 0; col_info[i].col != 0; i++) {
+	if (!(cols & col_info[i].col)) {
+	    continue;
+	}
+
+	fc_arena_t *arena = &chain->arenas[i];
+	if (fc_arena_init(arena, FC_CHAIN_MAX_PKTS * col_info[i].size) != 0) {
+	    pcap_free_chain(chain);
+	    return -1;
+	}
+	*col_ptr(&chain->pkts, i) = arena->base;
+    }
+
+    return 0;
+}
+
+/*
+ * Make sure that the chain has room for another n packets.  The
+ * chain grows by PKTS_PER_CHUNK packets at a time, so we only need
+ * to actually commit more space if the chain is full.
+ */
+static int
+reserve_chain(
+	pkt_chain_t *chain,
+	uint64_t n)
+{
+
+    if (chain->pkts.count + n <= chain->capacity) {
+	return 0;
+    }
+
+    uint64_t new_capacity = chain->capacity;
+    while (chain->pkts.count + n > new_capacity) {
+	new_capacity += PKTS_PER_CHUNK;
+    }
+
+    for (int i = 0; col_info[i].col != 0; i++) {
+	if (chain->pkts.cols & col_info[i].col) {
+	    if (fc_arena_commit(&chain->arenas[i],
+			new_capacity * col_info[i].size) != 0) {
+		return -1;
+	    }
+	}
+    }
+    chain->capacity = new_capacity;
+
+    return 0;
+}
+
 /*
  * Before we add a new pkt to the chain, we need to "extend"
- * the chain to ensure that it has enough space.  Each link
- * in the chain is a pkt_chunk_t, which can hold multiple
- * packets, so we only need to actually allocate new space
- * if the chain is new (and we haven't allocated any space
- * for it at all) or if the last link in the chain is full.
+ * the chain to ensure that it has enough space.
  */
 int
 fc_extend_chain(
 	pkt_chain_t *chain)
 {
 
-    if (chain->first == NULL) {
-	/*
-	 * If the first chunk hasn't been created yet, create it.
-	 */
-        pkt_chunk_t *first = (pkt_chunk_t *) malloc (sizeof (pkt_chunk_t));
-	if (first == NULL) {
+    return reserve_chain(chain, 1);
+}
+
+/*
+ * Filter the packets in the staging block of the chain, append the
+ * ones that match to the chain, and empty the block.
+ */
+int
+fc_chain_flush(
+	pkt_chain_t *chain)
+{
+    fc_chunk_t *block = &chain->block;
+
+    if ((chain->filter == NULL) || (block->count == 0)) {
+	return 0;
+    }
+
+    uint64_t n = fc_filter_block(chain->filter, block, 0, block->count,
+	    chain->sel);
+    block->count = 0;
+
+    if (reserve_chain(chain, n) != 0) {
+	return -1;
+    }
+
+    fc_chunk_gather(&chain->pkts, chain->pkts.count, block, chain->sel, n);
+    chain->pkts.count += n;
+
+    return 0;
+}
+
+/*
+ * Only append the packets that match the given filter to the chain.
+ *
+ * Rather than checking each packet as it is appended, the packets
+ * are staged in a block of FC_FILTER_BLOCK_SIZE packets (with the
+ * columns of the chain, plus any other columns that the filter
+ * uses), and then the whole block is checked at once by the batched
+ * filter kernel and the packets that match are copied to the chain.
+ * The caller must call fc_chain_flush after the last packet has been
+ * appended.
+ *
+ * If filter is NULL or empty, then every packet is appended.
+ */
+int
+fc_chain_set_filter(
+	pkt_chain_t *chain,
+	fc_filter_t *filter)
+{
+
+    if (fc_chain_flush(chain) != 0) {
+	return -1;
+    }
+
+    if ((filter == NULL) || (filter->n_fields == 0)) {
+	chain->filter = NULL;
+	return 0;
+    }
+
+    if (chain->sel == NULL) {
+	chain->sel = malloc(FC_FILTER_BLOCK_SIZE * sizeof(uint64_t));
+	if (chain->sel == NULL) {
 	    return -1;
 	}
+    }
 
-        first->next = NULL;
-        first->cnt = 0;
-        chain->first = first;
-        chain->curr = first;
-    }
-    else if (chain->curr->cnt == PKTS_PER_CHUNK) {
-	/*
-	 * If the current chunk is full, then create a new, empty
-	 * chunk to be current chunk, and link it in to the chain
-	 */
-        pkt_chunk_t *new_curr = (pkt_chunk_t *) malloc (sizeof (pkt_chunk_t));
-	if (new_curr == NULL) {
+    uint32_t cols = chain->pkts.cols | filter->cols;
+    if (chain->block.cols != cols) {
+	fc_chunk_free(&chain->block);
+	if (fc_chunk_alloc(&chain->block, cols, FC_FILTER_BLOCK_SIZE) != 0) {
 	    return -1;
 	}
+    }
 
-        new_curr->next = NULL;
-        new_curr->cnt = 0;
+    chain->filter = filter;
 
-        chain->curr->next = new_curr;
-        chain->curr = new_curr;
+    return 0;
+}
+
+/*
+ * Append the (columns of interest of the) given packet to the chain,
+ * or to its staging block if the chain has a filter
+ */
+int
+fc_chain_append(
+	pkt_chain_t *chain,
+	fc_pkt_t *pkt)
+{
+
+    if (chain->filter != NULL) {
+	fc_chunk_set(&chain->block, chain->block.count, pkt);
+	chain->block.count++;
+
+	if (chain->block.count == FC_FILTER_BLOCK_SIZE) {
+	    return fc_chain_flush(chain);
+	}
+	return 0;
     }
 
+    if (fc_extend_chain(chain) != 0) {
+	return -1;
+    }
+
+    fc_chunk_set(&chain->pkts, chain->pkts.count, pkt);
+    chain->pkts.count++;
+
     return 0;
 }
 
@@ -92,16 +534,24 @@ pcap_free_chain(
 	return 0;
     }
 
-    pkt_chunk_t *curr = chain->first;
-    while (curr != NULL) {
-	pkt_chunk_t *next = curr->next;
-	free(curr);
-	curr = next;
+    for (int i = 0; i < FC_N_COLS; i++) {
+	fc_arena_free(&chain->arenas[i]);
     }
+    memset(&chain->pkts, 0, sizeof(fc_chunk_t));
+    chain->capacity = 0;
+
+    fc_chunk_free(&chain->block);
+    free(chain->sel);
+    chain->sel = NULL;
+    chain->filter = NULL;
 
     return 0;
 }
 
+/*
+ * Copy the packets in the chain into a newly-allocated chunk
+ * (which, unlike the chain, can be freed with fc_chunk_free)
+ */
 int
 pcap_chain_to_chunk(
 	pkt_chain_t *chain,
@@ -115,31 +565,14 @@ pcap_chain_to_chunk(
 	return 2;
     }
 
-    uint64_t total_pkts = 0;
-    for (pkt_chunk_t *curr = chain->first; curr != NULL; curr = curr->next) {
-	total_pkts += curr->cnt;
-    }
-
-    chunk->count = total_pkts;
-
-    /* If there aren't any packets, then we don't have much to do... */
-    if (total_pkts == 0) {
-	chunk->pkts = NULL;
-	return 0;
-    }
+    uint64_t total_pkts = chain->pkts.count;
 
-    chunk->pkts = (fc_pkt_t *) malloc(total_pkts * sizeof(fc_pkt_t));
-    if (chunk->pkts == NULL) {
+    if (fc_chunk_alloc(chunk, chain->pkts.cols, total_pkts) != 0) {
 	return 3;
     }
 
-    uint64_t curr_ind = 0;
-    for (pkt_chunk_t *curr = chain->first; curr != NULL; curr = curr->next) {
-	fc_pkt_t *dst = chunk->pkts + curr_ind;
-
-	memcpy(dst, curr->pkts, curr->cnt * sizeof(fc_pkt_t));
-	curr_ind += curr->cnt;
-    }
+    fc_chunk_copy(chunk, 0, &chain->pkts, 0, total_pkts);
+    chunk->count = total_pkts;
 
     return 0;
 }
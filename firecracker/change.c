@@ -0,0 +1,308 @@
+/* CODEMARK: nice-ibr */
+/*
+ * Copyright (C) 2020-2024 - Raytheon BBN Technologies Corp.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0.
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+ *
+ * Distribution Statement "A" (Approved for Public Release,
+ * Distribution Unlimited).
+ *
+ * This material is based upon work supported by the Defense
+ * Advanced Research Projects Agency (DARPA) under Contract No.
+ * HR001119C0102.  The opinions, findings, and conclusions stated
+ * herein are those of the authors and do not necessarily reflect
+ * those of DARPA.
+ *
+ * In the event permission is required, DARPA is authorized to
+ * reproduce the copyrighted material for use as an exhibit or
+ * handout at DARPA-sponsored events and/or to post the material
+ * on the DARPA website.
+ */
+/* CODEMARK: end */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "firecracker.h"
+
+/*
+ * Change detection: instead of printing the count of each key for
+ * each interval, compare the aggregate for each interval against the
+ * aggregate for the previous interval, and only print the keys whose
+ * count changed by more than the thresholds given in the query.
+ * Keys that appear (or vanish) are treated as having a count of zero
+ * in the interval where they are absent.
+ *
+ * The aggregate for the previous interval is the only state that
+ * persists from one interval to the next.
+ */
+
+typedef struct {
+    const uint32_t *key;
+    uint64_t curr;
+    uint64_t prev;
+} fc_change_t;
+
+static uint64_t
+change_delta(
+	const fc_change_t *change)
+{
+
+    if (change->curr > change->prev) {
+	return change->curr - change->prev;
+    }
+    else {
+	return change->prev - change->curr;
+    }
+}
+
+static int
+change_compare(
+	const void *p1,
+	const void *p2)
+{
+    uint64_t d1 = change_delta((fc_change_t *) p1);
+    uint64_t d2 = change_delta((fc_change_t *) p2);
+
+    /* This looks backwards because we sort in descending order */
+    if (d1 < d2) {
+	return 1;
+    }
+    else if (d1 > d2) {
+	return -1;
+    }
+    else {
+	return 0;
+    }
+}
+
+static int
+key_compare(
+	const uint32_t *k1,
+	const uint32_t *k2,
+	uint8_t n_fields)
+{
+
+    for (uint8_t i = 0; i < n_fields; i++) {
+	if (k1[i] < k2[i]) {
+	    return -1;
+	}
+	else if (k1[i] > k2[i]) {
+	    return 1;
+	}
+    }
+
+    return 0;
+}
+
+static void
+free_agg(
+	fc_agg_t *agg)
+{
+
+    if (agg != NULL) {
+	free(agg->keys);
+	free(agg->counts);
+	free(agg);
+    }
+}
+
+/*
+ * Build the aggregate for the current interval from the counts
+ * computed by fc_compute_counts_subset.  The counts are already
+ * in key order, so the keys are too.
+ */
+static fc_agg_t *
+build_agg(
+	fc_chunk_t *chunk,
+	fc_query_t *query,
+	fc_count_order_t *counts,
+	uint64_t n_counts)
+{
+    uint8_t n_fields = query->n_fields;
+
+    fc_agg_t *agg = calloc(1, sizeof(fc_agg_t));
+    if (agg == NULL) {
+	return NULL;
+    }
+
+    agg->n_keys = n_counts;
+    if (n_counts == 0) {
+	return agg;
+    }
+
+    agg->keys = malloc(n_counts * n_fields * sizeof(uint32_t));
+    agg->counts = malloc(n_counts * sizeof(uint64_t));
+    if ((agg->keys == NULL) || (agg->counts == NULL)) {
+	free_agg(agg);
+	return NULL;
+    }
+
+    for (uint64_t i = 0; i < n_counts; i++) {
+	uint64_t ind = counts[i].index;
+	uint32_t *key = agg->keys + (i * n_fields);
+
+	for (uint8_t j = 0; j < n_fields; j++) {
+	    uint32_t mask = fc_width_mask(query->fields[j].width);
+
+	    key[j] = mask & fetch_col(chunk, ind, query->fields[j].name);
+	}
+	agg->counts[i] = counts[i].count;
+    }
+
+    return agg;
+}
+
+static int
+is_change(
+	fc_query_t *query,
+	const fc_change_t *change)
+{
+    uint64_t delta = change_delta(change);
+
+    if (delta == 0 || delta <= query->change_abs) {
+	return 0;
+    }
+
+    /*
+     * If the key is new, then the relative change is infinite,
+     * so it always exceeds the relative threshold
+     */
+    if ((query->change_rel > 0) && (change->prev > 0)) {
+	double ratio = ((double) delta) / ((double) change->prev);
+
+	if (ratio <= query->change_rel) {
+	    return 0;
+	}
+    }
+
+    return 1;
+}
+
+static void
+print_change(
+	fc_change_t *change,
+	fc_query_t *query,
+	uint32_t start_time,
+	FILE *fout)
+{
+
+    fprintf(fout, "D,%ld,start_time,%d", change->curr, start_time);
+    fc_print_key(fout, query, change->key);
+    fprintf(fout, ",prev,%ld", change->prev);
+    if (query->show_query) {
+	fprintf(fout, ",%s", query->query_str);
+    }
+    fprintf(fout, "\n");
+}
+
+int
+fc_report_changes(
+	fc_chunk_t *chunk,
+	fc_query_t *query,
+	fc_count_order_t *counts,
+	uint64_t n_counts,
+	uint32_t start_time,
+	FILE *fout)
+{
+    uint8_t n_fields = query->n_fields;
+
+    fc_agg_t *curr = build_agg(chunk, query, counts, n_counts);
+    if (curr == NULL) {
+	fprintf(stderr, "ERROR: malloc failed\n");
+	return -1;
+    }
+
+    /*
+     * If this is the first interval, then there's nothing to compare
+     * against yet.  The first interval only establishes the baseline.
+     */
+    fc_agg_t *prev = query->prev;
+    if (prev == NULL) {
+	query->prev = curr;
+	return 0;
+    }
+
+    uint64_t max_changes = prev->n_keys + curr->n_keys;
+    fc_change_t *changes = NULL;
+    if (max_changes > 0) {
+	changes = malloc(max_changes * sizeof(fc_change_t));
+	if (changes == NULL) {
+	    fprintf(stderr, "ERROR: malloc failed\n");
+	    free_agg(curr);
+	    return -1;
+	}
+    }
+
+    uint64_t n_changes = 0;
+    uint64_t i = 0;
+    uint64_t j = 0;
+
+    while ((i < prev->n_keys) || (j < curr->n_keys)) {
+	const uint32_t *pkey = prev->keys + (i * n_fields);
+	const uint32_t *ckey = curr->keys + (j * n_fields);
+	fc_change_t *change = &changes[n_changes];
+	int cmp;
+
+	if (i == prev->n_keys) {
+	    cmp = 1;
+	}
+	else if (j == curr->n_keys) {
+	    cmp = -1;
+	}
+	else {
+	    cmp = key_compare(pkey, ckey, n_fields);
+	}
+
+	if (cmp < 0) {
+	    /* the key vanished */
+	    change->key = pkey;
+	    change->prev = prev->counts[i++];
+	    change->curr = 0;
+	}
+	else if (cmp > 0) {
+	    /* the key appeared */
+	    change->key = ckey;
+	    change->prev = 0;
+	    change->curr = curr->counts[j++];
+	}
+	else {
+	    change->key = ckey;
+	    change->prev = prev->counts[i++];
+	    change->curr = curr->counts[j++];
+	}
+
+	if (is_change(query, change)) {
+	    n_changes++;
+	}
+    }
+
+    if (query->show_max > 0) {
+	qsort(changes, n_changes, sizeof(fc_change_t), change_compare);
+    }
+    if (query->show_max < n_changes) {
+	n_changes = query->show_max;
+    }
+
+    for (uint64_t k = 0; k < n_changes; k++) {
+	print_change(&changes[k], query, start_time, fout);
+    }
+
+    free(changes);
+    free_agg(prev);
+    query->prev = curr;
+
+    return 0;
+}
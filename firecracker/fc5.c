@@ -47,9 +47,6 @@ fc_fc5_read(
 {
     int rc;
 
-    chain->first = NULL;
-    chain->curr = NULL;
-
     for (;;) {
 	fc_pkt_t new_pkt;
 
@@ -58,32 +55,26 @@ fc_fc5_read(
 	    break;
 	}
 
-	rc = fc_extend_chain(chain);
+	fc_pkt_t pkt;
+
+	pkt.saddr = ntohl(new_pkt.saddr);
+	pkt.daddr = ntohl(new_pkt.daddr);
+	pkt.sport = ntohs(new_pkt.sport);
+	pkt.dport = ntohs(new_pkt.dport);
+	pkt.proto = new_pkt.proto;
+	pkt.flags = new_pkt.flags;
+	pkt.len = ntohs(new_pkt.len);
+	pkt.ts.ts_sec = ntohl(new_pkt.ts.ts_sec);
+	pkt.ts.ts_usec = ntohl(new_pkt.ts.ts_usec);
+
+	/* If there's a filter, the chain checks it (see
+	 * fc_chain_set_filter)
+	 */
+	rc = fc_chain_append(chain, &pkt);
 	if (rc != 0) {
 	    pcap_free_chain(chain);
 	    return 1;
 	}
-
-	uint32_t curr_cnt = chain->curr->cnt;
-	fc_pkt_t *pkt = &chain->curr->pkts[curr_cnt];
-
-	pkt->saddr = ntohl(new_pkt.saddr);
-	pkt->daddr = ntohl(new_pkt.daddr);
-	pkt->sport = ntohs(new_pkt.sport);
-	pkt->dport = ntohs(new_pkt.dport);
-	pkt->proto = new_pkt.proto;
-	pkt->flags = new_pkt.flags;
-	pkt->len = ntohs(new_pkt.len);
-	pkt->ts.ts_sec = ntohl(new_pkt.ts.ts_sec);
-	pkt->ts.ts_usec = ntohl(new_pkt.ts.ts_usec);
-
-	/* If there's a filter, and it doesn't match this packet,
-	 * then don't increment the current count.  Just ignore
-	 * this packet
-	 */
-	if ((filter == NULL) || fc_filter_pkt(pkt, filter)) {
-	    chain->curr->cnt++;
-	}
     }
 
     return 0;
@@ -96,18 +87,20 @@ fc_fc5_write(
 {
 
     for (uint64_t i = 0; i < chunk->count; i++) {
-	fc_pkt_t *pkt = &chunk->pkts[i];
+	fc_pkt_t pkt;
 	fc_pkt_t new_pkt;
 
-	new_pkt.saddr = ntohl(pkt->saddr);
-	new_pkt.daddr = ntohl(pkt->daddr);
-	new_pkt.sport = ntohs(pkt->sport);
-	new_pkt.dport = ntohs(pkt->dport);
-	new_pkt.proto = pkt->proto;
-	new_pkt.flags = pkt->flags;
-	new_pkt.len = ntohs(pkt->len);
-	new_pkt.ts.ts_sec = ntohl(pkt->ts.ts_sec);
-	new_pkt.ts.ts_usec = ntohl(pkt->ts.ts_usec);
+	fc_chunk_get(chunk, i, &pkt);
+
+	new_pkt.saddr = ntohl(pkt.saddr);
+	new_pkt.daddr = ntohl(pkt.daddr);
+	new_pkt.sport = ntohs(pkt.sport);
+	new_pkt.dport = ntohs(pkt.dport);
+	new_pkt.proto = pkt.proto;
+	new_pkt.flags = pkt.flags;
+	new_pkt.len = ntohs(pkt.len);
+	new_pkt.ts.ts_sec = ntohl(pkt.ts.ts_sec);
+	new_pkt.ts.ts_usec = ntohl(pkt.ts.ts_usec);
 
 	size_t n_written = fwrite(&new_pkt, sizeof(fc_pkt_t), 1, fout);
 	if (n_written != 1) {
@@ -58,8 +58,6 @@ times over the same inputs, it may make sense to convert the inputs
 to fc5 first.
 */
 
-#define MAX_INPUT_FILES	(7 * 24)
-
 typedef struct {
     char **input_fnames;
     char *dump_file;
@@ -119,7 +117,7 @@ main(
 	return -1;
     }
 
-    pkt_chain_t chains[MAX_INPUT_FILES];
+    pkt_chain_t chain;
     fc_chunk_t chunk;
 
     if (fc_args.input_fnames[0] == NULL) {
@@ -128,25 +126,24 @@ main(
 	return -1;
     }
 
-    for (i = 0; fc_args.input_fnames[i] != NULL; i++) {
-
-	if (i >= MAX_INPUT_FILES) {
-	    fprintf(stderr, "%s: ERROR: too many input files (max=%d)\n",
-		    argv[0], MAX_INPUT_FILES);
-	    return -1;
-	}
+    rc = fc_chain_init(&chain, FC_COL_ALL);
+    if (rc != 0) {
+	fprintf(stderr, "%s: ERROR: could not allocate chain\n", argv[0]);
+	return -1;
+    }
 
+    for (i = 0; fc_args.input_fnames[i] != NULL; i++) {
 	char *fname = fc_args.input_fnames[i];
-	rc = fc_read_file(fname, &chains[i], NULL);
+
+	rc = fc_read_file(fname, &chain, NULL);
 	if (rc != 0) {
 	    fprintf(stderr, "%s: ERROR: could not read input [%s]\n",
 		    argv[0], fname);
 	    return -1;
 	}
     }
-    uint32_t n_chains = i;
 
-    rc = fc_merge_chains(chains, n_chains, &chunk);
+    rc = fc_sort_chain(&chain, &chunk);
     if (rc != 0) {
 	fprintf(stderr, "%s: ERROR: could not merge input files\n",
 		argv[0]);
@@ -30,6 +30,9 @@
  */
 /* CODEMARK: end */
 
+#include <stdlib.h>
+#include <ctype.h>
+#include <errno.h>
 #include <stdlib.h>
 
 #include "firecracker.h"
@@ -40,9 +43,9 @@
  * name[width]=value/...
  *
  * The name is the name of the field ot use (currently one of
- * S, D, P, E, or A) and the optional width is the prefix length
- * to use.  So, for example, if you wanted to match source address
- * 1.0.0.0/8, then you would use filter S8=1.0.0.0.
+ * S, D, P, E, A, L, s, or u) and the optional width is the prefix
+ * length to use.  So, for example, if you wanted to match source
+ * address 1.0.0.0/8, then you would use filter S8=1.0.0.0.
  *
  * for example:
  *
@@ -53,6 +56,29 @@
  *
  * Note that to satisfy the filter, ALL of the fields must match.
  *
+ * In addition:
+ *
+ * - A value may be a range (A=48000-65535) or a comma-separated list
+ *   of values and ranges (A=22,23,2222-2223).
+ *
+ * - Instead of a list of values, a field may name a file containing
+ *   the list, one value, range, or prefix (1.2.3.0/24) per line, with
+ *   # comments: S@ackscan.dat.  Since the file name may contain
+ *   slashes, it extends to the next '|' or the end of the filter,
+ *   so it must be the last field of its term.  IPv6 prefixes in the
+ *   file are ignored.
+ *
+ * - A field may be negated with a '!' prefix: !P=6
+ *
+ * - Several of these lists of fields (terms) may be separated by '|',
+ *   in which case a packet satisfies the filter if it satisfies ANY
+ *   of the terms:  P=6/A=23|P=17/A=53
+ *
+ * Single values and ranges are just compared directly.  Larger sets
+ * of values are stored in a bitmap (for fields that have 16 bits or
+ * fewer) or in a radix trie of prefixes (for 32-bit fields), so they
+ * can be matched quickly no matter how large they are.
+ *
  * All numbers are in decimal.
  */
 
@@ -67,15 +93,332 @@ fc_filter_pp(
 
     printf("filter n = %u\n", filter->n_fields);
     for (uint8_t i = 0; i < filter->n_fields; i++) {
+	printf("  %u: %s%c", fields[i].term,
+		fields[i].negate ? "!" : "", fields[i].name);
 	if (fields[i].width != 0) {
-	    printf("  %c%u=%u\n",
-		    fields[i].name, fields[i].width, fields[i].value);
+	    printf("%u", fields[i].width);
+	}
+
+	switch (fields[i].type) {
+	    case FC_FILTER_EQ:
+		printf("=%u\n", fields[i].value);
+		break;
+	    case FC_FILTER_RANGE:
+		printf("=%u-%u\n", fields[i].value, fields[i].value_hi);
+		break;
+	    case FC_FILTER_BITMAP:
+		printf(" in bitmap\n");
+		break;
+	    case FC_FILTER_PREFIXES:
+		printf(" in prefixes\n");
+		break;
+	}
+    }
+
+    return 0;
+}
+
+/*
+ * Fields that are 32 bits wide (and so use a prefix set instead of
+ * a bitmap when matched against a set of values)
+ */
+static int
+is_wide_field(
+	fc_field_name_t name)
+{
+
+    switch (name) {
+	case FC_FIELD_NAME_SADDR:
+	case FC_FIELD_NAME_DADDR:
+	case FC_FIELD_NAME_SEC:
+	case FC_FIELD_NAME_USEC:
+	    return 1;
+	default:
+	    return 0;
+    }
+}
+
+/*
+ * Parse one value for the given field: a dotted quad for addresses,
+ * and a decimal number for everything else.
+ */
+static int
+parse_value(
+	fc_field_name_t name,
+	const char *str,
+	uint32_t *value,
+	char **endptr)
+{
+
+    if (!isdigit((unsigned char) *str)) {
+	return -1;
+    }
+
+    if ((name == FC_FIELD_NAME_SADDR) || (name == FC_FIELD_NAME_DADDR)) {
+	uint32_t addr = 0;
+
+	for (int i = 0; i < 4; i++) {
+	    if (!isdigit((unsigned char) *str)) {
+		return -1;
+	    }
+	    unsigned long octet = strtoul(str, endptr, 10);
+	    if (octet > 255) {
+		return -1;
+	    }
+	    addr = (addr << 8) | octet;
+
+	    if (i < 3) {
+		if (**endptr != '.') {
+		    return -1;
+		}
+		str = *endptr + 1;
+	    }
+	}
+	*value = addr;
+    }
+    else {
+	unsigned long val = strtoul(str, endptr, 10);
+
+	if (val > (is_wide_field(name) ? 0xffffffff : 0xffff)) {
+	    return -1;
+	}
+	*value = val;
+    }
+
+    return 0;
+}
+
+/*
+ * Parse one element of a list of values: either a single value or
+ * a range (lo-hi).  If allow_len is set, then the element may also
+ * be a prefix (value/len), and *len is set to the length of the
+ * prefix (or 0, if there's no explicit length).
+ */
+static int
+parse_element(
+	fc_field_name_t name,
+	const char *str,
+	int allow_len,
+	uint32_t *lo,
+	uint32_t *hi,
+	uint8_t *len,
+	char **endptr)
+{
+
+    *len = 0;
+
+    if (parse_value(name, str, lo, endptr) != 0) {
+	return -1;
+    }
+    *hi = *lo;
+
+    if (**endptr == '-') {
+	if (parse_value(name, *endptr + 1, hi, endptr) != 0) {
+	    return -1;
+	}
+	if (*hi < *lo) {
+	    return -1;
+	}
+    }
+    else if (allow_len && (**endptr == '/')) {
+	str = *endptr + 1;
+	if (!isdigit((unsigned char) *str)) {
+	    return -1;
+	}
+	unsigned long prefix_len = strtoul(str, endptr, 10);
+	if ((prefix_len < 1) || (prefix_len > 32)) {
+	    return -1;
+	}
+	*len = prefix_len;
+    }
+
+    return 0;
+}
+
+/*
+ * Make the given field into an empty set: a bitmap or a prefix set,
+ * depending on the width of the field.
+ */
+static int
+init_set(
+	fc_filter_field_t *field)
+{
+
+    if (is_wide_field(field->name)) {
+	field->prefixes = fc_prefix_new();
+	if (field->prefixes == NULL) {
+	    return -1;
+	}
+	field->type = FC_FILTER_PREFIXES;
+    }
+    else {
+	field->bitmap = calloc(FC_FILTER_BITMAP_WORDS, sizeof(uint64_t));
+	if (field->bitmap == NULL) {
+	    fprintf(stderr, "ERROR: malloc failed\n");
+	    return -1;
+	}
+	field->type = FC_FILTER_BITMAP;
+    }
+
+    return 0;
+}
+
+/*
+ * Add a value, range, or prefix (as parsed by parse_element) to the
+ * set for the given field.  Single values are masked according to
+ * the width of the field.
+ */
+static int
+add_to_set(
+	fc_filter_field_t *field,
+	uint32_t lo,
+	uint32_t hi,
+	uint8_t len)
+{
+
+    if (field->type == FC_FILTER_PREFIXES) {
+	if (len > 0) {
+	    return fc_prefix_add(field->prefixes, lo, len);
+	}
+	else if (lo == hi) {
+	    return fc_prefix_add(field->prefixes, lo,
+		    field->width ? field->width : 32);
 	}
 	else {
-	    printf("  %c=%u\n", fields[i].name, fields[i].value);
+	    return fc_prefix_add_range(field->prefixes, lo, hi);
+	}
+    }
+    else {
+	if (lo == hi) {
+	    lo &= fc_width_mask(field->width);
+	    hi = lo;
+	}
+	for (uint32_t v = lo; v <= hi; v++) {
+	    field->bitmap[v >> 6] |= 1ULL << (v & 63);
+	}
+	return 0;
+    }
+}
+
+/*
+ * Add an element (as parsed by parse_element) to the values for the
+ * field.  A single value or range is stored directly, and only when
+ * a second element is added is the field converted into a set.
+ */
+static int
+add_element(
+	fc_filter_field_t *field,
+	int is_first,
+	uint32_t lo,
+	uint32_t hi)
+{
+
+    if (is_first) {
+	if (lo == hi) {
+	    field->type = FC_FILTER_EQ;
+	    field->value = lo & fc_width_mask(field->width);
+	    field->value_hi = field->value;
+	}
+	else {
+	    field->type = FC_FILTER_RANGE;
+	    field->value = lo;
+	    field->value_hi = hi;
+	}
+	return 0;
+    }
+
+    if ((field->type == FC_FILTER_EQ) || (field->type == FC_FILTER_RANGE)) {
+	uint32_t old_lo = field->value;
+	uint32_t old_hi = field->value_hi;
+
+	if ((init_set(field) != 0) ||
+		(add_to_set(field, old_lo, old_hi, 0) != 0)) {
+	    return -1;
 	}
     }
 
+    return add_to_set(field, lo, hi, 0);
+}
+
+/*
+ * Read a list of values, ranges, and prefixes for the given field
+ * from a file, one per line.
+ */
+static int
+load_file(
+	fc_filter_field_t *field,
+	char *fname)
+{
+    char buf[MAX_LINE_LEN];
+    uint64_t line_num = 0;
+    int n_elems = 0;
+
+    FILE *fin = fopen(fname, "r");
+    if (fin == NULL) {
+	fprintf(stderr, "ERROR: could not open [%s]: %s\n",
+		fname, strerror(errno));
+	return -1;
+    }
+
+    while (fgets(buf, MAX_LINE_LEN, fin) != NULL) {
+	uint32_t lo, hi;
+	uint8_t len;
+	char *endptr;
+	char *p = buf;
+
+	line_num++;
+
+	char *comment = strchr(buf, '#');
+	if (comment != NULL) {
+	    *comment = '\0';
+	}
+	while (isspace((unsigned char) *p)) {
+	    p++;
+	}
+	if (*p == '\0') {
+	    continue;
+	}
+
+	/* Skip IPv6 prefixes, since we only handle IPv4 */
+	if (strchr(p, ':') != NULL) {
+	    continue;
+	}
+
+	if ((parse_element(field->name, p, 1, &lo, &hi, &len, &endptr) != 0) ||
+		(len > 0 && !is_wide_field(field->name))) {
+	    fprintf(stderr, "ERROR: bad value in [%s] line %lu\n",
+		    fname, line_num);
+	    fclose(fin);
+	    return -1;
+	}
+	while (isspace((unsigned char) *endptr)) {
+	    endptr++;
+	}
+	if (*endptr != '\0') {
+	    fprintf(stderr, "ERROR: bad value in [%s] line %lu\n",
+		    fname, line_num);
+	    fclose(fin);
+	    return -1;
+	}
+
+	if ((n_elems == 0) && (init_set(field) != 0)) {
+	    fclose(fin);
+	    return -1;
+	}
+	if (add_to_set(field, lo, hi, len) != 0) {
+	    fclose(fin);
+	    return -1;
+	}
+	n_elems++;
+    }
+
+    fclose(fin);
+
+    if (n_elems == 0) {
+	fprintf(stderr, "ERROR: no values in [%s]\n", fname);
+	return -1;
+    }
+
     return 0;
 }
 
@@ -87,70 +430,104 @@ fc_str2filter(
 	fc_filter_t *filter)
 {
     uint32_t field_index = 0;
+    uint8_t term = 0;
     char *endptr;
-    int rc;
+
+    memset(filter, 0, sizeof(fc_filter_t));
 
     while (*str != '\0') {
+	if (field_index >= FC_FILTER_MAX_FIELDS) {
+	    fprintf(stderr, "ERROR: too many fields in filter\n");
+	    fc_free_filter(filter);
+	    return -1;
+	}
+
+	fc_filter_field_t *field = &filter->fields[field_index];
+
+	field->term = term;
+	if (*str == '!') {
+	    field->negate = 1;
+	    str++;
+	}
+
 	switch (*str) {
 	    case FC_FIELD_NAME_SADDR:
-	    case FC_FIELD_NAME_DADDR: {
-		uint8_t b3, b2, b1, b0;
-		int consumed;
+	    case FC_FIELD_NAME_DADDR:
+	    case FC_FIELD_NAME_SPORT:
+	    case FC_FIELD_NAME_DPORT:
+	    case FC_FIELD_NAME_PROTO:
+	    case FC_FIELD_NAME_LEN:
+	    case FC_FIELD_NAME_SEC:
+	    case FC_FIELD_NAME_USEC:
+		field->name = *str;
+		break;
+	    default:
+	       fprintf(stderr, "ERROR: bad field name [%c]\n", *str);
+	       fc_free_filter(filter);
+	       return -1;
+	}
 
-		filter->fields[field_index].name = *str;
+	filter->cols |= fc_field2col(field->name);
 
-		uint32_t width = strtol(str + 1, &endptr, 10);
-		filter->fields[field_index].width = width;
+	uint32_t width = strtol(str + 1, &endptr, 10);
+	if (width > 32) {
+	    fprintf(stderr, "ERROR: bad width [%u]\n", width);
+	    fc_free_filter(filter);
+	    return -1;
+	}
+	field->width = width;
+	field_index++;
+	filter->n_fields = field_index;
 
-		if (*endptr != '=') {
-		    fprintf(stderr, "ERROR: expected '=' after field name\n");
-		    return -1;
-		}
-		str = endptr + 1;
-		rc = sscanf(str, "%hhu.%hhu.%hhu.%hhu%n",
-			&b3, &b2, &b1, &b0, &consumed);
-		if (rc != 4) {
-		   fprintf(stderr, "ERROR: bad IP address [%s]\n", str);
-		    return -1;
-		}
-		filter->fields[field_index].value =
-			(b3 << 24) | (b2 << 16) | (b1 << 8) | b0;
-		str += consumed;
-		break;
+	if (*endptr == '@') {
+	    str = endptr + 1;
+
+	    size_t fname_len = strcspn(str, "|");
+	    char *fname = strndup(str, fname_len);
+	    if (fname == NULL) {
+		fprintf(stderr, "ERROR: malloc failed\n");
+		fc_free_filter(filter);
+		return -1;
 	    }
 
-	    case FC_FIELD_NAME_SPORT:
-	    case FC_FIELD_NAME_DPORT:
-	    case FC_FIELD_NAME_PROTO:
-	    case FC_FIELD_NAME_SEC: {
-		filter->fields[field_index].name = *str;
+	    int rc = load_file(field, fname);
+	    free(fname);
+	    if (rc != 0) {
+		fc_free_filter(filter);
+		return -1;
+	    }
+	    str += fname_len;
+	}
+	else if (*endptr == '=') {
+	    str = endptr + 1;
 
-		uint32_t width = strtol(str + 1, &endptr, 10);
-		filter->fields[field_index].width = width;
+	    for (int i = 0; ; i++) {
+		uint32_t lo, hi;
+		uint8_t len;
 
-		if (*endptr != '=') {
-		   fprintf(stderr, "ERROR: expected '=' after field name\n");
+		if (parse_element(field->name, str, 0,
+			    &lo, &hi, &len, &endptr) != 0) {
+		    fprintf(stderr, "ERROR: bad value [%s]\n", str);
+		    fc_free_filter(filter);
 		    return -1;
 		}
-		str = endptr + 1;
-		uint32_t value = strtol(str, &endptr, 10);
-		filter->fields[field_index].value = value;
-
-		if (endptr != str + 1) {
-		    str = endptr;
-		}
-		else {
-		    str++;
+		if (add_element(field, i == 0, lo, hi) != 0) {
+		    fc_free_filter(filter);
+		    return -1;
 		}
 
-		break;
+		str = endptr;
+		if (*str != ',') {
+		    break;
+		}
+		str++;
 	    }
-	    default:
-	       fprintf(stderr, "ERROR: bad field name [%c]\n", *str);
-	       return -1;
 	}
-
-	field_index++;
+	else {
+	    fprintf(stderr, "ERROR: expected '=' or '@' after field name\n");
+	    fc_free_filter(filter);
+	    return -1;
+	}
 
 	if (*str == '\0') {
 	    break;
@@ -158,12 +535,115 @@ fc_str2filter(
 	else if (*str == '/') {
 	    str++;
 	}
+	else if (*str == '|') {
+	    str++;
+	    term++;
+	}
 	else {
+	    fprintf(stderr, "ERROR: bad filter syntax at [%s]\n", str);
+	    fc_free_filter(filter);
 	    return -1;
 	}
     }
 
-    filter->n_fields = field_index;
+    return 0;
+}
+
+void
+fc_free_filter(
+	fc_filter_t *filter)
+{
+
+    for (uint8_t i = 0; i < filter->n_fields; i++) {
+	free(filter->fields[i].bitmap);
+	fc_prefix_free(filter->fields[i].prefixes);
+	filter->fields[i].bitmap = NULL;
+	filter->fields[i].prefixes = NULL;
+    }
+    filter->n_fields = 0;
+    filter->cols = 0;
+}
+
+static inline int
+filter_field_match(
+	fc_filter_field_t *field,
+	uint32_t val)
+{
+    int match;
+
+    val &= fc_width_mask(field->width);
+
+    switch (field->type) {
+	case FC_FILTER_EQ:
+	    match = (val == field->value);
+	    break;
+	case FC_FILTER_RANGE:
+	    match = (val >= field->value) && (val <= field->value_hi);
+	    break;
+	case FC_FILTER_BITMAP:
+	    match = (val <= 0xffff) &&
+		    ((field->bitmap[val >> 6] >> (val & 63)) & 1);
+	    break;
+	case FC_FILTER_PREFIXES:
+	    match = fc_prefix_match(field->prefixes, val);
+	    break;
+	default:
+	    match = 0;
+	    break;
+    }
+
+    return match ^ field->negate;
+}
+
+/*
+ * Check the packet against the filter, using only the fields of the
+ * packet that are in known_cols (the others are assumed to match).
+ * Returns 0 if the packet can't match, and 1 if it might.
+ *
+ * This lets the readers reject a packet as soon as they've decoded
+ * enough of it to know that it won't match, instead of decoding
+ * all of it first.
+ */
+int
+fc_filter_partial(
+	fc_pkt_t *pkt,
+	fc_filter_t *filter,
+	uint32_t known_cols)
+{
+    uint8_t i = 0;
+
+    if (filter->n_fields == 0) {
+	return 1;
+    }
+
+    /*
+     * Check each term in turn, and stop at the first one that
+     * matches.  Within each term, stop at the first field that
+     * doesn't match.
+     */
+    while (i < filter->n_fields) {
+	uint8_t term = filter->fields[i].term;
+	int match = 1;
+
+	for (; (i < filter->n_fields) && (filter->fields[i].term == term); i++) {
+	    fc_filter_field_t *field = &filter->fields[i];
+
+	    if (!(known_cols & fc_field2col(field->name))) {
+		continue;
+	    }
+	    if (!filter_field_match(field, fetch_field(pkt, field->name))) {
+		match = 0;
+		break;
+	    }
+	}
+	if (match) {
+	    return 1;
+	}
+
+	while ((i < filter->n_fields) && (filter->fields[i].term == term)) {
+	    i++;
+	}
+    }
 
     return 0;
 }
@@ -174,27 +654,371 @@ fc_filter_pkt(
 	fc_filter_t *filter)
 {
 
-    for (uint8_t i = 0; i < filter->n_fields; i++) {
-	fc_field_name_t name = filter->fields[i].name;
-	uint32_t val1 = fetch_field(pkt, name);
-	uint32_t val2 = filter->fields[i].value;
-	uint8_t width = filter->fields[i].width;
+    return fc_filter_partial(pkt, filter, FC_COL_ALL);
+}
 
-	if (width > 0) {
-	    uint32_t mask = 0xffffffff & ~((1 << (32 - width)) - 1);
+/*
+ * The BPF expressions for the fields of an IPv4 packet, in the same
+ * form as firecracker reads them (so the "ports" are the first two
+ * 16-bit words after the IP header, whatever the protocol is)
+ */
+static const char *
+bpf_field(
+	fc_field_name_t name)
+{
 
-	    val1 &= mask;
-	    val2 &= mask;
+    switch (name) {
+	case FC_FIELD_NAME_SADDR:
+	    return "ip[12:4]";
+	case FC_FIELD_NAME_DADDR:
+	    return "ip[16:4]";
+	case FC_FIELD_NAME_SPORT:
+	    return "ip[((ip[0] & 0xf) << 2):2]";
+	case FC_FIELD_NAME_DPORT:
+	    return "ip[((ip[0] & 0xf) << 2) + 2:2]";
+	case FC_FIELD_NAME_PROTO:
+	    return "ip[9]";
+	case FC_FIELD_NAME_LEN:
+	    return "ip[2:2]";
+	default:
+	    return NULL;
+    }
+}
+
+/*
+ * Translate the terms of the filter into a BPF expression for the
+ * fields of an IPv4 header, in buf.  Returns the length of the
+ * expression, or -1 if it would accept everything or didn't fit in
+ * buf.  See fc_filter2bpf.
+ */
+static int
+bpf_terms(
+	fc_filter_t *filter,
+	char *buf,
+	size_t buf_len)
+{
+    size_t used = 0;
+    uint8_t i = 0;
+
+    while (i < filter->n_fields) {
+	uint8_t term = filter->fields[i].term;
+	int n_translated = 0;
+
+	if (used < buf_len) {
+	    used += snprintf(buf + used, buf_len - used, "%s(",
+		    (term == 0) ? "" : " or ");
 	}
 
-	if (val1 != val2) {
-	    return 0;
+	for (; (i < filter->n_fields) && (filter->fields[i].term == term); i++) {
+	    fc_filter_field_t *field = &filter->fields[i];
+	    const char *expr = bpf_field(field->name);
+	    char masked[128];
+
+	    if ((expr == NULL) || (used >= buf_len) ||
+		    ((field->type != FC_FILTER_EQ) &&
+		     (field->type != FC_FILTER_RANGE))) {
+		continue;
+	    }
+
+	    if ((field->width == 0) || (field->width >= 32)) {
+		snprintf(masked, sizeof(masked), "%s", expr);
+	    }
+	    else {
+		snprintf(masked, sizeof(masked), "(%s & 0x%x)",
+			expr, fc_width_mask(field->width));
+	    }
+
+	    used += snprintf(buf + used, buf_len - used, "%s%s(",
+		    (n_translated == 0) ? "" : " and ",
+		    field->negate ? "not " : "");
+	    if (used >= buf_len) {
+		continue;
+	    }
+
+	    if (field->type == FC_FILTER_EQ) {
+		used += snprintf(buf + used, buf_len - used, "%s = %u)",
+			masked, field->value);
+	    }
+	    else {
+		used += snprintf(buf + used, buf_len - used,
+			"%s >= %u and %s <= %u)",
+			masked, field->value, masked, field->value_hi);
+	    }
+	    n_translated++;
+	}
+
+	/*
+	 * If none of the fields in this term could be translated,
+	 * then the term (and therefore the whole filter) would accept
+	 * every packet, so there's no point in using BPF at all.
+	 */
+	if (n_translated == 0) {
+	    return -1;
+	}
+
+	if (used < buf_len) {
+	    used += snprintf(buf + used, buf_len - used, ")");
+	}
+    }
+
+    return (used < buf_len) ? (int) used : -1;
+}
+
+/*
+ * Translate the filter into a BPF filter expression (for pcap_compile)
+ * that accepts at least every packet that the filter accepts, so that
+ * libpcap can discard most of the other packets before they're even
+ * passed to the reader.
+ *
+ * Fields that can't be translated (sets of values and timestamps)
+ * are left out of their term, which only makes the BPF filter accept
+ * more packets, so the packets must still be checked with the filter
+ * afterwards.
+ *
+ * The readers also accept IPv4 packets inside as many as vlan_tags
+ * stacked VLAN tags (which the BPF "ip" test doesn't match), so the
+ * expression repeats the test for each number of tags, after that
+ * many "vlan" tests (each of which moves the offsets of the tests
+ * that follow it past one more tag).  vlan_tags must be 0 for link
+ * types that can't have VLAN tags, because pcap_compile rejects
+ * "vlan" for them.
+ *
+ * Returns 0 if a useful expression was created, or -1 if not (because
+ * it would accept everything, or it didn't fit in buf).
+ */
+int
+fc_filter2bpf(
+	fc_filter_t *filter,
+	int vlan_tags,
+	char *buf,
+	size_t buf_len)
+{
+    size_t used = 0;
+
+    if (filter->n_fields == 0) {
+	return -1;
+    }
+
+    char *terms = malloc(buf_len);
+    if (terms == NULL) {
+	return -1;
+    }
+    if (bpf_terms(filter, terms, buf_len) < 0) {
+	free(terms);
+	return -1;
+    }
+
+    /*
+     * For example, with one tag:
+     * (ip and (T)) or (vlan and ((ip and (T))))
+     */
+    for (int i = 0; (i <= vlan_tags) && (used < buf_len); i++) {
+	used += snprintf(buf + used, buf_len - used, "%s(ip and (%s))",
+		(i == 0) ? "" : " or (vlan and (", terms);
+    }
+    for (int i = 0; (i < vlan_tags) && (used < buf_len); i++) {
+	used += snprintf(buf + used, buf_len - used, "))");
+    }
+
+    free(terms);
+
+    return (used < buf_len) ? 0 : -1;
+}
+
+/*
+ * The batched filter kernel.  Instead of checking one packet at a
+ * time against all of the fields of the filter, check one field at
+ * a time against a block of packets, reading the column for that
+ * field directly.  For single values and ranges (the most common
+ * cases, like address prefixes, protocols, and ports), the inner
+ * loops are simple enough for the compiler to vectorize them into
+ * SIMD masked compares.
+ *
+ * The result for each packet in the block is kept in a byte array:
+ * for each term, the results for each of its fields are ANDed
+ * together, and then the results for each term are ORed together.
+ * Finally the array is converted into a selection vector (a list of
+ * the indices of the packets that matched).
+ */
+
+/*
+ * AND the result of test (which may use the masked value v of the
+ * ith element of the column) into m[i] for each of the n elements
+ * of the column.
+ */
+#define FILTER_LOOP(col_type, col, test) \
+    do { \
+	const col_type *c = (const col_type *) (col); \
+	for (uint64_t i = 0; i < n; i++) { \
+	    uint32_t v = c[i] & mask; \
+	    m[i] &= (uint8_t) ((test) ^ negate); \
+	} \
+    } while (0)
+
+/*
+ * Apply the given field to n packets of the chunk, starting at base,
+ * and AND the result into m.
+ */
+static void
+filter_field_block(
+	fc_filter_field_t *field,
+	fc_chunk_t *chunk,
+	uint64_t base,
+	uint64_t n,
+	uint8_t *m)
+{
+    const uint32_t mask = fc_width_mask(field->width);
+    const uint32_t lo = field->value;
+    const uint32_t hi = field->value_hi;
+    const uint8_t negate = field->negate;
+    const uint64_t *bitmap = field->bitmap;
+    const void *col;
+    size_t size;
+
+    switch (field->name) {
+	case FC_FIELD_NAME_SADDR:
+	    col = chunk->saddr + base;
+	    size = sizeof(uint32_t);
+	    break;
+	case FC_FIELD_NAME_DADDR:
+	    col = chunk->daddr + base;
+	    size = sizeof(uint32_t);
+	    break;
+	case FC_FIELD_NAME_SPORT:
+	    col = chunk->sport + base;
+	    size = sizeof(uint16_t);
+	    break;
+	case FC_FIELD_NAME_DPORT:
+	    col = chunk->dport + base;
+	    size = sizeof(uint16_t);
+	    break;
+	case FC_FIELD_NAME_PROTO:
+	    col = chunk->proto + base;
+	    size = sizeof(uint8_t);
+	    break;
+	case FC_FIELD_NAME_FLAGS:
+	    col = chunk->flags + base;
+	    size = sizeof(uint8_t);
+	    break;
+	case FC_FIELD_NAME_LEN:
+	    col = chunk->len + base;
+	    size = sizeof(uint16_t);
+	    break;
+	case FC_FIELD_NAME_SEC:
+	    col = chunk->ts_sec + base;
+	    size = sizeof(uint32_t);
+	    break;
+	case FC_FIELD_NAME_USEC:
+	    col = chunk->ts_usec + base;
+	    size = sizeof(uint32_t);
+	    break;
+	default:
+	    memset(m, 0, n);
+	    return;
+    }
+
+    switch (field->type) {
+	case FC_FILTER_EQ:
+	    if (size == sizeof(uint32_t)) {
+		FILTER_LOOP(uint32_t, col, v == lo);
+	    }
+	    else if (size == sizeof(uint16_t)) {
+		FILTER_LOOP(uint16_t, col, v == lo);
+	    }
+	    else {
+		FILTER_LOOP(uint8_t, col, v == lo);
+	    }
+	    break;
+	case FC_FILTER_RANGE:
+	    if (size == sizeof(uint32_t)) {
+		FILTER_LOOP(uint32_t, col, (v >= lo) && (v <= hi));
+	    }
+	    else if (size == sizeof(uint16_t)) {
+		FILTER_LOOP(uint16_t, col, (v >= lo) && (v <= hi));
+	    }
+	    else {
+		FILTER_LOOP(uint8_t, col, (v >= lo) && (v <= hi));
+	    }
+	    break;
+	case FC_FILTER_BITMAP:
+	    if (size == sizeof(uint16_t)) {
+		FILTER_LOOP(uint16_t, col,
+			(v <= 0xffff) && ((bitmap[v >> 6] >> (v & 63)) & 1));
+	    }
+	    else {
+		FILTER_LOOP(uint8_t, col, (bitmap[v >> 6] >> (v & 63)) & 1);
+	    }
+	    break;
+	case FC_FILTER_PREFIXES:
+	    FILTER_LOOP(uint32_t, col, fc_prefix_match(field->prefixes, v));
+	    break;
+    }
+}
+
+/*
+ * Apply the filter to count packets of the chunk, starting at base,
+ * and write the indices of the packets that match into sel.  Returns
+ * the number of packets that matched.  The chunk must have a column
+ * for each of the fields used by the filter.
+ */
+uint64_t
+fc_filter_block(
+	fc_filter_t *filter,
+	fc_chunk_t *chunk,
+	uint64_t base,
+	uint64_t count,
+	uint64_t *sel)
+{
+    uint8_t any[FC_FILTER_BLOCK_SIZE];
+    uint8_t term_match[FC_FILTER_BLOCK_SIZE];
+    uint64_t n_sel = 0;
+
+    if (filter->n_fields == 0) {
+	for (uint64_t i = 0; i < count; i++) {
+	    sel[i] = base + i;
+	}
+	return count;
+    }
+
+    for (uint64_t start = 0; start < count; start += FC_FILTER_BLOCK_SIZE) {
+	uint64_t n = count - start;
+	uint8_t i = 0;
+
+	if (n > FC_FILTER_BLOCK_SIZE) {
+	    n = FC_FILTER_BLOCK_SIZE;
+	}
+
+	memset(any, 0, n);
+	while (i < filter->n_fields) {
+	    uint8_t term = filter->fields[i].term;
+
+	    memset(term_match, 1, n);
+	    for (; (i < filter->n_fields) &&
+		    (filter->fields[i].term == term); i++) {
+		filter_field_block(&filter->fields[i], chunk,
+			base + start, n, term_match);
+	    }
+
+	    for (uint64_t j = 0; j < n; j++) {
+		any[j] |= term_match[j];
+	    }
+	}
+
+	/* Convert the results to a selection vector, without branches */
+	for (uint64_t j = 0; j < n; j++) {
+	    sel[n_sel] = base + start + j;
+	    n_sel += any[j];
 	}
     }
 
-    return 1;
+    return n_sel;
 }
 
+/*
+ * Note that the chunk must have a column for each of the fields
+ * used by the filter.  (Usually the filter is applied as the input
+ * is read, so those columns aren't loaded unless a query uses them.)
+ */
 int
 fc_apply_filter(
 	fc_filter_t *filter,
@@ -220,14 +1044,7 @@ fc_apply_filter(
      * filter.
      */
 
-    uint64_t matches = 0;
-    for (uint64_t i = 0; i < n_elem; i++) {
-	if (fc_filter_pkt(&chunk->pkts[base + i], filter)) {
-	    elems->order[matches++] = base + i;
-	}
-    }
-
-    elems->count = matches;
+    elems->count = fc_filter_block(filter, chunk, base, n_elem, elems->order);
 
     return 0;
 }
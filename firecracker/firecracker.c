@@ -87,7 +87,6 @@ This example read input.pcap, and create several table files:
 
 */
 
-#define MAX_INPUT_FILES	(7 * 24)
 #define MAX_QUERIES (25)
 
 typedef struct {
@@ -103,8 +102,23 @@ typedef struct {
     int alignment;
     char *stdin_type;
     int normalized;
+    int change_mode;
+    uint64_t change_abs;
+    double change_rel;
+    int pivot_mode;
+    uint64_t pivot_top_k;
+    fc_pivot_format_t pivot_format;
+    uint64_t mem_limit;
 } firecracker_args_t;
 
+/* Long options that don't have a short equivalent */
+#define OPT_MEM_LIMIT	(256)
+
+static struct option long_opts[] = {
+    { "mem-limit", required_argument, NULL, OPT_MEM_LIMIT },
+    { NULL, 0, NULL, 0 }
+};
+
 
 static void
 usage(char *const prog)
@@ -115,24 +129,84 @@ usage(char *const prog)
 	    prog);
     printf("    -h          Print help message and exit.\n");
     printf("    -A N        Align timing intervals on N-second boundaries.\n");
+    printf("    -d N        Only show the keys whose count changed by more\n");
+    printf("                than N since the previous interval.\n");
     printf("    -F FILTER   Apply FILTER to the data prior to the query\n");
     printf("    -I N        Group the output by N seconds.  The default\n");
     printf("                value of N is 900.\n");
     printf("    -m N        Only show the top N values for each group,\n");
     printf("                instead of showing all of them.\n");
+    printf("    -M K        Print a matrix of the counts for the top K keys\n");
+    printf("                over the entire input (or all keys, if K is 0),\n");
+    printf("                with one column per interval.\n");
     printf("    -n          Print the normalized counts (as a fraction of the total)\n");
     printf("                in addition to the raw counts.\n");
     printf("    -o FNAME    Write output to the given FNAME instead of stdout.\n");
+    printf("    -P FORMAT   The format of the matrix printed by -M, which\n");
+    printf("                must be one of csv, sparse, or bin.  The\n");
+    printf("                default is csv.\n");
+    printf("    -r FRAC     Only show the keys whose count changed by more\n");
+    printf("                than FRAC (relative to the count in the previous\n");
+    printf("                interval) since the previous interval.\n");
     printf("    -s type     If reading from stdin, specify the input type,\n");
     printf("                which must be one of csv, pcap, or fc5.  The\n");
     printf("                default is csv.\n");
     printf("    -t QUERY    Specify the query and grouping to use.\n");
     printf("                The default QUERY is \"PA\".\n");
     printf("    -T          Add the query to the end of each count line.\n");
+    printf("    --mem-limit SIZE\n");
+    printf("                Try to use at most SIZE bytes for aggregating each\n");
+    printf("                interval, spilling to temporary files if needed.\n");
+    printf("                SIZE may have a K, M, G, or T suffix.\n");
 
     return;
 }
 
+/*
+ * Parse a size, in bytes, with an optional K, M, G, or T suffix
+ * (which are powers of 1024, not 1000).
+ */
+static int
+parse_size(
+	const char *str,
+	uint64_t *size)
+{
+    char *endptr;
+    uint64_t scale = 1;
+
+    if ((str[0] < '0') || (str[0] > '9')) {
+	return -1;
+    }
+
+    uint64_t val = strtoull(str, &endptr, 10);
+
+    switch (*endptr) {
+	case '\0':
+	    break;
+	case 'K': case 'k':
+	    scale = 1ULL << 10;
+	    break;
+	case 'M': case 'm':
+	    scale = 1ULL << 20;
+	    break;
+	case 'G': case 'g':
+	    scale = 1ULL << 30;
+	    break;
+	case 'T': case 't':
+	    scale = 1ULL << 40;
+	    break;
+	default:
+	    return -1;
+    }
+
+    if ((*endptr != '\0') && (endptr[1] != '\0')) {
+	return -1;
+    }
+
+    *size = val * scale;
+    return 0;
+}
+
 static int
 parse_args(
 	int argc,
@@ -153,12 +227,20 @@ parse_args(
     args->stdin_type = "csv";
     args->normalized = 0;
     args->output_fname = NULL;
+    args->change_mode = 0;
+    args->change_abs = 0;
+    args->change_rel = 0.0;
+    args->pivot_mode = 0;
+    args->pivot_top_k = 0;
+    args->pivot_format = FC_PIVOT_CSV;
+    args->mem_limit = 0;
 
     for (int i = 0; i < MAX_QUERIES; i++) {
 	args->queries[i].n_fields = 0;
     }
 
-    while ((opt = getopt(argc, argv, "A:hF:I:m:no:s:t:T")) != -1) {
+    while ((opt = getopt_long(argc, argv, "A:d:hF:I:m:M:no:P:r:s:t:T",
+		    long_opts, NULL)) != -1) {
 	switch (opt) {
 	    case 'A':
 		args->alignment = strtol(optarg, NULL, 10);
@@ -168,6 +250,18 @@ parse_args(
 		    return -1;
 		}
 		break;
+	    case 'd': {
+		char *endptr;
+
+		args->change_abs = strtoull(optarg, &endptr, 10);
+		if ((*endptr != '\0') || (optarg[0] == '-')) {
+		    fprintf(stderr, "%s: ERROR: change threshold must be >= 0\n",
+			    argv[0]);
+		    return -1;
+		}
+		args->change_mode = 1;
+		break;
+	    }
 	    case 'h':
 		usage(argv[0]);
 		exit(0);
@@ -191,9 +285,49 @@ parse_args(
 		    return -1;
 		}
 		break;
+	    case 'M': {
+		char *endptr;
+
+		args->pivot_top_k = strtoull(optarg, &endptr, 10);
+		if ((*endptr != '\0') || (optarg[0] == '-')) {
+		    fprintf(stderr, "%s: ERROR: top-K must be >= 0\n",
+			    argv[0]);
+		    return -1;
+		}
+		args->pivot_mode = 1;
+		break;
+	    }
 	    case 'n':
 		args->normalized = 1;
 		break;
+	    case 'P':
+		if (!strcmp(optarg, "csv")) {
+		    args->pivot_format = FC_PIVOT_CSV;
+		}
+		else if (!strcmp(optarg, "sparse")) {
+		    args->pivot_format = FC_PIVOT_SPARSE;
+		}
+		else if (!strcmp(optarg, "bin")) {
+		    args->pivot_format = FC_PIVOT_BIN;
+		}
+		else {
+		    fprintf(stderr, "%s: ERROR: unknown pivot format [%s]\n",
+			    argv[0], optarg);
+		    return -1;
+		}
+		break;
+	    case 'r': {
+		char *endptr;
+
+		args->change_rel = strtod(optarg, &endptr);
+		if ((*endptr != '\0') || (args->change_rel < 0)) {
+		    fprintf(stderr, "%s: ERROR: relative change must be >= 0\n",
+			    argv[0]);
+		    return -1;
+		}
+		args->change_mode = 1;
+		break;
+	    }
 	    case 't':
 		query_strs[args->n_queries++] = optarg;
 		break;
@@ -206,6 +340,13 @@ parse_args(
 	    case 'o':
 		args->output_fname = optarg;
 		break;
+	    case OPT_MEM_LIMIT:
+		if (parse_size(optarg, &args->mem_limit) != 0) {
+		    fprintf(stderr, "%s: ERROR: bad memory limit [%s]\n",
+			    argv[0], optarg);
+		    return -1;
+		}
+		break;
 	    default:
 		/* OOPS -- should not happen */
 		return -1;
@@ -217,6 +358,12 @@ parse_args(
 	args->n_queries = 1;
     }
 
+    if (args->pivot_mode && args->change_mode) {
+	fprintf(stderr, "%s: ERROR: -M cannot be combined with -d or -r\n",
+		argv[0]);
+	return -1;
+    }
+
     /*
      * If there are multiple queries, then *always* show the
      * query for each line of the output
@@ -235,6 +382,11 @@ parse_args(
 	args->queries[i].show_max = args->show_max;
 	args->queries[i].query_str = query_strs[i];
 	args->queries[i].show_query = args->show_query;
+	args->queries[i].change_mode = args->change_mode;
+	args->queries[i].change_abs = args->change_abs;
+	args->queries[i].change_rel = args->change_rel;
+	args->queries[i].prev = NULL;
+	args->queries[i].mem_limit = args->mem_limit;
     }
 
     if (filter_str != NULL) {
@@ -258,66 +410,70 @@ main(
 {
     firecracker_args_t fc_args;
     uint32_t i;
-    uint32_t n_chains;
 
     int rc = parse_args(argc, argv, &fc_args);
     if (rc != 0) {
 	return -1;
     }
 
-    pkt_chain_t chains[MAX_INPUT_FILES];
+    pkt_chain_t chain;
     fc_chunk_t chunk;
 
+    /*
+     * Only load the columns that the queries use.  The filter is
+     * applied as the input is read, so it doesn't need any columns.
+     */
+    uint32_t cols = 0;
+    for (i = 0; i < fc_args.n_queries; i++) {
+	cols |= fc_query_cols(&fc_args.queries[i]);
+    }
+
+    rc = fc_chain_init(&chain, cols);
+    if (rc != 0) {
+	fprintf(stderr, "%s: ERROR: could not allocate chain\n", argv[0]);
+	return -1;
+    }
+
+    /*
+     * All of the input files are appended to the same chain, and
+     * then sorted in place.
+     */
     if (fc_args.input_fnames[0] == NULL) {
-	rc = fc_read_stdin(fc_args.stdin_type, &chains[0], &fc_args.filter);
+	rc = fc_read_stdin(fc_args.stdin_type, &chain, &fc_args.filter);
 	if (rc != 0) {
 	    fprintf(stderr, "%s: ERROR: could not read stdin\n", argv[0]);
 	    return -1;
 	}
-	n_chains = 1;
     }
     else {
 	for (i = 0; fc_args.input_fnames[i] != NULL; i++) {
-
-	    if (i >= MAX_INPUT_FILES) {
-		fprintf(stderr, "%s: ERROR: too many input files (max=%d)\n",
-			argv[0], MAX_INPUT_FILES);
-		return -1;
-	    }
-
 	    char *fname = fc_args.input_fnames[i];
-	    rc = fc_read_file(fname, &chains[i], &fc_args.filter);
+
+	    rc = fc_read_file(fname, &chain, &fc_args.filter);
 	    if (rc != 0) {
 		fprintf(stderr, "%s: ERROR: could not read input [%s]\n",
 			argv[0], fname);
 		return -1;
 	    }
 	}
-	n_chains = i;
     }
 
-    rc = fc_merge_chains(chains, n_chains, &chunk);
+    rc = fc_sort_chain(&chain, &chunk);
     if (rc != 0) {
 	fprintf(stderr, "%s: ERROR: could not merge input files\n",
 		argv[0]);
 	return -1;
     }
 
-    for (i = 0; i < n_chains; i++) {
-	rc = pcap_free_chain(&chains[i]);
-    }
-
     fc_chunk_t aligned_chunk = chunk;
     if (fc_args.alignment > 0) {
 	/*
 	 * this is simple, but also lame
 	 */
 	aligned_chunk.count = 0;
-	aligned_chunk.pkts =  NULL;
 	for (i = 0; i < chunk.count; i++) {
-	    if ((chunk.pkts[i].ts.ts_sec % fc_args.alignment) == 0) {
-		aligned_chunk.count = chunk.count - i;
-		aligned_chunk.pkts = chunk.pkts + i;
+	    if ((chunk.ts_sec[i] % fc_args.alignment) == 0) {
+		fc_chunk_slice(&chunk, i, chunk.count - i, &aligned_chunk);
 		break;
 	    }
 	}
@@ -343,7 +499,28 @@ main(
 	}
     }
 
-    if (aligned_chunk.count == 0) {
+    if (fc_args.pivot_mode) {
+	fc_timespan_t timespan = { 0, fc_args.interval };
+
+	if (aligned_chunk.count > 0) {
+	    timespan.base_sec = aligned_chunk.ts_sec[0];
+	}
+
+	for (i = 0; i < fc_args.n_queries; i++) {
+	    fc_args.queries[i].chunk = &aligned_chunk;
+	    rc = fc_compute_pivot(
+		    &aligned_chunk, &fc_args.queries[i],
+		    &timespan, fc_args.pivot_top_k,
+		    fc_args.pivot_format, fout);
+	    if (rc != 0) {
+		fprintf(stderr,
+			"%s: ERROR: could not execute query %d [%s]\n",
+			argv[0], i, fc_args.queries[i].query_str);
+		exit(1);
+	    }
+	}
+    }
+    else if (aligned_chunk.count == 0) {
 	/*
 	 * if this happens, we try to print *something*
 	 * meaningful, even though we can't assign a timespan
@@ -360,7 +537,7 @@ main(
     }
     else {
 	fc_timespan_t timespan = {
-		aligned_chunk.pkts[0].ts.ts_sec,
+		aligned_chunk.ts_sec[0],
 		fc_args.interval
 	};
 
@@ -379,6 +556,10 @@ main(
 	}
     }
 
+    /* The chunk is a view of the chain, so this frees both */
+    pcap_free_chain(&chain);
+    fc_free_filter(&fc_args.filter);
+
     /* If we're writing directly to a file, then once all of the output
      * has been rewritten, close the file and rename it to the final name.
      * This prevents partially-written output files from being mistaken
@@ -63,24 +63,70 @@ typedef struct {
     uint32_t offset;
 } fc_ind_entry_t;
 
+/*
+ * The columns of a chunk.  Instead of storing an fc_pkt_t for each
+ * packet, a chunk stores each field of the packets in a separate
+ * array (a column), and only the columns that are actually needed
+ * by the queries are loaded.  For example, a PA query only needs the
+ * proto, dport, and ts_sec columns, which is 7 bytes per packet
+ * instead of 24.
+ */
+typedef enum {
+    FC_COL_SADDR = (1 << 0),
+    FC_COL_DADDR = (1 << 1),
+    FC_COL_SPORT = (1 << 2),
+    FC_COL_DPORT = (1 << 3),
+    FC_COL_PROTO = (1 << 4),
+    FC_COL_FLAGS = (1 << 5),
+    FC_COL_LEN = (1 << 6),
+    FC_COL_SEC = (1 << 7),
+    FC_COL_USEC = (1 << 8),
+} fc_col_t;
+
+#define FC_COL_ALL	(0x1ff)
+#define FC_N_COLS	(9)
+
 typedef struct {
     uint64_t count;
-    fc_pkt_t *pkts;
+    uint32_t cols;		/* which FC_COL_* columns are present */
+    uint32_t *saddr;
+    uint32_t *daddr;
+    uint16_t *sport;
+    uint16_t *dport;
+    uint8_t *proto;
+    uint8_t *flags;
+    uint16_t *len;
+    int32_t *ts_sec;
+    uint32_t *ts_usec;
 } fc_chunk_t;
 
-/* TODO: move the low-level pcap definitions back into p25.c? */
-#define PKTS_PER_CHUNK	(256 * 1024)
-
-typedef struct pkt_chunk {
-    fc_pkt_t pkts[PKTS_PER_CHUNK];
-    uint64_t cnt;
-    struct pkt_chunk *next;
-} pkt_chunk_t;
+/*
+ * See arena.c.  The arena is grown in steps of FC_ARENA_PAGE_SIZE,
+ * which is the size of a huge page on most x86_64 and arm64 systems.
+ */
+#define FC_ARENA_PAGE_SIZE	((size_t) 2 * 1024 * 1024)
+#define FC_ARENA_MIN_RESERVE	((size_t) 64 * 1024 * 1024)
 
 typedef struct {
-    pkt_chunk_t *first;
-    pkt_chunk_t *curr;
-} pkt_chain_t;
+    char *base;
+    size_t reserved;		/* bytes of address space at base */
+    size_t committed;		/* bytes at base that are usable */
+    void *map;
+    size_t map_len;
+} fc_arena_t;
+
+/*
+ * The maximum number of packets that a chain will try to reserve
+ * space for.  This is only address space, not memory, until the
+ * packets are actually read.
+ */
+#define FC_CHAIN_MAX_PKTS	((uint64_t) 1 << 33)
+
+/*
+ * The number of packets to add to the capacity of a chain each time
+ * it fills up.  (For a one-byte column, this is one huge page.)
+ */
+#define PKTS_PER_CHUNK	(2 * 1024 * 1024)
 
 typedef enum {
     FC_INPUT_ERROR,
@@ -120,6 +166,18 @@ typedef struct {
 /* This is much more than needed, for now */
 #define FC_QUERY_MAX_FIELDS	(16)
 
+/*
+ * The aggregate (the count for each distinct key) computed for one
+ * interval of a query.  The keys are stored as n_fields masked field
+ * values per entry, in sorted order, so that the aggregate for the
+ * next interval can be compared against it with a simple merge.
+ */
+typedef struct {
+    uint64_t n_keys;
+    uint32_t *keys;
+    uint64_t *counts;
+} fc_agg_t;
+
 typedef struct {
     char *query_str;
     fc_chunk_t *chunk;
@@ -129,31 +187,134 @@ typedef struct {
     uint8_t n_groups;
     uint64_t show_max;
     int show_query;
+
+    /*
+     * If change_mode is set, then instead of printing the counts
+     * for each interval, print only the keys whose count changed
+     * by more than change_abs packets and more than change_rel
+     * (as a fraction of the previous count) since the previous
+     * interval.  prev is the aggregate for the previous interval,
+     * or NULL if there hasn't been a previous interval yet.
+     */
+    int change_mode;
+    uint64_t change_abs;
+    double change_rel;
+    fc_agg_t *prev;
+
+    /*
+     * If mem_limit is not zero, then intervals whose index would
+     * need more than mem_limit bytes are aggregated in partitions
+     * (see spill.c) instead of all at once.
+     */
+    uint64_t mem_limit;
 } fc_query_t;
 
-#define FC_FILTER_MAX_FIELDS	(16)
+/*
+ * A set of 32-bit prefixes, stored as a radix trie (see prefix.c)
+ */
+typedef struct fc_prefix_node {
+    uint32_t prefix;
+    uint8_t len;
+    uint8_t terminal;
+    struct fc_prefix_node *child[2];
+} fc_prefix_node_t;
+
+typedef struct {
+    fc_prefix_node_t *root;
+} fc_prefix_set_t;
+
+#define FC_FILTER_MAX_FIELDS	(32)
+
+/* The number of packets checked at a time by fc_filter_block */
+#define FC_FILTER_BLOCK_SIZE	(1024)
+
+/* The number of uint64_t words in a bitmap of all 16-bit values */
+#define FC_FILTER_BITMAP_WORDS	(65536 / 64)
+
+/*
+ * How a filter field is matched against the (masked) value of the
+ * field in a packet
+ */
+typedef enum {
+    FC_FILTER_EQ,		/* equal to value */
+    FC_FILTER_RANGE,		/* between value and value_hi, inclusive */
+    FC_FILTER_BITMAP,		/* in bitmap (for fields of 16 bits or less) */
+    FC_FILTER_PREFIXES,		/* in prefixes (for 32-bit fields) */
+} fc_filter_type_t;
 
 typedef struct {
     fc_field_name_t name;
     uint8_t width;
+    uint8_t negate;		/* match if the test fails, not succeeds */
+    uint8_t term;		/* which OR term this field is part of */
+    fc_filter_type_t type;
     uint32_t value;
+    uint32_t value_hi;
+    uint64_t *bitmap;
+    fc_prefix_set_t *prefixes;
 } fc_filter_field_t;
 
+/*
+ * A filter is an OR of terms, each of which is an AND of fields.
+ * The fields are stored in order of their term.
+ */
 typedef struct {
     uint8_t n_fields;
+    uint32_t cols;		/* the columns used by any of the fields */
     fc_filter_field_t fields[FC_FILTER_MAX_FIELDS];
 } fc_filter_t;
 
+/*
+ * A chain holds all of the packets read from the inputs.  Each of
+ * its columns is in its own arena, so the columns never move as
+ * the chain grows, and the packets are read directly into the place
+ * where they will be processed.
+ */
+typedef struct {
+    fc_chunk_t pkts;		/* the packets read so far */
+    uint64_t capacity;		/* how many packets fit before growing */
+    fc_arena_t arenas[FC_N_COLS];
+    fc_filter_t *filter;	/* if non-NULL, see fc_chain_set_filter */
+    fc_chunk_t block;		/* staged packets, not yet filtered */
+    uint64_t *sel;		/* the packets of block that match */
+} pkt_chain_t;
+
 typedef struct {
     uint64_t *order;
     uint64_t count;
 } fc_elems_t;
 
+/*
+ * The count for one group of a query: index is the index (in the
+ * chunk) of one of the packets in the group.
+ */
+typedef struct {
+    uint64_t index;
+    uint64_t count;
+} fc_count_order_t;
+
 typedef struct {
     uint64_t base_sec;
     uint32_t length_sec;
 } fc_timespan_t;
 
+/* The maximum number of partitions used by spill.c, which is also
+ * the maximum number of spill files that may be open at once.
+ */
+#define FC_SPILL_MAX_PARTS	(256)
+
+/* The minimum number of entries in each spill buffer */
+#define FC_SPILL_MIN_BUF_LEN	(4096)
+
+typedef struct {
+    uint32_t n_parts;
+    uint64_t buf_len;
+    uint64_t **bufs;
+    uint64_t *buf_cnt;
+    uint64_t *spilled;
+    FILE **files;
+} fc_spill_t;
+
 
 extern int fc_csv_read(
 	fc_fin_t *fin, pkt_chain_t *chain, fc_filter_t *filter);
@@ -170,24 +331,108 @@ extern int fc_compute_counts(
 	fc_timespan_t *timespan, int normalized,
 	FILE *fout);
 
+typedef enum {
+    FC_PIVOT_CSV,
+    FC_PIVOT_SPARSE,
+    FC_PIVOT_BIN,
+} fc_pivot_format_t;
+
+extern int fc_compute_pivot(
+	fc_chunk_t *chunk, fc_query_t *query,
+	fc_timespan_t *timespan, uint64_t top_k,
+	fc_pivot_format_t format, FILE *fout);
+
+extern int fc_create_index(
+	fc_chunk_t *chunk, uint64_t base, uint64_t count,
+	fc_query_t *query, fc_elems_t *elems);
+extern int comparator_group(
+	uint64_t ind1, uint64_t ind2, fc_query_t *query);
+
+extern fc_spill_t *fc_spill_open(uint32_t n_parts, uint64_t buf_bytes);
+extern int fc_spill_add(fc_spill_t *spill, uint32_t part, uint64_t value);
+extern int fc_spill_load(
+	fc_spill_t *spill, uint32_t part,
+	uint64_t **values, uint64_t *n_values);
+extern int fc_spill_close(fc_spill_t *spill);
+
+extern fc_prefix_set_t *fc_prefix_new(void);
+extern void fc_prefix_free(fc_prefix_set_t *set);
+extern int fc_prefix_add(fc_prefix_set_t *set, uint32_t prefix, uint8_t len);
+extern int fc_prefix_add_range(fc_prefix_set_t *set, uint32_t lo, uint32_t hi);
+extern int fc_prefix_match(fc_prefix_set_t *set, uint32_t val);
+
+extern int fc_print_key(
+	FILE *fout, fc_query_t *query, const uint32_t *vals);
+extern int fc_report_changes(
+	fc_chunk_t *chunk, fc_query_t *query,
+	fc_count_order_t *counts, uint64_t n_counts,
+	uint32_t start_time, FILE *fout);
+
 extern void print_pkt(fc_pkt_t *pkt);
 
 extern int fc_str2query(char *str, fc_query_t *query);
 
 extern int fc_str2filter(char *str, fc_filter_t *filter);
+extern void fc_free_filter(fc_filter_t *filter);
 extern int fc_apply_filter(
 	fc_filter_t *filter, fc_chunk_t *chunk,
 	uint64_t base, uint64_t count, fc_elems_t *elems);
 extern int fc_filter_pkt(fc_pkt_t *pkt, fc_filter_t *filter);
-
+extern int fc_filter_partial(
+	fc_pkt_t *pkt, fc_filter_t *filter, uint32_t known_cols);
+extern int fc_filter2bpf(fc_filter_t *filter, int vlan_tags,
+	char *buf, size_t buf_len);
+extern uint64_t fc_filter_block(
+	fc_filter_t *filter, fc_chunk_t *chunk,
+	uint64_t base, uint64_t count, uint64_t *sel);
+
+extern int fc_chunk_alloc(fc_chunk_t *chunk, uint32_t cols, uint64_t size);
+extern void fc_chunk_free(fc_chunk_t *chunk);
+extern void fc_chunk_copy(
+	fc_chunk_t *dst, uint64_t dst_off,
+	fc_chunk_t *src, uint64_t src_off, uint64_t count);
+extern void fc_chunk_gather(
+	fc_chunk_t *dst, uint64_t dst_off,
+	fc_chunk_t *src, const uint64_t *sel, uint64_t count);
+extern int fc_chunk_permute(fc_chunk_t *chunk, const uint64_t *order);
+extern void fc_chunk_slice(
+	fc_chunk_t *src, uint64_t base, uint64_t count, fc_chunk_t *dst);
+extern void fc_chunk_set(fc_chunk_t *chunk, uint64_t ind, fc_pkt_t *pkt);
+extern void fc_chunk_get(fc_chunk_t *chunk, uint64_t ind, fc_pkt_t *pkt);
+
+extern int fc_arena_init(fc_arena_t *arena, size_t reserve);
+extern int fc_arena_commit(fc_arena_t *arena, size_t size);
+extern void fc_arena_free(fc_arena_t *arena);
+
+extern int fc_chain_init(pkt_chain_t *chain, uint32_t cols);
 extern int fc_extend_chain(pkt_chain_t *chain);
+extern int fc_chain_append(pkt_chain_t *chain, fc_pkt_t *pkt);
+extern int fc_chain_set_filter(pkt_chain_t *chain, fc_filter_t *filter);
+extern int fc_chain_flush(pkt_chain_t *chain);
 extern int pcap_chain_to_chunk(pkt_chain_t *chain, fc_chunk_t *chunk);
 extern int pcap_free_chain(pkt_chain_t *chain);
 
-extern int fc_merge_chains(
-	pkt_chain_t *chains, int n_chains, fc_chunk_t *chunk);
+extern int fc_sort_chain(pkt_chain_t *chain, fc_chunk_t *chunk);
 
 extern uint32_t fetch_field(fc_pkt_t *pkt, fc_field_name_t name);
+extern uint32_t fetch_col(
+	fc_chunk_t *chunk, uint64_t ind, fc_field_name_t name);
+extern uint32_t fc_field2col(fc_field_name_t name);
+extern uint32_t fc_query_cols(fc_query_t *query);
+
+/*
+ * Return the mask for a field prefix of the given width.  A width of
+ * zero (or anything too wide) means that the whole field is used.
+ */
+static inline uint32_t
+fc_width_mask(
+	uint8_t width)
+{
+    if ((width == 0) || (width >= 32)) {
+	return 0xffffffff;
+    }
+    return ~(0xffffffff >> width);
+}
 
 extern int fc_fc5_write(FILE *fout, fc_chunk_t *chunk);
 extern int fc_fc5_read(
@@ -51,6 +51,9 @@ find_input_type(
 	{ ".pcap", FC_INPUT_PCAP },
 	{ ".pcap.gz", FC_INPUT_PCAP_GZ },
 	{ ".pcap.lz4", FC_INPUT_PCAP_LZ4 },
+	{ ".pcapng", FC_INPUT_PCAP },
+	{ ".pcapng.gz", FC_INPUT_PCAP_GZ },
+	{ ".pcapng.lz4", FC_INPUT_PCAP_LZ4 },
 	{ ".csv", FC_INPUT_CSV },
 	{ ".csv.gz", FC_INPUT_CSV_GZ },
 	{ ".csv.lz4", FC_INPUT_CSV_LZ4 },
@@ -199,15 +202,22 @@ fc_read_stdin(
     }
 
     /*
-     * NOTE: if the chain isn't empty, we'll end up
-     * appending to it unless we reset it.
-     *
-     * Right now, this is always an error, but at some
-     * point we might want to append chains.
+     * NOTE: if the chain isn't empty, then the packets
+     * are appended to it.
      */
     fin.file = stdin;
     fin.type = fin_type;
 
+    /*
+     * Let the chain check the filter on blocks of packets, so
+     * the readers only need to reject the packets they can
+     * without decoding them completely.
+     */
+    if (fc_chain_set_filter(chain, filter) != 0) {
+	fprintf(stderr, "ERROR: cannot allocate filter block\n");
+	return -1;
+    }
+
     switch (fin_type) {
 	case FC_INPUT_PCAP:
 	case FC_INPUT_PCAP_GZ:
@@ -246,6 +256,11 @@ fc_read_stdin(
 	    return -1;
     }
 
+    if (fc_chain_flush(chain) != 0) {
+	fprintf(stderr, "ERROR: could not add packets to the chain\n");
+	return -1;
+    }
+
     return 0;
 }
 
@@ -260,15 +275,23 @@ fc_read_file(
     int rc;
 
     /*
-     * NOTE: if the chain isn't empty, we'll end up
-     * appending to it unless we reset it.
-     *
-     * Right now, this is always an error, but at some
-     * point we might want to append chains.
+     * NOTE: if the chain isn't empty, then the packets
+     * are appended to it.  This is how multiple input
+     * files are combined.
      */
 
     rc = fc_input_open(fname, fin_type, &fin);
 
+    /*
+     * Let the chain check the filter on blocks of packets, so
+     * the readers only need to reject the packets they can
+     * without decoding them completely.
+     */
+    if (fc_chain_set_filter(chain, filter) != 0) {
+	fprintf(stderr, "ERROR: cannot allocate filter block\n");
+	return -1;
+    }
+
     switch (fin_type) {
 	case FC_INPUT_PCAP:
 	case FC_INPUT_PCAP_GZ:
@@ -307,6 +330,11 @@ fc_read_file(
 	    return -1;
     }
 
+    if (fc_chain_flush(chain) != 0) {
+	fprintf(stderr, "ERROR: could not add packets to the chain\n");
+	return -1;
+    }
+
     rc = fc_input_close(&fin);
     if (rc != 0) {
 	fprintf(stderr, "WARNING: could not close [%s]\n", fname);
@@ -316,212 +344,87 @@ fc_read_file(
     return 0;
 }
 
-static inline int
-ts_smaller(
-	fc_timeval_t *t1,
-	fc_timeval_t *t2)
-{
-    if (t1->ts_sec < t2->ts_sec) {
-	return 1;
-    }
-    else if (t1->ts_sec > t2->ts_sec) {
-	return 0;
-    }
-    else if (t1->ts_usec < t2->ts_usec) {
-	return 1;
-    }
-    else {
-	return 0;
-    }
-}
-
+/*
+ * Compare the timestamps of two packets, given their indices in the
+ * chunk.  If the chunk doesn't have a ts_usec column, then only the
+ * seconds are compared.  Ties are broken by the index, so the sort
+ * is stable (which keeps the order from the input files for packets
+ * with the same timestamp).
+ */
 static int
-compare_secs(
+compare_times(
 	const void *p1,
-	const void *p2)
+	const void *p2,
+	void *arg)
 {
-    fc_pkt_t *pkt1 = (fc_pkt_t *) p1;
-    fc_pkt_t *pkt2 = (fc_pkt_t *) p2;
+    fc_chunk_t *chunk = (fc_chunk_t *) arg;
+    uint64_t ind1 = *(uint64_t *) p1;
+    uint64_t ind2 = *(uint64_t *) p2;
 
-    if (pkt1->ts.ts_sec != pkt2->ts.ts_sec) {
-	return pkt1->ts.ts_sec - pkt2->ts.ts_sec;
-    }
-    else {
-	return pkt1->ts.ts_usec - pkt2->ts.ts_usec;
+    if (chunk->ts_sec[ind1] != chunk->ts_sec[ind2]) {
+	return (chunk->ts_sec[ind1] < chunk->ts_sec[ind2]) ? -1 : 1;
     }
-}
-
-int
-fc_merge_chains(
-	pkt_chain_t *chains,
-	int n_chains,
-	fc_chunk_t *chunk)
-{
-
-    /*
-     * 1. Make a chunk large enough for all the chains.
-     */
-
-    uint64_t total_pkts = 0;
-    for (int i = 0; i < n_chains; i++) {
-	pkt_chain_t *c = &chains[i];
-
-	for (pkt_chunk_t *curr = c->first; curr != NULL; curr = curr->next) {
-	    total_pkts += curr->cnt;
-	}
-    }
-
-    chunk->count = total_pkts;;
-
-    /* If there aren't any packets, then we don't have much to do... */
-    if (total_pkts == 0) {
-	chunk->pkts = NULL;
-	return 0;
+    if ((chunk->cols & FC_COL_USEC) &&
+	    (chunk->ts_usec[ind1] != chunk->ts_usec[ind2])) {
+	return (chunk->ts_usec[ind1] < chunk->ts_usec[ind2]) ? -1 : 1;
     }
 
-    chunk->pkts = (fc_pkt_t *) malloc(total_pkts * sizeof(fc_pkt_t));
-    if (chunk->pkts == NULL) {
-	fprintf(stderr, "ERROR: malloc failed\n");
-	return -1;
-    }
-
-    uint64_t copied = 0;
-    for (int i = 0; i < n_chains; i++) {
-	pkt_chain_t *c = &chains[i];
-
-	for (pkt_chunk_t *curr = c->first; curr != NULL; curr = curr->next) {
-	    fc_pkt_t *dst = chunk->pkts + copied;
-
-	    memcpy(dst, curr->pkts, curr->cnt * sizeof(fc_pkt_t));
-	    copied += curr->cnt;
-	}
-    }
-
-    qsort(chunk->pkts, copied, sizeof(fc_pkt_t), compare_secs);
-
-    return 0;
+    return (ind1 < ind2) ? -1 : ((ind1 > ind2) ? 1 : 0);
 }
 
 /*
- * The algorithm sketched out in this routine can be significantly
- * faster than the brute-force algorithm, but it's also got some
- * subtle difficulties.  The current implementation is buggy.
- * FIXME: remove the bugs and use it instead of the slower method.
+ * Sort the packets in the chain by time, in place, and make the
+ * chunk a view of the sorted packets.  The chunk shares its columns
+ * with the chain, so it must not be freed, and the chain must not
+ * be freed until the chunk isn't needed any more.
+ *
+ * The inputs are usually already in time order (and given in time
+ * order), so check for that first and avoid the sort entirely.
  */
 int
-fc_merge_chains_buggy(
-	pkt_chain_t *chains,
-	int n_chains,
+fc_sort_chain(
+	pkt_chain_t *chain,
 	fc_chunk_t *chunk)
 {
+    fc_chunk_t *pkts = &chain->pkts;
+    uint64_t count = pkts->count;
+    uint64_t i;
 
-    /*
-     * 1. Make a chunk large enough for all the chains.
-     */
+    *chunk = *pkts;
 
-    uint64_t total_pkts = 0;
-    for (int i = 0; i < n_chains; i++) {
-	pkt_chain_t *c = &chains[i];
+    for (i = 1; i < count; i++) {
+	uint64_t prev = i - 1;
 
-	for (pkt_chunk_t *curr = c->first; curr != NULL; curr = curr->next) {
-	    total_pkts += curr->cnt;
+	if (compare_times(&prev, &i, pkts) > 0) {
+	    break;
 	}
     }
-
-    chunk->count = total_pkts;;
-
-    /* If there aren't any packets, then we don't have much to do... */
-    if (total_pkts == 0) {
-	chunk->pkts = NULL;
-	return 0;
-    }
-
-    chunk->pkts = (fc_pkt_t *) malloc(total_pkts * sizeof(fc_pkt_t));
-    if (chunk->pkts == NULL) {
-	fprintf(stderr, "ERROR: malloc failed\n");
-	return -1;
-    }
-
-    /*
-     * Special case: if there's only one chain, then just copy it
-     */
-    if (n_chains == 1) {
-	uint64_t curr_ind = 0;
-	pkt_chain_t *c = &chains[0];
-
-	for (pkt_chunk_t *curr = c->first; curr != NULL; curr = curr->next) {
-	    fc_pkt_t *dst = chunk->pkts + curr_ind;
-
-	    memcpy(dst, curr->pkts, curr->cnt * sizeof(fc_pkt_t));
-	    curr_ind += curr->cnt;
-	}
-
+    if (i >= count) {
 	return 0;
     }
 
     /*
-     * More complicated case: there are multiple chains, and we have
-     * to merge them.  There are some nice optimizations we can make
-     * if we assume that the pkt_chunks are unlikely to overlap, but
-     * for the first cut we'll just do things the most simple way.
+     * We can't sort the columns directly, so we sort an index into
+     * the chunk, and then use the index to reorder each column.
      */
-    pkt_chunk_t **currs = malloc(n_chains * sizeof(pkt_chunk_t *));
-    uint32_t *curr_offs = malloc(n_chains * sizeof(uint32_t *));
 
-    if (currs == NULL) {
-	fprintf(stderr, "ERROR: malloc failed\n");
-	return -1;
-    }
-    if (curr_offs == NULL) {
+    uint64_t *order = malloc(count * sizeof(uint64_t));
+    if (order == NULL) {
 	fprintf(stderr, "ERROR: malloc failed\n");
 	return -1;
     }
 
-    for (int i = 0; i < n_chains; i++) {
-	currs[i] = chains[i].first;
-	curr_offs[i] = 0;
+    for (i = 0; i < count; i++) {
+	order[i] = i;
     }
+    qsort_r(order, count, sizeof(uint64_t), compare_times, pkts);
 
-    for (uint64_t indx = 0; indx < total_pkts; indx++) {
-	fc_timeval_t smallest_ts = { 0x7fffffff, 0 };
-	fc_pkt_t *candidate = NULL;
-	int candidate_chain = -1;
-
-	for (int i = 0; i < n_chains; i++) {
-	    if (currs[i] != NULL) {
-
-		/*
-		 * If we've already reached the end of the chunk,
-		 * move to the next
-		 */
-		if (curr_offs[i] >= currs[i]->cnt) {
-		    currs[i] = currs[i]->next;
-		    curr_offs[i] = 0;
-
-		    if (currs[i] == NULL) {
-			continue;
-		    }
-		}
-
-		fc_pkt_t *pkt = &currs[i]->pkts[curr_offs[i]];
-
-		if (ts_smaller(&pkt->ts, &smallest_ts)) {
-		    candidate = pkt;
-		    candidate_chain = i;
-		}
-	    }
-	}
-
-	chunk->pkts[indx] = *candidate;
-	if (candidate_chain < 0) {
-	    printf("oops - candidate chain\n");
-	}
-
-	curr_offs[candidate_chain]++;
+    int rc = fc_chunk_permute(chunk, order);
+    if (rc != 0) {
+	fprintf(stderr, "ERROR: malloc failed\n");
     }
 
-    free(currs);
-    free(curr_offs);
+    free(order);
 
-    return 0;
+    return rc;
 }
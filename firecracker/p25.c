@@ -36,85 +36,152 @@
 #include <unistd.h>
 #include <pcap.h>
 
-#include <netinet/ip.h>
-#include <netinet/tcp.h>
-#include <netinet/udp.h>
-#include <net/ethernet.h>
 #include <arpa/inet.h>
 
 #include "firecracker.h"
+#include "capfile.h"
+#include "pktdecode.h"
 
 typedef struct {
     pkt_chain_t *chain;
     fc_filter_t *filter;
+    int dlt;
 } fc_pcap_handler_t;
 
-static void
-handler(
-	unsigned char *user,
-	const struct pcap_pkthdr *pkthdr,
-	const unsigned char *packet)
+/*
+ * The columns that are known after decoding the IP header (and the
+ * pcap header), before looking at the ports
+ */
+#define P25_IP_COLS	(FC_COL_SADDR | FC_COL_DADDR | FC_COL_PROTO | \
+			FC_COL_LEN | FC_COL_FLAGS | FC_COL_SEC | FC_COL_USEC)
+
+/* Plenty of space for any filter expression we would use */
+#define P25_BPF_MAX_LEN	(16 * 1024)
+
+/* The snapshot length for compiling the prefilter without a pcap_t */
+#define P25_BPF_SNAPLEN	(262144)
+
+/*
+ * Append the decoded packet to the chain, unless it can't match the
+ * filter.  Returns 0 on success (including when the packet is
+ * skipped), non-zero if the chain could not be extended.
+ */
+static inline int
+add_pkt(
+	pkt_chain_t *chain,
+	fc_filter_t *filter,
+	uint32_t ts_sec,
+	uint32_t ts_usec,
+	const pktd_ip_t *ip)
 {
-    fc_pcap_handler_t *handler_args = (fc_pcap_handler_t *) user;
-    pkt_chain_t *chain = handler_args->chain;
-    fc_filter_t *filter = handler_args->filter;
-    int rc;
+    fc_pkt_t info;
 
-    /* printf("chain %p %p\n", chain->first, chain->curr); */
+    info.saddr = ip->saddr;
+    info.daddr = ip->daddr;
+    info.proto = ip->proto;
+    info.len = ip->ip_len;
+    info.ts.ts_sec = ts_sec;
+    info.ts.ts_usec = ts_usec;
+    info.flags = 0; /* TODO */
 
-    struct ether_header *eth_header = (struct ether_header *) packet;
-    if (ntohs(eth_header->ether_type) != ETHERTYPE_IP) {
-	// fprintf(stderr, "not IP %d\n", eth_header->ether_type);
-	return;
+    /*
+     * If there's a filter, and this packet can't match it no matter
+     * what its ports are, then stop here.
+     */
+    if ((filter != NULL) && (filter->cols & P25_IP_COLS) &&
+	    !fc_filter_partial(&info, filter, P25_IP_COLS)) {
+	return 0;
     }
 
-    struct ip *ip_header = (struct ip *) (packet + sizeof(struct ether_header));
-    uint32_t saddr = ntohl(ip_header->ip_src.s_addr);
-    uint32_t daddr = ntohl(ip_header->ip_dst.s_addr);
-    uint8_t proto = ip_header->ip_p;
-    uint16_t *proto_hdr = (uint16_t *)
-	    (((unsigned char *) ip_header) + (ip_header->ip_hl * 4));
-    uint16_t len = ntohs(ip_header->ip_len);
-
     /*
      * For protocols that don't have a source or destination port, we
      * pretend that they do, because these fields are often used for
-     * similar purposes by other protocols
+     * similar purposes by other protocols.  If the ports weren't
+     * captured, then they're zero.
      */
-    uint16_t sport = ntohs(proto_hdr[0]);
-    uint16_t dport = ntohs(proto_hdr[1]);
+    if (ip->l4_caplen >= 4) {
+	info.sport = pktd_get16(ip->l4);
+	info.dport = pktd_get16(ip->l4 + 2);
+    }
+    else {
+	info.sport = 0;
+	info.dport = 0;
+    }
 
     /*
-     * Need to extract the other fields here, including the timestamp
+     * The rest of the filter (if any) is checked by the chain, a
+     * block of packets at a time.  See fc_chain_set_filter.
      */
+    return fc_chain_append(chain, &info);
+}
 
-    rc = fc_extend_chain(chain);
+static void
+handler(
+	unsigned char *user,
+	const struct pcap_pkthdr *pkthdr,
+	const unsigned char *packet)
+{
+    fc_pcap_handler_t *handler_args = (fc_pcap_handler_t *) user;
+    pkt_chain_t *chain = handler_args->chain;
+    pktd_ip_t ip;
+    int rc;
+
+    if (pktd_decode(handler_args->dlt, packet, pkthdr->caplen, &ip) != 0) {
+	return;
+    }
+
+    rc = add_pkt(chain, handler_args->filter,
+	    pkthdr->ts.tv_sec, pkthdr->ts.tv_usec, &ip);
     if (rc != 0) {
 	pcap_free_chain(chain);
 	fprintf(stderr, "ERROR: count not add another packet\n");
 	exit(1);
     }
+}
+
+/*
+ * If the filter (or something close to it) can be expressed in BPF,
+ * then compile it into prog, for packets with the given link type, so
+ * that the readers can discard the packets that don't match it before
+ * decoding them.  This is only a prefilter, and the real filter is
+ * still checked afterwards.  (pktd_decode accepts VLAN-tagged IPv4 on
+ * Ethernet, so the prefilter must too.)
+ *
+ * Returns 0 if prog was compiled, or -1 if there is no prefilter
+ * (which is not an error).
+ */
+static int
+compile_prefilter(
+	fc_filter_t *filter,
+	int dlt,
+	struct bpf_program *prog)
+{
+    int rc = -1;
+
+    if (filter == NULL) {
+	return -1;
+    }
 
-    uint32_t curr_cnt = chain->curr->cnt;
-    fc_pkt_t *info = &chain->curr->pkts[curr_cnt];
+    char *bpf_str = malloc(P25_BPF_MAX_LEN);
+    if (bpf_str == NULL) {
+	return -1;
+    }
 
-    info->saddr = saddr;
-    info->daddr = daddr;
-    info->proto = proto;
-    info->sport = sport;
-    info->dport = dport;
-    info->len = len;
-    info->ts.ts_sec = pkthdr->ts.tv_sec;
-    info->ts.ts_usec = pkthdr->ts.tv_usec;
-    info->flags = 0; /* TODO */
+    if (fc_filter2bpf(filter, (dlt == DLT_EN10MB) ? PKTD_MAX_VLAN_TAGS : 0,
+		bpf_str, P25_BPF_MAX_LEN) == 0) {
+	pcap_t *pcap = pcap_open_dead(dlt, P25_BPF_SNAPLEN);
 
-    /* If there's a filter, and it doesn't match this packet,
-     * then don't increment the current count.  Just ignore
-     * this packet
-     */
-    if ((filter == NULL) || fc_filter_pkt(info, filter)) {
-	chain->curr->cnt++;
+	if (pcap != NULL) {
+	    if (pcap_compile(pcap, prog, bpf_str, 1,
+			PCAP_NETMASK_UNKNOWN) == 0) {
+		rc = 0;
+	    }
+	    pcap_close(pcap);
+	}
     }
+    free(bpf_str);
+
+    return rc;
 }
 
 static int
@@ -135,6 +202,23 @@ pcap_reader(
     fc_pcap_handler_t args;
     args.chain = chain;
     args.filter = filter;
+    args.dlt = pcap_datalink(pcap);
+
+    if (!pktd_link_supported(args.dlt)) {
+	fprintf(stderr, "ERROR: unsupported link type (%d)\n", args.dlt);
+	pcap_close(pcap);
+	return 1;
+    }
+
+    /*
+     * Let libpcap discard the packets that don't match the prefilter
+     * (if any) before they're passed to the handler
+     */
+    struct bpf_program prog;
+    if (compile_prefilter(filter, args.dlt, &prog) == 0) {
+	pcap_setfilter(pcap, &prog);
+	pcap_freecode(&prog);
+    }
 
     if (pcap_loop(pcap, 0, handler, (u_char *) &args) < 0) {
 	/*
@@ -147,6 +231,135 @@ pcap_reader(
     return 0;
 }
 
+/* The number of packets read and decoded at a time by capf_reader */
+#define P25_BATCH_SIZE		(256)
+
+/*
+ * Read a pcap or pcapng file with capfile (which maps regular files
+ * into memory, and reads other inputs in large blocks) instead of
+ * going through pcap_loop (which copies each packet into its own
+ * buffer and calls the handler through a function pointer).
+ *
+ * The packets are checked against the BPF prefilter (if any) with
+ * pcap_offline_filter, as libpcap would in pcap_reader, before they
+ * are decoded.  The prefilter is compiled for the link type of each
+ * packet (which may change in a pcapng file).
+ *
+ * Returns 0 on success, CAPF_ERR_FORMAT if the input isn't in a
+ * format that capfile understands (in which case the caller may try
+ * pcap_reader instead, if it can rewind the input), or -1 on error.
+ */
+static int
+capf_reader(
+	fc_fin_t *fin,
+	pkt_chain_t *chain,
+	fc_filter_t *filter)
+{
+    capf_pkt_t pkts[P25_BATCH_SIZE];
+    const uint8_t *packets[P25_BATCH_SIZE];
+    uint32_t caplens[P25_BATCH_SIZE];
+    pktd_ip_t ips[P25_BATCH_SIZE];
+    capf_t cf;
+    struct bpf_program prog;
+    int have_prog = 0;
+    int have_dlt = 0;
+    int last_dlt = -1;		/* the link type of the previous packet */
+    int n_pkts;
+    int rc;
+
+    rc = capf_open(&cf, fin->file);
+    if (rc != 0) {
+	return rc;
+    }
+
+    /*
+     * Read the packets a batch at a time, and decode each run of
+     * packets with the same link type (which in practice is the
+     * entire batch) all at once before adding them to the chain.
+     */
+    while ((n_pkts = capf_next_batch(&cf, pkts, P25_BATCH_SIZE)) > 0) {
+	int n_kept = 0;
+	int start = 0;
+
+	for (int i = 0; i < n_pkts; i++) {
+	    if (!have_dlt || (pkts[i].dlt != last_dlt)) {
+		if (have_prog) {
+		    pcap_freecode(&prog);
+		    have_prog = 0;
+		}
+		if (!pktd_link_supported(pkts[i].dlt)) {
+		    fprintf(stderr, "ERROR: unsupported link type (%d)\n",
+			    pkts[i].dlt);
+		    capf_close(&cf);
+		    pcap_free_chain(chain);
+		    return -1;
+		}
+		if (filter != NULL) {
+		    have_prog = (compile_prefilter(filter, pkts[i].dlt,
+				&prog) == 0);
+		}
+		have_dlt = 1;
+		last_dlt = pkts[i].dlt;
+	    }
+
+	    if (have_prog) {
+		struct pcap_pkthdr hdr;
+
+		hdr.ts.tv_sec = pkts[i].ts_sec;
+		hdr.ts.tv_usec = pkts[i].ts_nsec / 1000;
+		hdr.caplen = pkts[i].caplen;
+		hdr.len = pkts[i].len;
+		if (pcap_offline_filter(&prog, &hdr, pkts[i].data) == 0) {
+		    continue;
+		}
+	    }
+	    pkts[n_kept++] = pkts[i];
+	}
+
+	while (start < n_kept) {
+	    int dlt = pkts[start].dlt;
+	    int end;
+
+	    for (end = start; (end < n_kept) && (pkts[end].dlt == dlt); end++) {
+		packets[end] = pkts[end].data;
+		caplens[end] = pkts[end].caplen;
+	    }
+
+	    pktd_decode_batch(dlt, end - start, packets + start,
+		    caplens + start, ips + start);
+	    start = end;
+	}
+
+	for (int i = 0; i < n_kept; i++) {
+	    if (ips[i].ip == NULL) {
+		continue;
+	    }
+
+	    if (add_pkt(chain, filter, pkts[i].ts_sec,
+			pkts[i].ts_nsec / 1000, &ips[i]) != 0) {
+		if (have_prog) {
+		    pcap_freecode(&prog);
+		}
+		capf_close(&cf);
+		pcap_free_chain(chain);
+		fprintf(stderr, "ERROR: count not add another packet\n");
+		return -1;
+	    }
+	}
+    }
+
+    if (n_pkts < 0) {
+	fprintf(stderr, "WARNING: could not read all of the input\n");
+    }
+
+    if (have_prog) {
+	pcap_freecode(&prog);
+    }
+    capf_close(&cf);
+
+    return 0;
+}
+
 int
 fc_pcap_read(
 	fc_fin_t *fin,
@@ -155,8 +368,19 @@ fc_pcap_read(
 {
     int rc;
 
-    chain->first = NULL;
-    chain->curr = NULL;
+    /*
+     * If capfile doesn't recognize the format, then let libpcap try,
+     * if we can rewind the input
+     */
+    rc = capf_reader(fin, chain, filter);
+    if (rc == 0) {
+	return 0;
+    }
+    else if ((rc != CAPF_ERR_FORMAT) ||
+	    (fseeko(fin->file, 0, SEEK_SET) != 0)) {
+	fprintf(stderr, "ERROR: pcap reader failed\n");
+	return -1;
+    }
 
     rc = pcap_reader(fin, chain, filter);
     if (rc != 0) {
@@ -0,0 +1,382 @@
+/* CODEMARK: nice-ibr */
+/*
+ * Copyright (C) 2020-2024 - Raytheon BBN Technologies Corp.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0.
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+ *
+ * Distribution Statement "A" (Approved for Public Release,
+ * Distribution Unlimited).
+ *
+ * This material is based upon work supported by the Defense
+ * Advanced Research Projects Agency (DARPA) under Contract No.
+ * HR001119C0102.  The opinions, findings, and conclusions stated
+ * herein are those of the authors and do not necessarily reflect
+ * those of DARPA.
+ *
+ * In the event permission is required, DARPA is authorized to
+ * reproduce the copyrighted material for use as an exhibit or
+ * handout at DARPA-sponsored events and/or to post the material
+ * on the DARPA website.
+ */
+/* CODEMARK: end */
+
+#include <endian.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "firecracker.h"
+
+/*
+ * Pivot output: instead of printing one line per key per interval,
+ * print a matrix with one row for each of the top K keys (selected
+ * by their total count over the entire input) and one column for
+ * each interval.
+ *
+ * There are three output formats:
+ *
+ * FC_PIVOT_CSV - a dense CSV table.  The first line is a header:
+ *
+ *	QUERY,total,T0,T1,...
+ *
+ *     where T0, T1, etc are the start times of the intervals, and
+ *     each of the following lines is a row of the matrix:
+ *
+ *	KEY,TOTAL,C0,C1,...
+ *
+ *     The KEY is expressed in the same syntax as a firecracker filter
+ *     (i.e. "P=6/A=23" or "S24=146.88.240.0"), so that it can be
+ *     used as a filter to drill down into that key.
+ *
+ * FC_PIVOT_SPARSE - a sparse CSV table, with a header line of
+ *
+ *	QUERY,start_time,count
+ *
+ *     followed by a KEY,START_TIME,COUNT line for each interval where
+ *     the count for the key is not zero.
+ *
+ * FC_PIVOT_BIN - a binary matrix.  All of the values are
+ *     little-endian.  The header is:
+ *
+ *	char magic[4]		"FCPV"
+ *	uint32_t version	1
+ *	uint32_t n_fields
+ *	uint32_t n_keys
+ *	uint32_t n_intervals
+ *	uint32_t base_sec	start time of the first interval
+ *	uint32_t length_sec	length of each interval
+ *	followed by n_fields field descriptors, each of which is four
+ *	bytes: the field name (as an ASCII char), the field width,
+ *	and two bytes of padding.
+ *
+ *     This is followed by one record for each key:
+ *
+ *	uint32_t key[n_fields]
+ *	uint64_t total
+ *	uint64_t counts[n_intervals]
+ *
+ * In all of the formats, the keys appear in descending order of their
+ * total count.
+ */
+
+#define FC_PIVOT_MAGIC		"FCPV"
+#define FC_PIVOT_VERSION	(1)
+
+static int
+count_compare(
+	const void *p1,
+	const void *p2)
+{
+    fc_count_order_t *o1 = (fc_count_order_t *) p1;
+    fc_count_order_t *o2 = (fc_count_order_t *) p2;
+
+    /* This looks backwards because we sort in descending order */
+    if (o1->count < o2->count) {
+	return 1;
+    }
+    else if (o1->count > o2->count) {
+	return -1;
+    }
+    else {
+	return 0;
+    }
+}
+
+static void
+print_pivot_key(
+	FILE *fout,
+	fc_query_t *query,
+	const uint32_t *vals)
+{
+
+    for (int i = 0; i < query->n_fields; i++) {
+	fc_field_name_t name = query->fields[i].name;
+	uint8_t width = query->fields[i].width;
+	uint32_t val = vals[i];
+
+	if (i > 0) {
+	    fputc('/', fout);
+	}
+
+	fputc(name, fout);
+	if (width > 0 && width != 32) {
+	    fprintf(fout, "%u", width);
+	}
+
+	if ((name == 'S') || (name == 'D')) {
+	    fprintf(fout, "=%u.%u.%u.%u",
+		    0xff & (val >> 24), 0xff & (val >> 16),
+		    0xff & (val >> 8), 0xff & val);
+	}
+	else {
+	    fprintf(fout, "=%u", val);
+	}
+    }
+}
+
+static int
+write_u32(
+	FILE *fout,
+	uint32_t val)
+{
+    uint32_t le = htole32(val);
+
+    return fwrite(&le, sizeof(le), 1, fout) == 1 ? 0 : -1;
+}
+
+static int
+write_u64(
+	FILE *fout,
+	uint64_t val)
+{
+    uint64_t le = htole64(val);
+
+    return fwrite(&le, sizeof(le), 1, fout) == 1 ? 0 : -1;
+}
+
+static int
+print_header(
+	fc_query_t *query,
+	fc_timespan_t *timespan,
+	uint64_t n_keys,
+	uint64_t n_intervals,
+	fc_pivot_format_t format,
+	FILE *fout)
+{
+    int rc = 0;
+
+    switch (format) {
+	case FC_PIVOT_CSV:
+	    fprintf(fout, "%s,total", query->query_str);
+	    for (uint64_t i = 0; i < n_intervals; i++) {
+		fprintf(fout, ",%lu",
+			timespan->base_sec + (i * timespan->length_sec));
+	    }
+	    fprintf(fout, "\n");
+	    break;
+	case FC_PIVOT_SPARSE:
+	    fprintf(fout, "%s,start_time,count\n", query->query_str);
+	    break;
+	case FC_PIVOT_BIN:
+	    if (fwrite(FC_PIVOT_MAGIC, 4, 1, fout) != 1) {
+		return -1;
+	    }
+	    rc |= write_u32(fout, FC_PIVOT_VERSION);
+	    rc |= write_u32(fout, query->n_fields);
+	    rc |= write_u32(fout, n_keys);
+	    rc |= write_u32(fout, n_intervals);
+	    rc |= write_u32(fout, timespan->base_sec);
+	    rc |= write_u32(fout, timespan->length_sec);
+	    for (uint8_t i = 0; i < query->n_fields; i++) {
+		uint8_t desc[4] = {
+		    query->fields[i].name, query->fields[i].width, 0, 0
+		};
+		if (fwrite(desc, sizeof(desc), 1, fout) != 1) {
+		    return -1;
+		}
+	    }
+	    break;
+    }
+
+    return rc;
+}
+
+static int
+print_row(
+	fc_query_t *query,
+	fc_timespan_t *timespan,
+	const uint32_t *key,
+	uint64_t total,
+	const uint64_t *row,
+	uint64_t n_intervals,
+	fc_pivot_format_t format,
+	FILE *fout)
+{
+    int rc = 0;
+
+    switch (format) {
+	case FC_PIVOT_CSV:
+	    print_pivot_key(fout, query, key);
+	    fprintf(fout, ",%lu", total);
+	    for (uint64_t i = 0; i < n_intervals; i++) {
+		fprintf(fout, ",%lu", row[i]);
+	    }
+	    fprintf(fout, "\n");
+	    break;
+	case FC_PIVOT_SPARSE:
+	    for (uint64_t i = 0; i < n_intervals; i++) {
+		if (row[i] != 0) {
+		    print_pivot_key(fout, query, key);
+		    fprintf(fout, ",%lu,%lu\n",
+			    timespan->base_sec + (i * timespan->length_sec),
+			    row[i]);
+		}
+	    }
+	    break;
+	case FC_PIVOT_BIN:
+	    for (uint8_t i = 0; i < query->n_fields; i++) {
+		rc |= write_u32(fout, key[i]);
+	    }
+	    rc |= write_u64(fout, total);
+	    for (uint64_t i = 0; i < n_intervals; i++) {
+		rc |= write_u64(fout, row[i]);
+	    }
+	    break;
+    }
+
+    return rc;
+}
+
+/*
+ * Compute the pivot for the entire chunk.  If top_k is zero, then
+ * all of the keys are included.
+ *
+ * This only needs one sort of the chunk: the index is sorted by key
+ * (and then by time), so each group of packets with the same key is
+ * a contiguous run of the index, and the interval for each packet in
+ * the run can be computed directly from its timestamp.
+ */
+int
+fc_compute_pivot(
+	fc_chunk_t *chunk,
+	fc_query_t *query,
+	fc_timespan_t *timespan,
+	uint64_t top_k,
+	fc_pivot_format_t format,
+	FILE *fout)
+{
+    fc_elems_t elems;
+    uint64_t n_intervals = 0;
+    int rc;
+
+    if ((timespan == NULL) || (timespan->length_sec == 0)) {
+	fprintf(stderr, "ERROR: pivot requires an interval length\n");
+	return -1;
+    }
+
+    if (chunk->count == 0) {
+	return print_header(query, timespan, 0, 0, format, fout);
+    }
+
+    uint64_t last_sec = chunk->ts_sec[chunk->count - 1];
+    if (last_sec >= timespan->base_sec) {
+	n_intervals = 1 +
+		((last_sec - timespan->base_sec) / timespan->length_sec);
+    }
+
+    rc = fc_create_index(chunk, 0, chunk->count, query, &elems);
+    if (rc != 0) {
+	fprintf(stderr, "ERROR: could not create index\n");
+	return -1;
+    }
+
+    /*
+     * Find the groups.  For the pivot, the index of each group is
+     * the offset of the start of the group in elems.order (rather
+     * than the index of a packet in the chunk)
+     */
+    fc_count_order_t *groups = malloc(elems.count * sizeof(fc_count_order_t));
+    if (groups == NULL) {
+	fprintf(stderr, "ERROR: malloc failed\n");
+	free(elems.order);
+	return -1;
+    }
+
+    uint64_t *order = elems.order;
+    uint64_t n_groups = 0;
+    uint64_t tail = 0;
+
+    while (tail < elems.count) {
+	uint64_t head = tail;
+
+	for (tail = head + 1; tail < elems.count; tail++) {
+	    if (comparator_group(order[head], order[tail], query) != 0) {
+		break;
+	    }
+	}
+	groups[n_groups].index = head;
+	groups[n_groups].count = tail - head;
+	n_groups++;
+    }
+
+    qsort(groups, n_groups, sizeof(fc_count_order_t), count_compare);
+    if ((top_k > 0) && (top_k < n_groups)) {
+	n_groups = top_k;
+    }
+
+    uint64_t *row = malloc((n_intervals + 1) * sizeof(uint64_t));
+    if (row == NULL) {
+	fprintf(stderr, "ERROR: malloc failed\n");
+	free(elems.order);
+	free(groups);
+	return -1;
+    }
+
+    rc = print_header(query, timespan, n_groups, n_intervals, format, fout);
+
+    for (uint64_t i = 0; (rc == 0) && (i < n_groups); i++) {
+	uint64_t start = groups[i].index;
+	uint64_t end = start + groups[i].count;
+	uint32_t key[FC_QUERY_MAX_FIELDS];
+
+	memset(row, 0, n_intervals * sizeof(uint64_t));
+	for (uint64_t j = start; j < end; j++) {
+	    uint64_t sec = chunk->ts_sec[order[j]];
+
+	    if (sec >= timespan->base_sec) {
+		row[(sec - timespan->base_sec) / timespan->length_sec]++;
+	    }
+	}
+
+	for (uint8_t j = 0; j < query->n_fields; j++) {
+	    uint32_t mask = fc_width_mask(query->fields[j].width);
+
+	    key[j] = mask & fetch_col(chunk, order[start],
+		    query->fields[j].name);
+	}
+
+	rc = print_row(query, timespan, key, groups[i].count, row,
+		n_intervals, format, fout);
+    }
+
+    if (rc != 0) {
+	fprintf(stderr, "ERROR: could not write pivot\n");
+    }
+
+    free(row);
+    free(groups);
+    free(elems.order);
+
+    return rc;
+}
@@ -0,0 +1,276 @@
+/* CODEMARK: nice-ibr */
+/*
+ * Copyright (C) 2020-2024 - Raytheon BBN Technologies Corp.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0.
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+ *
+ * Distribution Statement "A" (Approved for Public Release,
+ * Distribution Unlimited).
+ *
+ * This material is based upon work supported by the Defense
+ * Advanced Research Projects Agency (DARPA) under Contract No.
+ * HR001119C0102.  The opinions, findings, and conclusions stated
+ * herein are those of the authors and do not necessarily reflect
+ * those of DARPA.
+ *
+ * In the event permission is required, DARPA is authorized to
+ * reproduce the copyrighted material for use as an exhibit or
+ * handout at DARPA-sponsored events and/or to post the material
+ * on the DARPA website.
+ */
+/* CODEMARK: end */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "firecracker.h"
+
+/*
+ * Sets of 32-bit prefixes (usually addresses, but they can also be
+ * used for any other 32-bit field, like the timestamp), stored in a
+ * path-compressed binary radix trie.
+ *
+ * Each node represents a prefix.  If the terminal flag is set, then
+ * the prefix is in the set (and since any value that matches that
+ * prefix is in the set, there's no need for any nodes below it).
+ * Otherwise, the node is just a branch point.  Because chains of
+ * nodes with only one child are compressed away, the depth of the
+ * trie is bounded by the number of prefixes, not by 32, and is
+ * usually much less than either.
+ */
+
+static inline uint32_t
+prefix_mask(
+	uint8_t len)
+{
+
+    return (len == 0) ? 0 : (0xffffffff << (32 - len));
+}
+
+/*
+ * Return the bit of val just after the first len bits
+ */
+static inline int
+prefix_bit(
+	uint32_t val,
+	uint8_t len)
+{
+
+    return (val >> (31 - len)) & 1;
+}
+
+static fc_prefix_node_t *
+new_node(
+	uint32_t prefix,
+	uint8_t len,
+	uint8_t terminal)
+{
+    fc_prefix_node_t *node = calloc(1, sizeof(fc_prefix_node_t));
+
+    if (node == NULL) {
+	fprintf(stderr, "ERROR: malloc failed\n");
+	return NULL;
+    }
+
+    node->prefix = prefix & prefix_mask(len);
+    node->len = len;
+    node->terminal = terminal;
+
+    return node;
+}
+
+static void
+free_nodes(
+	fc_prefix_node_t *node)
+{
+
+    if (node != NULL) {
+	free_nodes(node->child[0]);
+	free_nodes(node->child[1]);
+	free(node);
+    }
+}
+
+fc_prefix_set_t *
+fc_prefix_new(void)
+{
+    fc_prefix_set_t *set = calloc(1, sizeof(fc_prefix_set_t));
+
+    if (set == NULL) {
+	fprintf(stderr, "ERROR: malloc failed\n");
+	return NULL;
+    }
+
+    set->root = new_node(0, 0, 0);
+    if (set->root == NULL) {
+	free(set);
+	return NULL;
+    }
+
+    return set;
+}
+
+void
+fc_prefix_free(
+	fc_prefix_set_t *set)
+{
+
+    if (set != NULL) {
+	free_nodes(set->root);
+	free(set);
+    }
+}
+
+/*
+ * Add the given prefix (of length len, which must be at most 32)
+ * to the set
+ */
+int
+fc_prefix_add(
+	fc_prefix_set_t *set,
+	uint32_t prefix,
+	uint8_t len)
+{
+    fc_prefix_node_t *node = set->root;
+
+    prefix &= prefix_mask(len);
+
+    for (;;) {
+	/* If a shorter prefix already covers this one, we're done */
+	if (node->terminal) {
+	    return 0;
+	}
+
+	if (node->len == len) {
+	    /*
+	     * This prefix is now in the set, so anything below it
+	     * is redundant
+	     */
+	    node->terminal = 1;
+	    free_nodes(node->child[0]);
+	    free_nodes(node->child[1]);
+	    node->child[0] = NULL;
+	    node->child[1] = NULL;
+	    return 0;
+	}
+
+	int bit = prefix_bit(prefix, node->len);
+	fc_prefix_node_t *child = node->child[bit];
+
+	if (child == NULL) {
+	    node->child[bit] = new_node(prefix, len, 1);
+	    return (node->child[bit] == NULL) ? -1 : 0;
+	}
+
+	/*
+	 * Find how much of the child's prefix is shared with the new
+	 * prefix.  If all of it is, then keep descending.  Otherwise
+	 * we need to split the edge to the child with a new node
+	 * at the point where they differ.
+	 */
+	uint8_t max_common = (child->len < len) ? child->len : len;
+	uint32_t diff = child->prefix ^ prefix;
+	uint8_t common = (diff == 0) ? 32 : __builtin_clz(diff);
+	if (common > max_common) {
+	    common = max_common;
+	}
+
+	if (common == child->len) {
+	    node = child;
+	    continue;
+	}
+
+	fc_prefix_node_t *mid = new_node(prefix, common, common == len);
+	if (mid == NULL) {
+	    return -1;
+	}
+	mid->child[prefix_bit(child->prefix, common)] = child;
+	node->child[bit] = mid;
+
+	if (common < len) {
+	    mid->child[prefix_bit(prefix, common)] = new_node(prefix, len, 1);
+	    if (mid->child[prefix_bit(prefix, common)] == NULL) {
+		return -1;
+	    }
+	}
+	else {
+	    /* The new prefix covers the old child, so drop it */
+	    free_nodes(child);
+	    mid->child[0] = NULL;
+	    mid->child[1] = NULL;
+	}
+
+	return 0;
+    }
+}
+
+/*
+ * Add all the values from lo to hi (inclusive) to the set, as the
+ * smallest list of prefixes that covers exactly that range.
+ */
+int
+fc_prefix_add_range(
+	fc_prefix_set_t *set,
+	uint32_t lo,
+	uint32_t hi)
+{
+    uint64_t curr = lo;
+
+    while (curr <= hi) {
+	/*
+	 * Find the largest aligned block that starts at curr and
+	 * doesn't go past hi
+	 */
+	uint8_t len = 32;
+	while ((len > 0) &&
+		((curr & ~((uint64_t) prefix_mask(len - 1)) & 0xffffffff) == 0) &&
+		(curr + (1ULL << (33 - len)) - 1 <= hi)) {
+	    len--;
+	}
+
+	if (fc_prefix_add(set, (uint32_t) curr, len) != 0) {
+	    return -1;
+	}
+	curr += 1ULL << (32 - len);
+    }
+
+    return 0;
+}
+
+/*
+ * Return non-zero if the value matches any prefix in the set
+ */
+int
+fc_prefix_match(
+	fc_prefix_set_t *set,
+	uint32_t val)
+{
+    fc_prefix_node_t *node = set->root;
+
+    for (;;) {
+	if (node->terminal) {
+	    return 1;
+	}
+	if (node->len >= 32) {
+	    return 0;
+	}
+
+	node = node->child[prefix_bit(val, node->len)];
+	if ((node == NULL) ||
+		((val & prefix_mask(node->len)) != node->prefix)) {
+	    return 0;
+	}
+    }
+}
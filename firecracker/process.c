@@ -119,14 +119,99 @@ fetch_field(
     }
 }
 
+/*
+ * Like fetch_field, but fetch the field of the ind'th packet of the
+ * chunk from the corresponding column.  The column must be present.
+ */
+inline uint32_t
+fetch_col(
+	fc_chunk_t *chunk,
+	uint64_t ind,
+	fc_field_name_t name)
+{
+
+    switch (name) {
+	case FC_FIELD_NAME_SADDR:
+	    return chunk->saddr[ind];
+	case FC_FIELD_NAME_DADDR:
+	    return chunk->daddr[ind];
+	case FC_FIELD_NAME_SPORT:
+	    return chunk->sport[ind];
+	case FC_FIELD_NAME_DPORT:
+	    return chunk->dport[ind];
+	case FC_FIELD_NAME_PROTO:
+	    return chunk->proto[ind];
+	case FC_FIELD_NAME_FLAGS:
+	    return chunk->flags[ind];
+	case FC_FIELD_NAME_LEN:
+	    return chunk->len[ind];
+	case FC_FIELD_NAME_SEC:
+	    return chunk->ts_sec[ind];
+	case FC_FIELD_NAME_USEC:
+	    return chunk->ts_usec[ind];
+	default:
+	    printf("oops! fetch_col %d\n", name);
+	    return 0;
+    }
+}
+
+/*
+ * Return the column that holds the given field
+ */
+uint32_t
+fc_field2col(
+	fc_field_name_t name)
+{
+
+    switch (name) {
+	case FC_FIELD_NAME_SADDR:
+	    return FC_COL_SADDR;
+	case FC_FIELD_NAME_DADDR:
+	    return FC_COL_DADDR;
+	case FC_FIELD_NAME_SPORT:
+	    return FC_COL_SPORT;
+	case FC_FIELD_NAME_DPORT:
+	    return FC_COL_DPORT;
+	case FC_FIELD_NAME_PROTO:
+	    return FC_COL_PROTO;
+	case FC_FIELD_NAME_FLAGS:
+	    return FC_COL_FLAGS;
+	case FC_FIELD_NAME_LEN:
+	    return FC_COL_LEN;
+	case FC_FIELD_NAME_SEC:
+	    return FC_COL_SEC;
+	case FC_FIELD_NAME_USEC:
+	    return FC_COL_USEC;
+	default:
+	    return 0;
+    }
+}
+
+/*
+ * Return the columns that the given query needs.  Every query needs
+ * the ts_sec column, in order to divide the input into intervals.
+ */
+uint32_t
+fc_query_cols(
+	fc_query_t *query)
+{
+    uint32_t cols = FC_COL_SEC;
+
+    for (uint8_t i = 0; i < query->n_fields; i++) {
+	cols |= fc_field2col(query->fields[i].name);
+    }
+
+    return cols;
+}
+
 /*
  * Comparison function for stable sorting, according to the
  * fields specified in the query
  *
- * Note that the field widths are IGNORED for this comparison,
- * and ties are broken with the timestamp (in order to provide
- * stability, if we can assume that the pkts arrive in ascending
- * time order)
+ * The values are masked according to the field widths, and ties
+ * are broken with the index (which provides stability, and since
+ * the pkts in the chunk are in ascending time order, is the same
+ * as breaking ties with the timestamp)
  */
 static int
 comparator_sort(
@@ -135,16 +220,20 @@ comparator_sort(
 	void *arg)
 {
     fc_query_t *query = (fc_query_t *) arg;
-    fc_pkt_t *pkts = query->chunk->pkts;
+    fc_chunk_t *chunk = query->chunk;
     uint64_t ind1 = *(uint64_t *) p1;
     uint64_t ind2 = *(uint64_t *) p2;
-    fc_pkt_t *pkt1 = pkts + ind1;
-    fc_pkt_t *pkt2 = pkts + ind2;
 
+    /*
+     * Compare the masked values, not the raw values, so that all of
+     * the members of each group are adjacent in the sorted order
+     * even when a masked field is followed by other fields
+     */
     for (uint8_t i = 0; i < query->n_fields; i++) {
 	fc_field_name_t name = query->fields[i].name;
-	uint32_t val1 = fetch_field(pkt1, name);
-	uint32_t val2 = fetch_field(pkt2, name);
+	uint32_t mask = fc_width_mask(query->fields[i].width);
+	uint32_t val1 = mask & fetch_col(chunk, ind1, name);
+	uint32_t val2 = mask & fetch_col(chunk, ind2, name);
 
 	if (val1 < val2) {
 	    return -1;
@@ -155,22 +244,12 @@ comparator_sort(
     }
 
     /*
-     * If there's no difference, use the timestamp to
-     * break the tie, if possible
+     * If there's no difference, use the index to break the tie
      */
-    fc_timeval_t ts1 = pkt1->ts;
-    fc_timeval_t ts2 = pkt2->ts;
-
-    if (ts1.ts_sec < ts2.ts_sec) {
+    if (ind1 < ind2) {
 	return -1;
     }
-    else if (ts1.ts_sec > ts2.ts_sec) {
-	return 1;
-    }
-    else if (ts1.ts_usec < ts2.ts_usec) {
-	return -1;
-    }
-    else if (ts1.ts_usec > ts2.ts_usec) {
+    else if (ind1 > ind2) {
 	return 1;
     }
     else {
@@ -188,23 +267,21 @@ comparator_sort(
  *
  * Assumes that only adjacent items in the sorted order are compared,
  * and that the order is already total (so there's no need to break
- * ties with the timestamps).  Unlike comparator_sort, this function
- * DOES use the field widths when comparing two values
+ * ties with the timestamps).  Like comparator_sort, this function
+ * uses the field widths when comparing two values
  */
-static int
+int
 comparator_group(
 	uint64_t ind1,
 	uint64_t ind2,
 	fc_query_t *query)
 {
-    fc_pkt_t *pkts = query->chunk->pkts;
-    fc_pkt_t *pkt1 = pkts + ind1;
-    fc_pkt_t *pkt2 = pkts + ind2;
+    fc_chunk_t *chunk = query->chunk;
 
     for (uint8_t i = 0; i < query->n_fields; i++) {
 	fc_field_name_t name = query->fields[i].name;
-	uint32_t val1 = fetch_field(pkt1, name);
-	uint32_t val2 = fetch_field(pkt2, name);
+	uint32_t val1 = fetch_col(chunk, ind1, name);
+	uint32_t val2 = fetch_col(chunk, ind2, name);
 
 	uint8_t width = query->fields[i].width;
 	if (width > 0) {
@@ -231,7 +308,7 @@ comparator_group(
  * Create an index for a segment of the given chunk (starting
  * at base, and containing count elements) using the given query
  */
-static int
+int
 fc_create_index(
 	fc_chunk_t *chunk,
 	uint64_t base,
@@ -262,30 +339,21 @@ fc_create_index(
     return 0;
 }
 
-static int
-print_count(
-	uint64_t count,
-	fc_pkt_t *pkt,
+/*
+ * Print the field names and values for one key of the query, where
+ * vals[i] is the (already masked) value of the ith field.
+ */
+int
+fc_print_key(
+	FILE *fout,
 	fc_query_t *query,
-	uint32_t start_time,
-	int normalized,
-	uint64_t total_count,
-	FILE *fout)
+	const uint32_t *vals)
 {
 
-    if (normalized) {
-	double fraction = ((double) count) / ((double) total_count);
-	fprintf(fout, "N,%g,start_time,%d", fraction , start_time);
-    }
-    else {
-	fprintf(fout, "C,%ld,start_time,%d", count, start_time);
-    }
-
     for (int i = 0; i < query->n_fields; i++) {
 	fc_field_name_t name = query->fields[i].name;
 	uint8_t width = query->fields[i].width;
-	uint32_t mask = 0xffffffff & ~((1 << (32 - width)) - 1);
-	uint32_t val = mask & fetch_field(pkt, name);
+	uint32_t val = vals[i];
 
 	if ((name == 'S') || (name == 'D')) {
 	    if (width > 0 && width != 32) {
@@ -309,6 +377,37 @@ print_count(
 	    }
 	}
     }
+
+    return 0;
+}
+
+static int
+print_count(
+	uint64_t count,
+	uint64_t ind,
+	fc_query_t *query,
+	uint32_t start_time,
+	int normalized,
+	uint64_t total_count,
+	FILE *fout)
+{
+    uint32_t vals[FC_QUERY_MAX_FIELDS];
+
+    if (normalized) {
+	double fraction = ((double) count) / ((double) total_count);
+	fprintf(fout, "N,%g,start_time,%d", fraction , start_time);
+    }
+    else {
+	fprintf(fout, "C,%ld,start_time,%d", count, start_time);
+    }
+
+    for (int i = 0; i < query->n_fields; i++) {
+	uint32_t mask = fc_width_mask(query->fields[i].width);
+
+	vals[i] = mask & fetch_col(query->chunk, ind, query->fields[i].name);
+    }
+    fc_print_key(fout, query, vals);
+
     if (query->show_query) {
 	fprintf(fout, ",%s", query->query_str);
     }
@@ -317,11 +416,6 @@ print_count(
     return 0;
 }
 
-typedef struct {
-    uint64_t index;
-    uint64_t count;
-} fc_count_order_t;
-
 static int
 count_compare(
 	const void *p1,
@@ -334,6 +428,227 @@ count_compare(
     return o2->count - o1->count;
 }
 
+/*
+ * Given an index sorted by comparator_sort, find the groups and fill
+ * in the count for each.  Returns the number of groups.
+ */
+static uint64_t
+group_counts(
+	fc_query_t *query,
+	uint64_t *order,
+	uint64_t n_elems,
+	fc_count_order_t *counts)
+{
+    uint64_t n_counts = 0;
+    uint64_t tail = 0;
+
+    while (tail < n_elems) {
+	uint64_t subcount = 1;
+	uint64_t head = tail;
+
+	for (tail = head + 1; tail < n_elems; tail++) {
+	    if (comparator_group(order[head], order[tail], query) != 0) {
+		break;
+	    }
+	    subcount++;
+	}
+	counts[n_counts].index = order[head];
+	counts[n_counts].count = subcount;
+	n_counts++;
+    }
+
+    return n_counts;
+}
+
+static uint64_t
+key_hash(
+	fc_chunk_t *chunk,
+	uint64_t ind,
+	fc_query_t *query)
+{
+    uint64_t hash = 0;
+
+    for (uint8_t i = 0; i < query->n_fields; i++) {
+	uint32_t mask = fc_width_mask(query->fields[i].width);
+
+	hash ^= mask & fetch_col(chunk, ind, query->fields[i].name);
+	hash *= 0x9e3779b97f4a7c15;
+	hash ^= hash >> 29;
+    }
+
+    return hash;
+}
+
+/*
+ * Merge the counts for one partition into the results so far.  If
+ * only the top show_max counts will be printed, then only the top
+ * show_max counts need to be kept, so the results are sorted and
+ * truncated whenever they grow past that.
+ */
+static int
+merge_partition_counts(
+	fc_query_t *query,
+	fc_count_order_t *counts,
+	uint64_t n_counts,
+	fc_count_order_t **results,
+	uint64_t *n_results,
+	uint64_t *max_results)
+{
+
+    if (*n_results + n_counts > *max_results) {
+	uint64_t new_max = 2 * (*n_results + n_counts);
+	fc_count_order_t *new_results = realloc(*results,
+		new_max * sizeof(fc_count_order_t));
+	if (new_results == NULL) {
+	    fprintf(stderr, "ERROR: realloc failed\n");
+	    return -1;
+	}
+	*results = new_results;
+	*max_results = new_max;
+    }
+
+    memcpy(*results + *n_results, counts, n_counts * sizeof(fc_count_order_t));
+    *n_results += n_counts;
+
+    if (*n_results > query->show_max) {
+	qsort(*results, *n_results, sizeof(fc_count_order_t), count_compare);
+	*n_results = query->show_max;
+    }
+
+    return 0;
+}
+
+/*
+ * Like fc_compute_counts_subset, but instead of sorting the entire
+ * interval at once, divide the packets into partitions by a hash of
+ * their keys (so that all of the packets with the same key are in
+ * the same partition) and aggregate each partition separately.
+ *
+ * Only the indices for one partition, and the counts for the keys
+ * that will be printed, need to be in memory at any given time.
+ * If every count is printed, then the counts for all the keys are
+ * still kept, but that's usually much smaller than the index.
+ */
+static int
+compute_counts_partitioned(
+	fc_chunk_t *chunk,
+	uint64_t base,
+	uint64_t count,
+	fc_query_t *query,
+	uint32_t start_time,
+	int print_normalized,
+	FILE *fout)
+{
+    uint64_t per_elem = sizeof(uint64_t) + sizeof(fc_count_order_t);
+    fc_count_order_t *results = NULL;
+    uint64_t n_results = 0;
+    uint64_t max_results = 0;
+    int rc = 0;
+
+    /*
+     * Use twice as many partitions as the limit would suggest, to
+     * leave some room for partitions that are larger than average,
+     * and use a quarter of the limit for the staging buffers.
+     */
+    uint64_t n_parts = 2 * (1 + ((count * per_elem) / query->mem_limit));
+    if (n_parts > FC_SPILL_MAX_PARTS) {
+	static int warned = 0;
+
+	/* The partitions will be larger than the limit suggests,
+	 * so let the user know (once, rather than every interval)
+	 */
+	if (!warned) {
+	    fprintf(stderr, "WARNING: --mem-limit is too small for %lu "
+		    "records; using only %d partitions\n",
+		    count, FC_SPILL_MAX_PARTS);
+	    warned = 1;
+	}
+	n_parts = FC_SPILL_MAX_PARTS;
+    }
+
+    fc_spill_t *spill = fc_spill_open(n_parts, query->mem_limit / 4);
+    if (spill == NULL) {
+	fprintf(stderr, "ERROR: could not create partitions\n");
+	return -1;
+    }
+
+    for (uint64_t i = base; i < base + count; i++) {
+	uint32_t part = key_hash(chunk, i, query) % n_parts;
+
+	rc = fc_spill_add(spill, part, i);
+	if (rc != 0) {
+	    fc_spill_close(spill);
+	    return -1;
+	}
+    }
+
+    for (uint32_t part = 0; part < n_parts; part++) {
+	uint64_t *order;
+	uint64_t n_elems;
+
+	rc = fc_spill_load(spill, part, &order, &n_elems);
+	if (rc != 0) {
+	    break;
+	}
+	if (n_elems == 0) {
+	    continue;
+	}
+
+	qsort_r(order, n_elems, sizeof(uint64_t), comparator_sort, query);
+
+	fc_count_order_t *counts = malloc(n_elems * sizeof(fc_count_order_t));
+	if (counts == NULL) {
+	    fprintf(stderr, "ERROR: malloc failed\n");
+	    free(order);
+	    rc = -1;
+	    break;
+	}
+
+	uint64_t n_counts = group_counts(query, order, n_elems, counts);
+	free(order);
+
+	rc = merge_partition_counts(query, counts, n_counts,
+		&results, &n_results, &max_results);
+	free(counts);
+	if (rc != 0) {
+	    break;
+	}
+    }
+
+    fc_spill_close(spill);
+
+    if (rc != 0) {
+	free(results);
+	return -1;
+    }
+
+    if (query->show_max > 0) {
+	qsort(results, n_results, sizeof(fc_count_order_t), count_compare);
+    }
+    if (query->show_max < n_results) {
+	n_results = query->show_max;
+    }
+
+    for (uint64_t i = 0; i < n_results; i++) {
+	print_count(results[i].count, results[i].index, query,
+		start_time, 0, count, fout);
+    }
+
+    if (print_normalized) {
+	for (uint64_t i = 0; i < n_results; i++) {
+	    print_count(results[i].count, results[i].index,
+		    query, start_time, 1, count, fout);
+	}
+    }
+
+    fprintf(fout, "T,%ld,start_time,%d,%s\n",
+	    count, start_time, query->query_str);
+
+    free(results);
+
+    return 0;
+}
+
 static int
 fc_compute_counts_subset(
 	fc_chunk_t *chunk,
@@ -345,15 +660,37 @@ fc_compute_counts_subset(
 	FILE *fout)
 {
     fc_elems_t elems;
-    uint64_t tail = 0;
     int rc;
 
     if (count == 0) {
+	/*
+	 * An empty interval still matters in change mode: everything
+	 * that was seen in the previous interval has vanished.
+	 */
+	if (query->change_mode) {
+	    rc = fc_report_changes(chunk, query, NULL, 0, start_time, fout);
+	    if (rc != 0) {
+		return -1;
+	    }
+	}
 	fprintf(fout, "T,%d,start_time,%d,%s\n",
 		0, start_time, query->query_str);
 	return 0;
     }
 
+    /*
+     * If the index and the counts for this interval might not fit
+     * within the memory limit, then do the aggregation in partitions.
+     * (This isn't supported for change detection, which needs the
+     * counts for all of the keys, in key order.)
+     */
+    uint64_t needed = count * (sizeof(uint64_t) + sizeof(fc_count_order_t));
+    if ((query->mem_limit > 0) && (needed > query->mem_limit) &&
+	    !query->change_mode) {
+	return compute_counts_partitioned(chunk, base, count, query,
+		start_time, print_normalized, fout);
+    }
+
     rc = fc_create_index(chunk, base, count, query, &elems);
     if (rc != 0) {
 	fprintf(stderr, "ERROR: could not create index\n");
@@ -363,7 +700,8 @@ fc_compute_counts_subset(
     /*
      * TODO: This makes a worst-case assumption about how many unique
      * items there will be.  If we start to feel memory pressure
-     * then we should allocate this lazily.
+     * then we should allocate this lazily.  (Or use --mem-limit,
+     * which avoids this by aggregating in partitions.)
      */
     fc_count_order_t *counts = malloc(elems.count * sizeof(fc_count_order_t));
     if (counts == NULL) {
@@ -371,22 +709,23 @@ fc_compute_counts_subset(
 	return -1;
     }
 
-    uint64_t n_counts = 0;
-    uint64_t *order = elems.order;
-
-    while (tail < elems.count) {
-	uint64_t subcount = 1;
-	uint64_t head = tail;
+    uint64_t n_counts = group_counts(query, elems.order, elems.count, counts);
 
-	for (tail = head + 1; tail < elems.count; tail++) {
-	    if (comparator_group(order[head], order[tail], query) != 0) {
-		break;
-	    }
-	    subcount++;
+    if (query->change_mode) {
+	rc = fc_report_changes(chunk, query, counts, n_counts,
+		start_time, fout);
+	if (rc != 0) {
+	    free(elems.order);
+	    free(counts);
+	    return -1;
 	}
-	counts[n_counts].index = order[head];
-	counts[n_counts].count = subcount;
-	n_counts++;
+
+	fprintf(fout, "T,%ld,start_time,%d,%s\n",
+		elems.count, start_time, query->query_str);
+
+	free(elems.order);
+	free(counts);
+	return 0;
     }
 
     if (query->show_max >= 0) {
@@ -399,13 +738,13 @@ fc_compute_counts_subset(
     }
 
     for (uint64_t i = 0; i < n_counts; i++) {
-	print_count(counts[i].count, &chunk->pkts[counts[i].index], query,
+	print_count(counts[i].count, counts[i].index, query,
 		start_time, 0, elems.count, fout);
     }
 
     if (print_normalized) {
 	for (uint64_t i = 0; i < n_counts; i++) {
-	    print_count(counts[i].count, &chunk->pkts[counts[i].index], query,
+	    print_count(counts[i].count, counts[i].index, query,
 		    start_time, 1, elems.count, fout);
 	}
     }
@@ -431,7 +770,7 @@ fc_compute_counts(
 
     if ((timespan == NULL) || (timespan->length_sec == 0)) {
 	rc = fc_compute_counts_subset(chunk, 0, chunk->count,
-		query, chunk->pkts[0].ts.ts_sec,
+		query, chunk->ts_sec[0],
 		normalized, fout);
 	if (rc != 0) {
 	    return -1;
@@ -445,7 +784,7 @@ fc_compute_counts(
 	uint64_t i;
 
 	for (i = 0; i < chunk->count; i++) {
-	    uint64_t curr_time = chunk->pkts[i].ts.ts_sec;
+	    uint64_t curr_time = chunk->ts_sec[i];
 
 	    if (curr_time >= end_span) {
 		count = i - start;
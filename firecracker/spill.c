@@ -0,0 +1,255 @@
+/* CODEMARK: nice-ibr */
+/*
+ * Copyright (C) 2020-2024 - Raytheon BBN Technologies Corp.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0.
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+ *
+ * Distribution Statement "A" (Approved for Public Release,
+ * Distribution Unlimited).
+ *
+ * This material is based upon work supported by the Defense
+ * Advanced Research Projects Agency (DARPA) under Contract No.
+ * HR001119C0102.  The opinions, findings, and conclusions stated
+ * herein are those of the authors and do not necessarily reflect
+ * those of DARPA.
+ *
+ * In the event permission is required, DARPA is authorized to
+ * reproduce the copyrighted material for use as an exhibit or
+ * handout at DARPA-sponsored events and/or to post the material
+ * on the DARPA website.
+ */
+/* CODEMARK: end */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "firecracker.h"
+
+/*
+ * Hash partitioning with spill-to-disk, for aggregating intervals
+ * that have too many packets (and potentially too many distinct keys)
+ * to be sorted in memory all at once.
+ *
+ * Each packet index is added to one of n_parts partitions.  Each
+ * partition has a small staging buffer in memory, and whenever the
+ * buffer for a partition fills up, it is appended to a temporary
+ * file for that partition.  Partitions that never overflow their
+ * buffer never touch the disk.  Afterwards, each partition can be
+ * loaded (and then processed) one at a time.
+ *
+ * The temporary files are created in $TMPDIR (or /tmp, if TMPDIR
+ * is not set) and are unlinked as soon as they are created, so they
+ * are cleaned up automatically even if firecracker dies.
+ */
+
+static FILE *
+spill_file_open(void)
+{
+    char *tmpdir = getenv("TMPDIR");
+
+    if ((tmpdir == NULL) || (*tmpdir == '\0')) {
+	tmpdir = "/tmp";
+    }
+
+    char *template = malloc(strlen(tmpdir) + 32);
+    if (template == NULL) {
+	return NULL;
+    }
+    sprintf(template, "%s/firecracker-XXXXXX", tmpdir);
+
+    int fd = mkstemp(template);
+    if (fd < 0) {
+	fprintf(stderr, "ERROR: could not create spill file [%s]: %s\n",
+		template, strerror(errno));
+	free(template);
+	return NULL;
+    }
+
+    unlink(template);
+    free(template);
+
+    FILE *file = fdopen(fd, "w+");
+    if (file == NULL) {
+	close(fd);
+    }
+
+    return file;
+}
+
+fc_spill_t *
+fc_spill_open(
+	uint32_t n_parts,
+	uint64_t buf_bytes)
+{
+    fc_spill_t *spill = calloc(1, sizeof(fc_spill_t));
+    if (spill == NULL) {
+	return NULL;
+    }
+
+    spill->n_parts = n_parts;
+    spill->buf_len = buf_bytes / (n_parts * sizeof(uint64_t));
+    if (spill->buf_len < FC_SPILL_MIN_BUF_LEN) {
+	spill->buf_len = FC_SPILL_MIN_BUF_LEN;
+    }
+
+    spill->bufs = calloc(n_parts, sizeof(uint64_t *));
+    spill->buf_cnt = calloc(n_parts, sizeof(uint64_t));
+    spill->spilled = calloc(n_parts, sizeof(uint64_t));
+    spill->files = calloc(n_parts, sizeof(FILE *));
+    if ((spill->bufs == NULL) || (spill->buf_cnt == NULL) ||
+	    (spill->spilled == NULL) || (spill->files == NULL)) {
+	fc_spill_close(spill);
+	return NULL;
+    }
+
+    for (uint32_t i = 0; i < n_parts; i++) {
+	spill->bufs[i] = malloc(spill->buf_len * sizeof(uint64_t));
+	if (spill->bufs[i] == NULL) {
+	    fc_spill_close(spill);
+	    return NULL;
+	}
+    }
+
+    return spill;
+}
+
+static int
+spill_flush(
+	fc_spill_t *spill,
+	uint32_t part)
+{
+
+    if (spill->files[part] == NULL) {
+	spill->files[part] = spill_file_open();
+	if (spill->files[part] == NULL) {
+	    return -1;
+	}
+    }
+
+    size_t n_written = fwrite(spill->bufs[part], sizeof(uint64_t),
+	    spill->buf_cnt[part], spill->files[part]);
+    if (n_written != spill->buf_cnt[part]) {
+	fprintf(stderr, "ERROR: could not write spill file: %s\n",
+		strerror(errno));
+	return -1;
+    }
+
+    spill->spilled[part] += spill->buf_cnt[part];
+    spill->buf_cnt[part] = 0;
+
+    return 0;
+}
+
+int
+fc_spill_add(
+	fc_spill_t *spill,
+	uint32_t part,
+	uint64_t value)
+{
+
+    if (spill->buf_cnt[part] == spill->buf_len) {
+	if (spill_flush(spill, part) != 0) {
+	    return -1;
+	}
+    }
+
+    spill->bufs[part][spill->buf_cnt[part]++] = value;
+
+    return 0;
+}
+
+/*
+ * Load all of the values added to the given partition into a newly
+ * allocated array (which the caller must free), and release the
+ * resources used by the partition.
+ */
+int
+fc_spill_load(
+	fc_spill_t *spill,
+	uint32_t part,
+	uint64_t **values,
+	uint64_t *n_values)
+{
+    uint64_t n_spilled = spill->spilled[part];
+    uint64_t n_buffered = spill->buf_cnt[part];
+
+    *n_values = n_spilled + n_buffered;
+    *values = NULL;
+
+    if (*n_values > 0) {
+	*values = malloc(*n_values * sizeof(uint64_t));
+	if (*values == NULL) {
+	    fprintf(stderr, "ERROR: malloc failed\n");
+	    return -1;
+	}
+    }
+
+    if (n_spilled > 0) {
+	FILE *file = spill->files[part];
+
+	rewind(file);
+	if (fread(*values, sizeof(uint64_t), n_spilled, file) != n_spilled) {
+	    fprintf(stderr, "ERROR: could not read spill file\n");
+	    free(*values);
+	    *values = NULL;
+	    return -1;
+	}
+    }
+
+    if (n_buffered > 0) {
+	memcpy(*values + n_spilled, spill->bufs[part],
+		n_buffered * sizeof(uint64_t));
+    }
+
+    if (spill->files[part] != NULL) {
+	fclose(spill->files[part]);
+	spill->files[part] = NULL;
+    }
+    free(spill->bufs[part]);
+    spill->bufs[part] = NULL;
+    spill->buf_cnt[part] = 0;
+    spill->spilled[part] = 0;
+
+    return 0;
+}
+
+int
+fc_spill_close(
+	fc_spill_t *spill)
+{
+
+    if (spill == NULL) {
+	return 0;
+    }
+
+    for (uint32_t i = 0; i < spill->n_parts; i++) {
+	if (spill->bufs != NULL) {
+	    free(spill->bufs[i]);
+	}
+	if ((spill->files != NULL) && (spill->files[i] != NULL)) {
+	    fclose(spill->files[i]);
+	}
+    }
+
+    free(spill->bufs);
+    free(spill->buf_cnt);
+    free(spill->spilled);
+    free(spill->files);
+    free(spill);
+
+    return 0;
+}
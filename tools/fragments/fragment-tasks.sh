@@ -92,15 +92,15 @@ if [ -z ${CONCUR+x} ]; then
 fi
 
 SHOWFRAGS="$SCRIPTDIR/../../bin/show-frags"
-TESTASSEM="$SCRIPTDIR/test-assembly.py"
+FRAGREASM="$SCRIPTDIR/../../bin/frag-reasm"
 
 if [ ! -x "$SHOWFRAGS" ]; then
     echo "ERROR: $PNAME: Executable $SHOWFRAGS missing?"
     exit 1
 fi
 
-if [ ! -x "$TESTASSEM" ]; then
-    echo "ERROR: $PNAME: Executable $TESTASSEM missing?"
+if [ ! -x "$FRAGREASM" ]; then
+    echo "ERROR: $PNAME: Executable $FRAGREASM missing?"
     exit 1
 fi
 
@@ -218,18 +218,16 @@ find_busiest_sources() {
 
 # Try reassembling all the fragments; see whether the pieces fit.
 #
-# This is not realistic because it puts *all* of the fragments
-# with the same description into the same pool (potentially spanning
-# months or years of time), while in reality fragments would be
-# discarded if aren't reassembled within a short period of time.
+# The fragment pcap files are read in order, and (as in a real IP
+# stack) the fragments of a datagram that isn't reassembled within
+# the timeout are discarded, so fragments that happen to have the
+# same description but are far apart in time are not pooled together.
 #
 test_reassembly() {
-    local textoutdir="$1"
+    local pcapoutdir="$1"
     local outname="$2"
 
-    (cd "$textoutdir"; cat *.csv) \
-	    | "$TESTASSEM" \
-	    > "$outname"
+    "$FRAGREASM" "$pcapoutdir"/*.pcap > "$outname"
 }
 
 # The main function: find all the fragments, and then compute
@@ -260,7 +258,7 @@ process_pcaps() {
 	    "$resultdir/$name"-busy_dsts.txt
 
     echo "$PNAME: Testing reassembly"
-    test_reassembly "$textoutdir" "$resultdir/$name"-reassem.csv
+    test_reassembly "$pcapoutdir" "$resultdir/$name"-reassem.csv
 }
 
 process_pcaps "$PCAPDIR" "$FRAG_CSVOUTDIR" "$FRAG_PCAPOUTDIR" \
@@ -97,7 +97,7 @@ OUTPCAPDIR="$MEANIEDIR/pcap"
 OUTTEXTDIR="$MEANIEDIR/text"
 OUTSRCCNTDIR="$MEANIEDIR/src-cnts"
 
-HSC="$SCRIPTDIR"/highest-src-cnt
+HSC="$SCRIPTDIR/../../bin/meanie-ports"
 PCAP2TXT="$SCRIPTDIR/../../bin/meanie2csv"
 NOTEBOOKS="$SCRIPTDIR/.."
 ACKSCAN_FILTER="$NOTEBOOKS/pcap-ingestion/ackscan-filter.sh"
@@ -133,7 +133,7 @@ ALL_DAYS=$(ls "$FCSVDIR" \
 	| sort -u)
 
 
-# Use highest-src-cnt and some heuristics to find the
+# Use meanie-ports and some heuristics to find the
 # best candidate for the port-of-the-day
 
 find_ports() {
@@ -164,11 +164,10 @@ find_ports() {
 
 	    # echo Starting $day
 
-	    # We don't do ALL the daily CSV files; we just
-	    # do a few hours.  This makes things faster,
-	    # and works just as well because the meanie
-	    # activity happens around the clock (but does
-	    # seem to have a peak in the afternoon)
+	    # We count the sources over all of the hours of
+	    # the day.  (The meanie activity happens around
+	    # the clock, but does seem to have a peak in the
+	    # afternoon.)
 	    #
 	    # The filter on field 4 (dport), and then sorting
 	    # by the ratio of packets to sources (field 12)
@@ -177,8 +176,8 @@ find_ports() {
 	    # other strange things that pop up from time to
 	    # time
 	    #
-	    zcat "$FCSVDIR"/"$day"-[01][0-5].csv.gz \
-		    | "$HSC" -n 10 -l 24 -p udp -t $day -c - \
+	    "$HSC" -n 10 -l 24 -p udp -t $day -c \
+		    "$FCSVDIR"/"$day"-??.csv.gz \
 		    | awk "\$4 > $min_port" | sort -n -k12 | head -1 \
 		    > "$OUTPORTDIR"/"$day".txt &
 	fi
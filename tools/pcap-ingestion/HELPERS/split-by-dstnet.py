@@ -47,6 +47,11 @@ prefix (i.e. 24 for a /24, or 16 for a /16).
 
 Output is written to files of the form DIR/SUBNET/NAME (directories are
 created if necessary).
+
+If the input has a header line (a line that starts with '#', followed by
+the names of the columns, as written by cpcap2csv -c), then the
+destination address is found in the daddr column instead of the second
+column, and the header is copied to the start of each output file.
 """
 
 
@@ -55,11 +60,12 @@ import os
 import sys
 
 
-def make_fout(base_name, addr, out_dir, all_fout, prefixmask):
+def make_fout(base_name, addr, out_dir, all_fout, prefixmask, header):
     """
     Return the correct fout to use to store the record for the
     given address.  If the file doesn't exist yet, create it
-    and then return the fout for it.
+    (starting with the header, if any) and then return the fout
+    for it.
     """
 
     addr &= prefixmask
@@ -81,6 +87,8 @@ def make_fout(base_name, addr, out_dir, all_fout, prefixmask):
     path = '%s/%s' % (out_base, base_name)
 
     fout = open(path, 'w+')
+    if header:
+        fout.write(header)
     all_fout[addr] = fout
     return fout
 
@@ -91,18 +99,30 @@ def split24(out_dir, base_name, prefixlen):
     the destination subnet for each row
 
     The destination subnet must be the second column of the
-    the input CSV, and must be expressed in decimal.
+    the input CSV (or the daddr column, if the input has a header
+    line), and must be expressed in decimal.
     """
 
     prefixmask = 0xffffffff & (0xffffffff << (32 - prefixlen))
     all_fout = dict()
+    header = None
+    daddr_col = 1
 
     for line in sys.stdin:
-        elems = line.split(',', 2)
-        daddr = int(elems[1])
+        if line.startswith('#'):
+            names = line[1:].rstrip('\r\n').split(',')
+            if 'daddr' not in names:
+                print('ERROR: no daddr column in header', file=sys.stderr)
+                sys.exit(1)
+            header = line
+            daddr_col = names.index('daddr')
+            continue
+
+        elems = line.split(',', daddr_col + 1)
+        daddr = int(elems[daddr_col])
 
         dst_fout = make_fout(
-                base_name, daddr, out_dir, all_fout, prefixmask)
+                base_name, daddr, out_dir, all_fout, prefixmask, header)
         dst_fout.write(line)
 
     for addr in all_fout: